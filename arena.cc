@@ -0,0 +1,78 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+namespace gnossen {
+namespace arena {
+
+// Blocks double in size up to this limit, so that big compilations need few
+// of them.
+static constexpr size_t kMaxGrownBlockSize = 4 * 1024 * 1024;
+
+constexpr size_t Arena::kDefaultBlockSize;
+
+static char* AlignUp(char* pointer, size_t alignment) {
+  const uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+  return reinterpret_cast<char*>((address + alignment - 1) & ~(alignment - 1));
+}
+
+Arena::Arena(size_t block_size) :
+  block_size_(block_size),
+  blocks_(),
+  current_(0),
+  cursor_(nullptr),
+  limit_(nullptr),
+  bytes_allocated_(0) {}
+
+Arena::~Arena() {
+  for (const Block& block : blocks_) {
+    free(block.data);
+  }
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+  char* start = AlignUp(cursor_, alignment);
+  if (cursor_ == nullptr || start + size > limit_) {
+    NextBlock(size, alignment);
+    start = AlignUp(cursor_, alignment);
+  }
+  cursor_ = start + size;
+  bytes_allocated_ += size;
+  return start;
+}
+
+void Arena::NextBlock(size_t size, size_t alignment) {
+  const size_t needed = size + alignment;
+  size_t next = cursor_ == nullptr ? 0 : current_ + 1;
+  while (next < blocks_.size() && blocks_[next].size < needed) {
+    // Too small for this allocation. It'll get used after the next reset.
+    ++next;
+  }
+  if (next == blocks_.size()) {
+    size_t block_size = blocks_.empty() ? block_size_ :
+                        std::min(blocks_.back().size * 2, std::max(kMaxGrownBlockSize, block_size_));
+    block_size = std::max(block_size, needed);
+    char* data = static_cast<char*>(malloc(block_size));
+    if (data == nullptr) {
+      std::cerr << "Failed to allocate an arena block of " << block_size << " bytes." << std::endl;
+      exit(1);
+    }
+    blocks_.push_back({data, block_size});
+  }
+  current_ = next;
+  cursor_ = blocks_[next].data;
+  limit_ = cursor_ + blocks_[next].size;
+}
+
+void Arena::Reset() {
+  current_ = 0;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  bytes_allocated_ = 0;
+}
+
+} // end namespace arena
+} // end namespace gnossen
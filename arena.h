@@ -0,0 +1,116 @@
+#ifndef GNOSSEN_TINYJIT_ARENA_H_
+#define GNOSSEN_TINYJIT_ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace gnossen {
+namespace arena {
+
+// A bump allocator. Everything allocated from an arena is freed at once by
+// Reset() or by destroying the arena. Nothing allocated from it is ever
+// destroyed individually, so it must not need destroying.
+//
+// Blocks are retained across Reset(), so an arena reused for many
+// compilations stops calling malloc once it has grown to fit the largest one.
+class Arena {
+public:
+  static constexpr size_t kDefaultBlockSize = 64 * 1024;
+
+  explicit Arena(size_t block_size = kDefaultBlockSize);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Arena-allocated objects are never destroyed.");
+    return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  // Frees everything allocated so far.
+  void Reset();
+
+  // Bytes handed out since the last reset.
+  size_t BytesAllocated() const { return bytes_allocated_; }
+
+  // The number of blocks obtained from malloc over the arena's lifetime.
+  size_t BlockCount() const { return blocks_.size(); }
+
+private:
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  // Moves on to a block with room for `size` bytes at `alignment`,
+  // allocating one if none of the retained blocks are big enough.
+  void NextBlock(size_t size, size_t alignment);
+
+  const size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t current_;
+  char* cursor_;
+  char* limit_;
+  size_t bytes_allocated_;
+};
+
+// Adapts an Arena for use with standard containers. Deallocation is a no-op;
+// the memory comes back when the arena is reset. A null arena falls back to
+// the global heap.
+template <typename T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  ArenaAllocator(Arena* arena = nullptr) noexcept : arena_(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena()) {}
+
+  T* allocate(size_t n) {
+    if (arena_ == nullptr) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* pointer, size_t n) noexcept {
+    if (arena_ == nullptr) {
+      ::operator delete(pointer);
+    }
+  }
+
+  Arena* arena() const noexcept { return arena_; }
+
+private:
+  Arena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) noexcept {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) noexcept {
+  return a.arena() != b.arena();
+}
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} // end namespace arena
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_ARENA_H_
@@ -0,0 +1,61 @@
+#include "gtest/gtest.h"
+
+#include <cstdint>
+
+#include "arena.h"
+
+namespace gnossen {
+namespace arena {
+namespace {
+
+TEST(ArenaTest, AllocationsAreAlignedAndDisjoint) {
+  Arena arena(128);
+  char* a = static_cast<char*>(arena.Allocate(3, 1));
+  uint64_t* b = static_cast<uint64_t*>(arena.Allocate(sizeof(uint64_t), alignof(uint64_t)));
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(b) % alignof(uint64_t), 0);
+  EXPECT_GE(reinterpret_cast<char*>(b), a + 3);
+  EXPECT_EQ(arena.BytesAllocated(), 3 + sizeof(uint64_t));
+  EXPECT_EQ(arena.BlockCount(), 1);
+}
+
+TEST(ArenaTest, GrowsForLargeAllocations) {
+  Arena arena(128);
+  arena.Allocate(100);
+  char* big = static_cast<char*>(arena.Allocate(1000));
+  big[999] = 'x';
+  EXPECT_EQ(arena.BlockCount(), 2);
+}
+
+TEST(ArenaTest, ResetReusesBlocks) {
+  Arena arena(128);
+  for (size_t i = 0; i < 100; ++i) {
+    arena.Allocate(64);
+  }
+  const size_t blocks = arena.BlockCount();
+  arena.Reset();
+  EXPECT_EQ(arena.BytesAllocated(), 0);
+  for (size_t i = 0; i < 100; ++i) {
+    arena.Allocate(64);
+  }
+  EXPECT_EQ(arena.BlockCount(), blocks);
+}
+
+TEST(ArenaTest, WorksWithContainers) {
+  Arena arena;
+  ArenaVector<int> numbers(&arena);
+  for (int i = 0; i < 1000; ++i) {
+    numbers.push_back(i);
+  }
+  EXPECT_EQ(numbers[999], 999);
+  EXPECT_GT(arena.BytesAllocated(), 1000 * sizeof(int));
+
+  // Without an arena, the allocator falls back to the heap.
+  ArenaVector<int> heap_numbers;
+  heap_numbers.assign(numbers.begin(), numbers.end());
+  EXPECT_EQ(heap_numbers.get_allocator().arena(), nullptr);
+  EXPECT_EQ(heap_numbers, numbers);
+}
+
+} // end namespace
+} // end namespace arena
+} // end namespace gnossen
@@ -1,54 +1,283 @@
 #include "assembly_segment.h"
 
+#include <algorithm>
+#include <initializer_list>
 #include <iostream>
 #include <cstdlib>
 #include <limits>
 #include <cstring>
 #include <sstream>
 #include <cassert>
+#include <cctype>
 
 namespace gnossen {
 namespace assembly {
 
-static constexpr uint32_t k8BitMax = std::numeric_limits<int8_t>::max();
-static constexpr uint32_t k16BitMax = std::numeric_limits<int16_t>::max();
-static constexpr uint32_t k32BitMax = std::numeric_limits<int32_t>::max();
+size_t AssemblySubroutine::absolute_offset(unsigned int segment_index) const {
+  return offsets_[positions_[segment_index]];
+}
 
-size_t AssemblySubroutine::maximum_distance(unsigned int a, unsigned int b) const {
-  if (a == b) {
-    return 0;
-  } else if (b < a) {
-    return maximum_distance(b, a);
-  } else {
-    size_t offset = 0;
-    for (unsigned int i = a; i < b; ++i) {
-      offset += segments_[index_mapping_.at(i)]->max_size();
-    }
-    return offset;
+AssemblySubroutine::AssemblySubroutine(arena::Arena* arena) :
+  owned_arena_(arena == nullptr ? std::make_unique<arena::Arena>() : nullptr),
+  arena_(arena == nullptr ? owned_arena_.get() : arena),
+  segments_(arena_),
+  positions_(arena_),
+  offsets_(arena_) {}
+
+void AssemblySubroutine::add_segment(AssemblySegment* segment) {
+  if (segment->id() >= positions_.size()) {
+    positions_.resize(segment->id() + 1);
   }
+  positions_[segment->id()] = segments_.size();
+  segments_.push_back(segment);
 }
 
-size_t AssemblySubroutine::absolute_offset(unsigned int segment_index) const {
+void AssemblySubroutine::update_offsets() {
+  offsets_.resize(segments_.size() + 1);
   size_t offset = 0;
-  for (unsigned int i = 0; i < segment_index; ++i) {
-    offset += segments_[index_mapping_.at(i)]->size();
+  for (size_t i = 0; i < segments_.size(); ++i) {
+    offsets_[i] = offset;
+    offset += segments_[i]->size();
   }
-  return offset;
+  offsets_[segments_.size()] = offset;
 }
 
-
-void AssemblySubroutine::add_segment(std::unique_ptr<AssemblySegment> segment) {
-  index_mapping_[segment->id()] = segments_.size();
-  segments_.push_back(std::move(segment));
+void AssemblySubroutine::relax() {
+  for (auto&& segment : segments_) {
+    if (JumpSegment* jump = segment->jump()) {
+      jump->reset_size();
+    }
+  }
+  update_offsets();
+  bool grew = true;
+  while (grew) {
+    grew = false;
+    for (auto&& segment : segments_) {
+      const size_t size = segment->size();
+      segment->determine_size(this);
+      grew |= segment->size() != size;
+    }
+    update_offsets();
+  }
 }
 
-void AssemblySubroutine::finalize() {
+void AssemblySubroutine::optimize() {
+  relax();
+  unoptimized_size_ = size();
+  optimized_ = true;
+  const size_t count = segments_.size();
+
+  // A segment that's nothing but an unconditional jump.
+  auto is_jump = [](AssemblySegment* segment) {
+    JumpSegment* jump = segment->jump();
+    return jump != nullptr && jump->condition() == JumpCondition::kAlways &&
+           jump->parent_offset() == 0 && !segment->falls_through();
+  };
+  // The position of the first segment with any code at or after `position`.
+  auto skip_empty = [&](size_t position) {
+    while (position < count && segments_[position]->size() == 0) {
+      ++position;
+    }
+    return position;
+  };
+
+  // Thread jumps through unconditional jumps. Give up on cycles.
+  for (auto&& segment : segments_) {
+    JumpSegment* jump = segment->jump();
+    if (jump == nullptr) {
+      continue;
+    }
+    unsigned int target = jump->jmp_index();
+    bool threaded = false;
+    for (size_t steps = 0; steps < count; ++steps) {
+      const size_t position = skip_empty(positions_[target]);
+      if (position == count || !is_jump(segments_[position]) || segments_[position] == segment) {
+        break;
+      }
+      target = segments_[position]->jump()->jmp_index();
+      threaded = true;
+    }
+    if (threaded) {
+      jump->retarget(target, 0);
+      ++peephole_stats_.threaded_jumps;
+    }
+  }
+
+  // Turn a conditional jump over an unconditional one, like
+  //
+  //     je .a
+  //     jmp .b
+  //   .a:
+  //
+  // into a single jne .b, as long as nothing else leads to the jmp.
+  std::vector<unsigned int> references;
+  std::vector<bool> referenced(count, false);
+  for (auto&& segment : segments_) {
+    references.clear();
+    segment->add_references(&references);
+    if (JumpSegment* jump = segment->jump()) {
+      references.push_back(jump->jmp_index());
+    }
+    for (unsigned int index : references) {
+      const size_t position = skip_empty(positions_[index]);
+      if (position < count) {
+        referenced[position] = true;
+      }
+    }
+  }
+  std::vector<bool> dropped(count, false);
+  for (size_t position = 0; position < count; ++position) {
+    AssemblySegment* segment = segments_[position];
+    JumpSegment* jump = segment->jump();
+    if (jump == nullptr || jump->condition() == JumpCondition::kAlways ||
+        jump->parent_offset() + jump->size() != segment->size()) {
+      continue;
+    }
+    const size_t next = skip_empty(position + 1);
+    if (next == count || !is_jump(segments_[next]) || referenced[next] ||
+        skip_empty(positions_[jump->jmp_index()]) != skip_empty(next + 1)) {
+      continue;
+    }
+    jump->invert();
+    jump->retarget(segments_[next]->jump()->jmp_index(), 0);
+    dropped[next] = true;
+    ++peephole_stats_.inverted_jumps;
+  }
+
+  // Find the segments that are reachable and not empty, other than jumps to
+  // whatever comes next.
+  std::vector<bool> keep(count, false);
+  std::vector<size_t> pending {0};
+  while (!pending.empty()) {
+    const size_t position = pending.back();
+    pending.pop_back();
+    if (position >= count || keep[position]) {
+      continue;
+    } else if (dropped[position]) {
+      // Only ever fallen into, and now falls through.
+      pending.push_back(position + 1);
+      continue;
+    }
+    keep[position] = true;
+    AssemblySegment* segment = segments_[position];
+    references.clear();
+    segment->add_references(&references);
+    if (JumpSegment* jump = segment->jump()) {
+      references.push_back(jump->jmp_index());
+    }
+    for (unsigned int index : references) {
+      pending.push_back(positions_[index]);
+    }
+    if (segment->falls_through()) {
+      pending.push_back(position + 1);
+    }
+  }
+  size_t removed = 0;
+  for (size_t position = count; position-- > 0;) {
+    AssemblySegment* segment = segments_[position];
+    if (dropped[position]) {
+      continue;
+    } else if (!keep[position] || segment->size() == 0) {
+      keep[position] = false;
+      ++removed;
+      continue;
+    }
+    if (!is_jump(segment)) {
+      continue;
+    }
+    // Only the segments after this one that are being kept matter.
+    size_t next = position + 1;
+    while (next < count && !keep[next]) {
+      ++next;
+    }
+    size_t target = positions_[segment->jump()->jmp_index()];
+    while (target < next && !keep[target]) {
+      ++target;
+    }
+    if (target == next) {
+      keep[position] = false;
+      ++peephole_stats_.removed_jumps;
+    }
+  }
+  peephole_stats_.removed_segments = removed;
+
+  // Compact the segments, pointing the indices of removed ones at whatever
+  // followed them.
+  std::vector<unsigned int> new_positions(count + 1);
+  new_positions[count] = 0;
+  size_t kept = 0;
+  for (size_t position = 0; position < count; ++position) {
+    if (keep[position]) {
+      ++kept;
+    }
+  }
+  new_positions[count] = kept;
+  for (size_t position = count; position-- > 0;) {
+    if (keep[position]) {
+      --kept;
+    }
+    new_positions[position] = keep[position] ? kept : new_positions[position + 1];
+  }
+  size_t next = 0;
+  for (size_t position = 0; position < count; ++position) {
+    if (keep[position]) {
+      segments_[next++] = segments_[position];
+    }
+  }
+  segments_.resize(next);
+  for (auto&& position : positions_) {
+    position = new_positions[position];
+  }
+
+  // Work out what %eax holds on entry to each segment that can only be
+  // entered by falling into it, and skip loads that jumps don't need.
+  std::vector<bool> targeted(segments_.size() + 1, false);
   for (auto&& segment : segments_) {
-    segment->determine_size(this);
+    references.clear();
+    segment->add_references(&references);
+    if (JumpSegment* jump = segment->jump()) {
+      references.push_back(jump->jmp_index());
+    }
+    for (unsigned int index : references) {
+      targeted[positions_[index]] = true;
+    }
   }
+  KnownLetter on_entry = KnownLetter::Unknown();
+  for (size_t position = 0; position < segments_.size(); ++position) {
+    AssemblySegment* segment = segments_[position];
+    if (targeted[position]) {
+      on_entry = KnownLetter::Unknown();
+    }
+    if (JumpSegment* jump = segment->jump()) {
+      const KnownLetter letter = segment->letter_after(on_entry, true);
+      const unsigned int target = jump->jmp_index();
+      const size_t landing = positions_[target];
+      const size_t skip = landing < segments_.size() ?
+                          segments_[landing]->redundant_load_size(letter) : 0;
+      if (letter.kind != KnownLetter::Kind::kUnknown && skip != 0) {
+        if (skip == segments_[landing]->size() && landing + 1 < segments_.size()) {
+          // Land on whatever follows instead, whose offset doesn't depend on
+          // how big the skipped segment's own jumps turn out to be.
+          jump->retarget(segments_[landing + 1]->id(), 0);
+        } else {
+          jump->retarget(target, skip);
+        }
+        ++peephole_stats_.skipped_loads;
+      }
+    }
+    on_entry = segment->falls_through() ? segment->letter_after(on_entry, false) :
+                                          KnownLetter::Unknown();
+  }
+}
+
+void AssemblySubroutine::finalize() {
+  relax();
   for (auto&& segment : segments_) {
     segment->determine_offset(this);
   }
+  if (optimized_) {
+    peephole_stats_.bytes_saved = unoptimized_size_ - size();
+  }
 }
 
 void AssemblySubroutine::write_code(uint8_t* buffer) const {
@@ -59,11 +288,7 @@ void AssemblySubroutine::write_code(uint8_t* buffer) const {
 }
 
 size_t AssemblySubroutine::size() const {
-  size_t sum = 0;
-  for (auto&& segment : segments_) {
-    sum += segment->size();
-  }
-  return sum;
+  return offsets_.back();
 }
 
 std::string AssemblySubroutine::debug_string() const {
@@ -128,85 +353,121 @@ std::string ConsumingMatchNonConsumingNonMatch::debug_string() const {
 }
 
 
-const uint8_t JumpEqualSegment::kCodeRel8[] = {
-  0x74, 0x00       // je .section_X
+// Opcodes indexed by JumpCondition.
+static const uint8_t kJumpOpcodeRel8[][1] = {
+  {0xeb},         // jmp rel8
+  {0x74},         // je rel8
+  {0x75},         // jne rel8
+  {0x77},         // ja rel8
+  {0x76},         // jbe rel8
+  {0x72},         // jc rel8
+  {0x73},         // jnc rel8
+};
+
+static const uint8_t kJumpOpcodeRel32[][2] = {
+  {0xe9, 0x00},   // jmp rel32 ; one byte opcode
+  {0x0f, 0x84},   // je rel32
+  {0x0f, 0x85},   // jne rel32
+  {0x0f, 0x87},   // ja rel32
+  {0x0f, 0x86},   // jbe rel32
+  {0x0f, 0x82},   // jc rel32
+  {0x0f, 0x83},   // jnc rel32
 };
 
-const uint8_t JumpEqualSegment::kCodeRel16Or32[] = {
-  0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 // je .section_X ; rel16 or rel32
+static const char* const kJumpMnemonic[] = {
+  "jmp",
+  "je",
+  "jne",
+  "ja",
+  "jbe",
+  "jc",
+  "jnc",
 };
 
-void JumpEqualSegment::determine_size(
+void JumpSegment::invert() {
+  switch (condition_) {
+    case JumpCondition::kEqual: condition_ = JumpCondition::kNotEqual; break;
+    case JumpCondition::kNotEqual: condition_ = JumpCondition::kEqual; break;
+    case JumpCondition::kAbove: condition_ = JumpCondition::kBelowOrEqual; break;
+    case JumpCondition::kBelowOrEqual: condition_ = JumpCondition::kAbove; break;
+    case JumpCondition::kCarry: condition_ = JumpCondition::kNotCarry; break;
+    case JumpCondition::kNotCarry: condition_ = JumpCondition::kCarry; break;
+    case JumpCondition::kAlways:
+      std::cerr << "Can't invert an unconditional jump." << std::endl;
+      exit(1);
+  }
+}
+
+size_t JumpSegment::rel8_size() const noexcept {
+  return 2;
+}
+
+size_t JumpSegment::rel32_size() const noexcept {
+  return condition_ == JumpCondition::kAlways ? 5 : 6;
+}
+
+void JumpSegment::determine_size(
     const OffsetInterface* offset_if) noexcept
 {
-  const size_t max_inter_segment_distance = offset_if->maximum_distance(parent_index_, jmp_index_);
-
+  if (offset_size_ == 32) {
+    return;
+  }
   // Offset is relative to the end of the jump statement.
-  const size_t max_distance = max_inter_segment_distance + parent_offset_ + this->max_size();
-  if (max_distance < k8BitMax) {
-    offset_size_ = 8;
-  } else if (max_distance < k16BitMax) {
-    offset_size_ = 16;
-  } else if (max_distance < k32BitMax) {
+  const int64_t jmp_end = offset_if->absolute_offset(parent_index_) + parent_offset_ + size();
+  const int64_t distance =
+      static_cast<int64_t>(offset_if->absolute_offset(jmp_index_) + jmp_skip_) - jmp_end;
+  if (distance < std::numeric_limits<int8_t>::min() ||
+      distance > std::numeric_limits<int8_t>::max()) {
     offset_size_ = 32;
-  } else {
-    std::cerr << "Encountered offset " << max_distance << "not representable with 32 bits." << std::endl;
-    exit(1);
   }
 }
 
-void JumpEqualSegment::determine_offset(
+void JumpSegment::determine_offset(
     const OffsetInterface* offset_if) noexcept
 {
-  const size_t parent_segment_start = offset_if->absolute_offset(parent_index_);
-  const size_t other_segment_start = offset_if->absolute_offset(jmp_index_);
-  const size_t jmp_relative = parent_segment_start + parent_offset_ + this->size();
-  relative_offset_ = other_segment_start - jmp_relative;
+  const int64_t jmp_end = offset_if->absolute_offset(parent_index_) + parent_offset_ + size();
+  const int64_t distance =
+      static_cast<int64_t>(offset_if->absolute_offset(jmp_index_) + jmp_skip_) - jmp_end;
+  if (distance < std::numeric_limits<int32_t>::min() ||
+      distance > std::numeric_limits<int32_t>::max()) {
+    std::cerr << "Encountered offset " << distance << " not representable with 32 bits." << std::endl;
+    exit(1);
+  }
+  relative_offset_ = distance;
 }
 
-void JumpEqualSegment::write_code(uint8_t** code) const noexcept {
+void JumpSegment::write_code(uint8_t** code) const noexcept {
+  const size_t condition = static_cast<size_t>(condition_);
   if (offset_size_ == 8) {
     const int8_t offset = relative_offset_;
-    memcpy(*code, kCodeRel8, sizeof(kCodeRel8));
-    ((int8_t*)*code)[1] = offset;
-    *code += sizeof(kCodeRel8);
-  } else if (offset_size_ == 16 || offset_size_ == 32) {
-    const int32_t offset = relative_offset_;
-    memcpy(*code, kCodeRel16Or32, sizeof(kCodeRel16Or32));
-    ((int8_t*)*code)[2] = offset;
-    *code += sizeof(kCodeRel16Or32);
+    (*code)[0] = kJumpOpcodeRel8[condition][0];
+    memcpy(*code + 1, &offset, sizeof(offset));
+    *code += rel8_size();
   } else {
-    std::cerr << "write_code() called before determine_size()." << std::endl;
-    exit(1);
+    const int32_t offset = relative_offset_;
+    const size_t opcode_size = rel32_size() - sizeof(offset);
+    memcpy(*code, kJumpOpcodeRel32[condition], opcode_size);
+    memcpy(*code + opcode_size, &offset, sizeof(offset));
+    *code += rel32_size();
   }
 }
 
-std::string JumpEqualSegment::debug_string() const {
-  if  (offset_size_ == 0 || relative_offset_ == 0) {
-    std::cerr << "debug_string() called before determine_offset()." << std::endl;
-    exit(1);
-  }
-
+std::string JumpSegment::debug_string() const {
   std::stringstream ss;
   ss <<
-  "    je .section_" << jmp_index_ <<  "  // Offset 0x" <<
+  "    " << kJumpMnemonic[static_cast<size_t>(condition_)] <<
+      " .section_" << jmp_index_ << (jmp_skip_ != 0 ? "+" + std::to_string(jmp_skip_) : "") <<
+      "  // Offset 0x" <<
       std::hex << relative_offset_  << std::dec << std::endl;
   return ss.str();
 }
 
-size_t JumpEqualSegment::size() const noexcept {
-  if (offset_size_ == 8) {
-    return sizeof(kCodeRel8);
-  } else if (offset_size_ == 16 || offset_size_ == 32) {
-    return sizeof(kCodeRel16Or32);
-  } else {
-    std::cerr << "size() called before determine_size()." << std::endl;
-    exit(1);
-  }
+size_t JumpSegment::size() const noexcept {
+  return offset_size_ == 8 ? rel8_size() : rel32_size();
 }
 
-size_t JumpEqualSegment::max_size() const noexcept {
-  return sizeof(kCodeRel16Or32);
+size_t JumpSegment::max_size() const noexcept {
+  return rel32_size();
 }
 
 const uint8_t ConsumingMatchElse::kCodePreamble[] = {
@@ -252,73 +513,1743 @@ unsigned int ConsumingMatchElse::id() const {
   return index_;
 }
 
-void StaticCodeSegment::write_code(uint8_t** code) const noexcept{
+// Formats an immediate operand, with a comment naming the letter it refers
+// to if that's printable.
+static std::string Immediate(uint8_t value, uint8_t letter) {
+  std::stringstream ss;
+  ss << "$0x" << std::hex << (unsigned int)value << std::dec << ", %al";
+  if (std::isgraph(letter)) {
+    ss << "  // '" << letter << "'";
+  }
+  return ss.str();
+}
+
+// A letter as it would appear in a pattern.
+static std::string Escaped(uint8_t letter) {
+  if (std::isgraph(letter) || letter == ' ') {
+    return std::string(1, letter);
+  }
+  std::stringstream ss;
+  ss << "\\x" << std::hex << (letter < 0x10 ? "0" : "") << (unsigned int)letter;
+  return ss.str();
+}
+
+const uint8_t RangeTestSegment::kCodeConsumingMatchElse[] = {
+  0x0f, 0xb6, 0x07,       // movzbl (%rdi), %eax
+  0x48, 0xff, 0xc7,       // inc %rdi
+  0x2c, 0x00,             // sub FIRST, %al
+  0x3c, 0x00              // cmp LAST - FIRST, %al
+};
+
+const uint8_t RangeTestSegment::kCodeConsumingMatchNonConsumingNonMatch[] = {
+  0x0f, 0xb6, 0x07,       // movzbl (%rdi), %eax
+  0x48, 0x8d, 0x57, 0x01, // lea 0x1(%rdi), %rdx
+  0x2c, 0x00,             // sub FIRST, %al
+  0x3c, 0x00,             // cmp LAST - FIRST, %al
+  0x48, 0x0f, 0x46, 0xfa  // cmovbe %rdx, %rdi
+};
+
+RangeTestSegment::RangeTestSegment(unsigned int index, LetterTest test,
+                                   char first, char last, unsigned int jmp_index) noexcept :
+  index_(index),
+  test_(test),
+  first_(first),
+  last_(last),
+  jmp_segment_(test == LetterTest::kConsumingMatchElse ?
+                   JumpCondition::kAbove : JumpCondition::kBelowOrEqual,
+               index,
+               test == LetterTest::kConsumingMatchElse ?
+                   sizeof(kCodeConsumingMatchElse) :
+                   sizeof(kCodeConsumingMatchNonConsumingNonMatch),
+               jmp_index) {}
+
+size_t RangeTestSegment::code_size() const noexcept {
+  return test_ == LetterTest::kConsumingMatchElse ?
+         sizeof(kCodeConsumingMatchElse) :
+         sizeof(kCodeConsumingMatchNonConsumingNonMatch);
+}
+
+void RangeTestSegment::write_code(uint8_t** code) const noexcept {
+  const bool consume_always = test_ == LetterTest::kConsumingMatchElse;
+  const size_t immediates = consume_always ? 7 : 8;
+  memcpy(*code,
+         consume_always ? kCodeConsumingMatchElse : kCodeConsumingMatchNonConsumingNonMatch,
+         code_size());
+  (*code)[immediates] = first_;
+  (*code)[immediates + 2] = last_ - first_;
+  *code += code_size();
+  jmp_segment_.write_code(code);
+}
+
+void RangeTestSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void RangeTestSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string RangeTestSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":" << std::endl <<
+  "    movzbl (%rdi), %eax" << std::endl;
+  if (test_ == LetterTest::kConsumingMatchElse) {
+    ss << "    inc %rdi" << std::endl;
+  } else {
+    ss << "    lea 0x1(%rdi), %rdx" << std::endl;
+  }
+  ss <<
+  "    sub " << Immediate(first_, first_) << std::endl <<
+  "    cmp " << Immediate(last_ - first_, last_) << std::endl;
+  if (test_ == LetterTest::kConsumingMatchNonConsumingNonMatch) {
+    ss << "    cmovbe %rdx, %rdi" << std::endl;
+  }
+  ss << jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t RangeTestSegment::size() const noexcept {
+  return code_size() + jmp_segment_.size();
+}
+
+size_t RangeTestSegment::max_size() const noexcept {
+  return code_size() + jmp_segment_.max_size();
+}
+
+const uint8_t SetTestSegment::kCodeConsumingMatchElse[] = {
+  0x0f, 0xb6, 0x07,       // movzbl (%rdi), %eax
+  0x48, 0xff, 0xc7,       // inc %rdi
+  0x0f, 0xa3, 0x05,       // bt %eax, BITMAP(%rip)
+  0x00, 0x00, 0x00, 0x00
+};
+
+const uint8_t SetTestSegment::kCodeConsumingMatchNonConsumingNonMatch[] = {
+  0x0f, 0xb6, 0x07,       // movzbl (%rdi), %eax
+  0x48, 0x8d, 0x57, 0x01, // lea 0x1(%rdi), %rdx
+  0x0f, 0xa3, 0x05,       // bt %eax, BITMAP(%rip)
+  0x00, 0x00, 0x00, 0x00,
+  0x48, 0x0f, 0x42, 0xfa  // cmovc %rdx, %rdi
+};
+
+SetTestSegment::SetTestSegment(unsigned int index, LetterTest test,
+                               unsigned int bitmap_index, unsigned int jmp_index) noexcept :
+  index_(index),
+  test_(test),
+  bitmap_index_(bitmap_index),
+  bitmap_displacement_(0),
+  jmp_segment_(test == LetterTest::kConsumingMatchElse ?
+                   JumpCondition::kNotCarry : JumpCondition::kCarry,
+               index,
+               test == LetterTest::kConsumingMatchElse ?
+                   sizeof(kCodeConsumingMatchElse) :
+                   sizeof(kCodeConsumingMatchNonConsumingNonMatch),
+               jmp_index) {}
+
+size_t SetTestSegment::code_size() const noexcept {
+  return test_ == LetterTest::kConsumingMatchElse ?
+         sizeof(kCodeConsumingMatchElse) :
+         sizeof(kCodeConsumingMatchNonConsumingNonMatch);
+}
+
+size_t SetTestSegment::displacement_offset() const noexcept {
+  return test_ == LetterTest::kConsumingMatchElse ? 9 : 10;
+}
+
+void SetTestSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code,
+         test_ == LetterTest::kConsumingMatchElse ?
+             kCodeConsumingMatchElse : kCodeConsumingMatchNonConsumingNonMatch,
+         code_size());
+  memcpy(*code + displacement_offset(), &bitmap_displacement_, sizeof(bitmap_displacement_));
+  *code += code_size();
+  jmp_segment_.write_code(code);
+}
+
+void SetTestSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void SetTestSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+  // The displacement is relative to the end of the bt instruction.
+  const size_t instruction_end = offset_if->absolute_offset(index_) +
+                                 displacement_offset() + sizeof(bitmap_displacement_);
+  bitmap_displacement_ = offset_if->absolute_offset(bitmap_index_) - instruction_end;
+}
+
+std::string SetTestSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":" << std::endl <<
+  "    movzbl (%rdi), %eax" << std::endl;
+  if (test_ == LetterTest::kConsumingMatchElse) {
+    ss << "    inc %rdi" << std::endl;
+  } else {
+    ss << "    lea 0x1(%rdi), %rdx" << std::endl;
+  }
+  ss << "    bt %eax, .section_" << bitmap_index_ << "(%rip)" << std::endl;
+  if (test_ == LetterTest::kConsumingMatchNonConsumingNonMatch) {
+    ss << "    cmovc %rdx, %rdi" << std::endl;
+  }
+  ss << jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t SetTestSegment::size() const noexcept {
+  return code_size() + jmp_segment_.size();
+}
+
+size_t SetTestSegment::max_size() const noexcept {
+  return code_size() + jmp_segment_.max_size();
+}
+
+const uint8_t EndTestSegment::kCode[] = {
+  0x48, 0x39, 0xf7        // cmp %rsi, %rdi
+};
+
+EndTestSegment::EndTestSegment(unsigned int index, LetterTest test,
+                               unsigned int jmp_index) noexcept :
+  index_(index),
+  jmp_segment_(test == LetterTest::kConsumingMatchElse ?
+                   JumpCondition::kCarry : JumpCondition::kNotCarry,
+               index, sizeof(kCode), jmp_index) {}
+
+void EndTestSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, kCode, sizeof(kCode));
+  *code += sizeof(kCode);
+  jmp_segment_.write_code(code);
+}
+
+void EndTestSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void EndTestSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string EndTestSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":  // end of input" << std::endl <<
+  "    cmp %rsi, %rdi" << std::endl <<
+  jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t EndTestSegment::size() const noexcept {
+  return sizeof(kCode) + jmp_segment_.size();
+}
+
+size_t EndTestSegment::max_size() const noexcept {
+  return sizeof(kCode) + jmp_segment_.max_size();
+}
+
+LetterJumpSegment::LetterJumpSegment(unsigned int index, JumpCondition condition,
+                                     const uint8_t* code, size_t code_size,
+                                     unsigned int jmp_index) noexcept :
+  index_(index),
+  code_size_(code_size),
+  jmp_segment_(condition, index, code_size, jmp_index),
+  has_bitmap_(false),
+  bitmap_index_(0),
+  displacement_offset_(0)
+{
+  memcpy(code_, code, code_size);
+}
+
+void LetterJumpSegment::use_bitmap(unsigned int bitmap_index, size_t offset) noexcept {
+  has_bitmap_ = true;
+  bitmap_index_ = bitmap_index;
+  displacement_offset_ = offset;
+}
+
+void LetterJumpSegment::write_code(uint8_t** code) const noexcept {
   memcpy(*code, code_, code_size_);
   *code += code_size_;
+  jmp_segment_.write_code(code);
 }
 
-size_t StaticCodeSegment::size() const noexcept{
-  return code_size_;
+void LetterJumpSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
 }
 
-size_t StaticCodeSegment::max_size() const noexcept{
-  return code_size_;
+void LetterJumpSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+  if (has_bitmap_) {
+    const int32_t displacement = offset_if->absolute_offset(bitmap_index_) -
+                                 (offset_if->absolute_offset(index_) + code_size_);
+    memcpy(code_ + displacement_offset_, &displacement, sizeof(displacement));
+  }
 }
 
-const uint8_t StackManagementSegment::kCode[] = {
-  0x55,             // push %rbp
-  0x48, 0x89, 0xe5  // mov %rsp, %rbp
+size_t LetterJumpSegment::size() const noexcept {
+  return code_size_ + jmp_segment_.size();
+}
+
+size_t LetterJumpSegment::max_size() const noexcept {
+  return code_size_ + jmp_segment_.max_size();
+}
+
+const uint8_t JumpIfLetterSegment::kCode[] = {
+  0x3c, 0x00              // cmp LETTER, %al
 };
 
-StackManagementSegment::StackManagementSegment(unsigned int id) :
-  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+JumpIfLetterSegment::JumpIfLetterSegment(unsigned int index, char letter,
+                                         unsigned int jmp_index) noexcept :
+  LetterJumpSegment(index, JumpCondition::kEqual, kCode, sizeof(kCode), jmp_index)
+{
+  code_[1] = letter;
+}
 
-std::string StackManagementSegment::debug_string() const {
+std::string JumpIfLetterSegment::debug_string() const {
   std::stringstream ss;
   ss <<
-  "    push %rbp" << std::endl <<
-  "    mov %rsp, %rbp" << std::endl;
+  ".section_" << id() << ":" << std::endl <<
+  "    cmp " << Immediate(code_[1], code_[1]) << std::endl <<
+  jmp_segment().debug_string();
   return ss.str();
 }
 
-// TODO: Maybe xor %rax,%rax followed by inc would be faster?
-const uint8_t SuccessSegment::kCode[] = {
-  0x48, 0xc7, 0xc0, 0x01, 0x00, 0x00, 0x00,   // mov $01, %rax
-  0x5d,                                       // pop %rbp
-  0xc3                                        // retq
+const uint8_t JumpIfRangeSegment::kCode[] = {
+  0x8d, 0x48, 0x00,       // lea -FIRST(%rax), %ecx
+  0x80, 0xf9, 0x00        // cmp LAST - FIRST, %cl
 };
 
-SuccessSegment::SuccessSegment(unsigned int id) :
-  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+JumpIfRangeSegment::JumpIfRangeSegment(unsigned int index, char first, char last,
+                                       unsigned int jmp_index) noexcept :
+  LetterJumpSegment(index, JumpCondition::kBelowOrEqual, kCode, sizeof(kCode), jmp_index)
+{
+  // Only %cl is compared, so the low byte of the displacement is all that
+  // matters.
+  code_[2] = -static_cast<uint8_t>(first);
+  code_[5] = static_cast<uint8_t>(last) - static_cast<uint8_t>(first);
+}
 
-std::string SuccessSegment::debug_string() const {
+std::string JumpIfRangeSegment::debug_string() const {
+  const uint8_t first = -code_[2];
+  const uint8_t last = first + code_[5];
   std::stringstream ss;
   ss <<
-  ".section_" << id() << ":  // success" << std::endl <<
-  "    mov $01, %rax" << std::endl <<
-  "    pop %rbp" << std::endl <<
-  "    retq" << std::endl;
+  ".section_" << id() << ":" << std::endl <<
+  "    lea -0x" << std::hex << (unsigned int)first << std::dec << "(%rax), %ecx" <<
+      (std::isgraph(first) ? std::string("  // '") + (char)first + "'" : "") << std::endl <<
+  "    cmp $0x" << std::hex << (unsigned int)code_[5] << std::dec << ", %cl" <<
+      (std::isgraph(last) ? std::string("  // '") + (char)last + "'" : "") << std::endl <<
+  jmp_segment().debug_string();
   return ss.str();
 }
 
-const uint8_t FailureSegment::kCode[] = {
-  0x31, 0xc0,   // xor %eax, %eax
-  0x5d,         // pop %rbp
-  0xc3          // retq
+const uint8_t JumpIfSetSegment::kCode[] = {
+  0x0f, 0xa3, 0x05,       // bt %eax, BITMAP(%rip)
+  0x00, 0x00, 0x00, 0x00
 };
 
-FailureSegment::FailureSegment(unsigned int id) :
-  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+JumpIfSetSegment::JumpIfSetSegment(unsigned int index, unsigned int bitmap_index,
+                                   unsigned int jmp_index) noexcept :
+  LetterJumpSegment(index, JumpCondition::kCarry, kCode, sizeof(kCode), jmp_index),
+  bitmap_index_(bitmap_index)
+{
+  use_bitmap(bitmap_index, 3);
+}
 
-std::string FailureSegment::debug_string() const {
+std::string JumpIfSetSegment::debug_string() const {
   std::stringstream ss;
   ss <<
-  ".section_" << id() << ":  // failure" << std::endl <<
-  "    xor %eax, %eax" << std::endl <<
-  "    pop %rbp" << std::endl <<
-  "    retq" << std::endl;
+  ".section_" << id() << ":" << std::endl <<
+  "    bt %eax, .section_" << bitmap_index_ << "(%rip)" << std::endl <<
+  jmp_segment().debug_string();
+  return ss.str();
+}
+
+const uint8_t DispatchSegment::kCode[] = {
+  0x48, 0x8d, 0x0d,             // lea TABLE(%rip), %rcx
+  0x00, 0x00, 0x00, 0x00,
+  0x0f, 0xb6, 0x84, 0x01,       // movzbl SLOTS(%rcx,%rax), %eax
+  0x00, 0x00, 0x00, 0x00,
+  0x48, 0x63, 0x14, 0x81,       // movslq (%rcx,%rax,4), %rdx
+  0x48, 0x01, 0xca,             // add %rcx, %rdx
+  0xff, 0xe2                    // jmp *%rdx
+};
+
+DispatchSegment::DispatchSegment(unsigned int index, unsigned int table_index,
+                                 size_t slot_count) noexcept :
+  index_(index),
+  table_index_(table_index),
+  slot_count_(slot_count)
+{
+  static_assert(sizeof(kCode) == sizeof(code_), "DispatchSegment code size mismatch");
+  memcpy(code_, kCode, sizeof(kCode));
+  // The letters' slots follow the offsets.
+  const int32_t slots_offset = slot_count * sizeof(int32_t);
+  memcpy(code_ + 11, &slots_offset, sizeof(slots_offset));
+}
+
+void DispatchSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, sizeof(code_));
+  *code += sizeof(code_);
+}
+
+void DispatchSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  const int32_t displacement = offset_if->absolute_offset(table_index_) -
+                               (offset_if->absolute_offset(index_) + 7);
+  memcpy(code_ + 3, &displacement, sizeof(displacement));
+}
+
+std::string DispatchSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":" << std::endl <<
+  "    lea .section_" << table_index_ << "(%rip), %rcx" << std::endl <<
+  "    movzbl 0x" << std::hex << slot_count_ * sizeof(int32_t) << std::dec <<
+      "(%rcx,%rax), %eax" << std::endl <<
+  "    movslq (%rcx,%rax,4), %rdx" << std::endl <<
+  "    add %rcx, %rdx" << std::endl <<
+  "    jmp *%rdx" << std::endl;
   return ss.str();
 }
 
+size_t DispatchSegment::size() const noexcept {
+  return sizeof(code_);
+}
+
+size_t DispatchSegment::max_size() const noexcept {
+  return sizeof(code_);
+}
+
+constexpr size_t LiteralSegment::kMinLength;
+constexpr size_t LiteralSegment::kMaxLength;
+constexpr size_t LiteralSegment::kMinConstantLength;
+constexpr size_t LiteralSegment::kMaxCodeSize;
+constexpr size_t LiteralSegment::kMaxPieces;
+
+LiteralSegment::LiteralSegment(unsigned int index, const char* letters, size_t length,
+                               unsigned int constant_index, unsigned int jmp_index) noexcept :
+  index_(index),
+  length_(length),
+  constant_index_(constant_index),
+  code_size_(0),
+  bailout_count_(0),
+  constant_count_(0),
+  jmp_segment_(JumpCondition::kAlways, index, 0, jmp_index)
+{
+  if (length < kMinLength || length > kMaxLength) {
+    std::cerr << "Literal run of length " << length << " out of range." << std::endl;
+    exit(1);
+  }
+  memcpy(letters_, letters, length);
+  assemble(nullptr);
+  jmp_segment_ = JumpSegment(JumpCondition::kAlways, index, code_size_, jmp_index);
+}
+
+void LiteralSegment::assemble(std::ostream* listing) noexcept {
+  uint8_t* code = code_;
+  bailout_count_ = 0;
+  constant_count_ = 0;
+  auto emit = [&code](std::initializer_list<uint8_t> bytes) {
+    for (uint8_t byte : bytes) {
+      *code++ = byte;
+    }
+  };
+  auto emit_value = [&code](const void* value, size_t size) {
+    memcpy(code, value, size);
+    code += size;
+  };
+  auto bail_out = [&]() {
+    // jne/jb rel32 to the end of the segment, patched by write_code().
+    bailout_offsets_[bailout_count_++] = code - code_;
+    emit({0x00, 0x00, 0x00, 0x00});
+  };
+
+  if (listing != nullptr) {
+    *listing <<
+    "    mov %rsi, %rcx" << std::endl <<
+    "    sub %rdi, %rcx" << std::endl <<
+    "    cmp $0x" << std::hex << length_ << std::dec << ", %rcx" << std::endl <<
+    "    jb .section_" << index_ << "_end" << std::endl;
+  }
+  emit({0x48, 0x89, 0xf1});                     // mov %rsi, %rcx
+  emit({0x48, 0x29, 0xf9});                     // sub %rdi, %rcx
+  emit({0x48, 0x83, 0xf9, static_cast<uint8_t>(length_)});  // cmp LENGTH, %rcx
+  emit({0x0f, 0x82});                           // jb END
+  bail_out();
+
+  const size_t width = length_ >= kMinConstantLength ? 16 : length_ >= 8 ? 8 : 4;
+  for (size_t start = 0; start < length_; start += width) {
+    // The last piece ends at the end of the run, overlapping its predecessor.
+    const uint8_t offset = std::min(start, length_ - width);
+    if (width == 16) {
+      constant_letters_[constant_count_] = offset;
+      emit({0xf3, 0x0f, 0x6f, 0x47, offset});   // movdqu OFFSET(%rdi), %xmm0
+      emit({0xf3, 0x0f, 0x6f, 0x0d});           // movdqu CONSTANT(%rip), %xmm1
+      constant_offsets_[constant_count_++] = code - code_;
+      emit({0x00, 0x00, 0x00, 0x00});
+      emit({0x66, 0x0f, 0x74, 0xc1});           // pcmpeqb %xmm1, %xmm0
+      emit({0x66, 0x0f, 0xd7, 0xc8});           // pmovmskb %xmm0, %ecx
+      emit({0x81, 0xf9, 0xff, 0xff, 0x00, 0x00}); // cmp $0xffff, %ecx
+      if (listing != nullptr) {
+        *listing <<
+        "    movdqu 0x" << std::hex << (unsigned int)offset << std::dec << "(%rdi), %xmm0" << std::endl <<
+        "    movdqu .section_" << constant_index_ << "+" << (unsigned int)offset <<
+            "(%rip), %xmm1" << std::endl <<
+        "    pcmpeqb %xmm1, %xmm0" << std::endl <<
+        "    pmovmskb %xmm0, %ecx" << std::endl <<
+        "    cmp $0xffff, %ecx" << std::endl;
+      }
+    } else if (width == 8) {
+      emit({0x48, 0xba});                       // movabs LETTERS, %rdx
+      emit_value(letters_ + offset, 8);
+      emit({0x48, 0x39, 0x57, offset});         // cmp %rdx, OFFSET(%rdi)
+      if (listing != nullptr) {
+        uint64_t value;
+        memcpy(&value, letters_ + offset, sizeof(value));
+        *listing <<
+        "    movabs $0x" << std::hex << value << ", %rdx" << std::endl <<
+        "    cmp %rdx, 0x" << (unsigned int)offset << std::dec << "(%rdi)" << std::endl;
+      }
+    } else {
+      emit({0x81, 0x7f, offset});               // cmpl LETTERS, OFFSET(%rdi)
+      emit_value(letters_ + offset, 4);
+      if (listing != nullptr) {
+        uint32_t value;
+        memcpy(&value, letters_ + offset, sizeof(value));
+        *listing <<
+        "    cmpl $0x" << std::hex << value << ", 0x" << (unsigned int)offset << std::dec <<
+            "(%rdi)" << std::endl;
+      }
+    }
+    emit({0x0f, 0x85});                         // jne END
+    bail_out();
+    if (listing != nullptr) {
+      *listing << "    jne .section_" << index_ << "_end" << std::endl;
+    }
+  }
+  emit({0x48, 0x83, 0xc7, static_cast<uint8_t>(length_)});  // add LENGTH, %rdi
+  if (listing != nullptr) {
+    *listing << "    add $0x" << std::hex << length_ << std::dec << ", %rdi" << std::endl;
+  }
+  code_size_ = code - code_;
+}
+
+void LiteralSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, code_size_);
+  const size_t end = size();
+  for (size_t i = 0; i < bailout_count_; ++i) {
+    const int32_t displacement = end - (bailout_offsets_[i] + sizeof(int32_t));
+    memcpy(*code + bailout_offsets_[i], &displacement, sizeof(displacement));
+  }
+  *code += code_size_;
+  jmp_segment_.write_code(code);
+}
+
+void LiteralSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void LiteralSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+  if (constant_count_ == 0) {
+    // There's no constant section to refer to.
+    return;
+  }
+  const size_t start = offset_if->absolute_offset(index_);
+  const size_t constants = offset_if->absolute_offset(constant_index_);
+  for (size_t i = 0; i < constant_count_; ++i) {
+    const size_t instruction_end = start + constant_offsets_[i] + sizeof(int32_t);
+    const int32_t displacement = constants + constant_letters_[i] - instruction_end;
+    memcpy(code_ + constant_offsets_[i], &displacement, sizeof(displacement));
+  }
+}
+
+std::string LiteralSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << index_ << ":  // \"";
+  for (size_t i = 0; i < length_; ++i) {
+    ss << Escaped(letters_[i]);
+  }
+  ss << "\"" << std::endl;
+  // Describe the code without disturbing it.
+  LiteralSegment copy(*this);
+  copy.assemble(&ss);
+  ss << jmp_segment_.debug_string() <<
+  ".section_" << index_ << "_end:" << std::endl;
+  return ss.str();
+}
+
+size_t LiteralSegment::size() const noexcept {
+  return code_size_ + jmp_segment_.size();
+}
+
+size_t LiteralSegment::max_size() const noexcept {
+  return code_size_ + jmp_segment_.max_size();
+}
+
+namespace {
+
+// Hand-assembles code into a buffer, for segments whose code depends on
+// their arguments, or, if given a listing, describes it there as it goes.
+struct CodeWriter {
+  uint8_t* code;
+  std::ostream* listing;
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    for (uint8_t byte : bytes) {
+      *code++ = byte;
+    }
+  }
+
+  void line(const std::string& text) const {
+    if (listing != nullptr) {
+      *listing << "    " << text << std::endl;
+    }
+  }
+
+  // Labels the current position `name` within section `index`.
+  void label(unsigned int index, const char* name) const {
+    if (listing != nullptr) {
+      *listing << ".section_" << index << "_" << name << ":" << std::endl;
+    }
+  }
+
+  // Points the rel8 operand of the jump ending at `jump` here.
+  void land(uint8_t* jump) const {
+    jump[-1] = static_cast<uint8_t>(code - jump);
+  }
+
+  static std::string xmm(unsigned int reg) {
+    return "%xmm" + std::to_string(reg);
+  }
+
+  // An SSE2 instruction between two XMM registers.
+  void sse(uint8_t opcode, const char* mnemonic, unsigned int src, unsigned int dst) {
+    emit({0x66, 0x0f, opcode, static_cast<uint8_t>(0xc0 | dst << 3 | src)});
+    line(std::string(mnemonic) + " " + xmm(src) + ", " + xmm(dst));
+  }
+
+  // Fills %xmm`reg` with copies of `byte`. Clobbers %edx.
+  void broadcast(uint8_t byte, unsigned int reg) {
+    const uint32_t value = byte * 0x01010101u;
+    emit({0xba});
+    memcpy(code, &value, sizeof(value));
+    code += sizeof(value);
+    emit({0x66, 0x0f, 0x6e, static_cast<uint8_t>(0xc2 | reg << 3)});
+    emit({0x66, 0x0f, 0x70, static_cast<uint8_t>(0xc0 | reg << 3 | reg), 0x00});
+    if (listing != nullptr) {
+      std::stringstream ss;
+      ss << "mov $0x" << std::hex << value << ", %edx";
+      line(ss.str());
+    }
+    line("movd %edx, " + xmm(reg));
+    line("pshufd $0x0, " + xmm(reg) + ", " + xmm(reg));
+  }
+
+  void movemask(unsigned int src) {
+    emit({0x66, 0x0f, 0xd7, static_cast<uint8_t>(0xd0 | src)});
+    line("pmovmskb " + xmm(src) + ", %edx");
+  }
+};
+
+} // end namespace
+
+constexpr size_t SkipLoopSegment::kMaxStops;
+constexpr size_t SkipLoopSegment::kMaxCodeSize;
+
+bool SkipLoopSegment::CanSkip(const std::bitset<256>& letters) {
+  if (letters.none()) {
+    return false;
+  } else if (letters.count() == 1 || letters.count() + kMaxStops >= 256) {
+    return true;
+  }
+  size_t first = 0;
+  while (!letters.test(first)) {
+    ++first;
+  }
+  size_t last = first;
+  while (last + 1 < 256 && letters.test(last + 1)) {
+    ++last;
+  }
+  return last + 1 - first == letters.count();
+}
+
+SkipLoopSegment::SkipLoopSegment(unsigned int index, const std::bitset<256>& letters) noexcept :
+  index_(index),
+  stop_count_(0),
+  code_size_(0)
+{
+  if (!CanSkip(letters)) {
+    std::cerr << "Can't skip over " << letters.count() << " letters." << std::endl;
+    exit(1);
+  }
+  size_t first = 0;
+  while (!letters.test(first)) {
+    ++first;
+  }
+  if (letters.count() == 1) {
+    kind_ = Kind::kLetter;
+    letters_[0] = first;
+  } else if (letters.count() + kMaxStops >= 256) {
+    kind_ = Kind::kStops;
+    for (unsigned int letter = 0; letter < 256; ++letter) {
+      if (!letters.test(letter)) {
+        letters_[stop_count_++] = letter;
+      }
+    }
+  } else {
+    kind_ = Kind::kRange;
+    letters_[0] = first;
+    letters_[1] = first + letters.count() - 1;
+  }
+  assemble(nullptr);
+}
+
+void SkipLoopSegment::assemble(std::ostream* listing) noexcept {
+  CodeWriter writer {code_, listing};
+  // Sets a bit in %edx for each letter of the 16 in %xmm0 that isn't
+  // skipped. Clobbers %xmm0.
+  auto stop_mask = [&]() {
+    switch (kind_) {
+      case Kind::kLetter:
+        writer.sse(0x74, "pcmpeqb", 1, 0);
+        writer.movemask(0);
+        break;
+      case Kind::kRange:
+        // The letter is in range if, less the first letter, it's no more
+        // than the range's span, unsigned.
+        writer.sse(0xfc, "paddb", 1, 0);
+        writer.sse(0x6f, "movdqa", 0, 4);
+        writer.sse(0xda, "pminub", 2, 4);
+        writer.sse(0x74, "pcmpeqb", 0, 4);
+        writer.movemask(4);
+        break;
+      case Kind::kStops:
+        if (stop_count_ == 0) {
+          // Everything is skipped, up to the end of the input.
+          writer.emit({0x31, 0xd2});           // xor %edx, %edx
+          writer.line("xor %edx, %edx");
+          return;
+        }
+        for (unsigned int i = 0; i < stop_count_; ++i) {
+          writer.sse(0x6f, "movdqa", 0, 4 + i);
+          writer.sse(0x74, "pcmpeqb", 1 + i, 4 + i);
+        }
+        for (unsigned int i = 1; i < stop_count_; ++i) {
+          writer.sse(0xeb, "por", 4 + i, 4);
+        }
+        writer.movemask(4);
+        return;
+    }
+    writer.emit({0x81, 0xf2, 0xff, 0xff, 0x00, 0x00}); // xor $0xffff, %edx
+    writer.line("xor $0xffff, %edx");
+  };
+
+  switch (kind_) {
+    case Kind::kLetter:
+      writer.broadcast(letters_[0], 1);
+      break;
+    case Kind::kRange:
+      writer.broadcast(-letters_[0], 1);
+      writer.broadcast(letters_[1] - letters_[0], 2);
+      break;
+    case Kind::kStops:
+      for (unsigned int i = 0; i < stop_count_; ++i) {
+        writer.broadcast(letters_[i], 1 + i);
+      }
+      break;
+  }
+  // The block holding the end of the input may be on a page the input
+  // doesn't reach, if the input ends on a page boundary.
+  writer.emit({0x48, 0x39, 0xf7});             // cmp %rsi, %rdi
+  writer.emit({0x73, 0x00});                   // jae CLAMP
+  uint8_t* entry_end_jump = writer.code;
+  writer.line("cmp %rsi, %rdi");
+  writer.line("jae .section_" + std::to_string(index_) + "_clamp");
+  writer.emit({0x89, 0xf9});                   // mov %edi, %ecx
+  writer.emit({0x83, 0xe1, 0x0f});             // and $0xf, %ecx
+  writer.emit({0x48, 0x83, 0xe7, 0xf0});       // and $-16, %rdi
+  writer.emit({0x66, 0x0f, 0x6f, 0x07});       // movdqa (%rdi), %xmm0
+  writer.line("mov %edi, %ecx");
+  writer.line("and $0xf, %ecx");
+  writer.line("and $-16, %rdi");
+  writer.line("movdqa (%rdi), %xmm0");
+  stop_mask();
+  // Ignore the letters before the input pointer.
+  writer.emit({0xd3, 0xea});                   // shr %cl, %edx
+  writer.emit({0xd3, 0xe2});                   // shl %cl, %edx
+  writer.emit({0x85, 0xd2});                   // test %edx, %edx
+  writer.emit({0x75, 0x00});                   // jnz FOUND
+  uint8_t* found_jump = writer.code;
+  writer.line("shr %cl, %edx");
+  writer.line("shl %cl, %edx");
+  writer.line("test %edx, %edx");
+  writer.line("jnz .section_" + std::to_string(index_) + "_found");
+
+  uint8_t* loop = writer.code;
+  writer.label(index_, "loop");
+  writer.emit({0x48, 0x83, 0xc7, 0x10});       // add $16, %rdi
+  writer.emit({0x48, 0x39, 0xf7});             // cmp %rsi, %rdi
+  writer.emit({0x73, 0x00});                   // jae CLAMP
+  uint8_t* loop_end_jump = writer.code;
+  writer.emit({0x66, 0x0f, 0x6f, 0x07});       // movdqa (%rdi), %xmm0
+  writer.line("add $0x10, %rdi");
+  writer.line("cmp %rsi, %rdi");
+  writer.line("jae .section_" + std::to_string(index_) + "_clamp");
+  writer.line("movdqa (%rdi), %xmm0");
+  stop_mask();
+  writer.emit({0x85, 0xd2});                   // test %edx, %edx
+  writer.emit({0x74, 0x00});                   // jz LOOP
+  writer.code[-1] = static_cast<uint8_t>(loop - writer.code);
+  writer.line("test %edx, %edx");
+  writer.line("jz .section_" + std::to_string(index_) + "_loop");
+
+  writer.land(found_jump);
+  writer.label(index_, "found");
+  writer.emit({0x0f, 0xbc, 0xd2});             // bsf %edx, %edx
+  writer.emit({0x48, 0x01, 0xd7});             // add %rdx, %rdi
+  writer.line("bsf %edx, %edx");
+  writer.line("add %rdx, %rdi");
+
+  // Letters past the end of the input may have stopped the skip, or it may
+  // have run past the end a block at a time.
+  writer.land(entry_end_jump);
+  writer.land(loop_end_jump);
+  writer.label(index_, "clamp");
+  writer.emit({0x48, 0x39, 0xf7});             // cmp %rsi, %rdi
+  writer.emit({0x48, 0x0f, 0x47, 0xfe});       // cmova %rsi, %rdi
+  writer.line("cmp %rsi, %rdi");
+  writer.line("cmova %rsi, %rdi");
+  code_size_ = writer.code - code_;
+}
+
+void SkipLoopSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, code_size_);
+  *code += code_size_;
+}
+
+std::string SkipLoopSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << index_ << ":  // skip [";
+  switch (kind_) {
+    case Kind::kLetter:
+      ss << Escaped(letters_[0]);
+      break;
+    case Kind::kRange:
+      ss << Escaped(letters_[0]) << "-" << Escaped(letters_[1]);
+      break;
+    case Kind::kStops:
+      ss << "^";
+      for (size_t i = 0; i < stop_count_; ++i) {
+        ss << Escaped(letters_[i]);
+      }
+      break;
+  }
+  ss << "]" << std::endl;
+  // Describe the code without disturbing it.
+  SkipLoopSegment copy(*this);
+  copy.assemble(&ss);
+  return ss.str();
+}
+
+size_t SkipLoopSegment::size() const noexcept {
+  return code_size_;
+}
+
+size_t SkipLoopSegment::max_size() const noexcept {
+  return code_size_;
+}
+
+constexpr size_t PrefilterSegment::kMaxFirst;
+constexpr size_t PrefilterSegment::kMaxDistance;
+constexpr size_t PrefilterSegment::kMaxCodeSize;
+
+PrefilterSegment::PrefilterSegment(unsigned int index, const std::bitset<256>& first,
+                                   uint8_t last, size_t distance,
+                                   unsigned int jmp_index) noexcept :
+  index_(index),
+  first_count_(0),
+  last_(last),
+  distance_(distance),
+  code_size_(0),
+  // Placeholder. The offset is known once the code is.
+  jmp_segment_(JumpCondition::kNotCarry, index, 0, jmp_index)
+{
+  if (first.none() || first.count() > kMaxFirst || distance > kMaxDistance) {
+    std::cerr << "Can't prefilter for " << first.count() << " letters " <<
+        distance << " apart." << std::endl;
+    exit(1);
+  }
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    if (first.test(letter)) {
+      first_[first_count_++] = letter;
+    }
+  }
+  assemble(nullptr);
+  jmp_segment_ = JumpSegment(JumpCondition::kNotCarry, index, code_size_, jmp_index);
+}
+
+void PrefilterSegment::assemble(std::ostream* listing) noexcept {
+  CodeWriter writer {code_, listing};
+  const uint8_t distance = distance_;
+  auto immediate = [](uint8_t value) {
+    std::stringstream ss;
+    ss << "$0x" << std::hex << static_cast<unsigned int>(value);
+    return ss.str();
+  };
+
+  // Candidates start before %rax, so that their last letter is before the
+  // end of the input. %rcx is the next one to look at.
+  writer.emit({0x48, 0x8d, 0x46, static_cast<uint8_t>(-distance)});  // lea -DISTANCE(%rsi), %rax
+  writer.emit({0x48, 0x89, 0xf9});             // mov %rdi, %rcx
+  writer.line("lea -" + std::to_string(distance) + "(%rsi), %rax");
+  writer.line("mov %rdi, %rcx");
+  for (size_t i = 0; i < first_count_; ++i) {
+    writer.broadcast(first_[i], 1 + i);
+  }
+  if (distance != 0) {
+    writer.broadcast(last_, 4);
+  }
+
+  // Whole blocks of 16 candidates, while their last letters are in bounds.
+  uint8_t* loop = writer.code;
+  writer.label(index_, "loop");
+  writer.emit({0x48, 0x8d, 0x51, 0x10});       // lea 16(%rcx), %rdx
+  writer.emit({0x48, 0x39, 0xc2});             // cmp %rax, %rdx
+  writer.emit({0x77, 0x00});                   // ja TAIL
+  uint8_t* tail_jump = writer.code;
+  writer.emit({0xf3, 0x0f, 0x6f, 0x01});       // movdqu (%rcx), %xmm0
+  writer.line("lea 0x10(%rcx), %rdx");
+  writer.line("cmp %rax, %rdx");
+  writer.line("ja .section_" + std::to_string(index_) + "_tail");
+  writer.line("movdqu (%rcx), %xmm0");
+  unsigned int mask = 0;
+  if (first_count_ == 1) {
+    writer.sse(0x74, "pcmpeqb", 1, 0);
+  } else {
+    mask = 5;
+    for (size_t i = 0; i < first_count_; ++i) {
+      const unsigned int reg = i == 0 ? 5 : 6;
+      writer.sse(0x6f, "movdqa", 0, reg);
+      writer.sse(0x74, "pcmpeqb", 1 + i, reg);
+      if (i != 0) {
+        writer.sse(0xeb, "por", 6, 5);
+      }
+    }
+  }
+  if (distance != 0) {
+    writer.emit({0xf3, 0x0f, 0x6f, 0x71, distance});   // movdqu DISTANCE(%rcx), %xmm6
+    writer.line("movdqu " + std::to_string(distance) + "(%rcx), %xmm6");
+    writer.sse(0x74, "pcmpeqb", 4, 6);
+    writer.sse(0xdb, "pand", 6, mask);
+  }
+  writer.movemask(mask);
+  writer.emit({0x85, 0xd2});                   // test %edx, %edx
+  writer.emit({0x75, 0x00});                   // jnz DONE
+  uint8_t* block_found_jump = writer.code;
+  writer.emit({0x48, 0x83, 0xc1, 0x10});       // add $16, %rcx
+  writer.emit({0xeb, 0x00});                   // jmp LOOP
+  writer.code[-1] = static_cast<uint8_t>(loop - writer.code);
+  writer.line("test %edx, %edx");
+  writer.line("jnz .section_" + std::to_string(index_) + "_done");
+  writer.line("add $0x10, %rcx");
+  writer.line("jmp .section_" + std::to_string(index_) + "_loop");
+
+  // The rest, one at a time.
+  writer.land(tail_jump);
+  uint8_t* tail = writer.code;
+  writer.label(index_, "tail");
+  writer.emit({0x48, 0x39, 0xc1});             // cmp %rax, %rcx
+  writer.emit({0x73, 0x00});                   // jae DONE
+  uint8_t* tail_done_jump = writer.code;
+  writer.emit({0x0f, 0xb6, 0x11});             // movzbl (%rcx), %edx
+  writer.line("cmp %rax, %rcx");
+  writer.line("jae .section_" + std::to_string(index_) + "_done");
+  writer.line("movzbl (%rcx), %edx");
+  uint8_t* first_jumps[kMaxFirst];
+  for (size_t i = 0; i < first_count_; ++i) {
+    writer.emit({0x80, 0xfa, first_[i]});      // cmp $FIRST, %dl
+    writer.emit({0x74, 0x00});                 // je CHECK
+    first_jumps[i] = writer.code;
+    writer.line("cmp " + immediate(first_[i]) + ", %dl");
+    writer.line("je .section_" + std::to_string(index_) + "_check");
+  }
+  writer.emit({0xeb, 0x00});                   // jmp NEXT
+  uint8_t* next_jump = writer.code;
+  writer.line("jmp .section_" + std::to_string(index_) + "_next");
+  for (size_t i = 0; i < first_count_; ++i) {
+    writer.land(first_jumps[i]);
+  }
+  writer.label(index_, "check");
+  uint8_t* check_found_jump = nullptr;
+  if (distance != 0) {
+    writer.emit({0x80, 0x79, distance, last_});   // cmpb $LAST, DISTANCE(%rcx)
+    writer.emit({0x74, 0x00});                 // je DONE
+    check_found_jump = writer.code;
+    writer.line("cmpb " + immediate(last_) + ", " + std::to_string(distance) + "(%rcx)");
+    writer.line("je .section_" + std::to_string(index_) + "_done");
+  } else {
+    writer.emit({0xeb, 0x00});                 // jmp DONE
+    check_found_jump = writer.code;
+    writer.line("jmp .section_" + std::to_string(index_) + "_done");
+  }
+  writer.land(next_jump);
+  writer.label(index_, "next");
+  writer.emit({0x48, 0xff, 0xc1});             // inc %rcx
+  writer.emit({0xeb, 0x00});                   // jmp TAIL
+  writer.code[-1] = static_cast<uint8_t>(tail - writer.code);
+  writer.line("inc %rcx");
+  writer.line("jmp .section_" + std::to_string(index_) + "_tail");
+
+  // Found a candidate if %rcx stopped short of %rax.
+  writer.land(block_found_jump);
+  writer.land(tail_done_jump);
+  writer.land(check_found_jump);
+  writer.label(index_, "done");
+  writer.emit({0x48, 0x39, 0xc1});             // cmp %rax, %rcx
+  writer.line("cmp %rax, %rcx");
+  code_size_ = writer.code - code_;
+}
+
+void PrefilterSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, code_size_);
+  *code += code_size_;
+  jmp_segment_.write_code(code);
+}
+
+void PrefilterSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void PrefilterSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string PrefilterSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << index_ << ":  // prefilter [";
+  for (size_t i = 0; i < first_count_; ++i) {
+    ss << Escaped(first_[i]);
+  }
+  ss << "]";
+  if (distance_ != 0) {
+    ss << " then " << Escaped(last_) << " " << distance_ << " later";
+  }
+  ss << std::endl;
+  // Describe the code without disturbing it.
+  PrefilterSegment copy(*this);
+  copy.assemble(&ss);
+  ss << jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t PrefilterSegment::size() const noexcept {
+  return code_size_ + jmp_segment_.size();
+}
+
+size_t PrefilterSegment::max_size() const noexcept {
+  return code_size_ + jmp_segment_.max_size();
+}
+
+constexpr size_t ShuffleLoopSegment::kMaxStates;
+constexpr size_t ShuffleLoopSegment::kMaxNarrowStates;
+constexpr size_t ShuffleLoopSegment::kUnroll;
+constexpr size_t ShuffleLoopSegment::kMaxCodeSize;
+
+ShuffleLoopSegment::ShuffleLoopSegment(unsigned int index, unsigned int table_index,
+                                       size_t states, uint8_t failure,
+                                       uint32_t accepting) noexcept :
+  index_(index),
+  table_index_(table_index),
+  wide_(states > kMaxNarrowStates),
+  failure_(failure),
+  accepting_(accepting),
+  code_size_(0)
+{
+  assemble(nullptr);
+}
+
+void ShuffleLoopSegment::assemble(std::ostream* listing) noexcept {
+  CodeWriter writer {code_, listing};
+  const std::string section = ".section_" + std::to_string(index_);
+  // Points the rel32 operand of the jump ending at `jump` to `target`.
+  auto set_rel32 = [](uint8_t* jump, const uint8_t* target) {
+    const int32_t displacement = target - jump;
+    memcpy(jump - sizeof(displacement), &displacement, sizeof(displacement));
+  };
+
+  writer.emit({0x48, 0x8d, 0x0d, 0x00, 0x00, 0x00, 0x00});   // lea TABLE(%rip), %rcx
+  writer.emit({0x66, 0x0f, 0xef, 0xc0});                     // pxor %xmm0, %xmm0
+  writer.line("lea .section_" + std::to_string(table_index_) + "(%rip), %rcx");
+  writer.line("pxor %xmm0, %xmm0");
+  if (wide_) {
+    writer.broadcast(0x80, 7);
+  }
+
+  // Moves the state in %xmm0 on by the letter `offset` letters on.
+  auto step = [&](uint8_t offset) {
+    writer.emit({0x0f, 0xb6, 0x47, offset});                 // movzbl OFFSET(%rdi), %eax
+    writer.emit({0xc1, 0xe0, static_cast<uint8_t>(wide_ ? 5 : 4)});   // shl $SHIFT, %eax
+    writer.emit({0xf3, 0x0f, 0x6f, 0x0c, 0x01});             // movdqu (%rcx,%rax), %xmm1
+    writer.line("movzbl " + std::to_string(offset) + "(%rdi), %eax");
+    writer.line(wide_ ? "shl $0x5, %eax" : "shl $0x4, %eax");
+    writer.line("movdqu (%rcx,%rax), %xmm1");
+    if (wide_) {
+      writer.emit({0xf3, 0x0f, 0x6f, 0x54, 0x01, 0x10});     // movdqu 16(%rcx,%rax), %xmm2
+      writer.line("movdqu 0x10(%rcx,%rax), %xmm2");
+    }
+    writer.emit({0x66, 0x0f, 0x38, 0x00, 0xc8});             // pshufb %xmm0, %xmm1
+    writer.line("pshufb %xmm0, %xmm1");
+    if (wide_) {
+      writer.sse(0xef, "pxor", 7, 0);
+      writer.emit({0x66, 0x0f, 0x38, 0x00, 0xd0});           // pshufb %xmm0, %xmm2
+      writer.line("pshufb %xmm0, %xmm2");
+      writer.sse(0xeb, "por", 2, 1);
+    }
+    writer.sse(0x6f, "movdqa", 1, 0);
+  };
+
+  // Whole blocks of letters, while there are enough left.
+  uint8_t* loop = writer.code;
+  writer.label(index_, "loop");
+  writer.emit({0x48, 0x8d, 0x47, static_cast<uint8_t>(kUnroll)});   // lea UNROLL(%rdi), %rax
+  writer.emit({0x48, 0x39, 0xf0});                           // cmp %rsi, %rax
+  writer.emit({0x0f, 0x87, 0x00, 0x00, 0x00, 0x00});         // ja TAIL
+  uint8_t* tail_jump = writer.code;
+  writer.line("lea " + std::to_string(kUnroll) + "(%rdi), %rax");
+  writer.line("cmp %rsi, %rax");
+  writer.line("ja " + section + "_tail");
+  for (size_t i = 0; i < kUnroll; ++i) {
+    step(i);
+  }
+  writer.emit({0x48, 0x83, 0xc7, static_cast<uint8_t>(kUnroll)});   // add $UNROLL, %rdi
+  writer.emit({0x66, 0x0f, 0x7e, 0xc0});                     // movd %xmm0, %eax
+  writer.emit({0x3c, Encode(failure_)});                     // cmp $FAILURE, %al
+  writer.emit({0x0f, 0x85, 0x00, 0x00, 0x00, 0x00});         // jne LOOP
+  set_rel32(writer.code, loop);
+  std::stringstream compare;
+  compare << "cmp $0x" << std::hex << static_cast<unsigned int>(Encode(failure_)) << ", %al";
+  writer.line("add $" + std::to_string(kUnroll) + ", %rdi");
+  writer.line("movd %xmm0, %eax");
+  writer.line(compare.str());
+  writer.line("jne " + section + "_loop");
+
+  // Failed.
+  writer.emit({0x31, 0xc0});                                 // xor %eax, %eax
+  writer.emit({0x5d});                                       // pop %rbp
+  writer.emit({0xc3});                                       // retq
+  writer.line("xor %eax, %eax");
+  writer.line("pop %rbp");
+  writer.line("retq");
+
+  // The rest, one at a time.
+  set_rel32(tail_jump, writer.code);
+  uint8_t* tail = writer.code;
+  writer.label(index_, "tail");
+  writer.emit({0x48, 0x39, 0xf7});                           // cmp %rsi, %rdi
+  writer.emit({0x74, 0x00});                                 // je DONE
+  uint8_t* done_jump = writer.code;
+  writer.line("cmp %rsi, %rdi");
+  writer.line("je " + section + "_done");
+  step(0);
+  writer.emit({0x48, 0xff, 0xc7});                           // inc %rdi
+  writer.emit({0xeb, 0x00});                                 // jmp TAIL
+  writer.code[-1] = static_cast<uint8_t>(tail - writer.code);
+  writer.line("inc %rdi");
+  writer.line("jmp " + section + "_tail");
+
+  // Accept if the state's bit is set. Rotating its byte left by one packs
+  // both halves' states into the bottom five bits.
+  writer.land(done_jump);
+  writer.label(index_, "done");
+  std::stringstream accepting;
+  accepting << "mov $0x" << std::hex << accepting_ << ", %edx";
+  writer.emit({0x66, 0x0f, 0x7e, 0xc0});                     // movd %xmm0, %eax
+  writer.emit({0xd0, 0xc0});                                 // rol $1, %al
+  writer.emit({0x0f, 0xb6, 0xc0});                           // movzbl %al, %eax
+  writer.emit({0xba});                                       // mov $ACCEPTING, %edx
+  memcpy(writer.code, &accepting_, sizeof(accepting_));
+  writer.code += sizeof(accepting_);
+  writer.emit({0x0f, 0xa3, 0xc2});                           // bt %eax, %edx
+  writer.emit({0x0f, 0x92, 0xc0});                           // setc %al
+  writer.emit({0x0f, 0xb6, 0xc0});                           // movzbl %al, %eax
+  writer.emit({0x5d});                                       // pop %rbp
+  writer.emit({0xc3});                                       // retq
+  writer.line("movd %xmm0, %eax");
+  writer.line("rol $1, %al");
+  writer.line("movzbl %al, %eax");
+  writer.line(accepting.str());
+  writer.line("bt %eax, %edx");
+  writer.line("setc %al");
+  writer.line("movzbl %al, %eax");
+  writer.line("pop %rbp");
+  writer.line("retq");
+  code_size_ = writer.code - code_;
+}
+
+void ShuffleLoopSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, code_size_);
+  *code += code_size_;
+}
+
+void ShuffleLoopSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  const int32_t displacement = offset_if->absolute_offset(table_index_) -
+                               (offset_if->absolute_offset(index_) + 7);
+  memcpy(code_ + 3, &displacement, sizeof(displacement));
+}
+
+std::string ShuffleLoopSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << index_ << ":  // shuffle DFSM" << std::endl;
+  // Describe the code without disturbing it.
+  ShuffleLoopSegment copy(*this);
+  copy.assemble(&ss);
+  return ss.str();
+}
+
+size_t ShuffleLoopSegment::size() const noexcept {
+  return code_size_;
+}
+
+size_t ShuffleLoopSegment::max_size() const noexcept {
+  return code_size_;
+}
+
+ShuffleTableSegment::ShuffleTableSegment(unsigned int id, const uint8_t* next, size_t states) :
+  StaticCodeSegment(id, rows_, 256 * (states > ShuffleLoopSegment::kMaxNarrowStates ? 32 : 16)),
+  row_size_(states > ShuffleLoopSegment::kMaxNarrowStates ? 32 : 16)
+{
+  // States past the last lead to state 0, but are never reached.
+  memset(rows_, 0, sizeof(rows_));
+  for (size_t letter = 0; letter < 256; ++letter) {
+    for (size_t state = 0; state < states; ++state) {
+      const uint8_t code = ShuffleLoopSegment::Encode(state);
+      rows_[letter * row_size_ + (code & 0x7f) + (code & 0x80 ? 16 : 0)] =
+          ShuffleLoopSegment::Encode(next[letter * states + state]);
+    }
+  }
+}
+
+std::string ShuffleTableSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << id() << ":  // shuffle rows" << std::endl << std::hex;
+  for (size_t row = 0; row < 256 * row_size_; row += 16) {
+    ss << "    .byte ";
+    for (size_t i = row; i < row + 16; ++i) {
+      ss << (i == row ? "" : ", ") << "0x" << (unsigned int)rows_[i];
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+void UnconditionalJumpSegment::write_code(uint8_t** code) const noexcept {
+  jmp_segment_.write_code(code);
+}
+
+void UnconditionalJumpSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void UnconditionalJumpSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string UnconditionalJumpSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":" << std::endl <<
+  jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t UnconditionalJumpSegment::size() const noexcept {
+  return jmp_segment_.size();
+}
+
+size_t UnconditionalJumpSegment::max_size() const noexcept {
+  return jmp_segment_.max_size();
+}
+
+void StaticCodeSegment::write_code(uint8_t** code) const noexcept{
+  memcpy(*code, code_, code_size_);
+  *code += code_size_;
+}
+
+size_t StaticCodeSegment::size() const noexcept{
+  return code_size_;
+}
+
+size_t StaticCodeSegment::max_size() const noexcept{
+  return code_size_;
+}
+
+const uint8_t StackManagementSegment::kCode[] = {
+  0x55,             // push %rbp
+  0x48, 0x89, 0xe5  // mov %rsp, %rbp
+};
+
+StackManagementSegment::StackManagementSegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string StackManagementSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  "    push %rbp" << std::endl <<
+  "    mov %rsp, %rbp" << std::endl;
+  return ss.str();
+}
+
+const uint8_t LoadLetterSegment::kCodeTest[] = {
+  0x48, 0x39, 0xf7        // cmp %rsi, %rdi
+};
+
+const uint8_t LoadLetterSegment::kCodeLoad[] = {
+  0x0f, 0xb6, 0x07        // movzbl (%rdi), %eax
+};
+
+LoadLetterSegment::LoadLetterSegment(unsigned int index, unsigned int end_index) noexcept :
+  index_(index),
+  jmp_segment_(JumpCondition::kNotCarry, index, sizeof(kCodeTest), end_index) {}
+
+void LoadLetterSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, kCodeTest, sizeof(kCodeTest));
+  *code += sizeof(kCodeTest);
+  jmp_segment_.write_code(code);
+  memcpy(*code, kCodeLoad, sizeof(kCodeLoad));
+  *code += sizeof(kCodeLoad);
+}
+
+void LoadLetterSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void LoadLetterSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string LoadLetterSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":" << std::endl <<
+  "    cmp %rsi, %rdi" << std::endl <<
+  jmp_segment_.debug_string() <<
+  "    movzbl (%rdi), %eax" << std::endl;
+  return ss.str();
+}
+
+size_t LoadLetterSegment::size() const noexcept {
+  return sizeof(kCodeTest) + jmp_segment_.size() + sizeof(kCodeLoad);
+}
+
+size_t LoadLetterSegment::max_size() const noexcept {
+  return sizeof(kCodeTest) + jmp_segment_.max_size() + sizeof(kCodeLoad);
+}
+
+const uint8_t ConsumeAnySegment::kCode[] = {
+  0x48, 0xff, 0xc7  // inc %rdi
+};
+
+ConsumeAnySegment::ConsumeAnySegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string ConsumeAnySegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << id() << ":" << std::endl <<
+  "    inc %rdi" << std::endl;
+  return ss.str();
+}
+
+LiteralConstantSegment::LiteralConstantSegment(unsigned int id, const char* letters,
+                                               size_t length) :
+  StaticCodeSegment(id, letters_, length)
+{
+  memcpy(letters_, letters, length);
+}
+
+std::string LiteralConstantSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << id() << ":  // literal" << std::endl << std::hex;
+  for (size_t row = 0; row < size(); row += 8) {
+    ss << "    .byte ";
+    for (size_t i = row; i < std::min(row + 8, size()); ++i) {
+      ss << (i == row ? "" : ", ") << "0x" << (unsigned int)letters_[i];
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+constexpr size_t JumpTableSegment::kMaxSlots;
+
+JumpTableSegment::JumpTableSegment(unsigned int id, const uint8_t* slots,
+                                   const unsigned int* targets, size_t slot_count) noexcept :
+  id_(id),
+  slot_count_(slot_count)
+{
+  if (slot_count == 0 || slot_count > kMaxSlots) {
+    std::cerr << "Jump table with " << slot_count << " slots." << std::endl;
+    exit(1);
+  }
+  memcpy(slots_, slots, sizeof(slots_));
+  memcpy(targets_, targets, slot_count * sizeof(targets_[0]));
+  memset(offsets_, 0, sizeof(offsets_));
+}
+
+void JumpTableSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, offsets_, slot_count_ * sizeof(offsets_[0]));
+  *code += slot_count_ * sizeof(offsets_[0]);
+  memcpy(*code, slots_, sizeof(slots_));
+  *code += sizeof(slots_);
+}
+
+void JumpTableSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  const size_t table = offset_if->absolute_offset(id_);
+  for (size_t slot = 0; slot < slot_count_; ++slot) {
+    offsets_[slot] = offset_if->absolute_offset(targets_[slot]) - table;
+  }
+}
+
+std::string JumpTableSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << id_ << ":  // jump table" << std::endl;
+  for (size_t slot = 0; slot < slot_count_; ++slot) {
+    ss << "    .long .section_" << targets_[slot] << " - .section_" << id_ << std::endl;
+  }
+  ss << std::hex;
+  for (size_t row = 0; row < sizeof(slots_); row += 16) {
+    ss << "    .byte ";
+    for (size_t i = row; i < row + 16; ++i) {
+      ss << (i == row ? "" : ", ") << "0x" << (unsigned int)slots_[i];
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+size_t JumpTableSegment::size() const noexcept {
+  return slot_count_ * sizeof(offsets_[0]) + sizeof(slots_);
+}
+
+size_t JumpTableSegment::max_size() const noexcept {
+  return size();
+}
+
+BitmapSegment::BitmapSegment(unsigned int id, const std::bitset<256>& letters) :
+  StaticCodeSegment(id, bits_, sizeof(bits_))
+{
+  memset(bits_, 0, sizeof(bits_));
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    if (letters.test(letter)) {
+      bits_[letter / 8] |= 1 << (letter % 8);
+    }
+  }
+}
+
+std::string BitmapSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << id() << ":  // bitmap" << std::endl << std::hex;
+  for (size_t row = 0; row < sizeof(bits_); row += 8) {
+    ss << "    .byte ";
+    for (size_t i = row; i < row + 8; ++i) {
+      ss << (i == row ? "" : ", ") << "0x" << (unsigned int)bits_[i];
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+// TODO: Maybe xor %rax,%rax followed by inc would be faster?
+const uint8_t SuccessSegment::kCode[] = {
+  0x48, 0xc7, 0xc0, 0x01, 0x00, 0x00, 0x00,   // mov $01, %rax
+  0x5d,                                       // pop %rbp
+  0xc3                                        // retq
+};
+
+SuccessSegment::SuccessSegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string SuccessSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << id() << ":  // success" << std::endl <<
+  "    mov $01, %rax" << std::endl <<
+  "    pop %rbp" << std::endl <<
+  "    retq" << std::endl;
+  return ss.str();
+}
+
+const uint8_t MatchEndSegment::kCode[] = {
+  0x48, 0x89, 0xf8,   // mov %rdi, %rax
+  0x5d,               // pop %rbp
+  0xc3                // retq
+};
+
+MatchEndSegment::MatchEndSegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string MatchEndSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << id() << ":  // match end" << std::endl <<
+  "    mov %rdi, %rax" << std::endl <<
+  "    pop %rbp" << std::endl <<
+  "    retq" << std::endl;
+  return ss.str();
+}
+
+const uint8_t FailureSegment::kCode[] = {
+  0x31, 0xc0,   // xor %eax, %eax
+  0x5d,         // pop %rbp
+  0xc3          // retq
+};
+
+FailureSegment::FailureSegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string FailureSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << id() << ":  // failure" << std::endl <<
+  "    xor %eax, %eax" << std::endl <<
+  "    pop %rbp" << std::endl <<
+  "    retq" << std::endl;
+  return ss.str();
+}
+
+const uint8_t RecordSetupSegment::kCode[] = {
+  0x53,                                       // push %rbx
+  0x41, 0x54,                                 // push %r12
+  0x41, 0x55,                                 // push %r13
+  0x41, 0x56,                                 // push %r14
+  0x41, 0x57,                                 // push %r15
+  0x52,                                       // push %rdx
+  0x49, 0x89, 0xf4,                           // mov %rsi, %r12
+  0x49, 0x89, 0xcf,                           // mov %rcx, %r15
+  0x45, 0x31, 0xed,                           // xor %r13d, %r13d
+  0x49, 0xc7, 0xc6, 0xff, 0xff, 0xff, 0xff,   // mov $-1, %r14
+  0x48, 0x8d, 0x5f, 0xff                      // lea -1(%rdi), %rbx
+};
+
+RecordSetupSegment::RecordSetupSegment(unsigned int id) :
+  StaticCodeSegment(id, kCode, sizeof(kCode)) {}
+
+std::string RecordSetupSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << id() << ":  // record setup" << std::endl <<
+  "    push %rbx" << std::endl <<
+  "    push %r12" << std::endl <<
+  "    push %r13" << std::endl <<
+  "    push %r14" << std::endl <<
+  "    push %r15" << std::endl <<
+  "    push %rdx" << std::endl <<
+  "    mov %rsi, %r12" << std::endl <<
+  "    mov %rcx, %r15" << std::endl <<
+  "    xor %r13d, %r13d" << std::endl <<
+  "    mov $-1, %r14" << std::endl <<
+  "    lea -1(%rdi), %rbx" << std::endl;
+  return ss.str();
+}
+
+constexpr size_t RecordLoopSegment::kMaxCodeSize;
+
+RecordLoopSegment::RecordLoopSegment(unsigned int index, unsigned int start_index) noexcept :
+  index_(index),
+  code_size_(0),
+  // Placeholder. The offset is known once the code is.
+  jmp_segment_(JumpCondition::kAlways, index, 0, start_index)
+{
+  assemble(nullptr);
+  jmp_segment_ = JumpSegment(JumpCondition::kAlways, index, code_size_, start_index);
+}
+
+void RecordLoopSegment::assemble(std::ostream* listing) noexcept {
+  CodeWriter writer {code_, listing};
+  const std::string section = ".section_" + std::to_string(index_);
+  writer.emit({0x48, 0x8d, 0x7b, 0x01});   // lea 1(%rbx), %rdi
+  writer.emit({0x49, 0xff, 0xc6});         // inc %r14
+  writer.emit({0x4c, 0x39, 0xe7});         // cmp %r12, %rdi
+  writer.emit({0x72, 0x00});               // jb SCAN
+  uint8_t* scan_jump = writer.code;
+  writer.line("lea 0x1(%rbx), %rdi");
+  writer.line("inc %r14");
+  writer.line("cmp %r12, %rdi");
+  writer.line("jb " + section + "_scan");
+
+  // No records left.
+  writer.emit({0x4c, 0x89, 0xe8});         // mov %r13, %rax
+  writer.emit({0x48, 0x8d, 0x65, 0xd8});   // lea -0x28(%rbp), %rsp
+  writer.emit({0x41, 0x5f});               // pop %r15
+  writer.emit({0x41, 0x5e});               // pop %r14
+  writer.emit({0x41, 0x5d});               // pop %r13
+  writer.emit({0x41, 0x5c});               // pop %r12
+  writer.emit({0x5b});                     // pop %rbx
+  writer.emit({0x5d});                     // pop %rbp
+  writer.emit({0xc3});                     // retq
+  writer.line("mov %r13, %rax");
+  writer.line("lea -0x28(%rbp), %rsp");
+  writer.line("pop %r15");
+  writer.line("pop %r14");
+  writer.line("pop %r13");
+  writer.line("pop %r12");
+  writer.line("pop %rbx");
+  writer.line("pop %rbp");
+  writer.line("retq");
+
+  // Find the delimiter, or the end, in %rsi. The DFSM's code may have used
+  // any XMM register, so the delimiter is broadcast afresh every time.
+  writer.land(scan_jump);
+  writer.label(index_, "scan");
+  writer.emit({0x0f, 0xb6, 0x4d, 0xd0});               // movzbl -0x30(%rbp), %ecx
+  writer.emit({0x69, 0xd1, 0x01, 0x01, 0x01, 0x01});   // imul $0x01010101, %ecx, %edx
+  writer.emit({0x66, 0x0f, 0x6e, 0xca});               // movd %edx, %xmm1
+  writer.emit({0x66, 0x0f, 0x70, 0xc9, 0x00});         // pshufd $0x0, %xmm1, %xmm1
+  writer.emit({0x48, 0x89, 0xfe});                     // mov %rdi, %rsi
+  writer.line("movzbl -0x30(%rbp), %ecx");
+  writer.line("imul $0x01010101, %ecx, %edx");
+  writer.line("movd %edx, %xmm1");
+  writer.line("pshufd $0x0, %xmm1, %xmm1");
+  writer.line("mov %rdi, %rsi");
+
+  uint8_t* block = writer.code;
+  writer.label(index_, "block");
+  writer.emit({0x48, 0x8d, 0x46, 0x10});   // lea 0x10(%rsi), %rax
+  writer.emit({0x4c, 0x39, 0xe0});         // cmp %r12, %rax
+  writer.emit({0x77, 0x00});               // ja TAIL
+  uint8_t* tail_jump = writer.code;
+  writer.emit({0xf3, 0x0f, 0x6f, 0x06});   // movdqu (%rsi), %xmm0
+  writer.line("lea 0x10(%rsi), %rax");
+  writer.line("cmp %r12, %rax");
+  writer.line("ja " + section + "_tail");
+  writer.line("movdqu (%rsi), %xmm0");
+  writer.sse(0x74, "pcmpeqb", 1, 0);
+  writer.movemask(0);
+  writer.emit({0x85, 0xd2});               // test %edx, %edx
+  writer.emit({0x75, 0x00});               // jne FOUND_IN_BLOCK
+  uint8_t* found_in_block_jump = writer.code;
+  writer.emit({0x48, 0x89, 0xc6});         // mov %rax, %rsi
+  writer.emit({0xeb, 0x00});               // jmp BLOCK
+  writer.code[-1] = static_cast<uint8_t>(block - writer.code);
+  writer.line("test %edx, %edx");
+  writer.line("jne " + section + "_found_in_block");
+  writer.line("mov %rax, %rsi");
+  writer.line("jmp " + section + "_block");
+
+  writer.land(found_in_block_jump);
+  writer.label(index_, "found_in_block");
+  writer.emit({0x0f, 0xbc, 0xd2});         // bsf %edx, %edx
+  writer.emit({0x48, 0x01, 0xd6});         // add %rdx, %rsi
+  writer.emit({0xeb, 0x00});               // jmp FOUND
+  uint8_t* found_jump = writer.code;
+  writer.line("bsf %edx, %edx");
+  writer.line("add %rdx, %rsi");
+  writer.line("jmp " + section + "_found");
+
+  // The last few letters, one at a time.
+  writer.land(tail_jump);
+  uint8_t* tail = writer.code;
+  writer.label(index_, "tail");
+  writer.emit({0x4c, 0x39, 0xe6});         // cmp %r12, %rsi
+  writer.emit({0x74, 0x00});               // je FOUND
+  uint8_t* end_jump = writer.code;
+  writer.emit({0x38, 0x0e});               // cmp %cl, (%rsi)
+  writer.emit({0x74, 0x00});               // je FOUND
+  uint8_t* delimiter_jump = writer.code;
+  writer.emit({0x48, 0xff, 0xc6});         // inc %rsi
+  writer.emit({0xeb, 0x00});               // jmp TAIL
+  writer.code[-1] = static_cast<uint8_t>(tail - writer.code);
+  writer.line("cmp %r12, %rsi");
+  writer.line("je " + section + "_found");
+  writer.line("cmp %cl, (%rsi)");
+  writer.line("je " + section + "_found");
+  writer.line("inc %rsi");
+  writer.line("jmp " + section + "_tail");
+
+  writer.land(found_jump);
+  writer.land(end_jump);
+  writer.land(delimiter_jump);
+  writer.label(index_, "found");
+  writer.emit({0x48, 0x89, 0xf3});         // mov %rsi, %rbx
+  writer.line("mov %rsi, %rbx");
+  code_size_ = writer.code - code_;
+}
+
+void RecordLoopSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, code_, code_size_);
+  *code += code_size_;
+  jmp_segment_.write_code(code);
+}
+
+void RecordLoopSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void RecordLoopSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string RecordLoopSegment::debug_string() const {
+  std::stringstream ss;
+  ss << ".section_" << index_ << ":  // next record" << std::endl;
+  // Describe the code without disturbing it.
+  RecordLoopSegment copy(*this);
+  copy.assemble(&ss);
+  ss << jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t RecordLoopSegment::size() const noexcept {
+  return code_size_ + jmp_segment_.size();
+}
+
+size_t RecordLoopSegment::max_size() const noexcept {
+  return code_size_ + jmp_segment_.max_size();
+}
+
+const uint8_t RecordMatchSegment::kCode[] = {
+  0x4d, 0x85, 0xff,         // test %r15, %r15
+  0x74, 0x04,               // je +4
+  0x4f, 0x89, 0x34, 0xef,   // mov %r14, (%r15,%r13,8)
+  0x49, 0xff, 0xc5          // inc %r13
+};
+
+RecordMatchSegment::RecordMatchSegment(unsigned int index, unsigned int loop_index) noexcept :
+  index_(index),
+  jmp_segment_(JumpCondition::kAlways, index, sizeof(kCode), loop_index) {}
+
+void RecordMatchSegment::write_code(uint8_t** code) const noexcept {
+  memcpy(*code, kCode, sizeof(kCode));
+  *code += sizeof(kCode);
+  jmp_segment_.write_code(code);
+}
+
+void RecordMatchSegment::determine_size(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_size(offset_if);
+}
+
+void RecordMatchSegment::determine_offset(const OffsetInterface* offset_if) noexcept {
+  jmp_segment_.determine_offset(offset_if);
+}
+
+std::string RecordMatchSegment::debug_string() const {
+  std::stringstream ss;
+  ss <<
+  ".section_" << index_ << ":  // record matched" << std::endl <<
+  "    test %r15, %r15" << std::endl <<
+  "    je +4" << std::endl <<
+  "    mov %r14, (%r15,%r13,8)" << std::endl <<
+  "    inc %r13" << std::endl <<
+  jmp_segment_.debug_string();
+  return ss.str();
+}
+
+size_t RecordMatchSegment::size() const noexcept {
+  return sizeof(kCode) + jmp_segment_.size();
+}
+
+size_t RecordMatchSegment::max_size() const noexcept {
+  return sizeof(kCode) + jmp_segment_.max_size();
+}
+
 } // end namespace assembly
 } // end namespace gnossen
@@ -1,20 +1,26 @@
+#ifndef GNOSSEN_TINYJIT_ASSEMBLY_SEGMENT_H_
+#define GNOSSEN_TINYJIT_ASSEMBLY_SEGMENT_H_
+
+#include <bitset>
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <memory>
+#include <ostream>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 
+#include "arena.h"
+
 namespace gnossen {
 namespace assembly {
 
 class OffsetInterface {
 public:
 
-  // Returns the maximum offset distance between two code segments. It is valid
-  // to call this method regardless of the finalization state of either index.
-  virtual size_t maximum_distance(unsigned int a, unsigned int b) const = 0;
-
-  // Returns the absolute offset of the segment with index `segment_index`.
+  // Returns the absolute offset of the segment with index `segment_index`,
+  // given the sizes the segments currently have. Constant time.
   virtual size_t absolute_offset(unsigned int segment_index) const = 0;
 };
 
@@ -28,6 +34,34 @@ public:
  * `write_code` may be called.
  */
 
+class JumpSegment;
+
+// What %eax is known to hold at some point in the code. Lets
+// AssemblySubroutine::optimize() skip loads of values already there.
+struct KnownLetter {
+  enum class Kind {
+    kUnknown,
+
+    // %al holds `letter`. The rest of %eax is unknown.
+    kImmediate,
+
+    // %eax holds the zero-extended letter at (%rdi), which is therefore
+    // before the end of the input.
+    kNextLetter,
+  };
+
+  Kind kind = Kind::kUnknown;
+  uint8_t letter = 0;
+
+  static KnownLetter Unknown() { return KnownLetter(); }
+  static KnownLetter Immediate(uint8_t letter) { return {Kind::kImmediate, letter}; }
+  static KnownLetter NextLetter() { return {Kind::kNextLetter, 0}; }
+
+  bool operator==(const KnownLetter& other) const {
+    return kind == other.kind && (kind != Kind::kImmediate || letter == other.letter);
+  }
+};
+
 class AssemblySegment {
 public:
 
@@ -46,24 +80,91 @@ public:
   virtual size_t max_size() const = 0;
 
   virtual unsigned int id() const = 0;
+
+  // The following describe the segment's control flow to
+  // AssemblySubroutine::optimize(). The defaults are conservative.
+
+  // The jump this segment contains, if any.
+  virtual JumpSegment* jump() { return nullptr; }
+
+  // Appends the indices of any sections this segment refers to other than
+  // through jump(), such as data it loads.
+  virtual void add_references(std::vector<unsigned int>* indices) const {}
+
+  // Whether execution may continue into the next section.
+  virtual bool falls_through() const { return true; }
+
+  // What %eax holds once the segment has jumped, or fallen through, given
+  // what it held on entry.
+  virtual KnownLetter letter_after(KnownLetter on_entry, bool jumped) const {
+    return KnownLetter::Unknown();
+  }
+
+  // The number of bytes at the start of the segment that do nothing but load
+  // `letter` into %eax, and may be skipped if it's already there.
+  virtual size_t redundant_load_size(KnownLetter letter) const { return 0; }
+};
+
+// What AssemblySubroutine::optimize() did.
+struct PeepholeStats {
+  // Jumps to unconditional jumps, sent straight to the final destination.
+  size_t threaded_jumps = 0;
+
+  // Unconditional jumps to the code that follows them anyway.
+  size_t removed_jumps = 0;
+
+  // Conditional jumps over an unconditional jump, replaced by the opposite
+  // conditional jump to where that one went.
+  size_t inverted_jumps = 0;
+
+  // Empty segments and segments nothing can reach.
+  size_t removed_segments = 0;
+
+  // Jumps that skip reloading a letter already in %eax.
+  size_t skipped_loads = 0;
+
+  size_t bytes_saved = 0;
 };
 
+// Segments are allocated from an arena, which is either supplied by the
+// caller or owned by the subroutine. They must outlive the subroutine, so a
+// supplied arena may only be reset once the subroutine is gone.
 class AssemblySubroutine : public OffsetInterface {
 public:
 
-  AssemblySubroutine() = default;
-  AssemblySubroutine(const AssemblySubroutine&) = default;
+  explicit AssemblySubroutine(arena::Arena* arena = nullptr);
+  AssemblySubroutine(const AssemblySubroutine&) = delete;
   AssemblySubroutine(AssemblySubroutine&&) = default;
-  AssemblySubroutine& operator=(const AssemblySubroutine&) = default;
+  AssemblySubroutine& operator=(const AssemblySubroutine&) = delete;
   AssemblySubroutine& operator=(AssemblySubroutine&&) = default;
 
-  size_t maximum_distance(unsigned int a, unsigned int b) const override;
-
   size_t absolute_offset(unsigned int segment_index) const override;
 
-  void add_segment(std::unique_ptr<AssemblySegment> segment);
+  // Constructs a segment of type T in place.
+  template <typename T, typename... Args>
+  void add_segment(Args&&... args) {
+    add_segment(arena_->New<T>(std::forward<Args>(args)...));
+  }
+
+  // Optimizes the segments added so far. May only be called once, before
+  // finalize(). Jumps to unconditional jumps are threaded through to their
+  // final destination, conditional jumps over unconditional jumps are
+  // inverted, unconditional jumps to the following code are dropped, as are
+  // empty segments and segments nothing can reach, and jumps skip loading a
+  // letter into %eax that's already there.
+  //
+  // Removed segments' indices remain valid, referring to the code that
+  // followed them.
+  void optimize();
+
+  const PeepholeStats& peephole_stats() const { return peephole_stats_; }
 
   // After this method has been called, no further segments may be added.
+  //
+  // Relaxes jumps: every jump starts out with an 8-bit displacement, and any
+  // that don't fit are grown to 32 bits, over and over until none need to
+  // be. Since jumps only ever grow, this terminates, and each pass is linear
+  // in the number of segments.
   void finalize();
 
   // The buffer passed in must be at least as big as size().
@@ -76,11 +177,30 @@ public:
   std::string debug_string() const;
 
 private:
-  std::vector<std::unique_ptr<AssemblySegment>> segments_;
+  void add_segment(AssemblySegment* segment);
+
+  std::unique_ptr<arena::Arena> owned_arena_;
+  arena::Arena* arena_;
+
+  // Recomputes offsets_ from the segments' current sizes.
+  void update_offsets();
 
-  // Mapping from segment indices as supplied by the caller to offsets into the
-  // segments_ container.
-  std::unordered_map<unsigned int, unsigned int> index_mapping_;
+  // Sizes jumps as described for finalize(), starting over from 8-bit
+  // displacements.
+  void relax();
+
+  arena::ArenaVector<AssemblySegment*> segments_;
+
+  // Mapping from segment indices as supplied by the caller to positions in
+  // the segments_ container.
+  arena::ArenaVector<unsigned int> positions_;
+
+  // The offset of each segment in segments_, followed by the total size.
+  arena::ArenaVector<size_t> offsets_;
+
+  bool optimized_ = false;
+  size_t unoptimized_size_ = 0;
+  PeepholeStats peephole_stats_;
 };
 
 // You could argue that this is a hack and I should eliminate it in a
@@ -102,7 +222,7 @@ public:
   }
 
   std::string debug_string() const override {
-    return "    // No-op section\n";
+    return ".section_" + std::to_string(id_) + ":  // No-op section\n";
   }
 
   size_t size() const override { return 0; }
@@ -115,6 +235,10 @@ public:
     return id_;
   }
 
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry;
+  }
+
 private:
 
   const unsigned int id_;
@@ -122,17 +246,32 @@ private:
   static const uint8_t kCode[];
 };
 
+enum class JumpCondition {
+  kAlways,        // jmp
+  kEqual,         // je
+  kNotEqual,      // jne
+  kAbove,         // ja
+  kBelowOrEqual,  // jbe
+  kCarry,         // jc
+  kNotCarry,      // jnc
+};
+
 // This segment is not stored in an AssemblySubroutine and therefore
 // it does not have its own index. It is only used within the context of a
 // *parent* segment.
-class JumpEqualSegment : public AssemblySegment {
+class JumpSegment : public AssemblySegment {
 public:
-  JumpEqualSegment(unsigned int parent_index,
+  JumpSegment(JumpCondition condition,
+      unsigned int parent_index,
       unsigned int parent_offset,
       unsigned int jmp_index) noexcept :
+    condition_(condition),
     parent_index_(parent_index),
     parent_offset_(parent_offset),
-    jmp_index_(jmp_index) {}
+    jmp_index_(jmp_index),
+    jmp_skip_(0),
+    offset_size_(8),
+    relative_offset_(0) {}
 
   void determine_size(const OffsetInterface* offset_if) noexcept override;
 
@@ -151,10 +290,29 @@ public:
     return 0;
   }
 
+  JumpCondition condition() const { return condition_; }
+  unsigned int parent_offset() const { return parent_offset_; }
+  unsigned int jmp_index() const { return jmp_index_; }
+  size_t jmp_skip() const { return jmp_skip_; }
+
+  // Jumps `skip` bytes past the start of the given section instead.
+  void retarget(unsigned int jmp_index, size_t skip) {
+    jmp_index_ = jmp_index;
+    jmp_skip_ = skip;
+  }
+
+  // Jumps on the opposite condition. Must not be unconditional.
+  void invert();
+
+  // Starts relaxation over.
+  void reset_size() { offset_size_ = 8; }
+
 private:
 
-  static const uint8_t kCodeRel8[];
-  static const uint8_t kCodeRel16Or32[];
+  size_t rel8_size() const noexcept;
+  size_t rel32_size() const noexcept;
+
+  JumpCondition condition_;
 
   // The index of the parent segment.
   unsigned int parent_index_;
@@ -162,9 +320,12 @@ private:
   // The offset of this instruction within the parent.
   unsigned int parent_offset_;
 
-  // The index of the segment to which to jump.
+  // The index of the segment to which to jump, and how far into it.
   unsigned int jmp_index_;
+  size_t jmp_skip_;
 
+  // The width of the displacement in bits, 8 or 32. Starts out at 8 and only
+  // ever grows.
   size_t offset_size_;
   int32_t relative_offset_;
 };
@@ -180,7 +341,7 @@ public:
     index_(index),
     letter_(letter),
     jmp_index_(jmp_index),
-    jmp_segment_(index, 3, jmp_index) {}
+    jmp_segment_(JumpCondition::kEqual, index, 3, jmp_index) {}
 
   void write_code(uint8_t** code) const noexcept override;
 
@@ -197,6 +358,16 @@ public:
     return index_;
   }
 
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return KnownLetter::Immediate(letter_);
+  }
+
+  size_t redundant_load_size(KnownLetter letter) const override {
+    return letter == KnownLetter::Immediate(letter_) ? 2 : 0;
+  }
+
 private:
   static const uint8_t kCodePreamble[];
   static const uint8_t kCodeConclusion[];
@@ -205,7 +376,7 @@ private:
   unsigned int index_;
   char letter_;
   unsigned int jmp_index_;
-  JumpEqualSegment jmp_segment_;
+  JumpSegment jmp_segment_;
 };
 
 // Consumes a single character. If there's a match, continue to the next
@@ -218,7 +389,7 @@ public:
     index_(index),
     letter_(letter),
     jmp_index_(jmp_index),
-    jmp_segment_(index, 3, jmp_index) {}
+    jmp_segment_(JumpCondition::kNotEqual, index, 3, jmp_index) {}
 
   void write_code(uint8_t** code) const override;
 
@@ -232,6 +403,16 @@ public:
 
   unsigned int id() const override;
 
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return KnownLetter::Immediate(letter_);
+  }
+
+  size_t redundant_load_size(KnownLetter letter) const override {
+    return letter == KnownLetter::Immediate(letter_) ? 2 : 0;
+  }
+
 private:
 
   static const uint8_t kCodePreamble[];
@@ -241,7 +422,298 @@ private:
 
   // TODO: Is this member still needed at this level?
   unsigned int jmp_index_;
-  JumpEqualSegment jmp_segment_;
+  JumpSegment jmp_segment_;
+};
+
+// How a segment testing the next letter of the input behaves.
+enum class LetterTest {
+  // Consumes the letter either way. If it matches, continues to the next
+  // section, otherwise jumps to the given section.
+  kConsumingMatchElse,
+
+  // If the letter matches, consumes it and jumps to the given section.
+  // Otherwise, continues to the next section without consuming it.
+  kConsumingMatchNonConsumingNonMatch,
+};
+
+// Matches the letters of an inclusive range with a single unsigned comparison
+// against the letter's distance from the start of the range.
+class RangeTestSegment : public AssemblySegment {
+public:
+
+  RangeTestSegment(unsigned int index, LetterTest test,
+                   char first, char last, unsigned int jmp_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+private:
+  static const uint8_t kCodeConsumingMatchElse[];
+  static const uint8_t kCodeConsumingMatchNonConsumingNonMatch[];
+
+  size_t code_size() const noexcept;
+
+  unsigned int index_;
+  LetterTest test_;
+  uint8_t first_;
+  uint8_t last_;
+  JumpSegment jmp_segment_;
+};
+
+// Matches the letters of an arbitrary set by testing the letter's bit in a
+// bitmap held by a BitmapSegment.
+class SetTestSegment : public AssemblySegment {
+public:
+
+  SetTestSegment(unsigned int index, LetterTest test,
+                 unsigned int bitmap_index, unsigned int jmp_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    indices->push_back(bitmap_index_);
+  }
+
+private:
+  static const uint8_t kCodeConsumingMatchElse[];
+  static const uint8_t kCodeConsumingMatchNonConsumingNonMatch[];
+
+  size_t code_size() const noexcept;
+
+  // The offset of the bitmap's displacement within the code, and of the end
+  // of the instruction it belongs to.
+  size_t displacement_offset() const noexcept;
+
+  unsigned int index_;
+  LetterTest test_;
+  unsigned int bitmap_index_;
+  int32_t bitmap_displacement_;
+  JumpSegment jmp_segment_;
+};
+
+// Tests for the end of the input, rather than for a letter, with "the letter
+// matches" read as "the input has ended". Consumes nothing either way.
+class EndTestSegment : public AssemblySegment {
+public:
+
+  EndTestSegment(unsigned int index, LetterTest test, unsigned int jmp_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry;
+  }
+
+private:
+  static const uint8_t kCode[];
+
+  unsigned int index_;
+  JumpSegment jmp_segment_;
+};
+
+// The segments below make up the load/compare lowering of a deterministic
+// FSM. Each state loads the next letter once with a LoadLetterSegment, tests
+// it with a series of the jump segments below, and only advances the input
+// pointer, with a ConsumeAnySegment, on the way into the next state.
+
+// Tests the letter loaded by a LoadLetterSegment. On a match, jumps to the
+// given section, otherwise continues to the next one. Either way, the letter
+// and the input pointer are left as they are.
+class LetterJumpSegment : public AssemblySegment {
+public:
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    if (has_bitmap_) {
+      indices->push_back(bitmap_index_);
+    }
+  }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry;
+  }
+
+protected:
+  LetterJumpSegment(unsigned int index, JumpCondition condition,
+                    const uint8_t* code, size_t code_size, unsigned int jmp_index) noexcept;
+
+  // Patches the code with a RIP-relative displacement of the bitmap section
+  // at `bitmap_index`, to be found at `offset`. The displacement is relative
+  // to the end of the test's code.
+  void use_bitmap(unsigned int bitmap_index, size_t offset) noexcept;
+
+  const JumpSegment& jmp_segment() const { return jmp_segment_; }
+
+  uint8_t code_[8];
+
+private:
+  unsigned int index_;
+  size_t code_size_;
+  JumpSegment jmp_segment_;
+
+  bool has_bitmap_;
+  unsigned int bitmap_index_;
+  size_t displacement_offset_;
+};
+
+// Jumps if the letter is the given one.
+class JumpIfLetterSegment : public LetterJumpSegment {
+public:
+  JumpIfLetterSegment(unsigned int index, char letter, unsigned int jmp_index) noexcept;
+  std::string debug_string() const override;
+
+private:
+  static const uint8_t kCode[];
+};
+
+// Jumps if the letter is in the inclusive range [first, last]. Compares the
+// letter's distance from the start of the range, computed in %ecx.
+class JumpIfRangeSegment : public LetterJumpSegment {
+public:
+  JumpIfRangeSegment(unsigned int index, char first, char last, unsigned int jmp_index) noexcept;
+  std::string debug_string() const override;
+
+private:
+  static const uint8_t kCode[];
+};
+
+// Jumps if the letter's bit is set in the bitmap held by a BitmapSegment.
+class JumpIfSetSegment : public LetterJumpSegment {
+public:
+  JumpIfSetSegment(unsigned int index, unsigned int bitmap_index, unsigned int jmp_index) noexcept;
+  std::string debug_string() const override;
+
+private:
+  static const uint8_t kCode[];
+
+  unsigned int bitmap_index_;
+};
+
+// Jumps on the letter loaded by a LoadLetterSegment through a
+// JumpTableSegment, with a single indirect jump, instead of testing the
+// letter against each label in turn. Clobbers the letter.
+class DispatchSegment : public AssemblySegment {
+public:
+  DispatchSegment(unsigned int index, unsigned int table_index, size_t slot_count) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override {}
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    indices->push_back(table_index_);
+  }
+
+  bool falls_through() const override { return false; }
+
+private:
+  static const uint8_t kCode[];
+
+  unsigned int index_;
+  unsigned int table_index_;
+  size_t slot_count_;
+  uint8_t code_[24];
+};
+
+// Unconditionally jumps to the given section. Used when the section that
+// should follow this one in the graph could not be laid out directly after it.
+class UnconditionalJumpSegment : public AssemblySegment {
+public:
+
+  UnconditionalJumpSegment(unsigned int index, unsigned int jmp_index) noexcept :
+    index_(index),
+    jmp_segment_(JumpCondition::kAlways, index, 0, jmp_index) {}
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  bool falls_through() const override { return false; }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry;
+  }
+
+private:
+  unsigned int index_;
+  JumpSegment jmp_segment_;
 };
 
 class StaticCodeSegment : public AssemblySegment {
@@ -279,6 +751,398 @@ private:
 public:
   StackManagementSegment(unsigned int id);
   std::string debug_string() const override;
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry;
+  }
+};
+
+// Consumes a single character, whatever it is, and continues to the next
+// section.
+class ConsumeAnySegment : public StaticCodeSegment {
+private:
+  static const uint8_t kCode[];
+
+public:
+  ConsumeAnySegment(unsigned int id);
+  std::string debug_string() const override;
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return on_entry.kind == KnownLetter::Kind::kImmediate ? on_entry : KnownLetter::Unknown();
+  }
+};
+
+// Matches a run of literal letters several at a time: with SSE compares
+// against a LiteralConstantSegment for runs of 16 or more, otherwise with
+// 64-bit or 32-bit immediate compares. The last compare overlaps the one
+// before it rather than reading past the end of the run.
+//
+// The run is only tried if what's left of the input is at least as long, so
+// that a single check covers all of its letters. If it matches, consumes it
+// and jumps to the given section. Otherwise, consumes nothing and continues
+// to the next section to take the letters one at a time.
+class LiteralSegment : public AssemblySegment {
+public:
+  static constexpr size_t kMinLength = 4;
+  static constexpr size_t kMaxLength = 64;
+
+  // Runs at least this long need a LiteralConstantSegment.
+  static constexpr size_t kMinConstantLength = 16;
+
+  // `constant_index` is ignored for runs shorter than kMinConstantLength.
+  LiteralSegment(unsigned int index, const char* letters, size_t length,
+                 unsigned int constant_index, unsigned int jmp_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    if (constant_count_ != 0) {
+      indices->push_back(constant_index_);
+    }
+  }
+
+  // Leaves %eax alone, but consumes letters on the way to its jump.
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return jumped ? KnownLetter::Unknown() : on_entry;
+  }
+
+private:
+  static constexpr size_t kMaxCodeSize = 192;
+  static constexpr size_t kMaxPieces = kMaxLength / 4;
+
+  // Emits the code into code_, or, if `listing` is supplied, describes it
+  // there instead.
+  void assemble(std::ostream* listing) noexcept;
+
+  unsigned int index_;
+  char letters_[kMaxLength];
+  size_t length_;
+  unsigned int constant_index_;
+
+  uint8_t code_[kMaxCodeSize];
+  size_t code_size_;
+
+  // Offsets within code_ of the rel32 operands of the branches taken when
+  // the run doesn't match, all of which go to the end of the segment.
+  size_t bailout_offsets_[kMaxPieces + 1];
+  size_t bailout_count_;
+
+  // Offsets within code_ of the RIP-relative displacements of the SSE
+  // compares' operands, and of the letters each one refers to.
+  size_t constant_offsets_[kMaxPieces];
+  size_t constant_letters_[kMaxPieces];
+  size_t constant_count_;
+
+  JumpSegment jmp_segment_;
+};
+
+// Skips over letters that lead a state back to itself, 16 at a time, and
+// continues to the next section with the input pointing at the first letter
+// that doesn't. Letters are compared with SSE2 against vectors broadcast from
+// immediates, so that the segment needs no constants. Only some sets of
+// letters can be compared this way: see CanSkip().
+//
+// Loads are aligned, so they never cross into a page the input doesn't
+// reach, and skipping stops at the end of the input at the latest, with the
+// end only checked once for every 16 letters.
+class SkipLoopSegment : public AssemblySegment {
+public:
+  // Whether `letters` is a single letter, a single range, or everything but
+  // at most three letters.
+  static bool CanSkip(const std::bitset<256>& letters);
+
+  SkipLoopSegment(unsigned int index, const std::bitset<256>& letters) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override {}
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override {}
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+private:
+  static constexpr size_t kMaxStops = 3;
+  static constexpr size_t kMaxCodeSize = 192;
+
+  enum class Kind {
+    // Skips a single letter.
+    kLetter,
+
+    // Skips a range of letters, from letters_[0] to letters_[1].
+    kRange,
+
+    // Skips everything but letters_[0 .. stop_count_).
+    kStops,
+  };
+
+  // Emits the code into code_, or, if `listing` is supplied, describes it
+  // there instead.
+  void assemble(std::ostream* listing) noexcept;
+
+  unsigned int index_;
+  Kind kind_;
+  uint8_t letters_[kMaxStops];
+  size_t stop_count_;
+
+  uint8_t code_[kMaxCodeSize];
+  size_t code_size_;
+};
+
+// Looks through the whole input for a fingerprint of letters that every match
+// contains before any matching is done, and jumps to the given section if
+// there isn't one. Otherwise continues to the next section. The fingerprint
+// is one of up to three first letters, followed `distance` letters later, if
+// `distance` isn't zero, by a last letter.
+//
+// Compares 16 positions at a time with unaligned SSE2 loads, none of which
+// reach past the end of the input, then the rest one at a time. Leaves the
+// input pointer as it was.
+class PrefilterSegment : public AssemblySegment {
+public:
+  static constexpr size_t kMaxFirst = 3;
+  static constexpr size_t kMaxDistance = 127;
+
+  PrefilterSegment(unsigned int index, const std::bitset<256>& first,
+                   uint8_t last, size_t distance, unsigned int jmp_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+private:
+  static constexpr size_t kMaxCodeSize = 192;
+
+  // Emits the code into code_, or, if `listing` is supplied, describes it
+  // there instead.
+  void assemble(std::ostream* listing) noexcept;
+
+  unsigned int index_;
+  uint8_t first_[kMaxFirst];
+  size_t first_count_;
+  uint8_t last_;
+  size_t distance_;
+
+  uint8_t code_[kMaxCodeSize];
+  size_t code_size_;
+
+  JumpSegment jmp_segment_;
+};
+
+// Runs a whole DFSM of up to 32 states over the rest of the input without a
+// single branch on the letters, then returns whether it ended in an
+// accepting state, so it's the last code section there is.
+//
+// The state is a byte in %xmm0. The table in section `table_index` holds a
+// row for each letter giving the next state for each state, so a letter
+// takes a pshufb of its row by the state. With more than 16 states, each
+// row is split in two halves of 16 and the state's byte has its top bit
+// set for states in the second half. pshufb then zeroes the entry looked
+// up in the wrong half, and OR-ing both lookups together gives the next
+// state. Every eight letters, the state is checked against the failure
+// state so that inputs that fail early needn't be read to the end.
+class ShuffleLoopSegment : public AssemblySegment {
+public:
+  static constexpr size_t kMaxStates = 32;
+  static constexpr size_t kMaxNarrowStates = 16;
+
+  // `states` is the number of states, the start state being state 0.
+  // `accepting` has bit `i` set if the input may end in state `i`.
+  ShuffleLoopSegment(unsigned int index, unsigned int table_index, size_t states,
+                     uint8_t failure, uint32_t accepting) noexcept;
+
+  // The byte that stands for state `state` in %xmm0 and in the table.
+  static uint8_t Encode(uint8_t state) {
+    return state < kMaxNarrowStates ? state : (state - kMaxNarrowStates) | 0x80;
+  }
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override {}
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    indices->push_back(table_index_);
+  }
+
+  bool falls_through() const override { return false; }
+
+private:
+  static constexpr size_t kUnroll = 8;
+  static constexpr size_t kMaxCodeSize = 512;
+
+  // Emits the code into code_, or, if `listing` is supplied, describes it
+  // there instead.
+  void assemble(std::ostream* listing) noexcept;
+
+  unsigned int index_;
+  unsigned int table_index_;
+  bool wide_;
+  uint8_t failure_;
+  uint32_t accepting_;
+
+  uint8_t code_[kMaxCodeSize];
+  size_t code_size_;
+};
+
+// The rows read by a ShuffleLoopSegment, 16 bytes each for up to 16 states,
+// or 32 for more. Not code, so it belongs after all of the sections that are.
+class ShuffleTableSegment : public StaticCodeSegment {
+public:
+  // `next` holds the next state of each state on each letter, 256 rows of
+  // `states` entries.
+  ShuffleTableSegment(unsigned int id, const uint8_t* next, size_t states);
+  std::string debug_string() const override;
+  bool falls_through() const override { return false; }
+
+private:
+  size_t row_size_;
+  uint8_t rows_[256 * ShuffleLoopSegment::kMaxStates];
+};
+
+// Jumps to the given section at the end of the input. Otherwise, loads the
+// next letter into %eax without consuming it.
+class LoadLetterSegment : public AssemblySegment {
+public:
+  LoadLetterSegment(unsigned int index, unsigned int end_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  KnownLetter letter_after(KnownLetter on_entry, bool jumped) const override {
+    return jumped ? on_entry : KnownLetter::NextLetter();
+  }
+
+  // Having loaded the letter, the input is known not to have ended.
+  size_t redundant_load_size(KnownLetter letter) const override {
+    return letter == KnownLetter::NextLetter() ? size() : 0;
+  }
+
+private:
+  static const uint8_t kCodeTest[];
+  static const uint8_t kCodeLoad[];
+
+  unsigned int index_;
+  JumpSegment jmp_segment_;
+};
+
+// The letters of a literal run, for the SSE compares of a LiteralSegment. Not
+// code, so it belongs after all of the sections that are.
+class LiteralConstantSegment : public StaticCodeSegment {
+public:
+  LiteralConstantSegment(unsigned int id, const char* letters, size_t length);
+  std::string debug_string() const override;
+  bool falls_through() const override { return false; }
+
+private:
+  uint8_t letters_[LiteralSegment::kMaxLength];
+};
+
+// The table read by a DispatchSegment: the offset of each distinct target
+// from the start of the table, followed by the slot of each of the 256
+// letters. Compressing the letters down to slots keeps the table small even
+// though the offsets are 32-bit.
+class JumpTableSegment : public AssemblySegment {
+public:
+  static constexpr size_t kMaxSlots = 256;
+
+  // `slots` holds the slot of each letter and `targets` the section to jump
+  // to for each slot.
+  JumpTableSegment(unsigned int id, const uint8_t* slots,
+                   const unsigned int* targets, size_t slot_count) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override {}
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return id_;
+  }
+
+  void add_references(std::vector<unsigned int>* indices) const override {
+    indices->insert(indices->end(), targets_, targets_ + slot_count_);
+  }
+
+  bool falls_through() const override { return false; }
+
+private:
+  unsigned int id_;
+  size_t slot_count_;
+  uint8_t slots_[256];
+  unsigned int targets_[kMaxSlots];
+  int32_t offsets_[kMaxSlots];
+};
+
+// A bitmap with one bit for each letter in a set, for use by SetTestSegment.
+// It isn't code, so it belongs after all of the sections that are.
+class BitmapSegment : public StaticCodeSegment {
+public:
+  BitmapSegment(unsigned int id, const std::bitset<256>& letters);
+  std::string debug_string() const override;
+  bool falls_through() const override { return false; }
+
+private:
+  uint8_t bits_[32];
 };
 
 class SuccessSegment : public StaticCodeSegment {
@@ -288,6 +1152,19 @@ private:
 public:
   SuccessSegment(unsigned int id);
   std::string debug_string() const override;
+  bool falls_through() const override { return false; }
+};
+
+// Succeeds, returning the input pointer rather than 1. Used by searches, for
+// which the input pointer is at the end of the match.
+class MatchEndSegment : public StaticCodeSegment {
+private:
+  static const uint8_t kCode[];
+
+public:
+  MatchEndSegment(unsigned int id);
+  std::string debug_string() const override;
+  bool falls_through() const override { return false; }
 };
 
 class FailureSegment : public StaticCodeSegment {
@@ -297,7 +1174,110 @@ private:
 public:
   FailureSegment(unsigned int id);
   std::string debug_string() const override;
+  bool falls_through() const override { return false; }
+};
+
+// The segments below turn the code for a DFSM into a loop over the records
+// of the input, each ending at a delimiter or at the end. The generated
+// function is called as
+//
+//     size_t f(const uint8_t* begin, const uint8_t* end, uint8_t delimiter,
+//              size_t* indices);
+//
+// and returns the number of records that match. If `indices` isn't null,
+// the number of each matching record, counting from 0, is written there.
+// Within a record, %rsi is the end of the record rather than of the input,
+// so the DFSM's code stops at the delimiter as it would at the end. The
+// state of the loop is kept in callee-saved registers, which the DFSM's
+// code never touches: %rbx is the end of the record, %r12 the end of the
+// input, %r13 the number of matches, %r14 the number of the record, and
+// %r15 `indices`. The delimiter is kept on the stack.
+
+// Saves the callee-saved registers and sets up the loop. Follows a
+// StackManagementSegment, and is followed by the RecordLoopSegment.
+class RecordSetupSegment : public StaticCodeSegment {
+private:
+  static const uint8_t kCode[];
+
+public:
+  RecordSetupSegment(unsigned int id);
+  std::string debug_string() const override;
+};
+
+// Moves on to the next record, past the delimiter ending the last one, and
+// jumps to the given section, where the DFSM starts. Returns the number of
+// matches once there are no records left. Finds the end of the record 16
+// letters at a time with SSE2, as PrefilterSegment does.
+class RecordLoopSegment : public AssemblySegment {
+public:
+  RecordLoopSegment(unsigned int index, unsigned int start_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  bool falls_through() const override { return false; }
+
+private:
+  static constexpr size_t kMaxCodeSize = 128;
+
+  // Emits the code into code_, or, if `listing` is supplied, describes it
+  // there instead.
+  void assemble(std::ostream* listing) noexcept;
+
+  unsigned int index_;
+
+  uint8_t code_[kMaxCodeSize];
+  size_t code_size_;
+
+  JumpSegment jmp_segment_;
+};
+
+// Stands in for the success state: counts the record as a match, notes its
+// number, and jumps to the RecordLoopSegment. The failure state is just a
+// jump there.
+class RecordMatchSegment : public AssemblySegment {
+public:
+  RecordMatchSegment(unsigned int index, unsigned int loop_index) noexcept;
+
+  void write_code(uint8_t** code) const noexcept override;
+
+  void determine_size(const OffsetInterface* offset_if) noexcept override;
+
+  void determine_offset(const OffsetInterface* offset_if) noexcept override;
+
+  std::string debug_string() const override;
+  size_t size() const noexcept override;
+  size_t max_size() const noexcept override;
+
+  unsigned int id() const override {
+    return index_;
+  }
+
+  JumpSegment* jump() override { return &jmp_segment_; }
+
+  bool falls_through() const override { return false; }
+
+private:
+  static const uint8_t kCode[];
+
+  unsigned int index_;
+  JumpSegment jmp_segment_;
 };
 
 } // end namespace assembly
 } // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_ASSEMBLY_SEGMENT_H_
@@ -3,7 +3,9 @@
 
 #include "assembly_segment.h"
 
+#include <cstring>
 #include <memory>
+#include <vector>
 
 #include <iostream>
 #include <fstream>
@@ -21,14 +23,12 @@ TEST(AssemblySegmentTest, CanBuild) {
 
   // Matches "a*b".
   AssemblySubroutine subroutine;
-  subroutine.add_segment(std::move(std::make_unique<StackManagementSegment>(0)));
-  subroutine.add_segment(std::move(std::make_unique<NoOp>(1)));
-  subroutine.add_segment(std::move(
-        std::make_unique<ConsumingMatchNonConsumingNonMatch>(2, 'a', 2)));
-  subroutine.add_segment(std::move(
-        std::make_unique<ConsumingMatchElse>(3, 'b', 5)));
-  subroutine.add_segment(std::move(std::make_unique<SuccessSegment>(4)));
-  subroutine.add_segment(std::move(std::make_unique<FailureSegment>(5)));
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<NoOp>(1);
+  subroutine.add_segment<ConsumingMatchNonConsumingNonMatch>(2, 'a', 2);
+  subroutine.add_segment<ConsumingMatchElse>(3, 'b', 5);
+  subroutine.add_segment<SuccessSegment>(4);
+  subroutine.add_segment<FailureSegment>(5);
   subroutine.finalize();
 
   std::cerr << subroutine.debug_string();
@@ -44,8 +44,93 @@ TEST(AssemblySegmentTest, CanBuild) {
   delete [] code;
 }
 
-// TODO: Add test for `write_code`.
+TEST(AssemblySegmentTest, RelaxesJumps) {
+  // A jump over 40 others, each jumping to the next. Sized conservatively,
+  // they could all be 32-bit, putting the first jump's target out of 8-bit
+  // range. Relaxed, they're all 8-bit.
+  AssemblySubroutine subroutine;
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<UnconditionalJumpSegment>(1, 42);
+  for (unsigned int i = 2; i < 42; ++i) {
+    subroutine.add_segment<UnconditionalJumpSegment>(i, i + 1);
+  }
+  subroutine.add_segment<SuccessSegment>(42);
+  subroutine.finalize();
+
+  std::vector<uint8_t> code(subroutine.size());
+  subroutine.write_code(code.data());
+  const size_t jmp = subroutine.absolute_offset(1);
+  EXPECT_EQ(code[jmp], 0xeb);
+  EXPECT_EQ(code[jmp + 1], 40 * 2);
+  EXPECT_EQ(subroutine.absolute_offset(42), jmp + 41 * 2);
+}
 
+TEST(AssemblySegmentTest, WritesFullRel32Displacements) {
+  // Jumps forward and back over more than 8 bits' worth of code.
+  AssemblySubroutine subroutine;
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<UnconditionalJumpSegment>(1, 402);
+  for (unsigned int i = 2; i < 402; ++i) {
+    subroutine.add_segment<ConsumeAnySegment>(i);
+  }
+  subroutine.add_segment<UnconditionalJumpSegment>(402, 2);
+  subroutine.finalize();
+
+  std::vector<uint8_t> code(subroutine.size());
+  subroutine.write_code(code.data());
+  const size_t forward = subroutine.absolute_offset(1);
+  const size_t backward = subroutine.absolute_offset(402);
+  int32_t displacement;
+  EXPECT_EQ(code[forward], 0xe9);
+  memcpy(&displacement, &code[forward + 1], sizeof(displacement));
+  EXPECT_EQ(displacement, backward - (forward + 5));
+  EXPECT_EQ(code[backward], 0xe9);
+  memcpy(&displacement, &code[backward + 1], sizeof(displacement));
+  EXPECT_EQ(displacement, static_cast<int32_t>(subroutine.absolute_offset(2) - (backward + 5)));
+}
+
+
+TEST(AssemblySegmentTest, Optimizes) {
+  AssemblySubroutine subroutine;
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<NoOp>(1);
+  // Loops back to itself with 'a' still in %al.
+  subroutine.add_segment<ConsumingMatchNonConsumingNonMatch>(2, 'a', 2);
+  // Jumps to what follows anyway.
+  subroutine.add_segment<UnconditionalJumpSegment>(3, 4);
+  // Jumps over a jump.
+  subroutine.add_segment<ConsumingMatchElse>(4, 'b', 6);
+  subroutine.add_segment<UnconditionalJumpSegment>(5, 8);
+  // Jumps to a jump.
+  subroutine.add_segment<ConsumingMatchElse>(6, 'c', 10);
+  subroutine.add_segment<SuccessSegment>(7);
+  subroutine.add_segment<FailureSegment>(8);
+  // Unreachable.
+  subroutine.add_segment<ConsumeAnySegment>(9);
+  subroutine.add_segment<UnconditionalJumpSegment>(10, 11);
+  subroutine.add_segment<FailureSegment>(11);
+  subroutine.optimize();
+  subroutine.finalize();
+
+  const PeepholeStats& stats = subroutine.peephole_stats();
+  EXPECT_EQ(stats.threaded_jumps, 1);
+  EXPECT_EQ(stats.inverted_jumps, 1);
+  EXPECT_EQ(stats.removed_jumps, 1);
+  EXPECT_EQ(stats.removed_segments, 3);
+  EXPECT_EQ(stats.skipped_loads, 1);
+  EXPECT_GT(stats.bytes_saved, 0);
+
+  const std::string listing = subroutine.debug_string();
+  std::ofstream asm_file(artifact_path("optimized.S"), std::ofstream::out);
+  asm_file << listing;
+  EXPECT_THAT(listing, ::testing::HasSubstr("je .section_2+2"));
+  EXPECT_THAT(listing, ::testing::HasSubstr("je .section_8"));
+  EXPECT_THAT(listing, ::testing::HasSubstr("jne .section_11"));
+  for (const char* removed : {".section_1:", ".section_3:", ".section_5:",
+                              ".section_9:", ".section_10:"}) {
+    EXPECT_THAT(listing, ::testing::Not(::testing::HasSubstr(removed)));
+  }
+}
 
 // I don't know that I actually want to write a test for just the
 // assembly_segment file. Since it's so coupled to everything else, it doesn't
@@ -0,0 +1,126 @@
+#include "bit_parallel_nfa.h"
+
+#include <algorithm>
+#include <bitset>
+
+namespace gnossen {
+namespace fsm {
+
+size_t BitParallelNfa::TableSize() const {
+  return sizeof(classes_) + masks_.size() * sizeof(uint64_t) + follow_.size() * sizeof(uint64_t);
+}
+
+std::unique_ptr<BitParallelNfa> ToBitParallelNfa(const Fsm& nfsm) {
+  const size_t state_count = nfsm.StateCount();
+
+  // Each letter transition is a position, numbered from 1. Those leading to
+  // failure can be left out, since nothing follows them.
+  struct Position {
+    Fsm::StateId source;
+    Fsm::StateId target;
+    const EdgeLabel* label;
+  };
+  std::vector<Position> positions(1);
+  for (Fsm::StateId id = 0; id < state_count; ++id) {
+    for (const auto& transition : nfsm.GetTransitions(id)) {
+      if ((transition.second.IsLetters() || transition.second.remainder) &&
+          transition.first != Fsm::GetFailureState()) {
+        positions.push_back(Position{id, transition.first, &transition.second});
+      }
+    }
+  }
+  if (positions.size() > BitParallelNfa::kMaxPositions) {
+    return nullptr;
+  }
+
+  std::unique_ptr<BitParallelNfa> nfa(new BitParallelNfa());
+  nfa->position_count_ = positions.size();
+  const ByteClasses classes = ComputeByteClasses(nfsm);
+  std::copy(classes.class_of, classes.class_of + 256, nfa->classes_);
+  nfa->class_count_ = classes.count();
+
+  // As in Determinize(), a remainder transition covers whatever letters its
+  // state has no explicit transition for, and letters outside the alphabet
+  // lead nowhere.
+  std::vector<std::bitset<256>> explicit_letters(state_count);
+  for (Fsm::StateId id = 0; id < state_count; ++id) {
+    for (const auto& transition : nfsm.GetTransitions(id)) {
+      if (transition.second.IsLetters()) {
+        nfsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+          explicit_letters[id].set(letter);
+        });
+      }
+    }
+  }
+  std::vector<bool> in_alphabet(classes.count(), false);
+  for (char letter : nfsm.GetAlphabet()) {
+    in_alphabet[classes.class_of[static_cast<uint8_t>(letter)]] = true;
+  }
+  nfa->masks_.assign(classes.count(), 0);
+  for (size_t c = 0; c < classes.count(); ++c) {
+    const uint8_t letter = classes.representatives[c];
+    for (size_t p = 1; p < positions.size() && in_alphabet[c]; ++p) {
+      const Position& position = positions[p];
+      if (position.label->remainder ? !explicit_letters[position.source].test(letter) :
+                                      nfsm.LabelMatches(*position.label, letter)) {
+        nfa->masks_[c] |= uint64_t{1} << p;
+      }
+    }
+  }
+
+  // The positions leaving each state, and whether the input may end there.
+  std::vector<uint64_t> leaving(state_count, 0);
+  for (size_t p = 1; p < positions.size(); ++p) {
+    leaving[positions[p].source] |= uint64_t{1} << p;
+  }
+  std::vector<bool> ends(state_count, false);
+  for (Fsm::StateId id = 0; id < state_count; ++id) {
+    for (const auto& transition : nfsm.GetTransitions(id)) {
+      ends[id] = ends[id] ||
+                 (transition.second.end_of_input && transition.first == Fsm::GetSuccessState());
+    }
+  }
+
+  // Each position is followed by the positions leaving any state reachable
+  // from its target by nondeterministic transitions, and the input may end
+  // after it if it may end in any of those states.
+  std::vector<uint64_t> follow(positions.size(), 0);
+  std::vector<bool> seen(state_count);
+  std::vector<Fsm::StateId> to_visit;
+  for (size_t p = 0; p < positions.size(); ++p) {
+    std::fill(seen.begin(), seen.end(), false);
+    const Fsm::StateId first = p == 0 ? Fsm::GetStartState() : positions[p].target;
+    to_visit.assign(1, first);
+    seen[first] = true;
+    while (!to_visit.empty()) {
+      const Fsm::StateId id = to_visit.back();
+      to_visit.pop_back();
+      follow[p] |= leaving[id];
+      if (ends[id]) {
+        nfa->accepting_ |= uint64_t{1} << p;
+      }
+      for (const auto& transition : nfsm.GetTransitions(id)) {
+        if (transition.second.empty_edge && !seen[transition.first]) {
+          seen[transition.first] = true;
+          to_visit.push_back(transition.first);
+        }
+      }
+    }
+  }
+
+  nfa->chunks_ = (positions.size() + 7) / 8;
+  nfa->follow_.assign(nfa->chunks_ * 256, 0);
+  for (size_t chunk = 0; chunk < nfa->chunks_; ++chunk) {
+    uint64_t* table = &nfa->follow_[chunk * 256];
+    for (unsigned int bits = 1; bits < 256; ++bits) {
+      // Each entry adds one position to an entry already filled in.
+      const unsigned int lowest = bits & -bits;
+      const size_t p = chunk * 8 + __builtin_ctz(lowest);
+      table[bits] = table[bits ^ lowest] | (p < positions.size() ? follow[p] : 0);
+    }
+  }
+  return nfa;
+}
+
+} // end namespace fsm
+} // end namespace gnossen
@@ -0,0 +1,133 @@
+#ifndef GNOSSEN_TINYJIT_BIT_PARALLEL_NFA_H_
+#define GNOSSEN_TINYJIT_BIT_PARALLEL_NFA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "fsm.h"
+
+namespace gnossen {
+namespace fsm {
+
+// Simulates an NFSM directly, with each of its states held as one bit of a
+// single register. Needs no determinization at all, so it's quick to build
+// and its size grows only with the pattern, never with the number of states
+// a DFSM would need.
+//
+// The states are those of the Glushkov automaton: one per letter transition
+// of the NFSM, each standing for having just followed that transition, plus
+// one for the start. Those are exactly the states left after removing
+// nondeterministic transitions from the Thompson NFSM. Reading a letter then
+// takes the states following those currently set, masked by the states the
+// letter leads to. The follow sets are looked up eight states at a time in
+// tables of 256 entries each, so a letter costs one lookup per eight states
+// in use.
+class BitParallelNfa {
+public:
+  // Including the start, which takes the lowest bit.
+  static constexpr size_t kMaxPositions = 64;
+
+  BitParallelNfa(const BitParallelNfa&) = delete;
+  BitParallelNfa& operator=(const BitParallelNfa&) = delete;
+
+  // As TableDfa::Match().
+  uint8_t Match(const uint8_t* begin, const uint8_t* end) const {
+    switch (chunks_) {
+    case 1: return Run<1>(begin, end);
+    case 2: return Run<2>(begin, end);
+    case 3: return Run<3>(begin, end);
+    case 4: return Run<4>(begin, end);
+    case 5: return Run<5>(begin, end);
+    case 6: return Run<6>(begin, end);
+    case 7: return Run<7>(begin, end);
+    default: return Run<8>(begin, end);
+    }
+  }
+
+  // As TableDfa::Find().
+  const uint8_t* Find(const uint8_t* begin, const uint8_t* end) const {
+    uint64_t state = 1;
+    while ((state & accepting_) == 0) {
+      if (begin == end || state == 0) {
+        return nullptr;
+      }
+      state = Follow<8>(state) & masks_[classes_[*begin++]];
+    }
+    return begin;
+  }
+
+  // As LazyDfa::FindBackwards().
+  const uint8_t* FindBackwards(const uint8_t* begin, const uint8_t* end) const {
+    uint64_t state = 1;
+    const uint8_t* found = (state & accepting_) != 0 ? end : nullptr;
+    while (end != begin && state != 0) {
+      state = Follow<8>(state) & masks_[classes_[*--end]];
+      if ((state & accepting_) != 0) {
+        found = end;
+      }
+    }
+    return found;
+  }
+
+  size_t PositionCount() const { return position_count_; }
+  size_t ClassCount() const { return class_count_; }
+
+  // The size of the masks and follow tables.
+  size_t TableSize() const;
+
+private:
+  friend std::unique_ptr<BitParallelNfa> ToBitParallelNfa(const Fsm& nfsm);
+
+  BitParallelNfa() = default;
+
+  // The union of the follow sets of the positions in `state`, which has no
+  // positions beyond the first `Chunks` groups of eight. With the number of
+  // groups fixed, the lookups are unrolled and independent of each other.
+  template <size_t Chunks>
+  uint64_t Follow(uint64_t state) const {
+    const uint64_t* table = follow_.data();
+    uint64_t next = table[state & 0xff];
+    for (size_t chunk = 1; chunk < Chunks && (Chunks < 8 || chunk < chunks_); ++chunk) {
+      next |= table[chunk * 256 + ((state >> (8 * chunk)) & 0xff)];
+    }
+    return next;
+  }
+
+  template <size_t Chunks>
+  uint8_t Run(const uint8_t* begin, const uint8_t* end) const {
+    uint64_t state = 1;
+    while (begin != end && state != 0) {
+      state = Follow<Chunks>(state) & masks_[classes_[*begin++]];
+    }
+    return (state & accepting_) != 0;
+  }
+
+  size_t position_count_ = 0;
+  // The number of groups of eight positions.
+  size_t chunks_ = 0;
+  size_t class_count_ = 0;
+
+  // The class of each letter.
+  uint8_t classes_[256];
+
+  // For each class, the positions reached by reading a letter of it.
+  std::vector<uint64_t> masks_;
+
+  // For each group of eight positions, the union of the follow sets of each
+  // combination of them.
+  std::vector<uint64_t> follow_;
+
+  // The positions where the input may end.
+  uint64_t accepting_ = 0;
+};
+
+// Builds the bit-parallel simulation of an NFSM. Returns nullptr if it has
+// more than BitParallelNfa::kMaxPositions positions.
+std::unique_ptr<BitParallelNfa> ToBitParallelNfa(const Fsm& nfsm);
+
+} // end namespace fsm
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_BIT_PARALLEL_NFA_H_
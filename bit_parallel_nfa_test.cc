@@ -0,0 +1,99 @@
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "bit_parallel_nfa.h"
+
+namespace gnossen {
+namespace fsm {
+namespace {
+
+static bool Matches(const BitParallelNfa& nfa, const std::string& input) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  return nfa.Match(begin, begin + input.size()) != 0;
+}
+
+// An NFSM for "(a|b)*a(a|b){n}", as Thompson's construction would build it
+// for "(a|b)*" followed by "a[ab]{n}".
+static Fsm MakeNfsm(size_t n) {
+  Fsm fsm({'a', 'b', 'c'});
+  auto loop = fsm.AddState();
+  auto body = fsm.AddState();
+  auto left = fsm.AddState();
+  auto right = fsm.AddState();
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), loop);
+  fsm.AddNonDeterministicTransition(loop, body);
+  fsm.AddTransition(body, left, 'a');
+  fsm.AddTransition(body, right, 'b');
+  fsm.AddNonDeterministicTransition(left, loop);
+  fsm.AddNonDeterministicTransition(right, loop);
+  auto state = fsm.AddState();
+  fsm.AddTransition(loop, state, 'a');
+  for (size_t i = 0; i < n; ++i) {
+    auto next = fsm.AddState();
+    fsm.AddRangeTransition(state, next, 'a', 'b');
+    state = next;
+  }
+  fsm.AddEndOfInputTransition(state, fsm.GetSuccessState());
+  return fsm;
+}
+
+TEST(BitParallelNfaTest, Matches) {
+  std::unique_ptr<BitParallelNfa> nfa = ToBitParallelNfa(MakeNfsm(12));
+  ASSERT_NE(nfa, nullptr);
+  // The start, the two letters in the loop, the "a" and the twelve others.
+  EXPECT_EQ(nfa->PositionCount(), 16);
+  // "a", "b", "c" and everything else.
+  EXPECT_EQ(nfa->ClassCount(), 4);
+  EXPECT_EQ(nfa->TableSize(), 256 + 4 * 8 + 2 * 256 * 8);
+
+  const std::string tail(12, 'b');
+  EXPECT_TRUE(Matches(*nfa, "a" + tail));
+  EXPECT_TRUE(Matches(*nfa, "abba" + tail));
+  EXPECT_TRUE(Matches(*nfa, std::string(1000, 'b') + "a" + tail));
+  EXPECT_FALSE(Matches(*nfa, ""));
+  EXPECT_FALSE(Matches(*nfa, tail));
+  EXPECT_FALSE(Matches(*nfa, "a" + tail + "b"));
+  EXPECT_FALSE(Matches(*nfa, "ac" + tail.substr(1)));
+  EXPECT_FALSE(Matches(*nfa, "xa" + tail));
+}
+
+TEST(BitParallelNfaTest, Finds) {
+  std::unique_ptr<BitParallelNfa> nfa = ToBitParallelNfa(MakeNfsm(1));
+  ASSERT_NE(nfa, nullptr);
+  const std::string input = "bbabbab";
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  const uint8_t* end = begin + input.size();
+  EXPECT_EQ(nfa->Find(begin, end), begin + 4);
+  EXPECT_EQ(nfa->Find(begin, begin + 3), nullptr);
+  // Read backwards, the input is "babbabb", which "(a|b)*a(a|b)" matches
+  // after "bab" and "babbab", but not all of it.
+  EXPECT_EQ(nfa->FindBackwards(begin, end), begin + 1);
+  EXPECT_EQ(nfa->FindBackwards(begin, begin + 2), nullptr);
+}
+
+TEST(BitParallelNfaTest, RemainderTransitions) {
+  // An NFSM for "a[^b]*" over "abc", spelling its loop as a remainder.
+  Fsm fsm({'a', 'b', 'c'});
+  auto loop = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), loop, 'a');
+  fsm.AddTransition(loop, fsm.GetFailureState(), 'b');
+  fsm.AddTransitionForRemaining(loop, loop);
+  fsm.AddEndOfInputTransition(loop, fsm.GetSuccessState());
+  std::unique_ptr<BitParallelNfa> nfa = ToBitParallelNfa(fsm);
+  ASSERT_NE(nfa, nullptr);
+  EXPECT_TRUE(Matches(*nfa, "a"));
+  EXPECT_TRUE(Matches(*nfa, "acaca"));
+  EXPECT_FALSE(Matches(*nfa, "acb"));
+  // Outside the alphabet.
+  EXPECT_FALSE(Matches(*nfa, "ad"));
+}
+
+TEST(BitParallelNfaTest, RejectsTooManyPositions) {
+  EXPECT_NE(ToBitParallelNfa(MakeNfsm(BitParallelNfa::kMaxPositions - 4)), nullptr);
+  EXPECT_EQ(ToBitParallelNfa(MakeNfsm(BitParallelNfa::kMaxPositions - 3)), nullptr);
+}
+
+} // end namespace
+} // end namespace fsm
+} // end namespace gnossen
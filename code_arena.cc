@@ -0,0 +1,331 @@
+#include "code_arena.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+namespace gnossen {
+namespace assembly {
+
+constexpr size_t CodeArena::kCodeAlignment;
+constexpr size_t CodeArena::kHugePageSize;
+
+struct CodeArena::Chunk {
+  CodeArena* arena;
+
+  // The memory file behind the mapping.
+  int fd;
+
+  // The start of the executable view, and the whole mapping it was placed
+  // in, which may be bigger for the sake of alignment.
+  uint8_t* base;
+  void* mapping;
+  size_t mapping_size;
+
+  // The number of live subroutines overlapping each page. Zero means the page
+  // is free.
+  std::vector<uint32_t> live;
+  size_t pages_in_use;
+
+  // The free space, by offset, with neighbouring runs merged.
+  std::map<size_t, size_t> free;
+};
+
+static std::string ErrnoMessage(const char* call) {
+  return std::string(call) + " failed: " + strerror(errno);
+}
+
+CodeArena::Code::~Code() {
+  Release();
+}
+
+CodeArena::Code::Code(Code&& other) noexcept :
+  chunk_(other.chunk_), entry_(other.entry_), size_(other.size_)
+{
+  other.chunk_ = nullptr;
+  other.entry_ = nullptr;
+  other.size_ = 0;
+}
+
+CodeArena::Code& CodeArena::Code::operator=(Code&& other) noexcept {
+  if (this != &other) {
+    Release();
+    std::swap(chunk_, other.chunk_);
+    std::swap(entry_, other.entry_);
+    std::swap(size_, other.size_);
+  }
+  return *this;
+}
+
+size_t CodeArena::Code::footprint() const {
+  return entry_ != nullptr ? CodeArena::Footprint(size_) : 0;
+}
+
+void CodeArena::Code::Release() {
+  if (chunk_ != nullptr) {
+    chunk_->arena->Release(chunk_, entry_, size_);
+    chunk_ = nullptr;
+    entry_ = nullptr;
+    size_ = 0;
+  }
+}
+
+CodeArena::CodeArena() : CodeArena(Options()) {}
+
+CodeArena::CodeArena(const Options& options) :
+  options_(options),
+  page_size_(options.huge_pages ? kHugePageSize : sysconf(_SC_PAGESIZE)),
+  system_page_size_(sysconf(_SC_PAGESIZE)) {}
+
+CodeArena::~CodeArena() {
+  for (const auto& chunk : chunks_) {
+    if (chunk->pages_in_use != 0) {
+      std::cerr << "CodeArena destroyed with " << chunk->pages_in_use <<
+          " pages still in use." << std::endl;
+      exit(1);
+    }
+    munmap(chunk->mapping, chunk->mapping_size);
+    close(chunk->fd);
+  }
+}
+
+CodeArena* CodeArena::Default() {
+  static CodeArena* arena = new CodeArena();
+  return arena;
+}
+
+size_t CodeArena::ChunkCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return chunks_.size();
+}
+
+size_t CodeArena::PagesInUse() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t pages = 0;
+  for (const auto& chunk : chunks_) {
+    pages += chunk->pages_in_use;
+  }
+  return pages;
+}
+
+size_t CodeArena::Footprint(size_t size) {
+  return (std::max<size_t>(size, 1) + kCodeAlignment - 1) / kCodeAlignment * kCodeAlignment;
+}
+
+CodeArena::Chunk* CodeArena::MapChunk(size_t pages, std::string* error) {
+  const size_t size = pages * page_size_;
+  const int fd = memfd_create("tinyjit", MFD_CLOEXEC);
+  if (fd < 0) {
+    if (error != nullptr) {
+      *error = ErrnoMessage("memfd_create");
+    }
+    return nullptr;
+  }
+  if (ftruncate(fd, size) != 0) {
+    if (error != nullptr) {
+      *error = ErrnoMessage("ftruncate");
+    }
+    close(fd);
+    return nullptr;
+  }
+  // Huge pages must be aligned to their size, so reserve enough to be able to
+  // place the executable view at an aligned start.
+  const size_t mapping_size = options_.huge_pages ? size + kHugePageSize : size;
+  void* mapping = mmap(nullptr, mapping_size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    if (error != nullptr) {
+      *error = ErrnoMessage("mmap");
+    }
+    close(fd);
+    return nullptr;
+  }
+  uint8_t* base = static_cast<uint8_t*>(mapping);
+  if (options_.huge_pages) {
+    const uintptr_t address = reinterpret_cast<uintptr_t>(base);
+    base = reinterpret_cast<uint8_t*>((address + kHugePageSize - 1) & ~(kHugePageSize - 1));
+  }
+  if (mmap(base, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    if (error != nullptr) {
+      *error = ErrnoMessage("mmap");
+    }
+    munmap(mapping, mapping_size);
+    close(fd);
+    return nullptr;
+  }
+  if (options_.huge_pages) {
+    // Failing to get huge pages isn't fatal. They're just an optimization.
+    madvise(base, size, MADV_HUGEPAGE);
+  }
+  auto chunk = std::make_unique<Chunk>();
+  chunk->arena = this;
+  chunk->fd = fd;
+  chunk->base = base;
+  chunk->mapping = mapping;
+  chunk->mapping_size = mapping_size;
+  chunk->live.assign(pages, 0);
+  chunk->pages_in_use = 0;
+  chunk->free.emplace(0, size);
+  chunks_.push_back(std::move(chunk));
+  return chunks_.back().get();
+}
+
+void CodeArena::UnmapChunk(Chunk* chunk) {
+  munmap(chunk->mapping, chunk->mapping_size);
+  close(chunk->fd);
+  chunks_.erase(std::find_if(chunks_.begin(), chunks_.end(),
+                             [chunk](const std::unique_ptr<Chunk>& c) {
+                               return c.get() == chunk;
+                             }));
+}
+
+std::pair<CodeArena::Chunk*, size_t> CodeArena::Allocate(size_t size, std::string* error) {
+  Chunk* chunk = nullptr;
+  size_t offset = 0;
+  for (const auto& candidate : chunks_) {
+    for (const auto& run : candidate->free) {
+      if (run.second >= size) {
+        chunk = candidate.get();
+        offset = run.first;
+        break;
+      }
+    }
+    if (chunk != nullptr) {
+      break;
+    }
+  }
+  if (chunk == nullptr) {
+    const size_t pages = (size + page_size_ - 1) / page_size_;
+    chunk = MapChunk(std::max(pages, options_.chunk_pages), error);
+    if (chunk == nullptr) {
+      return {nullptr, 0};
+    }
+  }
+
+  // Take the space from the front of its run.
+  auto run = chunk->free.find(offset);
+  const size_t remaining = run->second - size;
+  chunk->free.erase(run);
+  if (remaining > 0) {
+    chunk->free.emplace(offset + size, remaining);
+  }
+  return {chunk, offset};
+}
+
+void CodeArena::Free(Chunk* chunk, size_t offset, size_t size) {
+  auto next = chunk->free.lower_bound(offset);
+  if (next != chunk->free.end() && offset + size == next->first) {
+    size += next->second;
+    next = chunk->free.erase(next);
+  }
+  if (next != chunk->free.begin()) {
+    auto previous = std::prev(next);
+    if (previous->first + previous->second == offset) {
+      offset = previous->first;
+      size += previous->second;
+      chunk->free.erase(previous);
+    }
+  }
+  chunk->free.emplace(offset, size);
+}
+
+void CodeArena::Release(Chunk* chunk, const uint8_t* entry, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t offset = entry - chunk->base;
+  const size_t footprint = Footprint(size);
+  Free(chunk, offset, footprint);
+  for (size_t page = offset / page_size_; page <= (offset + footprint - 1) / page_size_;
+       ++page) {
+    if (--chunk->live[page] == 0) {
+      --chunk->pages_in_use;
+      // Nothing will run here until something is written here again, so the
+      // memory can go back to the system.
+      fallocate(chunk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, page * page_size_,
+                page_size_);
+    }
+  }
+  if (chunk->pages_in_use == 0 && chunks_.size() > 1) {
+    UnmapChunk(chunk);
+  }
+}
+
+std::vector<CodeArena::Code> CodeArena::Batch::Commit(std::string* error) {
+  std::vector<Code> committed;
+  if (subroutines_.empty()) {
+    return committed;
+  }
+
+  std::vector<size_t> offsets;
+  size_t size = 0;
+  for (const AssemblySubroutine* subroutine : subroutines_) {
+    offsets.push_back(size);
+    size += Footprint(subroutine->size());
+  }
+
+  CodeArena* arena = arena_;
+  std::lock_guard<std::mutex> lock(arena->mutex_);
+  auto allocation = arena->Allocate(size, error);
+  Chunk* chunk = allocation.first;
+  if (chunk == nullptr) {
+    return committed;
+  }
+
+  // The code is written through a writable view of just the pages it
+  // covers, which is gone again by the time anything can run it.
+  const size_t view_start = allocation.second / arena->system_page_size_ *
+                            arena->system_page_size_;
+  const size_t view_size = allocation.second + size - view_start;
+  void* view = mmap(nullptr, view_size, PROT_READ | PROT_WRITE, MAP_SHARED, chunk->fd,
+                    view_start);
+  if (view == MAP_FAILED) {
+    if (error != nullptr) {
+      *error = ErrnoMessage("mmap");
+    }
+    arena->Free(chunk, allocation.second, size);
+    return committed;
+  }
+
+  // Pad with int3 so that stray jumps trap. Nothing is running in this space,
+  // though other code in the same pages may be.
+  uint8_t* start = static_cast<uint8_t*>(view) + (allocation.second - view_start);
+  memset(start, 0xcc, size);
+  for (size_t i = 0; i < subroutines_.size(); ++i) {
+    subroutines_[i]->write_code(start + offsets[i]);
+  }
+  munmap(view, view_size);
+
+  // Each subroutine holds a reference to every page it overlaps.
+  for (size_t i = 0; i < subroutines_.size(); ++i) {
+    const size_t offset = allocation.second + offsets[i];
+    const size_t code_size = subroutines_[i]->size();
+    const size_t last_page = (offset + Footprint(code_size) - 1) / arena->page_size_;
+    for (size_t page = offset / arena->page_size_; page <= last_page; ++page) {
+      if (chunk->live[page]++ == 0) {
+        ++chunk->pages_in_use;
+      }
+    }
+    committed.push_back(Code(chunk, chunk->base + offset, code_size));
+  }
+  subroutines_.clear();
+  return committed;
+}
+
+CodeArena::Code CodeArena::Add(const AssemblySubroutine& subroutine, std::string* error) {
+  Batch batch(this);
+  batch.Add(&subroutine);
+  std::vector<Code> committed = batch.Commit(error);
+  if (committed.empty()) {
+    return Code();
+  }
+  return std::move(committed[0]);
+}
+
+} // end namespace assembly
+} // end namespace gnossen
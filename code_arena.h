@@ -0,0 +1,168 @@
+#ifndef GNOSSEN_TINYJIT_CODE_ARENA_H_
+#define GNOSSEN_TINYJIT_CODE_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "assembly_segment.h"
+
+namespace gnossen {
+namespace assembly {
+
+// Executable memory shared by many subroutines.
+//
+// Memory is mapped a chunk of pages at a time, from a memory file that
+// stays mapped only as executable. Each batch of code is written through a
+// writable view of just the pages it covers, which is unmapped as soon as
+// the batch is written. No mapping is ever writable and executable at once,
+// and the executable one is never made writable, so code can be written
+// into the free space of a page while other code in it is running.
+// Subroutines are packed kCodeAlignment bytes apart, whether or not they
+// were added in the same batch, so many small ones share a page.
+//
+// Space is reused once the code in it is released, and a chunk is unmapped
+// once none of its pages are in use, unless it's the last one. Pages with no
+// live code are given back to the system.
+//
+// Safe to use from multiple threads.
+class CodeArena {
+public:
+  struct Options {
+    // Back chunks with transparent 2 MiB huge pages, to cut down on iTLB
+    // misses. Pages are then counted and given back 2 MiB at a time. The
+    // system only provides them if transparent huge pages are enabled for
+    // shared memory.
+    bool huge_pages = false;
+
+    // The number of pages to map at a time. Batches bigger than this get a
+    // chunk of their own.
+    size_t chunk_pages = 64;
+  };
+
+  // The alignment of each subroutine's entry point.
+  static constexpr size_t kCodeAlignment = 16;
+
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  // A mapping holding many pages. Defined in code_arena.cc.
+  struct Chunk;
+
+  // A subroutine written into the arena. Its space is given back when this is
+  // destroyed, so it must not be destroyed while the code might be running.
+  class Code {
+  public:
+    Code() : chunk_(nullptr), entry_(nullptr), size_(0) {}
+    ~Code();
+
+    Code(const Code&) = delete;
+    Code& operator=(const Code&) = delete;
+    Code(Code&& other) noexcept;
+    Code& operator=(Code&& other) noexcept;
+
+    const uint8_t* entry() const { return entry_; }
+    size_t size() const { return size_; }
+
+    // The space held in the arena, counting the padding up to the next
+    // subroutine.
+    size_t footprint() const;
+
+    template <typename Function>
+    Function function() const {
+      return reinterpret_cast<Function>(const_cast<uint8_t*>(entry_));
+    }
+
+    explicit operator bool() const { return entry_ != nullptr; }
+
+  private:
+    friend class CodeArena;
+
+    Code(Chunk* chunk, const uint8_t* entry, size_t size) :
+      chunk_(chunk), entry_(entry), size_(size) {}
+
+    void Release();
+
+    Chunk* chunk_;
+    const uint8_t* entry_;
+    size_t size_;
+  };
+
+  // Subroutines to be written into the arena together.
+  class Batch {
+  public:
+    explicit Batch(CodeArena* arena) : arena_(arena) {}
+
+    // Queues a finalized subroutine. It must stay alive until Commit().
+    void Add(const AssemblySubroutine* subroutine) { subroutines_.push_back(subroutine); }
+
+    size_t size() const { return subroutines_.size(); }
+
+    // Writes every queued subroutine, returning their code in the order they
+    // were added. On failure, returns nothing and writes a description of the
+    // problem to `error`, if supplied.
+    std::vector<Code> Commit(std::string* error = nullptr);
+
+  private:
+    CodeArena* arena_;
+    std::vector<const AssemblySubroutine*> subroutines_;
+  };
+
+  CodeArena();
+  explicit CodeArena(const Options& options);
+
+  // All code must have been released by now.
+  ~CodeArena();
+
+  CodeArena(const CodeArena&) = delete;
+  CodeArena& operator=(const CodeArena&) = delete;
+
+  // Writes a single subroutine. Equivalent to a batch of one.
+  Code Add(const AssemblySubroutine& subroutine, std::string* error = nullptr);
+
+  // A process-wide arena. It's never destroyed, so code from it may outlive
+  // static destructors.
+  static CodeArena* Default();
+
+  // The unit in which memory is counted by PagesInUse() and given back.
+  size_t page_size() const { return page_size_; }
+
+  size_t ChunkCount() const;
+  size_t PagesInUse() const;
+
+private:
+  // Rounds up to a multiple of kCodeAlignment, taking up at least one.
+  static size_t Footprint(size_t size);
+
+  // Finds `size` free bytes, the first fit in any chunk, mapping a new chunk
+  // if need be. Returns the chunk and the offset of the space, or a null
+  // chunk. Must be called with the lock held.
+  std::pair<Chunk*, size_t> Allocate(size_t size, std::string* error);
+
+  Chunk* MapChunk(size_t pages, std::string* error);
+
+  // Gives back the space, and the pages it leaves empty, unmapping the chunk
+  // if that leaves it empty too. Must be called with the lock held.
+  void Free(Chunk* chunk, size_t offset, size_t size);
+
+  void UnmapChunk(Chunk* chunk);
+
+  void Release(Chunk* chunk, const uint8_t* entry, size_t size);
+
+  const Options options_;
+  const size_t page_size_;
+
+  // The unit in which the memory file can be mapped, which page_size_ may be
+  // a multiple of.
+  const size_t system_page_size_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+};
+
+} // end namespace assembly
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_CODE_ARENA_H_
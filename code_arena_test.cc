@@ -0,0 +1,152 @@
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "code_arena.h"
+
+namespace gnossen {
+namespace assembly {
+namespace {
+
+using MatchFunction = uint8_t (*)(const uint8_t* begin, const uint8_t* end);
+
+static bool Matches(const CodeArena::Code& code, const std::string& input) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  return code.function<MatchFunction>()(begin, begin + input.size());
+}
+
+// Matches "a*b".
+static AssemblySubroutine MakeSubroutine() {
+  AssemblySubroutine subroutine;
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<NoOp>(1);
+  subroutine.add_segment<EndTestSegment>(2, LetterTest::kConsumingMatchNonConsumingNonMatch, 7);
+  subroutine.add_segment<ConsumingMatchNonConsumingNonMatch>(3, 'a', 2);
+  subroutine.add_segment<ConsumingMatchElse>(4, 'b', 7);
+  subroutine.add_segment<EndTestSegment>(5, LetterTest::kConsumingMatchElse, 7);
+  subroutine.add_segment<SuccessSegment>(6);
+  subroutine.add_segment<FailureSegment>(7);
+  subroutine.finalize();
+  return subroutine;
+}
+
+TEST(CodeArenaTest, RunsCode) {
+  CodeArena arena;
+  AssemblySubroutine subroutine = MakeSubroutine();
+  std::string error;
+  CodeArena::Code code = arena.Add(subroutine, &error);
+  ASSERT_TRUE(code) << error;
+  EXPECT_EQ(code.size(), subroutine.size());
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(code.entry()) % CodeArena::kCodeAlignment, 0);
+  EXPECT_TRUE(Matches(code, "aab"));
+  EXPECT_FALSE(Matches(code, "aac"));
+  EXPECT_FALSE(Matches(code, "aa"));
+  EXPECT_FALSE(Matches(code, "abb"));
+}
+
+TEST(CodeArenaTest, PacksBatchesIntoSharedPages) {
+  CodeArena arena;
+  AssemblySubroutine subroutine = MakeSubroutine();
+  CodeArena::Batch batch(&arena);
+  for (size_t i = 0; i < 100; ++i) {
+    batch.Add(&subroutine);
+  }
+  std::vector<CodeArena::Code> codes = batch.Commit();
+  ASSERT_EQ(codes.size(), 100);
+  const size_t bytes = 100 * CodeArena::kCodeAlignment *
+                       ((subroutine.size() + CodeArena::kCodeAlignment - 1) /
+                        CodeArena::kCodeAlignment);
+  EXPECT_LE(arena.PagesInUse(), bytes / arena.page_size() + 1);
+  for (const CodeArena::Code& code : codes) {
+    EXPECT_TRUE(Matches(code, "b"));
+  }
+}
+
+TEST(CodeArenaTest, PacksSeparateAddsIntoSharedPages) {
+  CodeArena arena;
+  AssemblySubroutine subroutine = MakeSubroutine();
+  std::vector<CodeArena::Code> codes;
+  for (size_t i = 0; i < 100; ++i) {
+    codes.push_back(arena.Add(subroutine));
+    ASSERT_TRUE(codes.back());
+  }
+  const size_t bytes = 100 * codes[0].footprint();
+  EXPECT_LE(arena.PagesInUse(), bytes / arena.page_size() + 1);
+  EXPECT_LT(arena.PagesInUse(), 100);
+
+  // Code added next to code that's already there doesn't disturb it.
+  for (const CodeArena::Code& code : codes) {
+    EXPECT_TRUE(Matches(code, "aab"));
+    EXPECT_FALSE(Matches(code, "aac"));
+  }
+}
+
+TEST(CodeArenaTest, LeavesNoWritableMappings) {
+  CodeArena arena;
+  AssemblySubroutine subroutine = MakeSubroutine();
+  std::vector<CodeArena::Code> codes;
+  for (size_t i = 0; i < 10; ++i) {
+    codes.push_back(arena.Add(subroutine));
+  }
+  std::ifstream maps("/proc/self/maps");
+  size_t executable = 0;
+  for (std::string line; std::getline(maps, line);) {
+    if (line.find("memfd:tinyjit") != std::string::npos) {
+      EXPECT_EQ(line.find("rw"), std::string::npos) << line;
+      executable += line.find("r-x") != std::string::npos;
+    }
+  }
+  EXPECT_GT(executable, 0);
+}
+
+TEST(CodeArenaTest, ReclaimsReleasedCode) {
+  CodeArena::Options options;
+  options.chunk_pages = 2;
+  CodeArena arena(options);
+  AssemblySubroutine subroutine = MakeSubroutine();
+  std::vector<CodeArena::Code> codes;
+  codes.push_back(arena.Add(subroutine));
+  const size_t per_chunk = 2 * arena.page_size() / codes[0].footprint();
+  while (codes.size() < 4 * per_chunk) {
+    codes.push_back(arena.Add(subroutine));
+  }
+  EXPECT_GE(arena.ChunkCount(), 4);
+
+  // Space freed in the middle of a page is handed out again.
+  codes[1] = CodeArena::Code();
+  const size_t pages = arena.PagesInUse();
+  const size_t chunks = arena.ChunkCount();
+  codes[1] = arena.Add(subroutine);
+  EXPECT_TRUE(Matches(codes[1], "ab"));
+  EXPECT_TRUE(Matches(codes[0], "ab"));
+  EXPECT_TRUE(Matches(codes[2], "ab"));
+  EXPECT_EQ(arena.PagesInUse(), pages);
+  EXPECT_EQ(arena.ChunkCount(), chunks);
+
+  codes.clear();
+  EXPECT_EQ(arena.PagesInUse(), 0);
+  EXPECT_EQ(arena.ChunkCount(), 1);
+
+  // Freed pages are handed out again.
+  CodeArena::Code code = arena.Add(subroutine);
+  EXPECT_TRUE(Matches(code, "ab"));
+  EXPECT_EQ(arena.ChunkCount(), 1);
+}
+
+TEST(CodeArenaTest, HugePages) {
+  CodeArena::Options options;
+  options.huge_pages = true;
+  options.chunk_pages = 1;
+  CodeArena arena(options);
+  AssemblySubroutine subroutine = MakeSubroutine();
+  CodeArena::Code code = arena.Add(subroutine);
+  ASSERT_TRUE(code);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(code.entry()) % CodeArena::kHugePageSize, 0);
+  EXPECT_TRUE(Matches(code, "aaab"));
+}
+
+} // end namespace
+} // end namespace assembly
+} // end namespace gnossen
@@ -1,10 +1,17 @@
 #include "fsm.h"
 
+#include <algorithm>
+#include <bitset>
 #include <cstdlib>
+#include <iostream>
 #include <iterator>
+#include <limits>
+#include <list>
 #include <sstream>
 #include <map>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace gnossen {
 namespace fsm {
@@ -17,13 +24,13 @@ static std::string TranslateLetter(char letter) {
     }
 }
 
-Fsm::State::State(unsigned int id) :
-    id(id), edges_out() {}
-
-Fsm::Fsm(const std::vector<char>& alphabet) :
+Fsm::Fsm(const std::vector<char>& alphabet, arena::Arena* arena) :
     alphabet_(alphabet),
-    states_(),
-    next_id_(0)
+    state_count_(0),
+    offsets_(1, 0, arena),
+    transitions_(arena),
+    pending_(arena),
+    sets_(arena)
 {
     // Create start, success, and failure states.
     for (size_t i = 0; i < 3; ++i) {
@@ -31,65 +38,99 @@ Fsm::Fsm(const std::vector<char>& alphabet) :
     }
 }
 
-Fsm::States::iterator
+Fsm::StateId
 Fsm::AddState() {
-    states_.emplace_back(next_id_++);
-    return --states_.end();
+    offsets_.push_back(transitions_.size());
+    return state_count_++;
 }
 
-const void Fsm::AddTransition(Fsm::States::iterator from,
-                              Fsm::States::iterator to,
-                              EdgeLabel label)
+void Fsm::AddTransition(StateId from, StateId to, EdgeLabel label)
 {
-    (*from).edges_out.emplace_back(to, label);
+    pending_.emplace_back(from, Transition(to, label));
 }
 
-const void Fsm::AddTransition(Fsm::States::iterator from,
-                              Fsm::States::iterator to,
-                              char letter)
+void Fsm::AddTransition(StateId from, StateId to, char letter)
 {
-    (*from).edges_out.emplace_back(to, EdgeLabel(letter));
+    pending_.emplace_back(from, Transition(to, EdgeLabel(letter)));
 }
 
-const void Fsm::AddNonDeterministicTransition(Fsm::States::iterator from,
-                                              Fsm::States::iterator to)
+void Fsm::AddRangeTransition(StateId from, StateId to, char first, char last)
 {
-    (*from).edges_out.emplace_back(to, EdgeLabel());
+    pending_.emplace_back(from, Transition(to, EdgeLabel::Range(first, last)));
 }
 
-const void Fsm::AddTransitionForRemaining(Fsm::States::iterator from,
-                                          Fsm::States::iterator to)
+void Fsm::AddSetTransition(StateId from, StateId to, const LetterSet& letters)
 {
-    (*from).edges_out.emplace_back(to, EdgeLabel::Remainder());
+    pending_.emplace_back(from, Transition(to, EdgeLabel::Set(AddSet(letters))));
 }
 
-const std::vector<char>&
-Fsm::GetAlphabet() const {
-    return alphabet_;
+uint32_t Fsm::AddSet(const LetterSet& letters)
+{
+    sets_.push_back(letters);
+    return sets_.size() - 1;
 }
 
-Fsm::StateContainer
-Fsm::GetStates() {
-    return Fsm::StateContainer(this);
+void Fsm::AddNonDeterministicTransition(StateId from, StateId to)
+{
+    pending_.emplace_back(from, Transition(to, EdgeLabel()));
 }
 
-Fsm::ConstStateContainer
-Fsm::GetStates() const {
-    return Fsm::ConstStateContainer(this);
+void Fsm::AddEndOfInputTransition(StateId from, StateId to)
+{
+    pending_.emplace_back(from, Transition(to, EdgeLabel::EndOfInput()));
 }
 
-Fsm::TransitionContainer
-Fsm::GetTransitions(Fsm::States::iterator state) {
-    return Fsm::TransitionContainer(state);
+void Fsm::AddTransitionForRemaining(StateId from, StateId to)
+{
+    pending_.emplace_back(from, Transition(to, EdgeLabel::Remainder()));
 }
 
-Fsm::ConstTransitionContainer
-Fsm::GetTransitions(Fsm::States::const_iterator state) const {
-    return Fsm::ConstTransitionContainer(state);
+void Fsm::Compact() {
+    CompactIfNeeded();
 }
 
-unsigned int Fsm::StateIdentifier(Fsm::States::const_iterator state) const {
-    return (*state).id;
+void Fsm::CompactIfNeeded() const {
+    if (pending_.empty()) {
+        return;
+    }
+    // A counting sort on the source state, keeping existing transitions ahead
+    // of pending ones.
+    arena::ArenaVector<uint32_t> offsets(state_count_ + 1, 0, offsets_.get_allocator());
+    for (StateId state = 0; state < state_count_; ++state) {
+        offsets[state + 1] = offsets_[state + 1] - offsets_[state];
+    }
+    for (const auto& pending : pending_) {
+        ++offsets[pending.first + 1];
+    }
+    for (StateId state = 0; state < state_count_; ++state) {
+        offsets[state + 1] += offsets[state];
+    }
+    arena::ArenaVector<Transition> transitions(offsets[state_count_], transitions_.get_allocator());
+    arena::ArenaVector<uint32_t> fill(offsets.begin(), offsets.end() - 1, offsets_.get_allocator());
+    for (StateId state = 0; state < state_count_; ++state) {
+        for (uint32_t i = offsets_[state]; i < offsets_[state + 1]; ++i) {
+            transitions[fill[state]++] = transitions_[i];
+        }
+    }
+    for (const auto& pending : pending_) {
+        transitions[fill[pending.first]++] = pending.second;
+    }
+    offsets_ = std::move(offsets);
+    transitions_ = std::move(transitions);
+    pending_ = arena::ArenaVector<std::pair<StateId, Transition>>(pending_.get_allocator());
+}
+
+const std::vector<char>&
+Fsm::GetAlphabet() const {
+    return alphabet_;
+}
+
+Fsm::TransitionContainer
+Fsm::GetTransitions(StateId state) const {
+    CompactIfNeeded();
+    const Transition* transitions = transitions_.data();
+    return TransitionContainer(transitions + offsets_[state],
+                               transitions + offsets_[state + 1]);
 }
 
 // TODO: Think about omitting the failure transitions.
@@ -97,16 +138,15 @@ std::string
 Fsm::ToDotGraph() const {
     std::stringstream ss;
     ss << "digraph FSM {" << std::endl;
-    const auto states = GetStates();
-    for (auto state = states.begin(); state != states.end(); ++state) {
-        std::string state_id(std::to_string(StateIdentifier(state)));
+    for (StateId state = 0; state < StateCount(); ++state) {
+        std::string state_id(std::to_string(state));
         std::map<unsigned int, std::list<std::string>> edges;
         std::unordered_set<char> remaining_letters;
         std::copy(GetAlphabet().begin(), GetAlphabet().end(),
                 std::inserter(remaining_letters, remaining_letters.begin()));
         auto transitions = GetTransitions(state);
         for (auto transition = transitions.begin(); transition != transitions.end(); ++transition) {
-            unsigned int out_id = StateIdentifier(transition->first);
+            unsigned int out_id = transition->first;
             EdgeLabel label = transition->second;
             std::string transition_str;
             if (label.remainder) {
@@ -114,9 +154,20 @@ Fsm::ToDotGraph() const {
                 break;
             } else if (label.empty_edge) {
                 transition_str = "eps.";
+            } else if (label.end_of_input) {
+                transition_str = "end";
             } else {
-                remaining_letters.erase(label.edge_label);
-                transition_str = TranslateLetter(label.edge_label);
+                ForEachLetter(label, [&](uint8_t letter) {
+                    remaining_letters.erase(letter);
+                });
+                if (label.IsSet()) {
+                    transition_str = "set " + std::to_string(label.set);
+                } else if (label.IsSingleLetter()) {
+                    transition_str = TranslateLetter(label.edge_label);
+                } else {
+                    transition_str = TranslateLetter(label.edge_label) + "-" +
+                                     TranslateLetter(label.last_letter);
+                }
             }
             edges[out_id].push_back(transition_str);
         }
@@ -139,53 +190,774 @@ Fsm::ToDotGraph() const {
     return ss.str();
 }
 
-static bool HasOneTransitionAndElse(Fsm::TransitionContainer& transitions) {
-  size_t transition_count = std::distance(transitions.begin(), transitions.end());
-  if (transition_count != 2) {
-    return false;
+// Splits each class into the letters in `letters` and the rest, renumbering
+// the classes in order of their smallest letter.
+static size_t SplitClasses(uint8_t* class_of, const LetterSet& letters) {
+  constexpr uint16_t kUnassigned = std::numeric_limits<uint16_t>::max();
+  uint16_t renumbered[2 * 256];
+  std::fill(renumbered, renumbered + 2 * 256, kUnassigned);
+  uint16_t count = 0;
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    uint16_t& id = renumbered[class_of[letter] * 2 + letters.test(letter)];
+    if (id == kUnassigned) {
+      id = count++;
+    }
+    class_of[letter] = id;
   }
-  auto transition = ++transitions.begin();
-  return transition->second.remainder;
+  return count;
 }
 
-Fsm ToBinarizedNfsm(Fsm& original) {
-  // Each state in the input graph will have a corresponding state in the
-  // output graph, so we start by copying those over.
+ByteClasses ComputeByteClasses(const Fsm& fsm) {
+  ByteClasses classes;
+  std::fill(classes.class_of, classes.class_of + 256, 0);
+
+  // Each distinct label only needs to split the classes once.
+  std::vector<std::pair<uint8_t, uint8_t>> ranges;
+  for (Fsm::StateId id = 0; id < fsm.StateCount(); ++id) {
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      const EdgeLabel& label = transition.second;
+      if (label.IsLetters() && !label.IsSet()) {
+        ranges.emplace_back(label.edge_label, label.last_letter);
+      }
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+  ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+
+  LetterSet alphabet;
+  for (char letter : fsm.GetAlphabet()) {
+    alphabet.set(static_cast<uint8_t>(letter));
+  }
+  size_t count = SplitClasses(classes.class_of, alphabet);
+  for (const auto& range : ranges) {
+    if (count == 256) {
+      break;
+    }
+    LetterSet letters;
+    for (unsigned int letter = range.first; letter <= range.second; ++letter) {
+      letters.set(letter);
+    }
+    count = SplitClasses(classes.class_of, letters);
+  }
+  for (uint32_t set = 0; set < fsm.SetCount() && count < 256; ++set) {
+    count = SplitClasses(classes.class_of, fsm.GetSet(set));
+  }
+
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    if (classes.class_of[letter] == classes.representatives.size()) {
+      classes.representatives.push_back(letter);
+    }
+  }
+  return classes;
+}
+
+namespace {
+
+// A superposition of states in a nondeterministic FSM, as a sorted list of
+// state identifiers.
+using Superposition = arena::ArenaVector<Fsm::StateId>;
+
+// Computes epsilon closures. The visited set is stamped with a generation
+// number so that it doesn't need clearing between closures.
+class EpsilonCloser {
+public:
+  explicit EpsilonCloser(const Fsm& fsm) :
+    fsm_(fsm), visited_(fsm.StateCount(), 0), generation_(0) {}
+
+  void Close(Superposition* superposition) {
+    ++generation_;
+    to_visit_.assign(superposition->begin(), superposition->end());
+    for (Fsm::StateId id : to_visit_) {
+      visited_[id] = generation_;
+    }
+    while (!to_visit_.empty()) {
+      Fsm::StateId id = to_visit_.back();
+      to_visit_.pop_back();
+      for (const auto& transition : fsm_.GetTransitions(id)) {
+        Fsm::StateId out_id = transition.first;
+        if (transition.second.empty_edge && visited_[out_id] != generation_) {
+          visited_[out_id] = generation_;
+          superposition->push_back(out_id);
+          to_visit_.push_back(out_id);
+        }
+      }
+    }
+    std::sort(superposition->begin(), superposition->end());
+  }
+
+private:
+  const Fsm& fsm_;
+  std::vector<uint32_t> visited_;
+  uint32_t generation_;
+  std::vector<Fsm::StateId> to_visit_;
+};
+
+} // end namespace
+
+// Beyond this many ranges, the letters leading to a state are matched as a
+// set instead.
+static constexpr size_t kMaxRangesPerTarget = 2;
+
+// Adds the transitions out of `from` given by a complete row of the transition
+// table. The letters leading to each state are grouped into ranges or a set,
+// in order of their first letter, and the state the most letters lead to is
+// reached by a remainder transition. Ties favour the failure state.
+static void AddGroupedTransitions(Fsm* fsm, Fsm::StateId from, const Fsm::StateId* row) {
+  std::vector<Fsm::StateId> targets(row, row + 256);
+  std::sort(targets.begin(), targets.end());
+  targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+  std::vector<LetterSet> groups(targets.size());
+  std::vector<size_t> order;
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    const size_t group = std::lower_bound(targets.begin(), targets.end(), row[letter]) -
+                         targets.begin();
+    if (groups[group].none()) {
+      order.push_back(group);
+    }
+    groups[group].set(letter);
+  }
+
+  size_t remainder = 0;
+  for (size_t group = 0; group < groups.size(); ++group) {
+    const size_t count = groups[group].count();
+    const size_t best = groups[remainder].count();
+    if (count > best || (count == best && targets[group] == fsm->GetFailureState())) {
+      remainder = group;
+    }
+  }
+
+  for (size_t group : order) {
+    if (group == remainder) {
+      continue;
+    }
+    const LetterSet& letters = groups[group];
+    std::vector<std::pair<unsigned int, unsigned int>> ranges;
+    for (unsigned int letter = 0; letter < 256; ++letter) {
+      if (!letters.test(letter)) {
+        continue;
+      }
+      if (ranges.empty() || ranges.back().second + 1 != letter) {
+        ranges.emplace_back(letter, letter);
+      } else {
+        ranges.back().second = letter;
+      }
+    }
+    if (ranges.size() > kMaxRangesPerTarget) {
+      fsm->AddSetTransition(from, targets[group], letters);
+      continue;
+    }
+    for (const auto& range : ranges) {
+      fsm->AddRangeTransition(from, targets[group],
+                              static_cast<char>(range.first), static_cast<char>(range.second));
+    }
+  }
+  fsm->AddTransitionForRemaining(from, targets[remainder]);
+}
+
+std::unique_ptr<Fsm> Determinize(const Fsm& nfsm, size_t max_states) {
+  const Fsm::StateId success_id = nfsm.GetSuccessState();
+  const Fsm::StateId failure_id = nfsm.GetFailureState();
+
+  // Note which letters each state has explicit transitions for so that we
+  // know which letters its remainder transition covers.
+  std::vector<std::bitset<256>> explicit_letters(nfsm.StateCount());
+  for (Fsm::StateId id = 0; id < nfsm.StateCount(); ++id) {
+    for (const auto& transition : nfsm.GetTransitions(id)) {
+      if (transition.second.IsLetters()) {
+        nfsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+          explicit_letters[id].set(letter);
+        });
+      }
+    }
+  }
+
+  arena::Arena* arena = nfsm.arena();
+  auto dfsm = std::make_unique<Fsm>(nfsm.GetAlphabet(), arena);
+  EpsilonCloser closer(nfsm);
+  std::map<Superposition, Fsm::StateId, std::less<Superposition>,
+           arena::ArenaAllocator<std::pair<const Superposition, Fsm::StateId>>>
+      correspondences(arena);
+  std::vector<std::pair<Superposition, Fsm::StateId>> to_visit;
+
+  // Maps a superposition to a state in the derived graph, creating it if this
+  // is the first time we've seen it.
+  bool over_budget = false;
+  auto derived_state = [&](Superposition superposition) {
+    closer.Close(&superposition);
+    // Reaching the failure state is the same as reaching no state at all.
+    superposition.erase(
+        std::remove(superposition.begin(), superposition.end(), failure_id),
+        superposition.end());
+    if (superposition.empty()) {
+      return dfsm->GetFailureState();
+    } else if (std::binary_search(superposition.begin(), superposition.end(), success_id)) {
+      return dfsm->GetSuccessState();
+    }
+    auto found = correspondences.find(superposition);
+    if (found != correspondences.end()) {
+      return found->second;
+    }
+    if (dfsm->StateCount() >= max_states) {
+      over_budget = true;
+      return dfsm->GetFailureState();
+    }
+    auto state = correspondences.empty() ? dfsm->GetStartState() : dfsm->AddState();
+    correspondences.emplace(superposition, state);
+    to_visit.emplace_back(std::move(superposition), state);
+    return state;
+  };
+
+  auto start_state = derived_state(Superposition({nfsm.GetStartState()}, arena));
+  if (start_state != dfsm->GetStartState()) {
+    // The start state is already decided one way or the other.
+    if (start_state == dfsm->GetSuccessState()) {
+      dfsm->AddNonDeterministicTransition(dfsm->GetStartState(), start_state);
+    } else {
+      dfsm->AddTransitionForRemaining(dfsm->GetStartState(), start_state);
+    }
+    dfsm->Compact();
+    return dfsm;
+  }
+
+  // Only one letter of each class needs following. Letters outside of the
+  // alphabet lead to failure, and the alphabet is made of whole classes.
+  const ByteClasses classes = ComputeByteClasses(nfsm);
+  const size_t class_count = classes.count();
+  std::vector<bool> in_alphabet(class_count, false);
+  for (char letter : nfsm.GetAlphabet()) {
+    in_alphabet[classes.class_of[static_cast<uint8_t>(letter)]] = true;
+  }
+
+  // The states reachable on each class from the current superposition.
+  std::vector<Superposition> moves(class_count, Superposition(arena));
+  Superposition end_move(arena);
+  std::vector<Fsm::StateId> class_row(class_count);
+  Fsm::StateId row[256];
+  while (!to_visit.empty()) {
+    Superposition superposition = std::move(to_visit.back().first);
+    auto state = to_visit.back().second;
+    to_visit.pop_back();
+
+    for (Fsm::StateId id : superposition) {
+      for (const auto& transition : nfsm.GetTransitions(id)) {
+        const EdgeLabel& label = transition.second;
+        if (label.empty_edge) {
+          continue;
+        } else if (label.end_of_input) {
+          end_move.push_back(transition.first);
+          continue;
+        }
+        for (size_t c = 0; c < class_count; ++c) {
+          const uint8_t letter = classes.representatives[c];
+          if (label.remainder ? !explicit_letters[id].test(letter) :
+                                nfsm.LabelMatches(label, letter)) {
+            moves[c].push_back(transition.first);
+          }
+        }
+      }
+    }
+
+    std::sort(end_move.begin(), end_move.end());
+    end_move.erase(std::unique(end_move.begin(), end_move.end()), end_move.end());
+    const Fsm::StateId at_end = derived_state(end_move);
+    end_move.clear();
+    if (over_budget) {
+      return nullptr;
+    } else if (at_end != dfsm->GetFailureState()) {
+      dfsm->AddEndOfInputTransition(state, at_end);
+    }
+
+    for (size_t c = 0; c < class_count; ++c) {
+      if (!in_alphabet[c]) {
+        class_row[c] = dfsm->GetFailureState();
+        continue;
+      }
+      Superposition& next = moves[c];
+      std::sort(next.begin(), next.end());
+      next.erase(std::unique(next.begin(), next.end()), next.end());
+      class_row[c] = derived_state(next);
+      if (over_budget) {
+        return nullptr;
+      }
+    }
+    for (Superposition& move : moves) {
+      move.clear();
+    }
+    for (unsigned int letter = 0; letter < 256; ++letter) {
+      row[letter] = class_row[classes.class_of[letter]];
+    }
+    AddGroupedTransitions(dfsm.get(), state, row);
+  }
+
+  dfsm->Compact();
+  return dfsm;
+}
+
+namespace {
+
+// The partition of a set of states used by Hopcroft's algorithm. Each block
+// occupies a contiguous range of `elements_`. Elements are marked by moving
+// them to the front of their block, so that a block can be split into its
+// marked and unmarked parts in time proportional to the marked part.
+class Partition {
+public:
+  explicit Partition(size_t size) :
+    elements_(size), location_(size), block_of_(size, 0), blocks_{{0, size, 0}}
+  {
+    for (size_t i = 0; i < size; ++i) {
+      elements_[i] = i;
+      location_[i] = i;
+    }
+  }
+
+  size_t BlockCount() const { return blocks_.size(); }
+  size_t BlockOf(unsigned int element) const { return block_of_[element]; }
+  size_t BlockSize(size_t block) const { return blocks_[block].end - blocks_[block].begin; }
+
+  const unsigned int* begin(size_t block) const { return &elements_[blocks_[block].begin]; }
+  const unsigned int* end(size_t block) const { return begin(block) + BlockSize(block); }
+
+  void Mark(unsigned int element) {
+    Block& block = blocks_[block_of_[element]];
+    const size_t marked_location = block.begin + block.marked;
+    if (location_[element] < marked_location) {
+      return;
+    }
+    if (block.marked == 0) {
+      touched_.push_back(block_of_[element]);
+    }
+    std::swap(elements_[location_[element]], elements_[marked_location]);
+    location_[elements_[location_[element]]] = location_[element];
+    location_[element] = marked_location;
+    ++block.marked;
+  }
+
+  // Splits every touched block whose elements were only partially marked.
+  // The new blocks, which hold the marked elements, are passed to `on_split`
+  // along with the block they came from.
+  template <typename Callback>
+  void SplitMarked(Callback on_split) {
+    for (size_t block_index : touched_) {
+      Block& block = blocks_[block_index];
+      const size_t marked = block.marked;
+      block.marked = 0;
+      if (marked == block.end - block.begin) {
+        continue;
+      }
+      const size_t new_index = blocks_.size();
+      const size_t split_location = block.begin + marked;
+      blocks_.push_back({block.begin, split_location, 0});
+      blocks_[block_index].begin = split_location;
+      for (size_t i = blocks_[new_index].begin; i < split_location; ++i) {
+        block_of_[elements_[i]] = new_index;
+      }
+      on_split(block_index, new_index);
+    }
+    touched_.clear();
+  }
+
+private:
+  struct Block {
+    size_t begin;
+    size_t end;
+    size_t marked;
+  };
+
+  std::vector<unsigned int> elements_;
+  std::vector<size_t> location_;
+  std::vector<size_t> block_of_;
+  std::vector<Block> blocks_;
+  std::vector<size_t> touched_;
+};
+
+} // end namespace
+
+std::unique_ptr<Fsm> Minimize(const Fsm& dfsm, size_t max_states) {
+  const size_t state_count = dfsm.StateCount();
+  if (state_count > max_states) {
+    return nullptr;
+  }
+  const Fsm::StateId start_id = dfsm.GetStartState();
+  const Fsm::StateId success_id = dfsm.GetSuccessState();
+  const Fsm::StateId failure_id = dfsm.GetFailureState();
+
+  for (const auto& transition : dfsm.GetTransitions(start_id)) {
+    if (transition.second.empty_edge) {
+      // The start state was decided without consuming anything. There's
+      // nothing to minimize.
+      return std::make_unique<Fsm>(dfsm);
+    }
+  }
+
+  // The complete transition table, with a column for each class of letters
+  // and one for the end of the input. Success and failure loop back to
+  // themselves, and anything without a transition leads to failure.
+  const ByteClasses classes = ComputeByteClasses(dfsm);
+  const unsigned int class_count = classes.count();
+  const unsigned int end_of_input = class_count;
+  const unsigned int symbols = class_count + 1;
+  std::vector<unsigned int> next(state_count * symbols, failure_id);
+  std::vector<bool> explicit_classes(class_count);
+  for (unsigned int id = 0; id < state_count; ++id) {
+    unsigned int* row = &next[id * symbols];
+    if (id == success_id || id == failure_id) {
+      std::fill(row, row + symbols, id);
+      continue;
+    }
+    const Fsm::Transition* remainder = nullptr;
+    explicit_classes.assign(class_count, false);
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.empty_edge) {
+        std::cerr << "Minimize() called on nondeterministic state " << id << "." << std::endl;
+        exit(1);
+      } else if (transition.second.remainder) {
+        remainder = &transition;
+      } else if (transition.second.end_of_input) {
+        row[end_of_input] = transition.first;
+      } else {
+        for (unsigned int c = 0; c < class_count; ++c) {
+          if (dfsm.LabelMatches(transition.second, classes.representatives[c])) {
+            row[c] = transition.first;
+            explicit_classes[c] = true;
+          }
+        }
+      }
+    }
+    if (remainder != nullptr) {
+      for (unsigned int c = 0; c < class_count; ++c) {
+        if (!explicit_classes[c]) {
+          row[c] = remainder->first;
+        }
+      }
+    }
+  }
+
+  // For each symbol, the states leading to each state, in CSR form.
+  std::vector<unsigned int> predecessor_offsets(symbols * (state_count + 1), 0);
+  std::vector<unsigned int> predecessors(state_count * symbols);
+  for (unsigned int symbol = 0; symbol < symbols; ++symbol) {
+    unsigned int* offsets = &predecessor_offsets[symbol * (state_count + 1)];
+    for (unsigned int id = 0; id < state_count; ++id) {
+      ++offsets[next[id * symbols + symbol] + 1];
+    }
+    for (unsigned int id = 0; id < state_count; ++id) {
+      offsets[id + 1] += offsets[id];
+    }
+    unsigned int* symbol_predecessors = &predecessors[symbol * state_count];
+    std::vector<unsigned int> fill(offsets, offsets + state_count);
+    for (unsigned int id = 0; id < state_count; ++id) {
+      symbol_predecessors[fill[next[id * symbols + symbol]]++] = id;
+    }
+  }
+
+  // Start by separating success from everything else. Everything that can't
+  // reach success ends up in a block with failure.
+  Partition partition(state_count);
+  partition.Mark(success_id);
+  std::vector<size_t> waiting;
+  std::vector<bool> is_waiting;
+  partition.SplitMarked([&](size_t, size_t new_block) {
+    waiting.push_back(new_block);
+  });
+  is_waiting.assign(partition.BlockCount(), false);
+  for (size_t block : waiting) {
+    is_waiting[block] = true;
+  }
+
+  std::vector<unsigned int> splitter;
+  while (!waiting.empty()) {
+    const size_t splitter_block = waiting.back();
+    waiting.pop_back();
+    is_waiting[splitter_block] = false;
+    splitter.assign(partition.begin(splitter_block), partition.end(splitter_block));
+    for (unsigned int symbol = 0; symbol < symbols; ++symbol) {
+      const unsigned int* offsets = &predecessor_offsets[symbol * (state_count + 1)];
+      const unsigned int* symbol_predecessors = &predecessors[symbol * state_count];
+      for (unsigned int target : splitter) {
+        for (unsigned int i = offsets[target]; i < offsets[target + 1]; ++i) {
+          partition.Mark(symbol_predecessors[i]);
+        }
+      }
+      partition.SplitMarked([&](size_t old_block, size_t new_block) {
+        is_waiting.push_back(false);
+        if (is_waiting[old_block]) {
+          waiting.push_back(new_block);
+          is_waiting[new_block] = true;
+        } else {
+          const size_t smaller = partition.BlockSize(new_block) < partition.BlockSize(old_block) ?
+                                 new_block : old_block;
+          waiting.push_back(smaller);
+          is_waiting[smaller] = true;
+        }
+      });
+    }
+  }
+
+  // Build the quotient graph, using the first state of each block as its
+  // representative.
+  auto minimized = std::make_unique<Fsm>(dfsm.GetAlphabet(), dfsm.arena());
+  constexpr Fsm::StateId kUnassigned = std::numeric_limits<Fsm::StateId>::max();
+  std::vector<Fsm::StateId> block_states(partition.BlockCount(), kUnassigned);
+  block_states[partition.BlockOf(start_id)] = minimized->GetStartState();
+  block_states[partition.BlockOf(success_id)] = minimized->GetSuccessState();
+  block_states[partition.BlockOf(failure_id)] = minimized->GetFailureState();
+  for (size_t block = 0; block < partition.BlockCount(); ++block) {
+    if (block_states[block] == kUnassigned) {
+      block_states[block] = minimized->AddState();
+    }
+  }
+  Fsm::StateId row[256];
+  for (size_t block = 0; block < partition.BlockCount(); ++block) {
+    const unsigned int representative = *partition.begin(block);
+    if (representative == success_id || representative == failure_id ||
+        block == partition.BlockOf(failure_id)) {
+      continue;
+    }
+    const Fsm::StateId at_end =
+        block_states[partition.BlockOf(next[representative * symbols + end_of_input])];
+    if (at_end != minimized->GetFailureState()) {
+      minimized->AddEndOfInputTransition(block_states[block], at_end);
+    }
+    for (unsigned int letter = 0; letter < 256; ++letter) {
+      const unsigned int c = classes.class_of[letter];
+      row[letter] = block_states[partition.BlockOf(next[representative * symbols + c])];
+    }
+    AddGroupedTransitions(minimized.get(), block_states[block], row);
+  }
+  minimized->Compact();
+  return minimized;
+}
+
+Fsm StopAtEarliestMatch(const Fsm& dfsm) {
+  // States and sets keep their identifiers, as in ToBinarizedNfsm().
+  Fsm derived(dfsm.GetAlphabet(), dfsm.arena());
+  for (Fsm::StateId id = 3; id < dfsm.StateCount(); ++id) {
+    derived.AddState();
+  }
+  for (uint32_t set = 0; set < dfsm.SetCount(); ++set) {
+    derived.AddSet(dfsm.GetSet(set));
+  }
+  const Fsm::StateId success = dfsm.GetSuccessState();
+  for (Fsm::StateId id = 0; id < dfsm.StateCount(); ++id) {
+    bool accepts = false;
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      accepts |= transition.second.end_of_input && transition.first == success;
+    }
+    if (accepts) {
+      // The end of the input still has to be tested for, since it's checked
+      // on the way to reading a letter. Either way, the match ends here.
+      derived.AddEndOfInputTransition(id, success);
+      derived.AddNonDeterministicTransition(id, success);
+      continue;
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      derived.AddTransition(id, transition.first, transition.second);
+    }
+  }
+  derived.Compact();
+  return derived;
+}
+
+RequiredFactor FindRequiredFactor(const Fsm& fsm, size_t max_letters) {
+  constexpr Fsm::StateId kNone = std::numeric_limits<Fsm::StateId>::max();
+  const size_t state_count = fsm.StateCount();
+  const Fsm::StateId start = fsm.GetStartState();
+  const Fsm::StateId success = fsm.GetSuccessState();
+
+  std::vector<std::vector<Fsm::Transition>> predecessors(state_count);
+  for (Fsm::StateId id = 0; id < state_count; ++id) {
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      predecessors[transition.first].emplace_back(id, transition.second);
+    }
+  }
+
+  // Only states on some path from start to success matter.
+  std::vector<bool> reachable(state_count, false);
+  std::vector<Fsm::StateId> pending {start};
+  reachable[start] = true;
+  while (!pending.empty()) {
+    const Fsm::StateId id = pending.back();
+    pending.pop_back();
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      if (!reachable[transition.first]) {
+        reachable[transition.first] = true;
+        pending.push_back(transition.first);
+      }
+    }
+  }
+  if (!reachable[success]) {
+    return RequiredFactor();
+  }
+  std::vector<bool> live(state_count, false);
+  pending.push_back(success);
+  live[success] = true;
+  while (!pending.empty()) {
+    const Fsm::StateId id = pending.back();
+    pending.pop_back();
+    for (const auto& transition : predecessors[id]) {
+      if (reachable[transition.first] && !live[transition.first]) {
+        live[transition.first] = true;
+        pending.push_back(transition.first);
+      }
+    }
+  }
+
+  // Number the live states in postorder.
+  std::vector<uint32_t> number(state_count, kNone);
+  std::vector<Fsm::StateId> postorder;
+  std::vector<bool> visited(state_count, false);
+  std::vector<std::pair<Fsm::StateId, size_t>> stack {{start, 0}};
+  visited[start] = true;
+  while (!stack.empty()) {
+    const Fsm::StateId id = stack.back().first;
+    const auto transitions = fsm.GetTransitions(id);
+    if (stack.back().second == transitions.size()) {
+      number[id] = postorder.size();
+      postorder.push_back(id);
+      stack.pop_back();
+      continue;
+    }
+    const Fsm::StateId next = (transitions.begin() + stack.back().second++)->first;
+    if (live[next] && !visited[next]) {
+      visited[next] = true;
+      stack.emplace_back(next, 0);
+    }
+  }
+
+  // Find each live state's immediate dominator, as described by Cooper,
+  // Harvey and Kennedy in "A Simple, Fast Dominance Algorithm".
+  std::vector<Fsm::StateId> dominator(state_count, kNone);
+  dominator[start] = start;
+  auto intersect = [&](Fsm::StateId a, Fsm::StateId b) {
+    while (a != b) {
+      while (number[a] < number[b]) {
+        a = dominator[a];
+      }
+      while (number[b] < number[a]) {
+        b = dominator[b];
+      }
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+      if (*it == start) {
+        continue;
+      }
+      Fsm::StateId idom = kNone;
+      for (const auto& transition : predecessors[*it]) {
+        if (live[transition.first] && dominator[transition.first] != kNone) {
+          idom = idom == kNone ? transition.first : intersect(transition.first, idom);
+        }
+      }
+      if (dominator[*it] != idom) {
+        dominator[*it] = idom;
+        changed = true;
+      }
+    }
+  }
 
-  // Maps from index of state in the original to the iterator for a state
-  // in the derived graph.
-  Fsm derived(original.GetAlphabet());
-  std::unordered_map<unsigned int, Fsm::States::iterator> correspondences;
+  std::vector<Fsm::StateId> chain {success};
+  while (chain.back() != start) {
+    chain.push_back(dominator[chain.back()]);
+  }
+  std::reverse(chain.begin(), chain.end());
 
-  correspondences[original.StateIdentifier(original.GetStartState())] = derived.GetStartState();
-  correspondences[original.StateIdentifier(original.GetSuccessState())] = derived.GetSuccessState();
-  correspondences[original.StateIdentifier(original.GetFailureState())] = derived.GetFailureState();
+  RequiredFactor factor;
+  std::string literal;
+  bool literal_prefix = false;
+  LetterSet letters;
+  bool letters_prefix = false;
+  // Whether no letter could have been consumed yet.
+  bool at_start = true;
+  auto finish_literal = [&]() {
+    if (literal.size() > factor.literal.size()) {
+      factor.literal = literal;
+      factor.prefix = literal_prefix;
+    }
+    literal.clear();
+  };
+  for (size_t i = 1; i < chain.size(); ++i) {
+    const Fsm::Transition* only = nullptr;
+    size_t incoming = 0;
+    for (const auto& transition : predecessors[chain[i]]) {
+      if (live[transition.first]) {
+        only = &transition;
+        ++incoming;
+      }
+    }
+    if (incoming != 1 || only->first != chain[i - 1]) {
+      finish_literal();
+      at_start = false;
+      continue;
+    }
+    const EdgeLabel& label = only->second;
+    if (label.empty_edge || label.end_of_input) {
+      continue;
+    } else if (label.IsSingleLetter()) {
+      if (literal.empty()) {
+        literal_prefix = at_start;
+      }
+      literal.push_back(label.edge_label);
+      at_start = false;
+      continue;
+    }
+    finish_literal();
+    if (label.IsLetters()) {
+      LetterSet matched;
+      fsm.ForEachLetter(label, [&matched](uint8_t letter) { matched.set(letter); });
+      if (matched.count() <= max_letters && (letters.none() || matched.count() < letters.count())) {
+        letters = matched;
+        letters_prefix = at_start;
+      }
+    }
+    at_start = false;
+  }
+  finish_literal();
+  if (factor.literal.empty()) {
+    factor.letters = letters;
+    factor.prefix = letters_prefix;
+  }
+  return factor;
+}
 
-  // Start by making a copy of every state in the original.
-  auto states = original.GetStates();
-  auto state = states.begin();
-  for (size_t i = 0; i < 3; ++i) {
-    // Skip special states.
-    ++state;
+static bool HasOneTransitionAndElse(const std::vector<Fsm::Transition>& transitions) {
+  if (transitions.size() != 2) {
+    return false;
+  }
+  return transitions[1].second.remainder;
+}
+
+Fsm ToBinarizedNfsm(const Fsm& original) {
+  // Each state in the input graph will have a corresponding state in the
+  // output graph, so we start by copying those over. The special states are
+  // created by the constructor and keep their identifiers, as does every
+  // other state, since they're created in the same order.
+  Fsm derived(original.GetAlphabet(), original.arena());
+  for (Fsm::StateId id = 3; id < original.StateCount(); ++id) {
+    derived.AddState();
   }
-  for (; state != states.end(); ++state) {
-    auto mirror_state = derived.AddState();
-    correspondences[original.StateIdentifier(state)] = mirror_state;
+  // Likewise for sets, so that labels can be copied as they are.
+  for (uint32_t set = 0; set < original.SetCount(); ++set) {
+    derived.AddSet(original.GetSet(set));
   }
 
-  std::unordered_set<unsigned int> visited;
-  std::vector<Fsm::States::iterator> to_visit;
+  std::vector<bool> visited(original.StateCount(), false);
+  std::vector<Fsm::StateId> to_visit;
   to_visit.push_back(original.GetStartState());
 
   while (!to_visit.empty()) {
     auto original_state = to_visit.back();
     to_visit.pop_back();
 
-    if (visited.find(original.StateIdentifier(original_state)) != visited.end()) {
+    if (visited[original_state]) {
       continue;
     }
 
-    visited.insert(original.StateIdentifier(original_state));
+    visited[original_state] = true;
 
     // This is just a single transformation into a form taht I know I can map
     // well to machine code. There are certainly others that could result in
@@ -194,47 +966,791 @@ Fsm ToBinarizedNfsm(Fsm& original) {
     // transformation to apply. It's possible that at some point we need to
     // record metadata that only applies to machine code -- such as some sort
     // of ordering of the nodes. We'll cross that bridge when we get to it.
-    auto mirror_state = correspondences[original.StateIdentifier(original_state)];
+    auto mirror_state = original_state;
 
-    auto transitions = original.GetTransitions(original_state);
-    size_t transition_count = std::distance(transitions.begin(), transitions.end());
+    // Test for the end of the input before reading a letter, whether or not
+    // the input may end here.
+    std::vector<Fsm::Transition> transitions;
+    Fsm::StateId at_end = original.GetFailureState();
+    for (const auto& transition : original.GetTransitions(original_state)) {
+      if (transition.second.end_of_input) {
+        at_end = transition.first;
+      } else {
+        transitions.push_back(transition);
+      }
+    }
+    const bool reads_letter = std::any_of(
+        transitions.begin(), transitions.end(),
+        [](const Fsm::Transition& transition) { return !transition.second.empty_edge; });
+    if (reads_letter || at_end != original.GetFailureState()) {
+      derived.AddEndOfInputTransition(mirror_state, at_end);
+      to_visit.push_back(at_end);
+      if (!reads_letter && transitions.empty()) {
+        continue;
+      }
+      auto current_state = derived.AddState();
+      derived.AddNonDeterministicTransition(mirror_state, current_state);
+      mirror_state = current_state;
+    }
+
+    size_t transition_count = transitions.size();
     if (transition_count == 0) {
       continue;
     } else if (transition_count == 1 || HasOneTransitionAndElse(transitions)) {
       // Copy state
-      for (auto transition = transitions.begin(); transition != transitions.end(); ++transition) {
-        derived.AddTransition(
-            mirror_state,
-            correspondences[original.StateIdentifier(transition->first)],
-            transition->second);
-        to_visit.push_back(transition->first);
+      for (const auto& transition : transitions) {
+        derived.AddTransition(mirror_state, transition.first, transition.second);
+        to_visit.push_back(transition.first);
       }
     } else {
       // TODO: If there's an immediate loop, prioritize that and don't make an
       // extra state for it. We can use `repe scasb` for it.
       auto previous_state = mirror_state;
-      for (auto transition = transitions.begin(); transition != transitions.end(); ++transition) {
-        if (transition->second.remainder)  {
-          derived.AddTransitionForRemaining(previous_state, transition->first);
+      for (const auto& transition : transitions) {
+        if (transition.second.remainder)  {
+          derived.AddTransitionForRemaining(previous_state, transition.first);
+          to_visit.push_back(transition.first);
         } else {
           auto current_state = derived.AddState();
           derived.AddNonDeterministicTransition(previous_state, current_state);
-          derived.AddTransition(
-              current_state,
-              correspondences[original.StateIdentifier(transition->first)],
-              transition->second);
+          derived.AddTransition(current_state, transition.first, transition.second);
           previous_state = current_state;
 
-          to_visit.push_back(transition->first);
+          to_visit.push_back(transition.first);
         }
       }
     }
   }
 
-  // TODO: Make sure we get copy elision here.
+  derived.Compact();
   return derived;
 }
 
 
+namespace {
+
+// The shape of a single state of a binarized FSM and how it maps to a section
+// of machine code.
+struct Section {
+  enum class Kind {
+    kSuccess,
+    kFailure,
+    kNoOp,                                // eps -> fallthrough
+    kConsumingMatchElse,                  // letters -> fallthrough, else -> jump
+    kConsumingMatchNonConsumingNonMatch,  // letters -> jump, eps -> fallthrough
+                                          // Either may test for the end of the
+                                          // input instead of letters.
+    kConsumeAny,                          // else -> fallthrough
+  };
+
+  Kind kind;
+  EdgeLabel label;
+
+  // For set labels, the index of the section holding the set's bitmap.
+  unsigned int bitmap_index;
+
+  unsigned int jump_state;
+  unsigned int fallthrough_state;
+  bool has_fallthrough;
+
+  // Whether the fallthrough state couldn't be laid out directly after this
+  // one, requiring an explicit jump.
+  bool needs_jump;
+
+  unsigned int index;
+};
+
+} // end namespace
+
+static Section ClassifyState(const Fsm& fsm, Fsm::StateId state) {
+  Section section{};
+  section.needs_jump = false;
+  if (state == fsm.GetSuccessState()) {
+    section.kind = Section::Kind::kSuccess;
+    return section;
+  } else if (state == fsm.GetFailureState()) {
+    section.kind = Section::Kind::kFailure;
+    return section;
+  }
+
+  const Fsm::StateId failure_id = fsm.GetFailureState();
+  const Fsm::Transition* letter = nullptr;
+  const Fsm::Transition* empty = nullptr;
+  const Fsm::Transition* remainder = nullptr;
+  size_t transition_count = 0;
+  for (const auto& transition : fsm.GetTransitions(state)) {
+    const Fsm::Transition** slot = transition.second.empty_edge ? &empty :
+                                   transition.second.remainder ? &remainder :
+                                   &letter;
+    if (*slot != nullptr) {
+      std::cerr << "State " << state << " is not binarized." << std::endl;
+      exit(1);
+    }
+    *slot = &transition;
+    ++transition_count;
+  }
+
+  section.has_fallthrough = true;
+  if (transition_count == 0) {
+    // A dead end. Treat it as failure.
+    section.kind = Section::Kind::kNoOp;
+    section.fallthrough_state = failure_id;
+  } else if (letter != nullptr && empty != nullptr && remainder == nullptr) {
+    section.kind = Section::Kind::kConsumingMatchNonConsumingNonMatch;
+    section.label = letter->second;
+    section.jump_state = letter->first;
+    section.fallthrough_state = empty->first;
+  } else if (letter != nullptr && empty == nullptr &&
+             !(letter->second.end_of_input && remainder != nullptr)) {
+    // A remainder would consume a letter that testing for the end of the
+    // input doesn't read, so binarized states never pair the two.
+    section.kind = Section::Kind::kConsumingMatchElse;
+    section.label = letter->second;
+    section.jump_state = remainder != nullptr ? remainder->first : failure_id;
+    section.fallthrough_state = letter->first;
+  } else if (transition_count == 1 && empty != nullptr) {
+    section.kind = Section::Kind::kNoOp;
+    section.fallthrough_state = empty->first;
+  } else if (transition_count == 1 && remainder != nullptr) {
+    section.kind = Section::Kind::kConsumeAny;
+    section.fallthrough_state = remainder->first;
+  } else {
+    std::cerr << "State " << state << " is not binarized." << std::endl;
+    exit(1);
+  }
+  return section;
+}
+
+static bool HasJump(const Section& section) {
+  return section.kind == Section::Kind::kConsumingMatchElse ||
+         section.kind == Section::Kind::kConsumingMatchNonConsumingNonMatch;
+}
+
+// Adds the segment testing a range or set label, or for the end of the input.
+static void AddLetterTest(assembly::AssemblySubroutine* subroutine, const Section& section,
+                          assembly::LetterTest test, unsigned int jump_index) {
+  if (section.label.end_of_input) {
+    subroutine->add_segment<assembly::EndTestSegment>(section.index, test, jump_index);
+  } else if (section.label.IsSet()) {
+    subroutine->add_segment<assembly::SetTestSegment>(
+          section.index, test, section.bitmap_index, jump_index);
+  } else {
+    subroutine->add_segment<assembly::RangeTestSegment>(
+          section.index, test, section.label.edge_label, section.label.last_letter, jump_index);
+  }
+}
+
+assembly::AssemblySubroutine ToSubroutine(const Fsm& fsm) {
+  using namespace assembly;
+
+  // Lay the sections out such that, wherever possible, a section's
+  // fallthrough state comes directly after it. Chains are started from the
+  // start state and then from each jump target in turn.
+  std::vector<Section> sections(fsm.StateCount());
+  std::vector<bool> placed(fsm.StateCount(), false);
+  std::vector<unsigned int> layout;
+  std::vector<unsigned int> pending {
+    fsm.GetFailureState(),
+    fsm.GetSuccessState(),
+    fsm.GetStartState(),
+  };
+  while (!pending.empty()) {
+    unsigned int id = pending.back();
+    pending.pop_back();
+    while (!placed[id]) {
+      placed[id] = true;
+      layout.push_back(id);
+      Section& section = sections[id];
+      section = ClassifyState(fsm, id);
+      if (HasJump(section)) {
+        pending.push_back(section.jump_state);
+      }
+      if (!section.has_fallthrough) {
+        break;
+      } else if (placed[section.fallthrough_state]) {
+        section.needs_jump = true;
+        break;
+      }
+      id = section.fallthrough_state;
+    }
+  }
+
+  // Section 0 is the stack management prologue.
+  unsigned int next_index = 1;
+  for (unsigned int id : layout) {
+    sections[id].index = next_index++;
+    if (sections[id].needs_jump) {
+      ++next_index;
+    }
+  }
+
+  // Bitmaps for set labels go after all of the code, one for each distinct
+  // set.
+  std::unordered_map<LetterSet, unsigned int> bitmap_indices;
+  std::vector<const LetterSet*> bitmaps;
+  const unsigned int first_bitmap_index = next_index;
+  for (unsigned int id : layout) {
+    Section& section = sections[id];
+    if (HasJump(section) && section.label.IsSet()) {
+      const LetterSet& letters = fsm.GetSet(section.label.set);
+      auto inserted = bitmap_indices.emplace(letters, next_index);
+      if (inserted.second) {
+        bitmaps.push_back(&letters);
+        ++next_index;
+      }
+      section.bitmap_index = inserted.first->second;
+    }
+  }
+
+  AssemblySubroutine subroutine(fsm.arena());
+  subroutine.add_segment<StackManagementSegment>(0);
+  for (unsigned int id : layout) {
+    const Section& section = sections[id];
+    const unsigned int jump_index = HasJump(section) ? sections[section.jump_state].index : 0;
+    switch (section.kind) {
+      case Section::Kind::kSuccess:
+        subroutine.add_segment<SuccessSegment>(section.index);
+        break;
+      case Section::Kind::kFailure:
+        subroutine.add_segment<FailureSegment>(section.index);
+        break;
+      case Section::Kind::kNoOp:
+        subroutine.add_segment<NoOp>(section.index);
+        break;
+      case Section::Kind::kConsumingMatchElse:
+        if (section.label.IsSingleLetter()) {
+          subroutine.add_segment<ConsumingMatchElse>(
+                section.index, section.label.edge_label, jump_index);
+        } else {
+          AddLetterTest(&subroutine, section, LetterTest::kConsumingMatchElse, jump_index);
+        }
+        break;
+      case Section::Kind::kConsumingMatchNonConsumingNonMatch:
+        if (section.label.IsSingleLetter()) {
+          subroutine.add_segment<ConsumingMatchNonConsumingNonMatch>(
+                section.index, section.label.edge_label, jump_index);
+        } else {
+          AddLetterTest(&subroutine, section,
+                        LetterTest::kConsumingMatchNonConsumingNonMatch, jump_index);
+        }
+        break;
+      case Section::Kind::kConsumeAny:
+        subroutine.add_segment<ConsumeAnySegment>(section.index);
+        break;
+    }
+    if (section.needs_jump) {
+      subroutine.add_segment<UnconditionalJumpSegment>(
+            section.index + 1, sections[section.fallthrough_state].index);
+    }
+  }
+  for (size_t i = 0; i < bitmaps.size(); ++i) {
+    subroutine.add_segment<BitmapSegment>(first_bitmap_index + i, *bitmaps[i]);
+  }
+  subroutine.optimize();
+  subroutine.finalize();
+  return subroutine;
+}
+
+namespace {
+
+// A state of a deterministic FSM lowered by ToLoadCompareSubroutine(). Its
+// sections are, in order: the advance entry, which consumes the letter that
+// led here, the load entry, which goes to the end state instead at the end
+// of the input, one test for each letter label, and, if the exit state can't
+// follow directly, a jump to it. States heading a literal run have a
+// LiteralSegment before the load, which becomes their load entry, and so do
+// states looping on themselves with a SkipLoopSegment, which leaves out the
+// tests for the letters it skips. States with many labels replace the tests
+// and the jump with a single DispatchSegment.
+struct StateBlock {
+  // For success and failure, which are single sections, all of these are
+  // the same.
+  unsigned int advance_index;
+  unsigned int load_index;
+  unsigned int first_test_index;
+
+  // Where to go if none of the tests match, and whether the letter is
+  // consumed on the way, as it is for a remainder transition but not for a
+  // nondeterministic one or for a dead end.
+  Fsm::StateId exit_state;
+  bool exit_advances;
+
+  // Where to go at the end of the input.
+  Fsm::StateId end_state;
+
+  bool needs_jump;
+  bool dispatch;
+
+  // The letters of the literal run starting here, if any, and the state at
+  // its end.
+  std::string run;
+  Fsm::StateId run_end;
+
+  // The letters leading back here, if they can all be skipped at once.
+  std::bitset<256> skip;
+};
+
+// States with at least this many letter labels dispatch through a jump table.
+// Below it, the tests are cheaper: a mispredicted indirect jump is only caught
+// once both of the table's loads are done, whereas a mispredicted test is
+// caught right after the letter's load.
+constexpr size_t kMinDispatchLabels = 18;
+
+} // end namespace
+
+// How unlikely a letter is to turn up in text, by its rank among the letters
+// most common in English prose and log files. Anything else is rarer still.
+static size_t LetterRarity(char letter) {
+  static const char kMostCommon[] =
+      " etaoinsrhldcumfpgwybvkxjqz0123456789ETAOINSRHLDCUMFPGWYBVKXJQZ.,-:/_=\n";
+  const char* found = std::find(kMostCommon, kMostCommon + sizeof(kMostCommon) - 1, letter);
+  return found - kMostCommon + 1;
+}
+
+assembly::AssemblySubroutine ToLoadCompareSubroutine(const Fsm& dfsm, const LoweringOptions& options) {
+  using namespace assembly;
+
+  const Fsm::StateId start_id = dfsm.GetStartState();
+  const Fsm::StateId success_id = dfsm.GetSuccessState();
+  const Fsm::StateId failure_id = dfsm.GetFailureState();
+  auto is_terminal = [&](Fsm::StateId id) {
+    return id == success_id || id == failure_id;
+  };
+
+  std::vector<StateBlock> blocks(dfsm.StateCount());
+  bool start_reentered = false;
+  for (Fsm::StateId id = 0; id < dfsm.StateCount(); ++id) {
+    StateBlock& block = blocks[id];
+    block.exit_state = failure_id;
+    block.exit_advances = false;
+    block.end_state = failure_id;
+    block.needs_jump = false;
+    block.dispatch = false;
+    if (is_terminal(id)) {
+      continue;
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.IsLetters()) {
+        start_reentered |= transition.first == start_id;
+        continue;
+      } else if (transition.second.end_of_input) {
+        block.end_state = transition.first;
+        continue;
+      } else if (transition.second.remainder) {
+        block.exit_advances = true;
+        start_reentered |= transition.first == start_id;
+      }
+      block.exit_state = transition.first;
+    }
+  }
+
+  // A state with a single letter leading anywhere but failure, and nothing
+  // else, is part of a literal run. Find the states heading each run, which
+  // are those that no other state in a run leads to, and chop the runs up
+  // into pieces no longer than a LiteralSegment can handle. Runs too short
+  // to be worth it are left to the per-letter tests.
+  // Returns the state a run continues to, or failure if `id` isn't in one.
+  auto run_successor = [&](Fsm::StateId id) {
+    if (is_terminal(id) || blocks[id].exit_state != failure_id) {
+      return failure_id;
+    }
+    Fsm::StateId next = failure_id;
+    size_t letter_edges = 0;
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.IsLetters()) {
+        ++letter_edges;
+        next = transition.second.IsSingleLetter() ? transition.first : failure_id;
+      }
+    }
+    return letter_edges == 1 && next != id ? next : failure_id;
+  };
+  std::vector<bool> continues_run(dfsm.StateCount(), false);
+  for (Fsm::StateId id = 0; id < dfsm.StateCount(); ++id) {
+    const Fsm::StateId next = run_successor(id);
+    if (next != failure_id && run_successor(next) != failure_id) {
+      continues_run[next] = true;
+    }
+  }
+  std::vector<bool> in_run(dfsm.StateCount(), false);
+  for (Fsm::StateId head = 0; head < dfsm.StateCount(); ++head) {
+    if (continues_run[head]) {
+      continue;
+    }
+    Fsm::StateId id = head;
+    while (run_successor(id) != failure_id && !in_run[id]) {
+      std::string run;
+      const Fsm::StateId run_head = id;
+      while (run.size() < LiteralSegment::kMaxLength &&
+             run_successor(id) != failure_id && !in_run[id]) {
+        in_run[id] = true;
+        for (const auto& transition : dfsm.GetTransitions(id)) {
+          if (transition.second.IsLetters()) {
+            run.push_back(transition.second.edge_label);
+          }
+        }
+        id = run_successor(id);
+      }
+      if (run.size() >= LiteralSegment::kMinLength) {
+        blocks[run_head].run = run;
+        blocks[run_head].run_end = id;
+      }
+    }
+  }
+
+  // Letters looping back to the same state can be skipped many at a time.
+  for (Fsm::StateId id = 0; id < dfsm.StateCount(); ++id) {
+    StateBlock& block = blocks[id];
+    if (is_terminal(id) || !block.run.empty()) {
+      continue;
+    }
+    std::bitset<256> loop;
+    std::bitset<256> labeled;
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (!transition.second.IsLetters()) {
+        continue;
+      }
+      dfsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+        labeled.set(letter);
+        if (transition.first == id) {
+          loop.set(letter);
+        }
+      });
+    }
+    if (block.exit_state == id && block.exit_advances) {
+      loop |= ~labeled;
+    }
+    if (SkipLoopSegment::CanSkip(loop)) {
+      block.skip = loop;
+    }
+  }
+  // Whether a state's test for the letters of `transition` is needed.
+  auto is_tested = [&](Fsm::StateId id, const auto& transition) {
+    return transition.second.IsLetters() && !(transition.first == id && blocks[id].skip.any());
+  };
+  for (Fsm::StateId id = 0; id < dfsm.StateCount(); ++id) {
+    if (is_terminal(id)) {
+      continue;
+    }
+    size_t labels = 0;
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      labels += is_tested(id, transition);
+    }
+    blocks[id].dispatch = labels >= kMinDispatchLabels;
+  }
+
+  // Lay the states out so that, wherever possible, a state's exit state
+  // comes directly after it. Only the advance entry can be fallen into, so
+  // that's only possible for exits that advance, or that go to success or
+  // failure, which don't care.
+  std::vector<bool> placed(dfsm.StateCount(), false);
+  std::vector<Fsm::StateId> layout;
+  std::vector<Fsm::StateId> pending {failure_id, success_id, start_id};
+  while (!pending.empty()) {
+    Fsm::StateId id = pending.back();
+    pending.pop_back();
+    while (!placed[id]) {
+      placed[id] = true;
+      layout.push_back(id);
+      if (is_terminal(id)) {
+        break;
+      }
+      StateBlock& block = blocks[id];
+      for (const auto& transition : dfsm.GetTransitions(id)) {
+        if (transition.second.IsLetters()) {
+          pending.push_back(transition.first);
+        }
+      }
+      const Fsm::StateId exit = block.exit_state;
+      if (block.dispatch) {
+        // Never falls through, so there's nothing to gain by placing the exit
+        // here.
+        pending.push_back(exit);
+        break;
+      } else if (placed[exit] || (!block.exit_advances && !is_terminal(exit))) {
+        block.needs_jump = true;
+        pending.push_back(exit);
+        break;
+      }
+      id = exit;
+    }
+  }
+
+  // Section 0 is the stack management prologue, followed by the prefilter, if
+  // any. If anything leads back to the start state, its advance entry is
+  // needed, so the prologue has to jump over it.
+  // A record loop sets itself up, then starts each record with a jump to
+  // the start state, so the prologue needs no jump of its own.
+  unsigned int next_index = 1;
+  const unsigned int record_setup_index = options.records ? next_index++ : 0;
+  const unsigned int record_loop_index = options.records ? next_index++ : 0;
+  const bool prefiltered = !options.prefilter.empty() && !options.records;
+  const unsigned int prefilter_index = prefiltered ? next_index++ : 0;
+  const bool start_jump = start_reentered && !options.records;
+  const unsigned int start_jump_index = start_jump ? next_index++ : 0;
+  for (Fsm::StateId id : layout) {
+    StateBlock& block = blocks[id];
+    block.advance_index = next_index;
+    if (is_terminal(id)) {
+      block.load_index = block.first_test_index = next_index++;
+      continue;
+    }
+    block.load_index = block.advance_index + 1;
+    block.first_test_index = block.load_index +
+                             (block.run.empty() && block.skip.none() ? 1 : 2);
+    next_index = block.first_test_index;
+    if (block.dispatch) {
+      ++next_index;
+      continue;
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (is_tested(id, transition)) {
+        ++next_index;
+      }
+    }
+    if (block.needs_jump) {
+      ++next_index;
+    }
+  }
+
+  // Bitmaps for set labels go after all of the code.
+  std::unordered_map<LetterSet, unsigned int> bitmap_indices;
+  std::vector<const LetterSet*> bitmaps;
+  const unsigned int first_bitmap_index = next_index;
+  for (Fsm::StateId id : layout) {
+    if (is_terminal(id) || blocks[id].dispatch) {
+      continue;
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (is_tested(id, transition) && transition.second.IsSet()) {
+        const LetterSet& letters = dfsm.GetSet(transition.second.set);
+        if (bitmap_indices.emplace(letters, next_index).second) {
+          bitmaps.push_back(&letters);
+          ++next_index;
+        }
+      }
+    }
+  }
+
+  // As do the letters of the runs long enough to be compared with SSE.
+  std::vector<Fsm::StateId> constants;
+  const unsigned int first_constant_index = next_index;
+  for (Fsm::StateId id : layout) {
+    if (blocks[id].run.size() >= LiteralSegment::kMinConstantLength) {
+      constants.push_back(id);
+      ++next_index;
+    }
+  }
+
+  // And so do the jump tables.
+  std::vector<Fsm::StateId> tables;
+  const unsigned int first_table_index = next_index;
+  for (Fsm::StateId id : layout) {
+    if (blocks[id].dispatch) {
+      tables.push_back(id);
+      ++next_index;
+    }
+  }
+
+  auto entry_index = [&](Fsm::StateId id, bool advances) {
+    return advances ? blocks[id].advance_index : blocks[id].load_index;
+  };
+
+  // The slot of each letter in a dispatching state's jump table, and the
+  // section each slot leads to. Slot 0 is the exit.
+  auto dispatch_slots = [&](Fsm::StateId id, uint8_t* letter_slots = nullptr) {
+    const StateBlock& block = blocks[id];
+    std::vector<unsigned int> targets {entry_index(block.exit_state, block.exit_advances)};
+    std::vector<uint8_t> slots(256, 0);
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (!is_tested(id, transition)) {
+        continue;
+      }
+      const unsigned int target = entry_index(transition.first, true);
+      auto found = std::find(targets.begin(), targets.end(), target);
+      const uint8_t slot = found - targets.begin();
+      if (found == targets.end()) {
+        targets.push_back(target);
+      }
+      dfsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+        slots[letter] = slot;
+      });
+    }
+    if (letter_slots != nullptr) {
+      std::copy(slots.begin(), slots.end(), letter_slots);
+    }
+    return targets;
+  };
+
+  AssemblySubroutine subroutine(dfsm.arena());
+  subroutine.add_segment<StackManagementSegment>(0);
+  if (options.records) {
+    subroutine.add_segment<RecordSetupSegment>(record_setup_index);
+    subroutine.add_segment<RecordLoopSegment>(record_loop_index, blocks[start_id].load_index);
+  }
+  if (prefiltered) {
+    // A literal's fingerprint is the pair of its letters least likely to
+    // turn up together by chance. Single letters fingerprint themselves.
+    const RequiredFactor& factor = options.prefilter;
+    LetterSet first = factor.letters;
+    uint8_t last = 0;
+    size_t distance = 0;
+    if (factor.literal.size() == 1) {
+      first.set(static_cast<uint8_t>(factor.literal[0]));
+    } else if (!factor.literal.empty()) {
+      const std::string& literal = factor.literal;
+      size_t best_rarity = 0;
+      for (size_t i = 0; i < literal.size(); ++i) {
+        for (size_t j = i + 1; j < literal.size() && j - i <= PrefilterSegment::kMaxDistance; ++j) {
+          const size_t rarity = LetterRarity(literal[i]) + LetterRarity(literal[j]);
+          if (rarity > best_rarity) {
+            best_rarity = rarity;
+            first.reset();
+            first.set(static_cast<uint8_t>(literal[i]));
+            last = literal[j];
+            distance = j - i;
+          }
+        }
+      }
+    }
+    subroutine.add_segment<PrefilterSegment>(prefilter_index, first, last, distance,
+                                             blocks[failure_id].advance_index);
+  }
+  if (start_jump) {
+    subroutine.add_segment<UnconditionalJumpSegment>(start_jump_index, blocks[start_id].load_index);
+  }
+  for (Fsm::StateId id : layout) {
+    const StateBlock& block = blocks[id];
+    if (id == success_id && options.records) {
+      subroutine.add_segment<RecordMatchSegment>(block.advance_index, record_loop_index);
+      continue;
+    } else if (id == failure_id && options.records) {
+      subroutine.add_segment<UnconditionalJumpSegment>(block.advance_index, record_loop_index);
+      continue;
+    } else if (id == success_id && options.return_end) {
+      subroutine.add_segment<MatchEndSegment>(block.advance_index);
+      continue;
+    } else if (id == success_id) {
+      subroutine.add_segment<SuccessSegment>(block.advance_index);
+      continue;
+    } else if (id == failure_id) {
+      subroutine.add_segment<FailureSegment>(block.advance_index);
+      continue;
+    }
+    if (id == start_id && !start_reentered) {
+      subroutine.add_segment<NoOp>(block.advance_index);
+    } else {
+      subroutine.add_segment<ConsumeAnySegment>(block.advance_index);
+    }
+    if (!block.run.empty()) {
+      const size_t constant = std::find(constants.begin(), constants.end(), id) - constants.begin();
+      subroutine.add_segment<LiteralSegment>(
+            block.load_index, block.run.data(), block.run.size(),
+            first_constant_index + constant, blocks[block.run_end].load_index);
+    } else if (block.skip.any()) {
+      subroutine.add_segment<SkipLoopSegment>(block.load_index, block.skip);
+    }
+    const bool tests = std::any_of(
+          dfsm.GetTransitions(id).begin(), dfsm.GetTransitions(id).end(),
+          [&](const Fsm::Transition& transition) { return is_tested(id, transition); });
+    if (!tests && !block.exit_advances && block.exit_state == block.end_state) {
+      // Goes the same way whether or not the input has ended, as a state
+      // ending a search does, so there's nothing to load.
+      subroutine.add_segment<NoOp>(block.first_test_index - 1);
+    } else {
+      subroutine.add_segment<LoadLetterSegment>(
+            block.first_test_index - 1, entry_index(block.end_state, false));
+    }
+    if (block.dispatch) {
+      const size_t table = std::find(tables.begin(), tables.end(), id) - tables.begin();
+      subroutine.add_segment<DispatchSegment>(
+            block.first_test_index, first_table_index + table, dispatch_slots(id).size());
+      continue;
+    }
+    unsigned int index = block.first_test_index;
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      const EdgeLabel& label = transition.second;
+      if (!is_tested(id, transition)) {
+        continue;
+      }
+      const unsigned int target = entry_index(transition.first, true);
+      if (label.IsSet()) {
+        subroutine.add_segment<JumpIfSetSegment>(
+              index, bitmap_indices.at(dfsm.GetSet(label.set)), target);
+      } else if (label.IsSingleLetter()) {
+        subroutine.add_segment<JumpIfLetterSegment>(index, label.edge_label, target);
+      } else {
+        subroutine.add_segment<JumpIfRangeSegment>(
+              index, label.edge_label, label.last_letter, target);
+      }
+      ++index;
+    }
+    if (block.needs_jump) {
+      subroutine.add_segment<UnconditionalJumpSegment>(
+            index, entry_index(block.exit_state, block.exit_advances));
+    }
+  }
+  for (size_t i = 0; i < bitmaps.size(); ++i) {
+    subroutine.add_segment<BitmapSegment>(first_bitmap_index + i, *bitmaps[i]);
+  }
+  for (size_t i = 0; i < constants.size(); ++i) {
+    const std::string& run = blocks[constants[i]].run;
+    subroutine.add_segment<LiteralConstantSegment>(
+          first_constant_index + i, run.data(), run.size());
+  }
+  for (size_t i = 0; i < tables.size(); ++i) {
+    uint8_t slots[256];
+    const std::vector<unsigned int> targets = dispatch_slots(tables[i], slots);
+    subroutine.add_segment<JumpTableSegment>(
+          first_table_index + i, slots, targets.data(), targets.size());
+  }
+  subroutine.optimize();
+  subroutine.finalize();
+  return subroutine;
+}
+
+bool CanShuffle(const Fsm& dfsm) {
+  return dfsm.StateCount() <= assembly::ShuffleLoopSegment::kMaxStates;
+}
+
+assembly::AssemblySubroutine ToShuffleSubroutine(const Fsm& dfsm) {
+  using namespace assembly;
+
+  // The next state of each state on each letter, filled in as TableDfa does,
+  // and the states the input may end in. Fsm state identifiers already start
+  // from the start state at 0.
+  const size_t count = dfsm.StateCount();
+  std::vector<uint8_t> next(256 * count, Fsm::GetFailureState());
+  uint32_t accepting = 0;
+  for (Fsm::StateId id = 0; id < count; ++id) {
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.remainder) {
+        for (size_t letter = 0; letter < 256; ++letter) {
+          next[letter * count + id] = transition.first;
+        }
+      }
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.end_of_input) {
+        if (transition.first == Fsm::GetSuccessState()) {
+          accepting |= uint32_t{1} << (2 * (id % ShuffleLoopSegment::kMaxNarrowStates) +
+                                       id / ShuffleLoopSegment::kMaxNarrowStates);
+        }
+      } else if (transition.second.IsLetters()) {
+        dfsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+          next[letter * count + id] = transition.first;
+        });
+      }
+    }
+  }
+
+  AssemblySubroutine subroutine;
+  subroutine.add_segment<StackManagementSegment>(0);
+  subroutine.add_segment<ShuffleLoopSegment>(1, 2, count, Fsm::GetFailureState(), accepting);
+  subroutine.add_segment<ShuffleTableSegment>(2, next.data(), count);
+  subroutine.optimize();
+  subroutine.finalize();
+  return subroutine;
+}
+
 } // end namespace fsm
 } // end namespace gnossen
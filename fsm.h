@@ -1,60 +1,133 @@
-// TODO: Header guards.
+#ifndef GNOSSEN_TINYJIT_FSM_H_
+#define GNOSSEN_TINYJIT_FSM_H_
 
+#include <bitset>
+#include <cstdint>
 #include <string>
-#include <list>
+#include <memory>
 #include <utility>
-#include <unordered_set>
 #include <vector>
 
+#include "arena.h"
+#include "assembly_segment.h"
+
 namespace gnossen {
 namespace fsm {
 
 struct EdgeLabel {
+    // Marks a label that doesn't refer to one of its graph's letter sets.
+    static constexpr uint32_t kNoSet = 0xffffffff;
+
     // If set, this is a nondeterministic transition, consuming no input
-    // characters. Mutually exlusive with the other two fields of this struct.
+    // characters. Mutually exlusive with the other fields of this struct.
     bool empty_edge;
 
     // If set, this represents all remaining characters not already represented
     // in the list of out edges for this state. Mutually exclusive with the
-    // other two fields in this struct.
+    // other fields in this struct.
     bool remainder;
 
-    // The label for this edge -- an actual character.
+    // If set, the edge is taken at the end of the input, consuming nothing.
+    // Mutually exclusive with the other fields in this struct.
+    bool end_of_input;
+
+    // The label for this edge -- an actual character. For a range of
+    // characters, this is the first one.
     char edge_label;
 
-    EdgeLabel() : empty_edge(true), remainder(false), edge_label() {}
-    EdgeLabel(char edge_label) : empty_edge(false), remainder(false), edge_label(edge_label) {}
+    // The last character of a range, inclusive. Equal to edge_label for an
+    // edge labelled with a single character.
+    char last_letter;
+
+    // If not kNoSet, the edge matches any letter of the set with this index
+    // in the graph owning the edge. Mutually exclusive with the other fields.
+    uint32_t set;
+
+    EdgeLabel() :
+        empty_edge(true),
+        remainder(false),
+        end_of_input(false),
+        edge_label(),
+        last_letter(),
+        set(kNoSet) {}
+    EdgeLabel(char edge_label) :
+        empty_edge(false),
+        remainder(false),
+        end_of_input(false),
+        edge_label(edge_label),
+        last_letter(edge_label),
+        set(kNoSet) {}
 
     static EdgeLabel Remainder() {
-        return EdgeLabel {false, true, '\0'};
+        return EdgeLabel {false, true, false, '\0', '\0', kNoSet};
+    }
+
+    static EdgeLabel EndOfInput() {
+        return EdgeLabel {false, false, true, '\0', '\0', kNoSet};
+    }
+
+    static EdgeLabel Range(char first, char last) {
+        return EdgeLabel {false, false, false, first, last, kNoSet};
     }
 
+    static EdgeLabel Set(uint32_t set) {
+        return EdgeLabel {false, false, false, '\0', '\0', set};
+    }
+
+    // Whether the edge consumes a letter from an explicit set of them,
+    // whether a single letter, a range or a set.
+    bool IsLetters() const { return !empty_edge && !remainder && !end_of_input; }
+
+    // Whether the edge matches exactly one letter, edge_label.
+    bool IsSingleLetter() const { return IsLetters() && set == kNoSet && edge_label == last_letter; }
+
+    bool IsSet() const { return IsLetters() && set != kNoSet; }
+
 private:
-    EdgeLabel(bool empty_edge, bool remainder, char edge_label) :
+    EdgeLabel(bool empty_edge, bool remainder, bool end_of_input,
+              char edge_label, char last_letter, uint32_t set) :
         empty_edge(empty_edge),
         remainder(remainder),
-        edge_label(edge_label) {}
+        end_of_input(end_of_input),
+        edge_label(edge_label),
+        last_letter(last_letter),
+        set(set) {}
 
 };
 
-
-
+using LetterSet = std::bitset<256>;
+
+// A finite state machine. States are identified by dense integer ids and
+// stored in compressed sparse row form: the transitions out of each state
+// occupy a contiguous range of a single transition array.
+//
+// Transitions may be added in any order. They are gathered into the
+// transition array the first time the graph is read after a modification,
+// preserving the order in which each state's transitions were added. Since
+// that happens lazily, concurrent reads are only safe once the graph has been
+// compacted, either explicitly or by a previous read.
+//
+// If given an arena, all of the graph's storage comes from it, as does that
+// of any graph derived from it by the passes below.
 class Fsm {
 public:
-    struct State;
-    using States = std::list<State>;
+    using StateId = uint32_t;
+    using Transition = std::pair<StateId, EdgeLabel>;
 
-    using Transition = std::pair<States::iterator, EdgeLabel>;
-    using Transitions = std::list<std::pair<States::iterator, EdgeLabel>>;
+    struct TransitionContainer {
+        const Transition* begin() const { return begin_; }
+        const Transition* end() const { return end_; }
+        size_t size() const { return end_ - begin_; }
 
-    struct State {
-        unsigned int id;
-        Transitions edges_out;
+        TransitionContainer(const Transition* begin, const Transition* end) :
+            begin_(begin), end_(end) {}
 
-        State(unsigned int id);
+    private:
+        const Transition* begin_;
+        const Transition* end_;
     };
 
-    explicit Fsm(const std::vector<char>& alphabet);
+    explicit Fsm(const std::vector<char>& alphabet, arena::Arena* arena = nullptr);
     ~Fsm() {}
 
     Fsm(const Fsm&) = default;
@@ -65,112 +138,231 @@ public:
 
     // Mutating methods.
 
-    // TODO: Add const_iterator version?
-    States::iterator AddState() ;
+    StateId AddState();
 
     // Adds a deterministic transition from one state to another.
-    const void AddTransition(States::iterator from,
-                             States::iterator to,
-                             EdgeLabel label);
+    void AddTransition(StateId from, StateId to, EdgeLabel label);
 
     // Adds a deterministic transition from one state to another.
-    const void AddTransition(States::iterator from,
-                             States::iterator to,
-                             char letter);
+    void AddTransition(StateId from, StateId to, char letter);
+
+    // Adds a deterministic transition on any letter in the inclusive range
+    // [first, last].
+    void AddRangeTransition(StateId from, StateId to, char first, char last);
 
+    // Adds a deterministic transition on any letter in the set.
+    void AddSetTransition(StateId from, StateId to, const LetterSet& letters);
+
+    // Adds a set of letters for use by EdgeLabel::Set() and returns its index.
+    uint32_t AddSet(const LetterSet& letters);
 
     // Adds a nondeterministic transition from one state to another.
     // Following this transition does not consume a character.
-    const void AddNonDeterministicTransition(States::iterator from,
-                                             States::iterator to);
+    void AddNonDeterministicTransition(StateId from, StateId to);
+
+    // Adds a transition taken at the end of the input, which is how a match
+    // reaches the success state. '\0' is an ordinary letter.
+    void AddEndOfInputTransition(StateId from, StateId to);
 
     // Adds a determinisic transition for all letters not already
     // represented by a transition to the given state. No more transitions
     // may be added after this method has been called.
-    const void AddTransitionForRemaining(States::iterator from,
-                                         States::iterator to);
-
+    void AddTransitionForRemaining(StateId from, StateId to);
 
-    // TODO: Supply an interface to add multiple letters to the
-    // transition?
+    // Gathers pending transitions into the transition array.
+    void Compact();
 
     // Read methods.
 
     const std::vector<char>& GetAlphabet() const;
 
-    friend class StateContainer;
-
-    struct StateContainer {
-        States::iterator begin() { return fsm_->states_.begin(); }
-        States::iterator end() { return fsm_->states_.end(); }
-
-        StateContainer(Fsm* fsm) : fsm_(fsm) {}
-
-    private:
-        Fsm* fsm_;
-    };
-
-    struct ConstStateContainer {
-        States::const_iterator begin() const { return fsm_->states_.begin(); }
-        States::const_iterator end() const { return fsm_->states_.end(); }
+    arena::Arena* arena() const { return offsets_.get_allocator().arena(); }
+
+    size_t StateCount() const { return state_count_; }
+    size_t TransitionCount() const { return transitions_.size() + pending_.size(); }
+
+    TransitionContainer GetTransitions(StateId state) const;
+
+    size_t SetCount() const { return sets_.size(); }
+    const LetterSet& GetSet(uint32_t set) const { return sets_[set]; }
+
+    // Calls `callback` with each letter matched by a letter, range or set
+    // label, in ascending order.
+    template <typename Callback>
+    void ForEachLetter(const EdgeLabel& label, Callback callback) const {
+        if (label.set != EdgeLabel::kNoSet) {
+            const LetterSet& letters = sets_[label.set];
+            for (unsigned int letter = 0; letter < 256; ++letter) {
+                if (letters.test(letter)) {
+                    callback(static_cast<uint8_t>(letter));
+                }
+            }
+        } else {
+            const unsigned int last = static_cast<uint8_t>(label.last_letter);
+            for (unsigned int letter = static_cast<uint8_t>(label.edge_label); letter <= last; ++letter) {
+                callback(static_cast<uint8_t>(letter));
+            }
+        }
+    }
 
-        ConstStateContainer(const Fsm* fsm) : fsm_(fsm) {}
+    // Whether a letter, range or set label matches `letter`.
+    bool LabelMatches(const EdgeLabel& label, uint8_t letter) const {
+        if (label.set != EdgeLabel::kNoSet) {
+            return sets_[label.set].test(letter);
+        }
+        return static_cast<uint8_t>(label.edge_label) <= letter &&
+               letter <= static_cast<uint8_t>(label.last_letter);
+    }
 
-    private:
-        const Fsm* fsm_;
-    };
+    // These three states are automatically created without intervention
+    // from the caller.
+    static constexpr StateId GetStartState() { return 0; }
+    static constexpr StateId GetSuccessState() { return 1; }
+    static constexpr StateId GetFailureState() { return 2; }
 
-    StateContainer GetStates();
-    ConstStateContainer GetStates() const;
+    // Generates a dot graph corresponding to this FSM.
+    std::string ToDotGraph() const;
 
-    struct TransitionContainer {
-        Transitions::iterator begin() { return (*state_).edges_out.begin(); }
-        Transitions::iterator end() { return (*state_).edges_out.end(); }
+private:
+    void CompactIfNeeded() const;
 
-        TransitionContainer(States::iterator state) : state_(state) {}
-    private:
-        States::iterator state_;
-    };
+    std::vector<char> alphabet_;
 
-    struct ConstTransitionContainer {
-        Transitions::const_iterator begin() const { return (*state_).edges_out.begin(); }
-        Transitions::const_iterator end() const { return (*state_).edges_out.end(); }
+    StateId state_count_;
 
-        ConstTransitionContainer(States::const_iterator state) : state_(state) {}
-    private:
-        const States::const_iterator state_;
-    };
-
-    TransitionContainer GetTransitions(States::iterator state);
-    ConstTransitionContainer GetTransitions(States::const_iterator state) const;
+    // offsets_[i] is the index into transitions_ of the first transition out
+    // of state i. Only valid when pending_ is empty.
+    mutable arena::ArenaVector<uint32_t> offsets_;
+    mutable arena::ArenaVector<Transition> transitions_;
 
-    unsigned int StateIdentifier(States::const_iterator state) const;
+    // Transitions added since the last compaction, with their source states.
+    mutable arena::ArenaVector<std::pair<StateId, Transition>> pending_;
 
-    // These three states are automatically created without intervention
-    // from the caller.
-    States::iterator GetStartState() { return states_.begin(); }
-    States::const_iterator GetStartState() const { return GetStartState(); }
+    // The sets of letters referred to by set labels.
+    arena::ArenaVector<LetterSet> sets_;
+};
 
-    States::iterator GetSuccessState() { return ++states_.begin(); }
-    States::const_iterator GetSuccessState() const { return GetSuccessState(); }
+// A partition of the 256 letters into classes that an FSM can't tell apart:
+// every label matches either all of a class or none of it, and so does the
+// alphabet. Passes that would otherwise consider each letter in turn need
+// only consider one letter of each class, and typical patterns have a few
+// dozen classes at most.
+struct ByteClasses {
+    uint8_t class_of[256];
 
-    States::iterator GetFailureState() { return ++GetSuccessState(); }
-    States::const_iterator GetFailureState() const { return GetFailureState(); }
+    // The smallest letter of each class, in ascending order, which stands for
+    // the whole class.
+    std::vector<uint8_t> representatives;
 
-    // Generates a dot graph corresponding to this FSM.
-    std::string ToDotGraph() const;
+    size_t count() const { return representatives.size(); }
+};
 
-private:
-    const std::vector<char> alphabet_;
+ByteClasses ComputeByteClasses(const Fsm& fsm);
+
+// The default limit on the number of states a pass may create before giving
+// up.
+constexpr size_t kDefaultStateBudget = 10000;
+
+// Converts an arbitrary FSM into a deterministic one accepting the same
+// language using the subset construction. Every state of the result has at
+// most one transition per letter, no nondeterministic transitions, and a
+// remainder transition, preceded by an end-of-input transition if the input
+// may end there. The letters leading to each other state are grouped
+// into ranges, or into a set if they're too scattered, and the remainder
+// transition goes to whichever state the most letters lead to. Any
+// superposition containing the success state collapses into the success
+// state.
+//
+// Returns nullptr if the result would need more than `max_states` states.
+std::unique_ptr<Fsm> Determinize(const Fsm& fsm, size_t max_states = kDefaultStateBudget);
+
+// Merges equivalent states of a deterministic FSM using Hopcroft's partition
+// refinement. States that can never reach success are merged into the
+// failure state. Transitions are grouped as by Determinize().
+//
+// Returns nullptr if the input has more than `max_states` states.
+std::unique_ptr<Fsm> Minimize(const Fsm& dfsm, size_t max_states = kDefaultStateBudget);
+
+// Makes each state of a deterministic FSM that could end a match go straight
+// to success, without reading any further. Lowered with `return_end` set, the
+// result finds the earliest end of a match: the subroutine reaches success
+// with the input pointer there.
+Fsm StopAtEarliestMatch(const Fsm& dfsm);
+
+// Letters that every input an FSM accepts contains.
+struct RequiredFactor {
+    // The longest run of letters found in every accepted input.
+    std::string literal;
+
+    // If there's no literal, a small set of letters, one of which every
+    // accepted input contains.
+    LetterSet letters;
+
+    // Whether every accepted input starts with the factor.
+    bool prefix = false;
+
+    bool empty() const { return literal.empty() && letters.none(); }
+};
 
-    States states_;
-    unsigned int next_id_;
+// Finds a factor of every input an FSM accepts, by following the chain of
+// states that every path from start to success passes through. An edge
+// between two consecutive states of the chain is required if it's the only
+// way into the second one. Required single letters, joined by nothing but
+// nondeterministic transitions, make up the literal. If there isn't one,
+// the required edge matching the fewest letters, if it matches no more than
+// `max_letters`, gives the set.
+//
+// Works best on the FSM straight from Thompson's construction, before
+// determinization has merged paths through the graph. Returns an empty
+// factor if no factor is found.
+RequiredFactor FindRequiredFactor(const Fsm& fsm, size_t max_letters = 3);
+
+// Splits each state of a deterministic FSM into a chain of states with a
+// single test each. Every chain that reads a letter starts by testing for
+// the end of the input, so that no letter is read past it.
+Fsm ToBinarizedNfsm(const Fsm& fsm);
+
+// Lowers a binarized FSM to machine code. The resulting subroutine has already
+// been finalized. Section indices are assigned in layout order, so they don't
+// correspond to state identifiers.
+assembly::AssemblySubroutine ToSubroutine(const Fsm& fsm);
+
+// Options for ToLoadCompareSubroutine().
+struct LoweringOptions {
+    // On success, the subroutine returns 1, or, if this is set, the input
+    // pointer. It returns 0 on failure either way.
+    bool return_end = false;
+
+    // If not empty, the subroutine first scans the whole input for a
+    // fingerprint of this factor, and fails straight away if there isn't one.
+    // The automaton still starts from the beginning of the input.
+    RequiredFactor prefilter;
+
+    // Rather than matching the whole input, the subroutine loops over its
+    // records, matching each from the start state, and counts the matches,
+    // as described in assembly_segment.h above RecordSetupSegment. Takes
+    // precedence over `return_end`, and leaves out the prefilter.
+    bool records = false;
 };
 
-Fsm ToBinarizedNfsm(Fsm& fsm);
+// Lowers a deterministic FSM straight to machine code, without binarizing it
+// first. Each state checks for the end of the input and loads the next letter
+// once, compares it against each of its labels in turn, and advances the
+// input pointer only once it knows where it's going. Much faster than ToSubroutine(), which remains for debugging.
+assembly::AssemblySubroutine ToLoadCompareSubroutine(const Fsm& dfsm,
+                                                     const LoweringOptions& options = LoweringOptions());
+
+// Whether ToShuffleSubroutine() can lower a deterministic FSM.
+bool CanShuffle(const Fsm& dfsm);
 
-// // TODO: Check for copy elision and if we don't get it, return unique_ptr.
-// AssemblySubroutine ToSubroutine(Fsm& fsm);
+// Lowers a deterministic FSM of no more than
+// assembly::ShuffleLoopSegment::kMaxStates states to a single branch-free
+// loop stepping through a table of next states with pshufb, which takes the
+// same time per letter whatever the pattern. Only decides whether the whole
+// input matches. Needs SSSE3.
+assembly::AssemblySubroutine ToShuffleSubroutine(const Fsm& dfsm);
 
 } // end namespace fsm
-} // end namespace gnosse
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_FSM_H_
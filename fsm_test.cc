@@ -18,17 +18,20 @@ namespace fsm {
 
 namespace {
 
-static void WriteDotFile(const Fsm& fsm, std::string filename) {
+static void WriteFile(const std::string& contents, std::string filename) {
   std::string extra_artifacts_dir(getenv("TEST_UNDECLARED_OUTPUTS_DIR"));
   std::string filepath = extra_artifacts_dir + "/" + filename;
   std::ofstream outfile(filepath, std::ofstream::out);
-  outfile << fsm.ToDotGraph() << std::endl;
+  outfile << contents << std::endl;
+}
+
+static void WriteDotFile(const Fsm& fsm, std::string filename) {
+  WriteFile(fsm.ToDotGraph(), filename);
 }
 
 TEST(FsmTest, CanBuild) {
   std::vector<char> alphabet {'a', 'b', 'c'};
-  std::vector<char> extended_alphabet = {'a', 'b', 'c', '\0'};
-  Fsm fsm(extended_alphabet);
+  Fsm fsm(alphabet);
   auto initial_state = fsm.GetStartState();
   auto state2 = fsm.AddState();
   fsm.AddTransition(initial_state, state2, 'c');
@@ -40,20 +43,19 @@ TEST(FsmTest, CanBuild) {
   for (char letter : alphabet) {
     fsm.AddTransition(state3, state4, letter);
   }
-  fsm.AddTransition(state4, fsm.GetSuccessState(), '\0');
+  fsm.AddEndOfInputTransition(state4, fsm.GetSuccessState());
 
   std::set<unsigned int> observed_states;
-  auto states = fsm.GetStates();
-  for (auto state = states.begin(); state != states.end(); ++state) {
-    observed_states.insert(fsm.StateIdentifier(state));
+  for (Fsm::StateId state = 0; state < fsm.StateCount(); ++state) {
+    observed_states.insert(state);
   }
   std::set<unsigned int> expected_states = {
-    fsm.StateIdentifier(initial_state),
-    fsm.StateIdentifier(state2),
-    fsm.StateIdentifier(state3),
-    fsm.StateIdentifier(state4),
-    fsm.StateIdentifier(fsm.GetSuccessState()),
-    fsm.StateIdentifier(fsm.GetFailureState())
+    initial_state,
+    state2,
+    state3,
+    state4,
+    fsm.GetSuccessState(),
+    fsm.GetFailureState()
   };
 
   EXPECT_THAT(observed_states, ::testing::ContainerEq(expected_states));
@@ -62,28 +64,29 @@ TEST(FsmTest, CanBuild) {
   using Edges = std::list<Edge>;
   std::map<unsigned int, Edges> observed_transitions;
   std::map<unsigned int, Edges> expected_transitions = {
-    {fsm.StateIdentifier(initial_state), Edges{Edge{fsm.StateIdentifier(state2), 'c'}}},
-    {fsm.StateIdentifier(state2), Edges{
-                Edge{fsm.StateIdentifier(state2), 'a'},
-                Edge{fsm.StateIdentifier(state2), 'b'},
-                Edge{fsm.StateIdentifier(state3), 'c'}
+    {initial_state, Edges{Edge{state2, 'c'}}},
+    {state2, Edges{
+                Edge{state2, 'a'},
+                Edge{state2, 'b'},
+                Edge{state3, 'c'}
              }
     },
-    {fsm.StateIdentifier(state3), Edges{
-                Edge{fsm.StateIdentifier(state4), 'a'},
-                Edge{fsm.StateIdentifier(state4), 'b'},
-                Edge{fsm.StateIdentifier(state4), 'c'}
+    {state3, Edges{
+                Edge{state4, 'a'},
+                Edge{state4, 'b'},
+                Edge{state4, 'c'}
              }
     },
-    {fsm.StateIdentifier(state4), Edges{Edge{fsm.StateIdentifier(fsm.GetSuccessState()), '\0'}}},
+    {state4, Edges{Edge{fsm.GetSuccessState(), '\0'}}},
   };
 
-  for (auto state = states.begin(); state != states.end(); ++state) {
+  for (Fsm::StateId state = 0; state < fsm.StateCount(); ++state) {
     for (auto transition : fsm.GetTransitions(state)) {
       EXPECT_FALSE(transition.second.empty_edge);
       EXPECT_FALSE(transition.second.remainder);
-      observed_transitions[fsm.StateIdentifier(state)].emplace_back(
-              fsm.StateIdentifier(transition.first),
+      EXPECT_EQ(transition.second.end_of_input, state == state4);
+      observed_transitions[state].emplace_back(
+              transition.first,
               transition.second.edge_label);
     }
   }
@@ -95,8 +98,7 @@ TEST(FsmTest, CanBuild) {
 
 TEST(FsmTest, ToBinarizedFsm) {
   std::vector<char> alphabet {'a', 'b', 'c'};
-  std::vector<char> extended_alphabet {'a', 'b', 'c', '\0'};
-  Fsm fsm(extended_alphabet);
+  Fsm fsm(alphabet);
   auto initial_state = fsm.GetStartState();
   auto state2 = fsm.AddState();
   fsm.AddTransition(initial_state, state2, 'c');
@@ -108,7 +110,7 @@ TEST(FsmTest, ToBinarizedFsm) {
   for (char letter : alphabet) {
     fsm.AddTransition(state3, state4, letter);
   }
-  fsm.AddTransition(state4, fsm.GetSuccessState(), '\0');
+  fsm.AddEndOfInputTransition(state4, fsm.GetSuccessState());
 
   Fsm binarized_fsm = ToBinarizedNfsm(fsm);
 
@@ -116,24 +118,24 @@ TEST(FsmTest, ToBinarizedFsm) {
   WriteDotFile(binarized_fsm, "binarized_fsm1.dot");
 
   std::unordered_set<unsigned int> visited;
-  std::list<Fsm::States::iterator> to_visit;
+  std::list<Fsm::StateId> to_visit;
   to_visit.push_back(binarized_fsm.GetStartState());
-  Fsm::States::iterator state;
+  Fsm::StateId state;
   do {
     state = to_visit.back();
     to_visit.pop_back();
 
     if (state == binarized_fsm.GetSuccessState() ||
         state == binarized_fsm.GetFailureState() ||
-        visited.find(binarized_fsm.StateIdentifier(state)) != visited.end())
+        visited.find(state) != visited.end())
       continue;
 
-    visited.insert(binarized_fsm.StateIdentifier(state));
+    visited.insert(state);
 
     auto transitions = binarized_fsm.GetTransitions(state);
-    size_t transition_count = std::distance(transitions.begin(), transitions.end());
+    size_t transition_count = transitions.size();
     size_t deterministic_transitions = 0;
-    std::vector<Fsm::States::iterator> next_states;
+    std::vector<Fsm::StateId> next_states;
     for (auto edge : transitions) {
       if (!edge.second.empty_edge && !edge.second.remainder)
         ++deterministic_transitions;
@@ -151,8 +153,7 @@ TEST(FsmTest, ToBinarizedFsm) {
 
 TEST(FsmTest, ToAssembly) {
   std::vector<char> alphabet {'a', 'b', 'c'};
-  std::vector<char> extended_alphabet {'a', 'b', 'c', '\0'};
-  Fsm fsm(extended_alphabet);
+  Fsm fsm(alphabet);
   auto initial_state = fsm.GetStartState();
   auto state2 = fsm.AddState();
   fsm.AddTransition(initial_state, state2, 'c');
@@ -167,13 +168,499 @@ TEST(FsmTest, ToAssembly) {
     fsm.AddTransition(state3, state4, letter);
   }
   fsm.AddTransitionForRemaining(state3, fsm.GetFailureState());
-  fsm.AddTransition(state4, fsm.GetSuccessState(), '\0');
+  fsm.AddEndOfInputTransition(state4, fsm.GetSuccessState());
   fsm.AddTransitionForRemaining(state4, fsm.GetFailureState());
 
   Fsm binarized_fsm = ToBinarizedNfsm(fsm);
   WriteDotFile(binarized_fsm, "assembly_input.dot");
-  // AssemblySubroutine subroutine = ToSubroutine(binarized_fsm);
-  //Tstd::cout << subroutine.debug_string() << std::endl;
+  assembly::AssemblySubroutine subroutine = ToSubroutine(binarized_fsm);
+  WriteFile(subroutine.debug_string(), "fsm1.S");
+  EXPECT_GT(subroutine.size(), 0);
+}
+
+TEST(FsmTest, Determinize) {
+  // An NFSM for "(a|ab)c".
+  std::vector<char> alphabet {'a', 'b', 'c'};
+  Fsm fsm(alphabet);
+  auto a_branch = fsm.AddState();
+  auto ab_branch = fsm.AddState();
+  auto ab_middle = fsm.AddState();
+  auto joined = fsm.AddState();
+  auto end = fsm.AddState();
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), a_branch);
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), ab_branch);
+  fsm.AddTransition(a_branch, joined, 'a');
+  fsm.AddTransition(ab_branch, ab_middle, 'a');
+  fsm.AddTransition(ab_middle, joined, 'b');
+  fsm.AddTransition(joined, end, 'c');
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+
+  std::unique_ptr<Fsm> dfsm = Determinize(fsm);
+  ASSERT_NE(dfsm, nullptr);
+  WriteDotFile(*dfsm, "determinized_fsm1.dot");
+
+  // Start, success, failure, after 'a', after 'ab', and after 'c'.
+  EXPECT_EQ(dfsm->StateCount(), 6);
+  for (Fsm::StateId state = 0; state < dfsm->StateCount(); ++state) {
+    std::set<char> letters;
+    for (auto transition : dfsm->GetTransitions(state)) {
+      EXPECT_FALSE(transition.second.empty_edge);
+      if (!transition.second.remainder) {
+        EXPECT_TRUE(letters.insert(transition.second.edge_label).second);
+      }
+    }
+  }
+}
+
+TEST(FsmTest, DeterminizeRespectsBudget) {
+  // An NFSM for "(a|b)*a(a|b)(a|b)(a|b)", which needs 2^4 deterministic states
+  // to remember the last four letters.
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto state = fsm.GetStartState();
+  fsm.AddTransition(state, state, 'a');
+  fsm.AddTransition(state, state, 'b');
+  auto next = fsm.AddState();
+  fsm.AddTransition(state, next, 'a');
+  for (size_t i = 0; i < 3; ++i) {
+    state = next;
+    next = fsm.AddState();
+    fsm.AddTransition(state, next, 'a');
+    fsm.AddTransition(state, next, 'b');
+  }
+  fsm.AddEndOfInputTransition(next, fsm.GetSuccessState());
+
+  std::unique_ptr<Fsm> dfsm = Determinize(fsm);
+  ASSERT_NE(dfsm, nullptr);
+  EXPECT_EQ(dfsm->StateCount(), 16 + 2);
+  EXPECT_EQ(Determinize(fsm, 16), nullptr);
+}
+
+TEST(FsmTest, ComputeByteClasses) {
+  // "[a-y]z|[^a-z]" splits the letters into "[a-y]", "z", and the rest.
+  std::vector<char> alphabet;
+  for (int letter = 0; letter < 256; ++letter) {
+    alphabet.push_back(static_cast<char>(letter));
+  }
+  Fsm fsm(alphabet);
+  auto after_range = fsm.AddState();
+  auto end = fsm.AddState();
+  LetterSet others;
+  others.set();
+  for (char letter = 'a'; letter <= 'z'; ++letter) {
+    others.reset(letter);
+  }
+  fsm.AddRangeTransition(fsm.GetStartState(), after_range, 'a', 'y');
+  fsm.AddSetTransition(fsm.GetStartState(), end, others);
+  fsm.AddTransition(after_range, end, 'z');
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+
+  ByteClasses classes = ComputeByteClasses(fsm);
+  ASSERT_EQ(classes.count(), 3);
+  EXPECT_EQ(classes.representatives, (std::vector<uint8_t> {'\0', 'a', 'z'}));
+  EXPECT_EQ(classes.class_of['a'], classes.class_of['y']);
+  EXPECT_NE(classes.class_of['y'], classes.class_of['z']);
+  EXPECT_EQ(classes.class_of['\0'], classes.class_of[0xff]);
+  EXPECT_EQ(classes.class_of['\0'], classes.class_of['{']);
+
+  // Letters outside of the alphabet are told apart from those in it, even
+  // by a remainder transition.
+  Fsm narrow({'a', 'b'});
+  narrow.AddTransitionForRemaining(narrow.GetStartState(), narrow.GetSuccessState());
+  classes = ComputeByteClasses(narrow);
+  ASSERT_EQ(classes.count(), 2);
+  EXPECT_EQ(classes.class_of['a'], classes.class_of['b']);
+  EXPECT_NE(classes.class_of['a'], classes.class_of['c']);
+  EXPECT_EQ(classes.class_of['c'], classes.class_of['\0']);
+}
+
+TEST(FsmTest, Minimize) {
+  // A DFSM for "ab|cb" with a separate state after each of 'a' and 'c', and
+  // a state that can never reach success.
+  std::vector<char> alphabet {'a', 'b', 'c'};
+  Fsm fsm(alphabet);
+  auto after_a = fsm.AddState();
+  auto after_c = fsm.AddState();
+  auto after_b = fsm.AddState();
+  auto dead = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), after_a, 'a');
+  fsm.AddTransition(fsm.GetStartState(), after_c, 'c');
+  fsm.AddTransition(fsm.GetStartState(), dead, 'b');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddTransition(after_a, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_a, fsm.GetFailureState());
+  fsm.AddTransition(after_c, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_c, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(after_b, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(after_b, fsm.GetFailureState());
+  fsm.AddTransition(dead, dead, 'a');
+  fsm.AddTransitionForRemaining(dead, fsm.GetFailureState());
+
+  std::unique_ptr<Fsm> minimized = Minimize(fsm);
+  ASSERT_NE(minimized, nullptr);
+  WriteDotFile(*minimized, "minimized_fsm1.dot");
+
+  // Start, success, failure, after 'a' or 'c', and after 'b'.
+  EXPECT_EQ(minimized->StateCount(), 5);
+  auto start_transitions = minimized->GetTransitions(minimized->GetStartState());
+  std::vector<Fsm::Transition> transitions(start_transitions.begin(), start_transitions.end());
+  ASSERT_EQ(transitions.size(), 3);
+  EXPECT_EQ(transitions[0].second.edge_label, 'a');
+  EXPECT_EQ(transitions[1].second.edge_label, 'c');
+  EXPECT_EQ(transitions[0].first, transitions[1].first);
+  EXPECT_TRUE(transitions[2].second.remainder);
+  EXPECT_EQ(transitions[2].first, minimized->GetFailureState());
+
+  EXPECT_EQ(Minimize(fsm, 4), nullptr);
+}
+
+TEST(FsmTest, GroupsLettersIntoRangesAndSets) {
+  std::vector<char> alphabet {'a', 'b', 'c', 'e', 'g', 'x', 'y', 'z'};
+  Fsm fsm(alphabet);
+  auto vowelish = fsm.AddState();
+  auto end = fsm.AddState();
+  for (char letter : {'a', 'c', 'e', 'g'}) {
+    fsm.AddTransition(fsm.GetStartState(), vowelish, letter);
+  }
+  fsm.AddRangeTransition(fsm.GetStartState(), end, 'x', 'z');
+  fsm.AddTransition(vowelish, end, 'b');
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+
+  std::unique_ptr<Fsm> dfsm = Determinize(fsm);
+  ASSERT_NE(dfsm, nullptr);
+  WriteDotFile(*dfsm, "grouped_fsm1.dot");
+  auto start_transitions = dfsm->GetTransitions(dfsm->GetStartState());
+  std::vector<Fsm::Transition> transitions(start_transitions.begin(), start_transitions.end());
+  ASSERT_EQ(transitions.size(), 3);
+  ASSERT_TRUE(transitions[0].second.IsSet());
+  EXPECT_EQ(dfsm->GetSet(transitions[0].second.set).count(), 4);
+  EXPECT_FALSE(transitions[1].second.IsSet());
+  EXPECT_EQ(transitions[1].second.edge_label, 'x');
+  EXPECT_EQ(transitions[1].second.last_letter, 'z');
+  EXPECT_TRUE(transitions[2].second.remainder);
+  EXPECT_EQ(transitions[2].first, dfsm->GetFailureState());
+
+  Fsm binarized = ToBinarizedNfsm(*dfsm);
+  assembly::AssemblySubroutine subroutine = ToSubroutine(binarized);
+  WriteFile(subroutine.debug_string(), "grouped_fsm1.S");
+  EXPECT_GT(subroutine.size(), 0);
+}
+
+TEST(FsmTest, ToLoadCompareAssembly) {
+  // A DFSM for "c(a|b)*c".
+  std::vector<char> alphabet {'a', 'b', 'c'};
+  Fsm fsm(alphabet);
+  auto loop = fsm.AddState();
+  auto end = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), loop, 'c');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddRangeTransition(loop, loop, 'a', 'b');
+  fsm.AddTransition(loop, end, 'c');
+  fsm.AddTransitionForRemaining(loop, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(end, fsm.GetFailureState());
+
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm);
+  WriteFile(subroutine.debug_string(), "load_compare_fsm1.S");
+  EXPECT_GT(subroutine.size(), 0);
+}
+
+TEST(FsmTest, ToLoadCompareAssemblyWithLiteralRun) {
+  // A DFSM for "a*0123456789abcdefg", whose run ends in success.
+  const std::string literal = "0123456789abcdefg";
+  std::vector<char> alphabet(literal.begin(), literal.end());
+  Fsm fsm(alphabet);
+  auto state = fsm.GetStartState();
+  fsm.AddTransition(state, state, 'a');
+  for (char letter : literal) {
+    auto next = fsm.AddState();
+    fsm.AddTransition(state, next, letter);
+    fsm.AddTransitionForRemaining(state, fsm.GetFailureState());
+    state = next;
+  }
+  fsm.AddEndOfInputTransition(state, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(state, fsm.GetFailureState());
+
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm2.S");
+  // The start state loops, so the run starts at the state after it: 16
+  // letters, compared as one SSE piece after a single length check.
+  EXPECT_NE(listing.find("\"123456789abcdefg\""), std::string::npos);
+  EXPECT_NE(listing.find("cmp $0x10, %rcx"), std::string::npos);
+  EXPECT_NE(listing.find("pcmpeqb"), std::string::npos);
+  EXPECT_NE(listing.find("add $0x10, %rdi"), std::string::npos);
+}
+
+TEST(FsmTest, ToLoadCompareAssemblyWithJumpTable) {
+  // A DFSM for "(a|b|...|r)z", whose start state has enough labels to
+  // dispatch through a jump table.
+  std::vector<char> alphabet {'z'};
+  for (char letter = 'a'; letter <= 'r'; ++letter) {
+    alphabet.push_back(letter);
+  }
+  Fsm fsm(alphabet);
+  auto middle = fsm.AddState();
+  auto end = fsm.AddState();
+  for (char letter = 'a'; letter <= 'r'; ++letter) {
+    fsm.AddTransition(fsm.GetStartState(), middle, letter);
+  }
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddTransition(middle, end, 'z');
+  fsm.AddTransitionForRemaining(middle, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(end, fsm.GetFailureState());
+
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm3.S");
+  EXPECT_NE(listing.find("jmp *%rdx"), std::string::npos);
+  EXPECT_NE(listing.find("// jump table"), std::string::npos);
+}
+
+TEST(FsmTest, ToLoadCompareAssemblyWithSkipLoop) {
+  // A DFSM for "[a-r]*z", whose start state skips its loop rather than
+  // testing for each of its letters.
+  std::vector<char> alphabet {'z'};
+  for (char letter = 'a'; letter <= 'r'; ++letter) {
+    alphabet.push_back(letter);
+  }
+  Fsm fsm(alphabet);
+  auto end = fsm.AddState();
+  for (char letter = 'a'; letter <= 'r'; ++letter) {
+    fsm.AddTransition(fsm.GetStartState(), fsm.GetStartState(), letter);
+  }
+  fsm.AddTransition(fsm.GetStartState(), end, 'z');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(end, fsm.GetFailureState());
+
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm4.S");
+  EXPECT_NE(listing.find("// skip [a-r]"), std::string::npos);
+  EXPECT_NE(listing.find("pmovmskb"), std::string::npos);
+  EXPECT_EQ(listing.find("jmp *%rdx"), std::string::npos);
+}
+
+TEST(FsmTest, ToShuffleAssembly) {
+  // A DFSM for "[a-r]*z", stepped through its table without a branch per
+  // letter.
+  Fsm fsm({'a', 'r', 'z'});
+  auto end = fsm.AddState();
+  fsm.AddRangeTransition(fsm.GetStartState(), fsm.GetStartState(), 'a', 'r');
+  fsm.AddTransition(fsm.GetStartState(), end, 'z');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(end, fsm.GetFailureState());
+  ASSERT_TRUE(CanShuffle(fsm));
+
+  assembly::AssemblySubroutine subroutine = ToShuffleSubroutine(fsm);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "shuffle_fsm.S");
+  EXPECT_NE(listing.find("// shuffle DFSM"), std::string::npos);
+  EXPECT_NE(listing.find("pshufb %xmm0, %xmm1"), std::string::npos);
+  // Four states fit in one half of each row.
+  EXPECT_EQ(listing.find("por"), std::string::npos);
+  // Only "end" accepts, and its byte rotates to bit 6.
+  EXPECT_NE(listing.find("mov $0x40, %edx"), std::string::npos);
+}
+
+TEST(FsmTest, StopAtEarliestMatch) {
+  // A DFSM for "ab+": the state after "ab" accepts, but also loops.
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto after_a = fsm.AddState();
+  auto after_b = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), after_a, 'a');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddTransition(after_a, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_a, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(after_b, fsm.GetSuccessState());
+  fsm.AddTransition(after_b, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_b, fsm.GetFailureState());
+
+  Fsm stopping = StopAtEarliestMatch(fsm);
+  EXPECT_EQ(stopping.StateCount(), fsm.StateCount());
+  EXPECT_EQ(stopping.GetTransitions(after_a).size(), 2);
+  std::vector<Fsm::Transition> transitions(stopping.GetTransitions(after_b).begin(),
+                                           stopping.GetTransitions(after_b).end());
+  ASSERT_EQ(transitions.size(), 2);
+  EXPECT_TRUE(transitions[0].second.end_of_input);
+  EXPECT_TRUE(transitions[1].second.empty_edge);
+  EXPECT_EQ(transitions[1].first, stopping.GetSuccessState());
+
+  LoweringOptions lowering;
+  lowering.return_end = true;
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(stopping, lowering);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm5.S");
+  EXPECT_NE(listing.find("// match end"), std::string::npos);
+  EXPECT_EQ(listing.find("// success"), std::string::npos);
+}
+
+TEST(FsmTest, FindRequiredFactor) {
+  // An NFSM for ".*ab[0-9]", as Thompson's construction would build it.
+  std::vector<char> alphabet {'a', 'b', '0'};
+  Fsm fsm(alphabet);
+  auto loop = fsm.AddState();
+  auto after_a = fsm.AddState();
+  auto before_b = fsm.AddState();
+  auto after_b = fsm.AddState();
+  auto after_digit = fsm.AddState();
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), loop);
+  fsm.AddRangeTransition(loop, loop, '\x00', '\xff');
+  fsm.AddTransition(loop, after_a, 'a');
+  fsm.AddNonDeterministicTransition(after_a, before_b);
+  fsm.AddTransition(before_b, after_b, 'b');
+  fsm.AddRangeTransition(after_b, after_digit, '0', '9');
+  fsm.AddEndOfInputTransition(after_digit, fsm.GetSuccessState());
+
+  RequiredFactor factor = FindRequiredFactor(fsm);
+  EXPECT_EQ(factor.literal, "ab");
+  EXPECT_FALSE(factor.prefix);
+
+  // With a way around the "b", only the "a" is left.
+  fsm.AddTransition(after_a, after_b, 'c');
+  factor = FindRequiredFactor(fsm);
+  EXPECT_EQ(factor.literal, "a");
+  EXPECT_FALSE(factor.prefix);
+
+  // Nothing can follow the "a" any more, so nothing is required.
+  Fsm unmatchable(alphabet);
+  unmatchable.AddTransition(unmatchable.GetStartState(), unmatchable.AddState(), 'a');
+  EXPECT_TRUE(FindRequiredFactor(unmatchable).empty());
+}
+
+TEST(FsmTest, FindsRequiredLetterSets) {
+  // An NFSM for "[ab](c|d)". Every match starts with an "a" or a "b".
+  std::vector<char> alphabet {'a', 'b', 'c', 'd'};
+  Fsm fsm(alphabet);
+  auto after_ab = fsm.AddState();
+  auto after_cd = fsm.AddState();
+  fsm.AddRangeTransition(fsm.GetStartState(), after_ab, 'a', 'b');
+  fsm.AddTransition(after_ab, after_cd, 'c');
+  fsm.AddTransition(after_ab, after_cd, 'd');
+  fsm.AddEndOfInputTransition(after_cd, fsm.GetSuccessState());
+
+  RequiredFactor factor = FindRequiredFactor(fsm);
+  EXPECT_TRUE(factor.literal.empty());
+  EXPECT_EQ(factor.letters.count(), 2);
+  EXPECT_TRUE(factor.letters.test('a'));
+  EXPECT_TRUE(factor.letters.test('b'));
+  EXPECT_TRUE(factor.prefix);
+
+  // Only small sets are worth looking for.
+  EXPECT_TRUE(FindRequiredFactor(fsm, 1).empty());
+}
+
+TEST(FsmTest, ToLoadCompareAssemblyWithPrefilter) {
+  // A DFSM for ".*ab".
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto after_a = fsm.AddState();
+  auto after_ab = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), after_a, 'a');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetStartState());
+  fsm.AddTransition(after_a, after_a, 'a');
+  fsm.AddTransition(after_a, after_ab, 'b');
+  fsm.AddTransitionForRemaining(after_a, fsm.GetStartState());
+  fsm.AddEndOfInputTransition(after_ab, fsm.GetSuccessState());
+  fsm.AddTransition(after_ab, after_a, 'a');
+  fsm.AddTransitionForRemaining(after_ab, fsm.GetStartState());
+
+  LoweringOptions lowering;
+  lowering.prefilter.literal = "ab";
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm, lowering);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm6.S");
+  EXPECT_NE(listing.find("// prefilter [a] then b 1 later"), std::string::npos);
+  EXPECT_NE(listing.find("pcmpeqb"), std::string::npos);
+}
+
+TEST(FsmTest, ToLoadCompareAssemblyWithRecords) {
+  // A DFSM for "ab", matched against each record in turn.
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto after_a = fsm.AddState();
+  auto after_ab = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), after_a, 'a');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddTransition(after_a, after_ab, 'b');
+  fsm.AddTransitionForRemaining(after_a, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(after_ab, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(after_ab, fsm.GetFailureState());
+
+  LoweringOptions lowering;
+  lowering.records = true;
+  lowering.prefilter.literal = "ab";
+  assembly::AssemblySubroutine subroutine = ToLoadCompareSubroutine(fsm, lowering);
+  const std::string listing = subroutine.debug_string();
+  WriteFile(listing, "load_compare_fsm7.S");
+  EXPECT_NE(listing.find("// record setup"), std::string::npos);
+  EXPECT_NE(listing.find("// next record"), std::string::npos);
+  EXPECT_NE(listing.find("// record matched"), std::string::npos);
+  EXPECT_EQ(listing.find("// prefilter"), std::string::npos);
+}
+
+TEST(FsmTest, CopyIsIndependent) {
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto state = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), state, 'a');
+
+  Fsm copy(fsm);
+  copy.AddTransition(fsm.GetStartState(), state, 'b');
+  copy.AddEndOfInputTransition(state, copy.GetSuccessState());
+
+  EXPECT_EQ(fsm.GetTransitions(fsm.GetStartState()).size(), 1);
+  EXPECT_EQ(fsm.GetTransitions(state).size(), 0);
+  EXPECT_EQ(copy.GetTransitions(copy.GetStartState()).size(), 2);
+  EXPECT_EQ(copy.GetTransitions(state).size(), 1);
+}
+
+TEST(FsmTest, PreservesTransitionOrder) {
+  std::vector<char> alphabet {'a', 'b', 'c'};
+  Fsm fsm(alphabet);
+  auto state = fsm.AddState();
+  fsm.AddTransition(state, state, 'c');
+  fsm.AddTransition(fsm.GetStartState(), state, 'a');
+  // Reading compacts the graph. Later transitions must still come after the
+  // earlier ones.
+  EXPECT_EQ(fsm.GetTransitions(state).size(), 1);
+  fsm.AddTransition(state, state, 'b');
+  fsm.AddTransitionForRemaining(state, fsm.GetFailureState());
+
+  std::string letters;
+  for (const auto& transition : fsm.GetTransitions(state)) {
+    letters += transition.second.remainder ? '*' : transition.second.edge_label;
+  }
+  EXPECT_EQ(letters, "cb*");
+}
+
+TEST(FsmTest, ScalesToLargeGraphs) {
+  // A chain of states matching "(ab){n}".
+  constexpr size_t kLength = 40000;
+  std::vector<char> alphabet {'a', 'b'};
+  Fsm fsm(alphabet);
+  auto state = fsm.GetStartState();
+  for (size_t i = 0; i < kLength; ++i) {
+    auto next = fsm.AddState();
+    fsm.AddTransition(state, next, i % 2 == 0 ? 'a' : 'b');
+    state = next;
+  }
+  fsm.AddEndOfInputTransition(state, fsm.GetSuccessState());
+
+  std::unique_ptr<Fsm> dfsm = Determinize(fsm, 2 * kLength);
+  ASSERT_NE(dfsm, nullptr);
+  EXPECT_EQ(dfsm->StateCount(), kLength + 3);
+  std::unique_ptr<Fsm> minimized = Minimize(*dfsm, 2 * kLength);
+  ASSERT_NE(minimized, nullptr);
+  EXPECT_EQ(minimized->StateCount(), kLength + 3);
+  // Each state tests for the end of the input in a state of its own, before
+  // testing its letter or failing.
+  Fsm binarized = ToBinarizedNfsm(*minimized);
+  EXPECT_EQ(binarized.StateCount(), 2 * kLength + 4);
 }
 
 } // end namespace
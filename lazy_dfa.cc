@@ -0,0 +1,333 @@
+#include "lazy_dfa.h"
+
+#include <algorithm>
+#include <bitset>
+
+namespace gnossen {
+namespace fsm {
+
+namespace {
+
+// A rough figure for the bookkeeping the hash map keeps per state, counted
+// against the cache's budget along with the states themselves.
+constexpr size_t kMapEntryBytes = 64;
+
+std::string_view MembersKey(const std::vector<Fsm::StateId>& members) {
+  return std::string_view(reinterpret_cast<const char*>(members.data()),
+                          members.size() * sizeof(Fsm::StateId));
+}
+
+} // end namespace
+
+LazyDfa::LazyDfa(const Fsm& fsm, size_t cache_bytes) :
+  cache_bytes_(cache_bytes),
+  state_count_(fsm.StateCount()),
+  classes_(ComputeByteClasses(fsm))
+{
+  const size_t class_count = classes_.count();
+  std::vector<bool> in_alphabet(class_count, false);
+  for (char letter : fsm.GetAlphabet()) {
+    in_alphabet[classes_.class_of[static_cast<uint8_t>(letter)]] = true;
+  }
+
+  // As in Determinize(), a remainder transition covers whatever letters
+  // the state has no explicit transition for, and letters outside the
+  // alphabet lead nowhere.
+  letter_offsets_.reserve(state_count_ * class_count + 1);
+  empty_offsets_.reserve(state_count_ + 1);
+  for (Fsm::StateId id = 0; id < state_count_; ++id) {
+    std::bitset<256> explicit_letters;
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      if (transition.second.IsLetters()) {
+        fsm.ForEachLetter(transition.second, [&](uint8_t letter) {
+          explicit_letters.set(letter);
+        });
+      }
+    }
+    for (size_t c = 0; c < class_count; ++c) {
+      letter_offsets_.push_back(letter_targets_.size());
+      if (!in_alphabet[c]) {
+        continue;
+      }
+      const uint8_t letter = classes_.representatives[c];
+      for (const auto& transition : fsm.GetTransitions(id)) {
+        const EdgeLabel& label = transition.second;
+        if (label.remainder ? !explicit_letters.test(letter) :
+            label.IsLetters() && fsm.LabelMatches(label, letter)) {
+          letter_targets_.push_back(transition.first);
+        }
+      }
+    }
+    empty_offsets_.push_back(empty_targets_.size());
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      if (transition.second.empty_edge) {
+        empty_targets_.push_back(transition.first);
+      }
+    }
+  }
+  letter_offsets_.push_back(letter_targets_.size());
+  empty_offsets_.push_back(empty_targets_.size());
+
+  // The input may end in a state if its end-of-input transitions lead to
+  // success, possibly by way of nondeterministic ones, so find the states
+  // that reach success that way by walking those backwards.
+  std::vector<std::vector<Fsm::StateId>> empty_sources(state_count_);
+  for (Fsm::StateId id = 0; id < state_count_; ++id) {
+    for (uint32_t i = empty_offsets_[id]; i < empty_offsets_[id + 1]; ++i) {
+      empty_sources[empty_targets_[i]].push_back(id);
+    }
+  }
+  std::vector<bool> reaches_success(state_count_, false);
+  std::vector<Fsm::StateId> to_visit = {Fsm::GetSuccessState()};
+  reaches_success[Fsm::GetSuccessState()] = true;
+  while (!to_visit.empty()) {
+    const Fsm::StateId id = to_visit.back();
+    to_visit.pop_back();
+    for (Fsm::StateId source : empty_sources[id]) {
+      if (!reaches_success[source]) {
+        reaches_success[source] = true;
+        to_visit.push_back(source);
+      }
+    }
+  }
+  accepts_.assign(state_count_, false);
+  for (Fsm::StateId id = 0; id < state_count_; ++id) {
+    for (const auto& transition : fsm.GetTransitions(id)) {
+      if (transition.second.end_of_input && reaches_success[transition.first]) {
+        accepts_[id] = true;
+      }
+    }
+  }
+}
+
+LazyDfa::Cache::Cache(const LazyDfa& dfa) :
+  dfa_(dfa),
+  start_(nullptr),
+  failure_(nullptr),
+  success_(nullptr),
+  visited_(dfa.state_count_, 0),
+  generation_(0)
+{
+  Flush();
+  stats_.flushes = 0;
+}
+
+void LazyDfa::Cache::Flush() {
+  arena_.Reset();
+  states_.clear();
+  start_ = nullptr;
+  failure_ = NewState({}, false);
+  success_ = NewState({Fsm::GetSuccessState()}, true);
+  std::fill(failure_->next, failure_->next + dfa_.classes_.count(), failure_);
+  std::fill(success_->next, success_->next + dfa_.classes_.count(), success_);
+  ++stats_.flushes;
+  stats_.cache_bytes = arena_.BytesAllocated();
+}
+
+LazyDfa::Cache::State* LazyDfa::Cache::NewState(const std::vector<Fsm::StateId>& members,
+                                                bool accepts) {
+  const size_t class_count = dfa_.classes_.count();
+  const size_t size = members.size() * sizeof(Fsm::StateId);
+  char* data = static_cast<char*>(arena_.Allocate(size, alignof(Fsm::StateId)));
+  std::copy(reinterpret_cast<const char*>(members.data()),
+            reinterpret_cast<const char*>(members.data()) + size, data);
+  State** next = static_cast<State**>(arena_.Allocate(class_count * sizeof(State*), alignof(State*)));
+  std::fill(next, next + class_count, nullptr);
+  return arena_.New<State>(State{std::string_view(data, size), accepts, next});
+}
+
+void LazyDfa::Cache::Close() {
+  if (++generation_ == 0) {
+    std::fill(visited_.begin(), visited_.end(), 0);
+    generation_ = 1;
+  }
+  to_visit_.clear();
+  size_t kept = 0;
+  for (Fsm::StateId id : members_) {
+    if (visited_[id] != generation_) {
+      visited_[id] = generation_;
+      members_[kept++] = id;
+      to_visit_.push_back(id);
+    }
+  }
+  members_.resize(kept);
+  while (!to_visit_.empty()) {
+    const Fsm::StateId id = to_visit_.back();
+    to_visit_.pop_back();
+    for (uint32_t i = dfa_.empty_offsets_[id]; i < dfa_.empty_offsets_[id + 1]; ++i) {
+      const Fsm::StateId target = dfa_.empty_targets_[i];
+      if (visited_[target] != generation_) {
+        visited_[target] = generation_;
+        members_.push_back(target);
+        to_visit_.push_back(target);
+      }
+    }
+  }
+  // Reaching the failure state is the same as reaching no state at all.
+  members_.erase(std::remove(members_.begin(), members_.end(), Fsm::GetFailureState()),
+                 members_.end());
+  std::sort(members_.begin(), members_.end());
+}
+
+LazyDfa::Cache::State* LazyDfa::Cache::Intern(const std::vector<Fsm::StateId>& members) {
+  if (members.empty()) {
+    return failure_;
+  } else if (std::binary_search(members.begin(), members.end(), Fsm::GetSuccessState())) {
+    return success_;
+  }
+  auto found = states_.find(MembersKey(members));
+  if (found != states_.end()) {
+    return found->second;
+  }
+  const size_t size = members.size() * sizeof(Fsm::StateId) + sizeof(State) +
+                      dfa_.classes_.count() * sizeof(State*) + kMapEntryBytes;
+  if (stats_.cache_bytes + size > dfa_.cache_bytes_ && !states_.empty()) {
+    Flush();
+  }
+  bool accepts = false;
+  for (Fsm::StateId id : members) {
+    accepts = accepts || dfa_.accepts_[id];
+  }
+  State* state = NewState(members, accepts);
+  states_.emplace(state->members, state);
+  stats_.cache_bytes = arena_.BytesAllocated() + states_.size() * kMapEntryBytes;
+  return state;
+}
+
+LazyDfa::Cache::State* LazyDfa::Cache::Start() {
+  if (start_ == nullptr) {
+    members_.assign(1, Fsm::GetStartState());
+    Close();
+    start_ = Intern(members_);
+  }
+  return start_;
+}
+
+LazyDfa::Cache::State* LazyDfa::Cache::Next(State* state, size_t letter_class) {
+  ++stats_.misses;
+  const size_t class_count = dfa_.classes_.count();
+  const Fsm::StateId* ids = reinterpret_cast<const Fsm::StateId*>(state->members.data());
+  const size_t count = state->members.size() / sizeof(Fsm::StateId);
+  members_.clear();
+  for (size_t i = 0; i < count; ++i) {
+    const size_t row = ids[i] * class_count + letter_class;
+    for (uint32_t j = dfa_.letter_offsets_[row]; j < dfa_.letter_offsets_[row + 1]; ++j) {
+      members_.push_back(dfa_.letter_targets_[j]);
+    }
+  }
+  Close();
+  const size_t flushes = stats_.flushes;
+  State* next = Intern(members_);
+  if (stats_.flushes == flushes) {
+    state->next[letter_class] = next;
+  }
+  return next;
+}
+
+uint8_t LazyDfa::Match(const uint8_t* begin, const uint8_t* end, Cache* cache) const {
+  const size_t misses = cache->stats_.misses;
+  const uint8_t* const first = begin;
+  Cache::State* state = cache->Start();
+  while (begin != end && state != cache->failure_) {
+    const uint8_t letter_class = classes_.class_of[*begin++];
+    Cache::State* next = state->next[letter_class];
+    state = next != nullptr ? next : cache->Next(state, letter_class);
+  }
+  cache->stats_.hits += (begin - first) - (cache->stats_.misses - misses);
+  return state->accepts;
+}
+
+const uint8_t* LazyDfa::Find(const uint8_t* begin, const uint8_t* end, Cache* cache) const {
+  const size_t misses = cache->stats_.misses;
+  const uint8_t* const first = begin;
+  Cache::State* state = cache->Start();
+  while (!state->accepts && begin != end && state != cache->failure_) {
+    const uint8_t letter_class = classes_.class_of[*begin++];
+    Cache::State* next = state->next[letter_class];
+    state = next != nullptr ? next : cache->Next(state, letter_class);
+  }
+  cache->stats_.hits += (begin - first) - (cache->stats_.misses - misses);
+  return state->accepts ? begin : nullptr;
+}
+
+const uint8_t* LazyDfa::FindBackwards(const uint8_t* begin, const uint8_t* end,
+                                      Cache* cache) const {
+  const size_t misses = cache->stats_.misses;
+  const uint8_t* const last = end;
+  Cache::State* state = cache->Start();
+  const uint8_t* found = state->accepts ? end : nullptr;
+  while (end != begin && state != cache->failure_) {
+    const uint8_t letter_class = classes_.class_of[*--end];
+    Cache::State* next = state->next[letter_class];
+    state = next != nullptr ? next : cache->Next(state, letter_class);
+    if (state->accepts) {
+      found = end;
+    }
+  }
+  cache->stats_.hits += (last - end) - (cache->stats_.misses - misses);
+  return found;
+}
+
+std::unique_ptr<LazyDfa::Cache> LazyDfa::Borrow() const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pool_.empty()) {
+      std::unique_ptr<Cache> cache = std::move(pool_.back());
+      pool_.pop_back();
+      return cache;
+    }
+  }
+  return std::make_unique<Cache>(*this);
+}
+
+void LazyDfa::Return(std::unique_ptr<Cache> cache) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pool_.push_back(std::move(cache));
+}
+
+uint8_t LazyDfa::Match(const uint8_t* begin, const uint8_t* end) const {
+  std::unique_ptr<Cache> cache = Borrow();
+  const uint8_t result = Match(begin, end, cache.get());
+  Return(std::move(cache));
+  return result;
+}
+
+void LazyDfa::MatchBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                         uint64_t* results) const {
+  std::unique_ptr<Cache> cache = Borrow();
+  std::fill(results, results + (count + 63) / 64, 0);
+  for (size_t i = 0; i < count; ++i) {
+    const uint64_t matched = Match(begins[i], begins[i] + lengths[i], cache.get());
+    results[i / 64] |= matched << (i % 64);
+  }
+  Return(std::move(cache));
+}
+
+const uint8_t* LazyDfa::Find(const uint8_t* begin, const uint8_t* end) const {
+  std::unique_ptr<Cache> cache = Borrow();
+  const uint8_t* result = Find(begin, end, cache.get());
+  Return(std::move(cache));
+  return result;
+}
+
+const uint8_t* LazyDfa::FindBackwards(const uint8_t* begin, const uint8_t* end) const {
+  std::unique_ptr<Cache> cache = Borrow();
+  const uint8_t* result = FindBackwards(begin, end, cache.get());
+  Return(std::move(cache));
+  return result;
+}
+
+LazyDfa::Stats LazyDfa::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats total;
+  for (const auto& cache : pool_) {
+    total.hits += cache->stats_.hits;
+    total.misses += cache->stats_.misses;
+    total.flushes += cache->stats_.flushes;
+    total.cache_bytes += cache->stats_.cache_bytes;
+  }
+  return total;
+}
+
+} // end namespace fsm
+} // end namespace gnossen
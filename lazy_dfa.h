@@ -0,0 +1,160 @@
+#ifndef GNOSSEN_TINYJIT_LAZY_DFA_H_
+#define GNOSSEN_TINYJIT_LAZY_DFA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "fsm.h"
+
+namespace gnossen {
+namespace fsm {
+
+// Determinizes an FSM on the fly, as the input is read, building only the
+// states that the inputs actually reach. Suits patterns like
+// "(a|b)*a(a|b){20}" whose deterministic FSM has exponentially many states,
+// nearly all of which a given input never visits.
+//
+// The states built so far are kept in a cache. Once the cache outgrows its
+// budget, it's flushed and rebuilt from whatever state the match is in, so
+// memory stays bounded however many states the inputs visit.
+//
+// Matching needs a cache of its own per thread. The overloads without one
+// borrow one from a pool held by the LazyDfa, and are safe to call from
+// multiple threads.
+class LazyDfa {
+public:
+  static constexpr size_t kDefaultCacheBytes = 1024 * 1024;
+
+  struct Stats {
+    // Transitions followed that had already been built, and that had to be
+    // built.
+    size_t hits = 0;
+    size_t misses = 0;
+
+    // The number of times the cache was emptied for being over budget.
+    size_t flushes = 0;
+
+    // Bytes used by the states currently cached.
+    size_t cache_bytes = 0;
+  };
+
+  // The states built so far, and the scratch space used to build more.
+  class Cache {
+  public:
+    explicit Cache(const LazyDfa& dfa);
+
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    const Stats& stats() const { return stats_; }
+
+  private:
+    friend class LazyDfa;
+
+    // A set of states of the original FSM, closed under nondeterministic
+    // transitions.
+    struct State {
+      std::string_view members;
+      bool accepts;
+      // Indexed by class. Null until built.
+      State** next;
+    };
+
+    // Returns the state for `members`, which must be sorted and without
+    // duplicates, building it if need be. May flush the cache first.
+    State* Intern(const std::vector<Fsm::StateId>& members);
+
+    // Builds the transition out of `state` on a class. If that flushes the
+    // cache, `state` is gone by the time this returns.
+    State* Next(State* state, size_t letter_class);
+
+    State* Start();
+
+    // Adds everything reachable from members_ by nondeterministic
+    // transitions, drops the failure state, and sorts it.
+    void Close();
+
+    State* NewState(const std::vector<Fsm::StateId>& members, bool accepts);
+
+    void Flush();
+
+    const LazyDfa& dfa_;
+    arena::Arena arena_;
+    std::unordered_map<std::string_view, State*> states_;
+    State* start_;
+    // Reading anything from these leads back to them.
+    State* failure_;
+    State* success_;
+    Stats stats_;
+
+    // Scratch space for closures.
+    std::vector<Fsm::StateId> members_;
+    std::vector<Fsm::StateId> to_visit_;
+    std::vector<uint32_t> visited_;
+    uint32_t generation_;
+  };
+
+  explicit LazyDfa(const Fsm& fsm, size_t cache_bytes = kDefaultCacheBytes);
+
+  LazyDfa(const LazyDfa&) = delete;
+  LazyDfa& operator=(const LazyDfa&) = delete;
+
+  // As TableDfa::Match().
+  uint8_t Match(const uint8_t* begin, const uint8_t* end) const;
+  uint8_t Match(const uint8_t* begin, const uint8_t* end, Cache* cache) const;
+
+  // As TableDfa::MatchBatch(), borrowing a cache once for the whole batch.
+  void MatchBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                  uint64_t* results) const;
+
+  // As TableDfa::Find().
+  const uint8_t* Find(const uint8_t* begin, const uint8_t* end) const;
+  const uint8_t* Find(const uint8_t* begin, const uint8_t* end, Cache* cache) const;
+
+  // Reads the input backwards from `end`, and returns the position furthest
+  // back such that the letters read so far, in the order they were read,
+  // match. Returns nullptr if there's none. Run on the reversed FSM for a
+  // pattern, that's where the longest match ending at `end` starts.
+  const uint8_t* FindBackwards(const uint8_t* begin, const uint8_t* end) const;
+  const uint8_t* FindBackwards(const uint8_t* begin, const uint8_t* end, Cache* cache) const;
+
+  // The sum of the statistics of the pooled caches.
+  Stats stats() const;
+
+  size_t ClassCount() const { return classes_.count(); }
+
+  // The most memory each cache may hold.
+  size_t CacheBytes() const { return cache_bytes_; }
+
+private:
+  std::unique_ptr<Cache> Borrow() const;
+  void Return(std::unique_ptr<Cache> cache) const;
+
+  const size_t cache_bytes_;
+  const size_t state_count_;
+  ByteClasses classes_;
+
+  // The targets of each state's letter transitions on each class, and of
+  // its nondeterministic transitions, in CSR form.
+  std::vector<uint32_t> letter_offsets_;
+  std::vector<Fsm::StateId> letter_targets_;
+  std::vector<uint32_t> empty_offsets_;
+  std::vector<Fsm::StateId> empty_targets_;
+
+  // Whether the input may end in each state.
+  std::vector<bool> accepts_;
+
+  mutable std::mutex mutex_;
+  mutable std::vector<std::unique_ptr<Cache>> pool_;
+};
+
+} // end namespace fsm
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_LAZY_DFA_H_
@@ -0,0 +1,133 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lazy_dfa.h"
+
+namespace gnossen {
+namespace fsm {
+namespace {
+
+static bool Matches(const LazyDfa& dfa, const std::string& input) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  return dfa.Match(begin, begin + input.size()) != 0;
+}
+
+// An NFSM for "(a|b)*a(a|b){n}", whose DFSM needs 2^(n+1) states: one for
+// each combination of the last n+1 letters.
+static Fsm MakeNfsm(size_t n) {
+  Fsm fsm({'a', 'b'});
+  auto loop = fsm.AddState();
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), loop);
+  fsm.AddRangeTransition(loop, loop, 'a', 'b');
+  auto state = fsm.AddState();
+  fsm.AddTransition(loop, state, 'a');
+  for (size_t i = 0; i < n; ++i) {
+    auto next = fsm.AddState();
+    fsm.AddRangeTransition(state, next, 'a', 'b');
+    state = next;
+  }
+  fsm.AddEndOfInputTransition(state, fsm.GetSuccessState());
+  return fsm;
+}
+
+// What the NFSM from MakeNfsm() accepts.
+static bool Reference(const std::string& input, size_t n) {
+  for (char letter : input) {
+    if (letter != 'a' && letter != 'b') {
+      return false;
+    }
+  }
+  return input.size() > n && input[input.size() - n - 1] == 'a';
+}
+
+static std::string RandomString(size_t length, uint32_t* seed) {
+  std::string str;
+  while (str.size() < length) {
+    *seed = *seed * 1103515245 + 12345;
+    str.push_back((*seed >> 16) % 2 == 0 ? 'a' : 'b');
+  }
+  return str;
+}
+
+TEST(LazyDfaTest, Matches) {
+  LazyDfa dfa(MakeNfsm(2));
+  // "a", "b" and everything else.
+  EXPECT_EQ(dfa.ClassCount(), 3);
+
+  EXPECT_TRUE(Matches(dfa, "abb"));
+  EXPECT_TRUE(Matches(dfa, "bbaab"));
+  EXPECT_TRUE(Matches(dfa, std::string(1000, 'b') + "aaa"));
+  EXPECT_FALSE(Matches(dfa, ""));
+  EXPECT_FALSE(Matches(dfa, "ab"));
+  EXPECT_FALSE(Matches(dfa, "abbb"));
+  EXPECT_FALSE(Matches(dfa, "acb"));
+  EXPECT_FALSE(Matches(dfa, std::string("a\0b", 3)));
+
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 500; ++i) {
+    const std::string str = RandomString(i % 20, &seed);
+    EXPECT_EQ(Matches(dfa, str), Reference(str, 2)) << "on \"" << str << "\"";
+  }
+  const LazyDfa::Stats stats = dfa.stats();
+  EXPECT_GT(stats.hits, stats.misses);
+  EXPECT_EQ(stats.flushes, 0);
+}
+
+TEST(LazyDfaTest, Finds) {
+  LazyDfa dfa(MakeNfsm(1));
+  const std::string input = "bbabbab";
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  const uint8_t* end = begin + input.size();
+  // The shortest prefix ending "a" and another letter is "bbab".
+  EXPECT_EQ(dfa.Find(begin, end), begin + 4);
+  EXPECT_EQ(dfa.Find(begin, begin + 3), nullptr);
+  // Read backwards, the input is "babbabb", which "(a|b)*a(a|b)" matches
+  // after "bab" and "babbab", but not all of it.
+  EXPECT_EQ(dfa.FindBackwards(begin, end), begin + 1);
+  EXPECT_EQ(dfa.FindBackwards(begin, begin + 2), nullptr);
+}
+
+TEST(LazyDfaTest, FlushesWhenFull) {
+  // Far more states than fit in the cache.
+  const size_t n = 12;
+  LazyDfa dfa(MakeNfsm(n), 4096);
+  LazyDfa::Cache cache(dfa);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 50; ++i) {
+    const std::string str = RandomString(1000 + i, &seed);
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(str.data());
+    EXPECT_EQ(dfa.Match(begin, begin + str.size(), &cache) != 0, Reference(str, n));
+  }
+  EXPECT_GT(cache.stats().flushes, 0);
+  EXPECT_LE(cache.stats().cache_bytes, 4096);
+  // The cache wasn't borrowed from the pool.
+  EXPECT_EQ(dfa.stats().hits, 0);
+}
+
+TEST(LazyDfaTest, MatchesFromManyThreads) {
+  const size_t n = 8;
+  LazyDfa dfa(MakeNfsm(n));
+  std::vector<std::thread> threads;
+  std::vector<int> mismatches(4, 0);
+  for (size_t t = 0; t < mismatches.size(); ++t) {
+    threads.emplace_back([&, t]() {
+      uint32_t seed = t + 1;
+      for (size_t i = 0; i < 200; ++i) {
+        const std::string str = RandomString(i, &seed);
+        mismatches[t] += Matches(dfa, str) != Reference(str, n);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(mismatches, std::vector<int>(4, 0));
+  EXPECT_GT(dfa.stats().hits, 0);
+}
+
+} // end namespace
+} // end namespace fsm
+} // end namespace gnossen
@@ -23,13 +23,14 @@ typedef unsigned int (*procedure)(unsigned int);
 static procedure square_procedure = nullptr;
 
 void init_procedures() {
-  square_procedure = reinterpret_cast<procedure>(
-    mmap(nullptr, sizeof(square_procedure_code),
-         PROT_EXEC | PROT_READ | PROT_WRITE,
-         MAP_PRIVATE | MAP_ANONYMOUS,
-         -1, 0));
-  memcpy((void*)square_procedure, (void*)square_procedure_code,
-      sizeof(square_procedure_code));
+  // Never writable and executable at once.
+  void* code = mmap(nullptr, sizeof(square_procedure_code),
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  memcpy(code, (void*)square_procedure_code, sizeof(square_procedure_code));
+  mprotect(code, sizeof(square_procedure_code), PROT_READ | PROT_EXEC);
+  square_procedure = reinterpret_cast<procedure>(code);
 }
 
 
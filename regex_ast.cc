@@ -0,0 +1,515 @@
+#include "regex_ast.h"
+
+#include <cctype>
+#include <sstream>
+#include <utility>
+
+namespace gnossen {
+namespace regex {
+
+constexpr unsigned int Node::kUnbounded;
+
+static std::string TranslateLetter(uint8_t letter) {
+  std::stringstream ss;
+  if (std::isgraph(letter) && letter != '\\' && letter != '(' && letter != ')') {
+    ss << letter;
+  } else {
+    ss << "\\x" << std::hex << (letter < 0x10 ? "0" : "") << (unsigned int)letter;
+  }
+  return ss.str();
+}
+
+std::string Node::ToSExpression() const {
+  std::stringstream ss;
+  switch (type) {
+    case Type::kEmpty:
+      ss << "(empty)";
+      break;
+    case Type::kLetter:
+      ss << "(letter " << TranslateLetter(letter) << ")";
+      break;
+    case Type::kClass:
+      ss << "(class";
+      for (unsigned int lo = 0; lo < 256; ++lo) {
+        if (!letters.test(lo)) {
+          continue;
+        }
+        unsigned int hi = lo;
+        while (hi + 1 < 256 && letters.test(hi + 1)) {
+          ++hi;
+        }
+        ss << " " << TranslateLetter(lo);
+        if (hi != lo) {
+          ss << "-" << TranslateLetter(hi);
+        }
+        lo = hi;
+      }
+      ss << ")";
+      break;
+    case Type::kCat:
+    case Type::kOr:
+      ss << (type == Type::kCat ? "(cat" : "(or");
+      for (const auto& child : children) {
+        ss << " " << child->ToSExpression();
+      }
+      ss << ")";
+      break;
+    case Type::kRep:
+      ss << "(rep ";
+      if (min != 0 || max != kUnbounded) {
+        ss << min << " ";
+        if (max == kUnbounded) {
+          ss << "inf ";
+        } else {
+          ss << max << " ";
+        }
+      }
+      ss << children[0]->ToSExpression() << ")";
+      break;
+  }
+  return ss.str();
+}
+
+namespace {
+
+// A recursive descent parser for the grammar:
+//
+//   alternation := concatenation ('|' concatenation)*
+//   concatenation := repetition*
+//   repetition := atom ('*' | '+' | '?' | '{' bounds '}')*
+//   atom := '(' alternation ')' | '[' class ']' | '.' | '\' escape | letter
+class Parser {
+public:
+  explicit Parser(const std::string& pattern) : pattern_(pattern), position_(0) {}
+
+  std::unique_ptr<Node> Parse(std::string* error) {
+    std::unique_ptr<Node> root = ParseAlternation();
+    if (root != nullptr && position_ != pattern_.size()) {
+      Fail("unmatched ')'");
+    }
+    if (!error_.empty()) {
+      if (error != nullptr) {
+        *error = error_;
+      }
+      return nullptr;
+    }
+    return root;
+  }
+
+private:
+  bool AtEnd() const { return position_ == pattern_.size(); }
+
+  char Peek() const { return pattern_[position_]; }
+
+  std::nullptr_t Fail(const std::string& message) {
+    if (error_.empty()) {
+      std::stringstream ss;
+      ss << message << " at offset " << position_ << " of pattern \"" << pattern_ << "\"";
+      error_ = ss.str();
+    }
+    return nullptr;
+  }
+
+  // Wraps `children` in a node of the given type unless there's just one.
+  static std::unique_ptr<Node> Collapse(Node::Type type,
+                                        std::vector<std::unique_ptr<Node>> children) {
+    if (children.empty()) {
+      return std::make_unique<Node>(Node::Type::kEmpty);
+    } else if (children.size() == 1) {
+      return std::move(children[0]);
+    }
+    auto node = std::make_unique<Node>(type);
+    node->children = std::move(children);
+    return node;
+  }
+
+  std::unique_ptr<Node> ParseAlternation() {
+    std::vector<std::unique_ptr<Node>> alternatives;
+    while (true) {
+      std::unique_ptr<Node> alternative = ParseConcatenation();
+      if (alternative == nullptr) {
+        return nullptr;
+      }
+      alternatives.push_back(std::move(alternative));
+      if (AtEnd() || Peek() != '|') {
+        break;
+      }
+      ++position_;
+    }
+    return Collapse(Node::Type::kOr, std::move(alternatives));
+  }
+
+  std::unique_ptr<Node> ParseConcatenation() {
+    std::vector<std::unique_ptr<Node>> elements;
+    while (!AtEnd() && Peek() != '|' && Peek() != ')') {
+      std::unique_ptr<Node> element = ParseRepetition();
+      if (element == nullptr) {
+        return nullptr;
+      }
+      elements.push_back(std::move(element));
+    }
+    return Collapse(Node::Type::kCat, std::move(elements));
+  }
+
+  std::unique_ptr<Node> ParseRepetition() {
+    std::unique_ptr<Node> atom = ParseAtom();
+    if (atom == nullptr) {
+      return nullptr;
+    }
+    while (!AtEnd()) {
+      unsigned int min;
+      unsigned int max;
+      if (Peek() == '*') {
+        min = 0;
+        max = Node::kUnbounded;
+        ++position_;
+      } else if (Peek() == '+') {
+        min = 1;
+        max = Node::kUnbounded;
+        ++position_;
+      } else if (Peek() == '?') {
+        min = 0;
+        max = 1;
+        ++position_;
+      } else if (Peek() == '{') {
+        if (!ParseBounds(&min, &max)) {
+          return nullptr;
+        }
+      } else {
+        break;
+      }
+      auto rep = std::make_unique<Node>(Node::Type::kRep);
+      rep->min = min;
+      rep->max = max;
+      rep->children.push_back(std::move(atom));
+      atom = std::move(rep);
+    }
+    return atom;
+  }
+
+  bool ParseNumber(unsigned int* number) {
+    if (AtEnd() || !std::isdigit(static_cast<unsigned char>(Peek()))) {
+      Fail("expected a number");
+      return false;
+    }
+    *number = 0;
+    while (!AtEnd() && std::isdigit(static_cast<unsigned char>(Peek()))) {
+      *number = *number * 10 + (Peek() - '0');
+      if (*number > kMaxRepetition) {
+        Fail("repetition count too large");
+        return false;
+      }
+      ++position_;
+    }
+    return true;
+  }
+
+  // Parses "{m}", "{m,}" or "{m,n}".
+  bool ParseBounds(unsigned int* min, unsigned int* max) {
+    ++position_;
+    if (!ParseNumber(min)) {
+      return false;
+    }
+    *max = *min;
+    if (!AtEnd() && Peek() == ',') {
+      ++position_;
+      if (!AtEnd() && Peek() == '}') {
+        *max = Node::kUnbounded;
+      } else if (!ParseNumber(max)) {
+        return false;
+      }
+    }
+    if (AtEnd() || Peek() != '}') {
+      Fail("expected '}'");
+      return false;
+    }
+    ++position_;
+    if (*max < *min) {
+      Fail("repetition bounds out of order");
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<Node> ParseAtom() {
+    const char c = Peek();
+    switch (c) {
+      case '(': {
+        ++position_;
+        std::unique_ptr<Node> group = ParseAlternation();
+        if (group == nullptr) {
+          return nullptr;
+        }
+        if (AtEnd() || Peek() != ')') {
+          return Fail("expected ')'");
+        }
+        ++position_;
+        return group;
+      }
+      case '[':
+        return ParseClass();
+      case '.': {
+        ++position_;
+        auto node = std::make_unique<Node>(Node::Type::kClass);
+        node->letters.set();
+        node->letters.reset('\n');
+        return node;
+      }
+      case '\\': {
+        ++position_;
+        std::bitset<256> letters;
+        if (!ParseEscape(&letters)) {
+          return nullptr;
+        }
+        return FromLetters(letters);
+      }
+      case '*':
+      case '+':
+      case '?':
+      case '{':
+        return Fail("nothing to repeat");
+      case '}':
+      case ']':
+        return Fail(std::string("unescaped '") + c + "'");
+      case '^':
+      case '$':
+        return Fail("anchors are not supported");
+      default: {
+        ++position_;
+        auto node = std::make_unique<Node>(Node::Type::kLetter);
+        node->letter = c;
+        return node;
+      }
+    }
+  }
+
+  // Single-member sets are represented as letters.
+  static std::unique_ptr<Node> FromLetters(const std::bitset<256>& letters) {
+    if (letters.count() == 1) {
+      for (unsigned int letter = 0; letter < 256; ++letter) {
+        if (letters.test(letter)) {
+          auto node = std::make_unique<Node>(Node::Type::kLetter);
+          node->letter = static_cast<char>(letter);
+          return node;
+        }
+      }
+    }
+    auto node = std::make_unique<Node>(Node::Type::kClass);
+    node->letters = letters;
+    return node;
+  }
+
+  static int HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  // Parses the escape sequence following a backslash into the set of letters
+  // it matches.
+  bool ParseEscape(std::bitset<256>* letters) {
+    if (AtEnd()) {
+      Fail("trailing backslash");
+      return false;
+    }
+    const char c = Peek();
+    ++position_;
+    std::bitset<256> result;
+    switch (c) {
+      case 'd':
+      case 'D':
+        for (unsigned int letter = '0'; letter <= '9'; ++letter) {
+          result.set(letter);
+        }
+        break;
+      case 'w':
+      case 'W':
+        for (unsigned int letter = 0; letter < 256; ++letter) {
+          if (letter < 128 && (std::isalnum(letter) || letter == '_')) {
+            result.set(letter);
+          }
+        }
+        break;
+      case 's':
+      case 'S':
+        for (char letter : {' ', '\t', '\n', '\r', '\f', '\v'}) {
+          result.set(static_cast<uint8_t>(letter));
+        }
+        break;
+      case 'n': result.set('\n'); break;
+      case 't': result.set('\t'); break;
+      case 'r': result.set('\r'); break;
+      case 'f': result.set('\f'); break;
+      case 'v': result.set('\v'); break;
+      case 'x': {
+        if (position_ + 2 > pattern_.size() ||
+            HexValue(pattern_[position_]) < 0 ||
+            HexValue(pattern_[position_ + 1]) < 0) {
+          Fail("expected two hex digits");
+          return false;
+        }
+        result.set(HexValue(pattern_[position_]) * 16 + HexValue(pattern_[position_ + 1]));
+        position_ += 2;
+        break;
+      }
+      default:
+        if (std::isalnum(static_cast<unsigned char>(c))) {
+          Fail(std::string("unknown escape '\\") + c + "'");
+          return false;
+        }
+        result.set(static_cast<uint8_t>(c));
+        break;
+    }
+    if (c == 'D' || c == 'W' || c == 'S') {
+      result.flip();
+    }
+    *letters = result;
+    return true;
+  }
+
+  // Parses a single member of a bracketed class, which may be an escape.
+  bool ParseClassMember(std::bitset<256>* letters, bool* single, uint8_t* letter) {
+    if (Peek() == '\\') {
+      ++position_;
+      if (!ParseEscape(letters)) {
+        return false;
+      }
+    } else {
+      letters->reset();
+      letters->set(static_cast<uint8_t>(Peek()));
+      ++position_;
+    }
+    *single = letters->count() == 1;
+    if (*single) {
+      for (unsigned int i = 0; i < 256; ++i) {
+        if (letters->test(i)) {
+          *letter = i;
+        }
+      }
+    }
+    return true;
+  }
+
+  std::unique_ptr<Node> ParseClass() {
+    ++position_;
+    bool negated = false;
+    if (!AtEnd() && Peek() == '^') {
+      negated = true;
+      ++position_;
+    }
+    std::bitset<256> letters;
+    bool first = true;
+    while (!AtEnd() && (Peek() != ']' || first)) {
+      first = false;
+      std::bitset<256> member;
+      bool single = false;
+      uint8_t lo = 0;
+      if (!ParseClassMember(&member, &single, &lo)) {
+        return nullptr;
+      }
+      if (single && position_ + 1 < pattern_.size() &&
+          Peek() == '-' && pattern_[position_ + 1] != ']') {
+        ++position_;
+        uint8_t hi = 0;
+        if (!ParseClassMember(&member, &single, &hi)) {
+          return nullptr;
+        }
+        if (!single || hi < lo) {
+          return Fail("invalid class range");
+        }
+        for (unsigned int letter = lo; letter <= hi; ++letter) {
+          letters.set(letter);
+        }
+      } else {
+        letters |= member;
+      }
+    }
+    if (AtEnd()) {
+      return Fail("expected ']'");
+    }
+    ++position_;
+    if (negated) {
+      letters.flip();
+    }
+    if (letters.none()) {
+      return Fail("empty class");
+    }
+    return FromLetters(letters);
+  }
+
+  const std::string& pattern_;
+  size_t position_;
+  std::string error_;
+};
+
+} // end namespace
+
+std::unique_ptr<Node> Parse(const std::string& pattern, std::string* error) {
+  return Parser(pattern).Parse(error);
+}
+
+std::string ToLinePattern(const std::string& pattern, bool whole_line) {
+  // Split at each `|` outside of groups and classes.
+  std::vector<std::string> alternatives(1);
+  int depth = 0;
+  bool in_class = false;
+  // Where the members of the current class start, past the `[` or `[^`.
+  size_t class_start = 0;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    const char c = pattern[i];
+    if (c == '\\' && i + 1 < pattern.size()) {
+      alternatives.back() += c;
+      alternatives.back() += pattern[++i];
+      continue;
+    }
+    if (in_class) {
+      // A `]` straight after the `[` or `[^` is a member.
+      const std::string& alternative = alternatives.back();
+      if (c == '^' && alternative.size() == class_start && alternative.back() == '[') {
+        ++class_start;
+      } else if (c == ']' && alternative.size() > class_start) {
+        in_class = false;
+      }
+    } else if (c == '[') {
+      in_class = true;
+      class_start = alternatives.back().size() + 1;
+    } else if (c == '(') {
+      ++depth;
+    } else if (c == ')') {
+      --depth;
+    } else if (c == '|' && depth == 0) {
+      alternatives.emplace_back();
+      continue;
+    }
+    alternatives.back() += c;
+  }
+
+  std::string result;
+  for (std::string& alternative : alternatives) {
+    bool at_start = whole_line;
+    bool at_end = whole_line;
+    if (!alternative.empty() && alternative.front() == '^') {
+      alternative.erase(0, 1);
+      at_start = true;
+    }
+    // A `$` ends the alternative unless it's escaped.
+    size_t backslashes = 0;
+    while (backslashes + 1 < alternative.size() &&
+           alternative[alternative.size() - 2 - backslashes] == '\\') {
+      ++backslashes;
+    }
+    if (!alternative.empty() && alternative.back() == '$' && backslashes % 2 == 0) {
+      alternative.pop_back();
+      at_end = true;
+    }
+    if (&alternative != &alternatives.front()) {
+      result += '|';
+    }
+    result += (at_start ? "(" : ".*(") + alternative + (at_end ? ")" : ").*");
+  }
+  return result;
+}
+
+} // end namespace regex
+} // end namespace gnossen
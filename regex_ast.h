@@ -0,0 +1,73 @@
+#ifndef GNOSSEN_TINYJIT_REGEX_AST_H_
+#define GNOSSEN_TINYJIT_REGEX_AST_H_
+
+#include <bitset>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gnossen {
+namespace regex {
+
+// A node in the parsed form of a regex string. See devlog/002.txt for the
+// S-expression form of the tree.
+struct Node {
+  enum class Type {
+    // Matches the empty string.
+    kEmpty,
+
+    // Matches exactly `letter`.
+    kLetter,
+
+    // Matches any single character in `letters`.
+    kClass,
+
+    // Matches each of the children in order.
+    kCat,
+
+    // Matches any one of the children.
+    kOr,
+
+    // Matches the only child between `min` and `max` times.
+    kRep,
+  };
+
+  static constexpr unsigned int kUnbounded = std::numeric_limits<unsigned int>::max();
+
+  Type type;
+  char letter;
+  std::bitset<256> letters;
+  unsigned int min;
+  unsigned int max;
+  std::vector<std::unique_ptr<Node>> children;
+
+  explicit Node(Type type) : type(type), letter('\0'), letters(), min(0), max(0), children() {}
+
+  // Renders the tree as an S-expression, e.g. "(cat (letter c) (rep (letter a)))".
+  std::string ToSExpression() const;
+};
+
+// Repetition counts beyond this are rejected, since every repetition gets its
+// own copy of the subexpression in the FSM.
+constexpr unsigned int kMaxRepetition = 1000;
+
+// Parses a regex string. Supports literals, `.`, bracketed classes (`[a-z]`,
+// `[^ab]`), the `\d`, `\w` and `\s` classes and their negations, `\xHH`
+// escapes, grouping, alternation, and the `*`, `+`, `?` and `{m,n}`
+// quantifiers. `.` matches anything but a newline.
+//
+// Returns nullptr and writes a description of the problem to `error`, if
+// supplied, when the pattern is malformed.
+std::unique_ptr<Node> Parse(const std::string& pattern, std::string* error);
+
+// Rewrites a pattern to match whole lines the way grep does: each top-level
+// alternative may match anywhere in the line, unless it starts with `^` or
+// ends with `$`, which tie it to the start or end of the line instead, or
+// `whole_line` is set. Anchors anywhere else are left for Parse() to reject.
+std::string ToLinePattern(const std::string& pattern, bool whole_line);
+
+} // end namespace regex
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_REGEX_AST_H_
@@ -0,0 +1,91 @@
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "regex_ast.h"
+
+namespace gnossen {
+namespace regex {
+namespace {
+
+static std::string ParseToSExpression(const std::string& pattern) {
+  std::string error;
+  std::unique_ptr<Node> root = Parse(pattern, &error);
+  EXPECT_NE(root, nullptr) << error;
+  if (root == nullptr) {
+    return "";
+  }
+  return root->ToSExpression();
+}
+
+static std::string ParseError(const std::string& pattern) {
+  std::string error;
+  std::unique_ptr<Node> root = Parse(pattern, &error);
+  EXPECT_EQ(root, nullptr) << pattern;
+  return error;
+}
+
+TEST(RegexAstTest, DevlogExample) {
+  EXPECT_EQ(ParseToSExpression("c(a|b)*c[abc]"),
+            "(cat (letter c) (rep (or (letter a) (letter b))) (letter c) (class a-c))");
+}
+
+TEST(RegexAstTest, Quantifiers) {
+  EXPECT_EQ(ParseToSExpression("a+"), "(rep 1 inf (letter a))");
+  EXPECT_EQ(ParseToSExpression("a?"), "(rep 0 1 (letter a))");
+  EXPECT_EQ(ParseToSExpression("a{3}"), "(rep 3 3 (letter a))");
+  EXPECT_EQ(ParseToSExpression("a{2,}"), "(rep 2 inf (letter a))");
+  EXPECT_EQ(ParseToSExpression("(ab){2,4}"), "(rep 2 4 (cat (letter a) (letter b)))");
+}
+
+TEST(RegexAstTest, Classes) {
+  EXPECT_EQ(ParseToSExpression("[a-z0-9_]"), "(class 0-9 _ a-z)");
+  EXPECT_EQ(ParseToSExpression("[x]"), "(letter x)");
+  EXPECT_EQ(ParseToSExpression("\\d"), "(class 0-9)");
+  EXPECT_EQ(ParseToSExpression("[]a]"), "(class ] a)");
+  EXPECT_EQ(ParseToSExpression("[a-]"), "(class - a)");
+  EXPECT_EQ(ParseToSExpression("\\x41"), "(letter A)");
+  EXPECT_EQ(ParseToSExpression("[^\\x01-\\xff]"), "(letter \\x00)");
+}
+
+TEST(RegexAstTest, Empty) {
+  EXPECT_EQ(ParseToSExpression(""), "(empty)");
+  EXPECT_EQ(ParseToSExpression("a|"), "(or (letter a) (empty))");
+  EXPECT_EQ(ParseToSExpression("()"), "(empty)");
+}
+
+TEST(RegexAstTest, Errors) {
+  EXPECT_NE(ParseError("(a"), "");
+  EXPECT_NE(ParseError("a)"), "");
+  EXPECT_NE(ParseError("*a"), "");
+  EXPECT_NE(ParseError("[a"), "");
+  EXPECT_NE(ParseError("[z-a]"), "");
+  EXPECT_NE(ParseError("a{2,1}"), "");
+  EXPECT_NE(ParseError("a{1001}"), "");
+  EXPECT_NE(ParseError("\\q"), "");
+  EXPECT_NE(ParseError("a\\"), "");
+  EXPECT_NE(ParseError("^a"), "");
+}
+
+TEST(RegexAstTest, ToLinePattern) {
+  EXPECT_EQ(ToLinePattern("a+b", false), ".*(a+b).*");
+  EXPECT_EQ(ToLinePattern("a+b", true), "(a+b)");
+  EXPECT_EQ(ToLinePattern("^foo", false), "(foo).*");
+  EXPECT_EQ(ToLinePattern("a.c$", false), ".*(a.c)");
+  EXPECT_EQ(ToLinePattern("^x$", true), "(x)");
+  EXPECT_EQ(ToLinePattern("^a|b$|c", false), "(a).*|.*(b)|.*(c).*");
+  // Only top-level `|` split alternatives.
+  EXPECT_EQ(ToLinePattern("^(a|b)", false), "((a|b)).*");
+  EXPECT_EQ(ToLinePattern("[|]|[]|]$", false), ".*([|]).*|.*([]|])");
+  EXPECT_EQ(ToLinePattern("[^]|]|\\|", false), ".*([^]|]).*|.*(\\|).*");
+  // Escaped, or not at either end, anchors are left alone.
+  EXPECT_EQ(ToLinePattern("a\\$", false), ".*(a\\$).*");
+  EXPECT_EQ(ToLinePattern("a\\\\$", false), ".*(a\\\\)");
+  EXPECT_EQ(ToLinePattern("a^b", false), ".*(a^b).*");
+  EXPECT_NE(ParseError(ToLinePattern("a^b", false)), "");
+  EXPECT_EQ(ParseToSExpression(ToLinePattern("^b$", false)), "(letter b)");
+}
+
+} // end namespace
+} // end namespace regex
+} // end namespace gnossen
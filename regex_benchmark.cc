@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "regex_compiler.h"
+
+using gnossen::regex::CompileOptions;
+using gnossen::regex::Engine;
+using gnossen::regex::Regex;
+
+namespace {
+
+struct Case {
+    std::string pattern;
+    std::string input;
+};
+
+// Short inputs like those of a per-line filter, and long ones that show
+// steady state throughput.
+std::vector<Case> DefaultCases() {
+    const std::string line = "2024-01-01 12:00:00 INFO request served in 12 ms from the east region";
+    return {
+        {".*foo", "the quick brown fox jumps over the lazy dog, and then ate some food"},
+        {"[a-z]+@[a-z]+\\.com", "alice@example.com"},
+        {"[^,]*,[^,]*,x", "alpha beta gamma,delta epsilon,x"},
+        {".*error [0-9]+.*", line},
+        {"(a|b)*a(a|b){8}", std::string(64, 'a') + "babababa"},
+        {".*foo", std::string(1 << 20, 'a') + "foo"},
+        {"[a-z ]*x", std::string(1 << 20, 'q') + "x"},
+        {"(ab|cd)*", std::string(1 << 20, 'a').replace(1, 1, "b")},
+    };
+}
+
+// Each engine, and the JIT again with its pshufb loop for small automata.
+struct Config {
+    const char* name;
+    Engine engine;
+    bool shuffle;
+};
+
+const Config kConfigs[] = {
+    {"jit", Engine::kJit, false},
+    {"shuf", Engine::kJit, true},
+    {"table", Engine::kTable, false},
+    {"lazy", Engine::kLazy, false},
+    {"bits", Engine::kBitParallel, false},
+};
+
+// Runs the pattern on the input for at least a fixed amount of time, and
+// returns the average time per call.
+double TimeMatches(const Regex& regex, const std::string& input, size_t* matches) {
+    using Clock = std::chrono::steady_clock;
+    const auto minimum = std::chrono::milliseconds(200);
+    size_t calls = 0;
+    *matches = 0;
+    const auto start = Clock::now();
+    auto now = start;
+    do {
+        for (size_t i = 0; i < 64; ++i) {
+            *matches += regex.Match(input);
+        }
+        calls += 64;
+        now = Clock::now();
+    } while (now - start < minimum);
+    return std::chrono::duration<double, std::nano>(now - start).count() / calls;
+}
+
+} // end namespace
+
+int main(int argc, char ** argv) {
+    std::vector<Case> cases;
+    if (argc == 1) {
+        cases = DefaultCases();
+    } else if (argc % 2 == 1) {
+        for (int i = 1; i < argc; i += 2) {
+            cases.push_back({argv[i], argv[i + 1]});
+        }
+    } else {
+        std::cerr << "USAGE: " << argv[0] << " [pattern input...]" << std::endl;
+        exit(1);
+    }
+
+    printf("%-20s %8s  %-5s %12s %12s %10s\n",
+           "pattern", "length", "engine", "compile ns", "ns/match", "bytes/ns");
+    for (const Case& c : cases) {
+        for (const Config& config : kConfigs) {
+            CompileOptions options;
+            options.engine = config.engine;
+            options.shuffle_codegen = config.shuffle;
+            std::string error;
+            std::unique_ptr<Regex> regex = gnossen::regex::Compile(c.pattern, options, &error);
+            if (regex == nullptr) {
+                std::cerr << error << std::endl;
+                exit(1);
+            }
+            size_t matches = 0;
+            const double ns = TimeMatches(*regex, c.input, &matches);
+            printf("%-20s %8zu  %-5s %12lld %12.1f %10.2f%s\n",
+                   c.pattern.substr(0, 20).c_str(), c.input.size(),
+                   config.name,
+                   static_cast<long long>(regex->stats().total().count()),
+                   ns, c.input.size() / ns, matches == 0 ? "" : " (matches)");
+        }
+    }
+}
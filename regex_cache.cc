@@ -0,0 +1,142 @@
+#include "regex_cache.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <utility>
+
+namespace gnossen {
+namespace regex {
+
+CpuLevel DetectCpuLevel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return CpuLevel::kAvx2;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    return CpuLevel::kSse42;
+  }
+  return CpuLevel::kBaseline;
+}
+
+static size_t HashCombine(size_t seed, size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+size_t RegexCache::KeyHash::operator()(const Key& key) const {
+  size_t hash = std::hash<std::string>()(key.pattern);
+  hash = HashCombine(hash, static_cast<size_t>(key.engine));
+  hash = HashCombine(hash, key.max_states);
+  hash = HashCombine(hash, key.lazy_fallback);
+  hash = HashCombine(hash, key.lazy_cache_bytes);
+  hash = HashCombine(hash, key.scasb_codegen);
+  hash = HashCombine(hash, key.shuffle_codegen);
+  hash = HashCombine(hash, key.parallel);
+  hash = HashCombine(hash, key.records);
+  hash = HashCombine(hash, key.search);
+  hash = HashCombine(hash, key.prefilter);
+  hash = HashCombine(hash, std::hash<const assembly::CodeArena*>()(key.code_arena));
+  hash = HashCombine(hash, static_cast<size_t>(key.cpu_level));
+  return hash;
+}
+
+RegexCache::RegexCache() : RegexCache(Options()) {}
+
+RegexCache::RegexCache(const Options& options) :
+  options_(options),
+  shard_budget_(options.max_bytes / std::max<size_t>(options.shards, 1)),
+  cpu_level_(DetectCpuLevel())
+{
+  CheckOptions(options.compile_options);
+  for (size_t i = 0; i < std::max<size_t>(options.shards, 1); ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+void RegexCache::CheckOptions(const CompileOptions& compile_options) {
+  if (compile_options.arena != nullptr) {
+    std::cerr << "RegexCache can't share a scratch arena between compilations." << std::endl;
+    exit(1);
+  }
+}
+
+std::shared_ptr<const Regex> RegexCache::Get(const std::string& pattern, std::string* error) {
+  return Get(pattern, options_.compile_options, error);
+}
+
+std::shared_ptr<const Regex> RegexCache::Get(const std::string& pattern,
+                                             const CompileOptions& compile_options,
+                                             std::string* error) {
+  CheckOptions(compile_options);
+  Key key {pattern, compile_options.engine, compile_options.max_states,
+           compile_options.lazy_fallback, compile_options.lazy_cache_bytes,
+           compile_options.scasb_codegen, compile_options.shuffle_codegen, compile_options.parallel,
+           compile_options.records, compile_options.search, compile_options.prefilter,
+           compile_options.code_arena, cpu_level_};
+  Shard* shard = shards_[KeyHash()(key) % shards_.size()].get();
+  {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto found = shard->index.find(key);
+    if (found != shard->index.end()) {
+      shard->entries.splice(shard->entries.begin(), shard->entries, found->second);
+      ++shard->hits;
+      return found->second->regex;
+    }
+  }
+
+  ++shard->misses;
+  std::shared_ptr<const Regex> regex = Compile(pattern, compile_options, error);
+  if (regex == nullptr) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  auto found = shard->index.find(key);
+  if (found != shard->index.end()) {
+    // Somebody else got there first.
+    shard->entries.splice(shard->entries.begin(), shard->entries, found->second);
+    return found->second->regex;
+  }
+  const size_t bytes = regex->MemoryFootprint() + pattern.size();
+  shard->entries.push_front(Entry{key, regex, bytes});
+  shard->index.emplace(std::move(key), shard->entries.begin());
+  shard->bytes += bytes;
+  Evict(shard);
+  return regex;
+}
+
+void RegexCache::Evict(Shard* shard) {
+  // Always keep the most recent entry, even if it's over budget by itself.
+  while (shard->bytes > shard_budget_ && shard->entries.size() > 1) {
+    const Entry& entry = shard->entries.back();
+    shard->bytes -= entry.bytes;
+    shard->index.erase(entry.key);
+    shard->entries.pop_back();
+    ++shard->evictions;
+  }
+}
+
+void RegexCache::Clear() {
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->evictions += shard->entries.size();
+    shard->index.clear();
+    shard->entries.clear();
+    shard->bytes = 0;
+  }
+}
+
+CacheStats RegexCache::stats() const {
+  CacheStats stats;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    stats.hits += shard->hits;
+    stats.misses += shard->misses;
+    stats.evictions += shard->evictions;
+    stats.entries += shard->entries.size();
+    stats.bytes += shard->bytes;
+  }
+  return stats;
+}
+
+} // end namespace regex
+} // end namespace gnossen
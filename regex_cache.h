@@ -0,0 +1,154 @@
+#ifndef GNOSSEN_TINYJIT_REGEX_CACHE_H_
+#define GNOSSEN_TINYJIT_REGEX_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "regex_compiler.h"
+
+namespace gnossen {
+namespace regex {
+
+// The instruction set extensions available to generated code. Part of the
+// cache key, so that code compiled for one level is never handed to a caller
+// expecting another.
+enum class CpuLevel {
+  kBaseline,  // x86-64
+  kSse42,
+  kAvx2,
+};
+
+// The level of the machine we're running on.
+CpuLevel DetectCpuLevel();
+
+struct CacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t entries = 0;
+
+  // The memory held by every cached pattern, as Regex::MemoryFootprint()
+  // counts it, plus the size of the patterns themselves.
+  size_t bytes = 0;
+};
+
+// Memoizes Compile().
+//
+// Entries are spread across independently locked shards by the hash of
+// their key, so that lookups for different patterns rarely contend. Each
+// shard evicts its least recently used entries once it holds more than its
+// share of the byte budget.
+//
+// Compiled patterns are handed out as shared pointers, so evicting one never
+// frees code that a caller is still running. Compilation happens outside of
+// the shard's lock. Two threads missing on the same pattern at once may both
+// compile it, in which case the first to finish wins.
+class RegexCache {
+public:
+  struct Options {
+    size_t shards = 16;
+    size_t max_bytes = 64 * 1024 * 1024;
+
+    // Used by Get() when it isn't given options. Its arena must be null,
+    // since compilations may run concurrently.
+    CompileOptions compile_options;
+  };
+
+  RegexCache();
+  explicit RegexCache(const Options& options);
+
+  RegexCache(const RegexCache&) = delete;
+  RegexCache& operator=(const RegexCache&) = delete;
+
+  // Returns the compiled pattern, compiling it if it isn't cached. Returns
+  // nullptr and writes a description of the problem to `error`, if supplied,
+  // if the pattern can't be compiled. Failures aren't cached.
+  std::shared_ptr<const Regex> Get(const std::string& pattern, std::string* error = nullptr);
+
+  // As above, but compiled with `compile_options` rather than the cache's
+  // own. Patterns compiled with different options are cached apart, and
+  // share the cache's budget. The options' arena must be null.
+  std::shared_ptr<const Regex> Get(const std::string& pattern,
+                                   const CompileOptions& compile_options,
+                                   std::string* error = nullptr);
+
+  // Evicts everything.
+  void Clear();
+
+  CacheStats stats() const;
+
+private:
+  struct Key {
+    std::string pattern;
+    Engine engine;
+    size_t max_states;
+    bool lazy_fallback;
+    size_t lazy_cache_bytes;
+    bool scasb_codegen;
+    bool shuffle_codegen;
+    bool parallel;
+    bool records;
+    bool search;
+    bool prefilter;
+    const assembly::CodeArena* code_arena;
+    CpuLevel cpu_level;
+
+    bool operator==(const Key& other) const {
+      return pattern == other.pattern && engine == other.engine &&
+             max_states == other.max_states && lazy_fallback == other.lazy_fallback &&
+             lazy_cache_bytes == other.lazy_cache_bytes &&
+             scasb_codegen == other.scasb_codegen &&
+             shuffle_codegen == other.shuffle_codegen && parallel == other.parallel &&
+             records == other.records && search == other.search &&
+             prefilter == other.prefilter && code_arena == other.code_arena &&
+             cpu_level == other.cpu_level;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const Regex> regex;
+    size_t bytes;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    size_t bytes = 0;
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    std::atomic<size_t> evictions{0};
+  };
+
+  // Exits if the options can't be used for concurrent compilations.
+  static void CheckOptions(const CompileOptions& compile_options);
+
+  // Evicts entries until the shard is within budget. Must be called with the
+  // shard's lock held.
+  void Evict(Shard* shard);
+
+  const Options options_;
+  const size_t shard_budget_;
+  const CpuLevel cpu_level_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // end namespace regex
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_REGEX_CACHE_H_
@@ -0,0 +1,138 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "regex_cache.h"
+
+namespace gnossen {
+namespace regex {
+namespace {
+
+TEST(RegexCacheTest, ReturnsCachedPatterns) {
+  RegexCache cache;
+  std::shared_ptr<const Regex> first = cache.Get("c(a|b)*c.");
+  ASSERT_NE(first, nullptr);
+  std::shared_ptr<const Regex> second = cache.Get("c(a|b)*c.");
+  EXPECT_EQ(first, second);
+  EXPECT_TRUE(second->Match("cabc!"));
+
+  CacheStats stats = cache.stats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_GT(stats.bytes, 0);
+}
+
+TEST(RegexCacheTest, DoesNotCacheFailures) {
+  RegexCache cache;
+  std::string error;
+  EXPECT_EQ(cache.Get("(a", &error), nullptr);
+  EXPECT_NE(error, "");
+  EXPECT_EQ(cache.stats().entries, 0);
+}
+
+TEST(RegexCacheTest, KeysOnOptions) {
+  RegexCache cache;
+  CompileOptions table;
+  table.engine = Engine::kTable;
+  std::shared_ptr<const Regex> jit = cache.Get("a+b");
+  std::shared_ptr<const Regex> tabled = cache.Get("a+b", table);
+  ASSERT_NE(jit, nullptr);
+  ASSERT_NE(tabled, nullptr);
+  EXPECT_NE(jit, tabled);
+  EXPECT_NE(jit->function(), nullptr);
+  EXPECT_EQ(tabled->function(), nullptr);
+  EXPECT_TRUE(tabled->Match("aab"));
+  EXPECT_EQ(cache.stats().entries, 2);
+
+  // The cache's own options are the default.
+  EXPECT_EQ(cache.Get("a+b", CompileOptions()), jit);
+  EXPECT_EQ(cache.Get("a+b", table), tabled);
+  EXPECT_EQ(cache.stats().hits, 2);
+}
+
+TEST(RegexCacheTest, EvictsLeastRecentlyUsed) {
+  RegexCache::Options options;
+  options.shards = 1;
+  options.max_bytes = 1;
+  RegexCache cache(options);
+  std::shared_ptr<const Regex> held = cache.Get("a+b");
+  ASSERT_NE(held, nullptr);
+  ASSERT_NE(cache.Get("b+a"), nullptr);
+
+  CacheStats stats = cache.stats();
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(stats.evictions, 1);
+
+  // Evicted code stays alive for as long as somebody holds on to it.
+  EXPECT_TRUE(held->Match("aab"));
+  EXPECT_NE(cache.Get("a+b"), held);
+  EXPECT_EQ(cache.stats().misses, 3);
+}
+
+TEST(RegexCacheTest, BudgetBoundsCodePages) {
+  assembly::CodeArena arena;
+  RegexCache::Options options;
+  options.shards = 1;
+  options.max_bytes = 4 * arena.page_size();
+  options.compile_options.code_arena = &arena;
+  RegexCache cache(options);
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_NE(cache.Get("x" + std::to_string(i) + "[a-c]+y"), nullptr);
+  }
+  EXPECT_GT(cache.stats().evictions, 0);
+  EXPECT_LE(cache.stats().bytes, options.max_bytes);
+  // Space freed by evictions is reused, give or take a page left partly
+  // empty at each end.
+  EXPECT_LE(arena.PagesInUse(), options.max_bytes / arena.page_size() + 2);
+  cache.Clear();
+  EXPECT_EQ(arena.PagesInUse(), 0);
+}
+
+TEST(RegexCacheTest, ChargesLazyCaches) {
+  RegexCache::Options options;
+  options.compile_options.engine = Engine::kLazy;
+  options.compile_options.lazy_cache_bytes = 100000;
+  RegexCache cache(options);
+  ASSERT_NE(cache.Get("a+b"), nullptr);
+  EXPECT_GE(cache.stats().bytes, options.compile_options.lazy_cache_bytes);
+}
+
+TEST(RegexCacheTest, Clear) {
+  RegexCache cache;
+  ASSERT_NE(cache.Get("a"), nullptr);
+  ASSERT_NE(cache.Get("b"), nullptr);
+  cache.Clear();
+  CacheStats stats = cache.stats();
+  EXPECT_EQ(stats.entries, 0);
+  EXPECT_EQ(stats.bytes, 0);
+  EXPECT_EQ(stats.evictions, 2);
+}
+
+TEST(RegexCacheTest, IsThreadSafe) {
+  RegexCache cache;
+  const std::vector<std::string> patterns {"a+", "b*c", "[a-c]+d", "(ab|cd)*", "x.y"};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 8; ++t) {
+    threads.emplace_back([&cache, &patterns]() {
+      for (size_t i = 0; i < 200; ++i) {
+        std::shared_ptr<const Regex> regex = cache.Get(patterns[i % patterns.size()]);
+        ASSERT_NE(regex, nullptr);
+        EXPECT_TRUE(regex->Match("aaaa") == (regex->pattern() == "a+"));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  CacheStats stats = cache.stats();
+  EXPECT_EQ(stats.entries, patterns.size());
+  EXPECT_EQ(stats.hits + stats.misses, 8 * 200);
+}
+
+} // end namespace
+} // end namespace regex
+} // end namespace gnossen
@@ -0,0 +1,542 @@
+#include "regex_compiler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+#include "assembly_segment.h"
+
+namespace gnossen {
+namespace regex {
+
+using fsm::Fsm;
+
+std::string CompileStats::DebugString() const {
+  std::stringstream ss;
+  ss << "parse:       " << parse.count() << " ns" << std::endl <<
+        "thompson:    " << thompson.count() << " ns (" << nfsm_states << " states, " <<
+            positions << " positions)" << std::endl <<
+        "determinize: " << determinize.count() << " ns (" << dfsm_states << " states" <<
+            (lazy ? ", lazy" : "") << ")" << std::endl <<
+        "minimize:    " << minimize.count() << " ns (" << minimized_states << " states, " <<
+            byte_classes << " byte classes)" << std::endl <<
+        "binarize:    " << binarize.count() << " ns (" << binarized_states << " states)" << std::endl <<
+        "lower:       " << lower.count() << " ns" << (shuffled ? " (shuffle)" : "") << std::endl <<
+        "search:      " << search.count() << " ns (" << search_states << " states, " <<
+            reverse_states << " reversed)" << std::endl <<
+        "prefilter:   " << (prefiltered ? "" : "unused, ");
+  if (required.empty()) {
+    ss << "none";
+  } else if (!required.literal.empty()) {
+    ss << "\"" << required.literal << "\"";
+  } else {
+    ss << required.letters.count() << " letters";
+  }
+  ss << (required.prefix ? " prefix" : "") << std::endl <<
+        "emit:        " << emit.count() << " ns (" << code_size << " bytes, " <<
+            table_size << " bytes of tables)" << std::endl <<
+        "peephole:    " << peephole.bytes_saved << " bytes saved (" <<
+            peephole.threaded_jumps << " jumps threaded, " <<
+            peephole.inverted_jumps << " inverted, " <<
+            peephole.removed_jumps << " jumps and " <<
+            peephole.removed_segments << " segments removed, " <<
+            peephole.skipped_loads << " loads skipped)" << std::endl <<
+        "scratch:     " << scratch_bytes << " bytes" << std::endl <<
+        "total:       " << total().count() << " ns" << std::endl;
+  return ss.str();
+}
+
+Regex::Regex(const std::string& pattern, assembly::CodeArena::Code code,
+             assembly::CodeArena::Code search_code, std::unique_ptr<fsm::TableDfa> table,
+             std::unique_ptr<fsm::TableDfa> search_table,
+             std::unique_ptr<fsm::TableDfa> reverse_table, const CompileStats& stats) :
+  pattern_(pattern),
+  code_(std::move(code)),
+  function_(code_.function<MatchFunction>()),
+  search_code_(std::move(search_code)),
+  search_function_(search_code_ ? search_code_.function<SearchFunction>() : nullptr),
+  table_(std::move(table)),
+  search_table_(std::move(search_table)),
+  reverse_table_(std::move(reverse_table)),
+  stats_(stats) {}
+
+void Regex::MatchBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                       uint64_t* results) const {
+  if (table_ != nullptr) {
+    table_->MatchBatch(begins, lengths, count, results);
+    return;
+  } else if (lazy_ != nullptr) {
+    lazy_->MatchBatch(begins, lengths, count, results);
+    return;
+  }
+  std::fill(results, results + (count + 63) / 64, 0);
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t* begin = begins[i];
+    const uint64_t matched = function_ != nullptr ?
+                             function_(begin, begin + lengths[i]) != 0 :
+                             bit_parallel_->Match(begin, begin + lengths[i]) != 0;
+    results[i / 64] |= matched << (i % 64);
+  }
+}
+
+size_t Regex::MatchRecords(std::string_view input, char delimiter, size_t* indices) const {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  if (record_function_ != nullptr) {
+    return record_function_(begin, begin + input.size(), delimiter, indices);
+  }
+  size_t matches = 0;
+  size_t record = 0;
+  while (!input.empty()) {
+    const size_t end = std::min(input.find(delimiter), input.size());
+    if (Match(input.substr(0, end))) {
+      if (indices != nullptr) {
+        indices[matches] = record;
+      }
+      ++matches;
+    }
+    input.remove_prefix(std::min(end + 1, input.size()));
+    ++record;
+  }
+  return matches;
+}
+
+bool Regex::MatchParallel(std::string_view input, thread_pool::ThreadPool* pool) const {
+  const fsm::TableDfa* table = table_ != nullptr ? table_.get() : parallel_table_.get();
+  if (table == nullptr) {
+    return Match(input);
+  }
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  return table->MatchParallel(begin, begin + input.size(),
+                              pool != nullptr ? pool : thread_pool::ThreadPool::Default()) != 0;
+}
+
+size_t Regex::MemoryFootprint() const {
+  size_t bytes = code_.footprint() + search_code_.footprint() + record_code_.footprint() +
+                 stats_.table_size;
+  for (const fsm::LazyDfa* dfa : {lazy_.get(), lazy_search_.get(), lazy_reverse_.get()}) {
+    if (dfa != nullptr) {
+      bytes += dfa->CacheBytes();
+    }
+  }
+  return bytes;
+}
+
+fsm::LazyDfa::Stats Regex::lazy_stats() const {
+  fsm::LazyDfa::Stats total;
+  for (const fsm::LazyDfa* dfa : {lazy_.get(), lazy_search_.get(), lazy_reverse_.get()}) {
+    if (dfa != nullptr) {
+      const fsm::LazyDfa::Stats stats = dfa->stats();
+      total.hits += stats.hits;
+      total.misses += stats.misses;
+      total.flushes += stats.flushes;
+      total.cache_bytes += stats.cache_bytes;
+    }
+  }
+  return total;
+}
+
+SearchResult Regex::Search(std::string_view input) const {
+  if (search_function_ == nullptr && search_table_ == nullptr && lazy_search_ == nullptr &&
+      bit_parallel_search_ == nullptr) {
+    std::cerr << "Searching with \"" << pattern_ << "\", which wasn't compiled for search." <<
+        std::endl;
+    exit(1);
+  }
+  // The generated code returns null when there's no match, so it must never
+  // be given a null input.
+  static const uint8_t kEmpty = 0;
+  const uint8_t* begin = input.empty() ? &kEmpty :
+                         reinterpret_cast<const uint8_t*>(input.data());
+  const uint8_t* match_end = search_table_ != nullptr ?
+                             search_table_->Find(begin, begin + input.size()) :
+                             bit_parallel_search_ != nullptr ?
+                             bit_parallel_search_->Find(begin, begin + input.size()) :
+                             lazy_search_ != nullptr ?
+                             lazy_search_->Find(begin, begin + input.size()) :
+                             search_function_(begin, begin + input.size());
+  SearchResult result;
+  if (match_end == nullptr) {
+    return result;
+  }
+  result.found = true;
+  result.end = match_end - begin;
+  result.start = result.end;
+  const uint8_t* match_start = reverse_table_ != nullptr ?
+                               reverse_table_->FindBackwards(begin, match_end) :
+                               lazy_reverse_ != nullptr ?
+                               lazy_reverse_->FindBackwards(begin, match_end) :
+                               bit_parallel_reverse_->FindBackwards(begin, match_end);
+  if (match_start != nullptr) {
+    result.start = match_start - begin;
+  }
+  return result;
+}
+
+// Adds the fragment for `node` to `fsm` with `source` as its source state,
+// matching the node's letters in reverse order if `reversed` is set. Returns
+// the fragment's sink.
+static Fsm::StateId AddFragment(const Node& node, Fsm* fsm, Fsm::StateId source,
+                                bool reversed) {
+  switch (node.type) {
+    case Node::Type::kEmpty:
+      return source;
+    case Node::Type::kLetter: {
+      auto sink = fsm->AddState();
+      fsm->AddTransition(source, sink, node.letter);
+      return sink;
+    }
+    case Node::Type::kClass: {
+      auto sink = fsm->AddState();
+      fsm->AddSetTransition(source, sink, node.letters);
+      return sink;
+    }
+    case Node::Type::kCat: {
+      auto sink = source;
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        const Node& child = *node.children[reversed ? node.children.size() - 1 - i : i];
+        sink = AddFragment(child, fsm, sink, reversed);
+      }
+      return sink;
+    }
+    case Node::Type::kOr: {
+      auto sink = fsm->AddState();
+      for (const auto& child : node.children) {
+        auto child_source = fsm->AddState();
+        fsm->AddNonDeterministicTransition(source, child_source);
+        fsm->AddNonDeterministicTransition(AddFragment(*child, fsm, child_source, reversed), sink);
+      }
+      return sink;
+    }
+    case Node::Type::kRep: {
+      const Node& child = *node.children[0];
+      auto sink = source;
+      for (unsigned int i = 0; i < node.min; ++i) {
+        sink = AddFragment(child, fsm, sink, reversed);
+      }
+      if (node.max == Node::kUnbounded) {
+        auto loop = fsm->AddState();
+        auto body = fsm->AddState();
+        auto exit = fsm->AddState();
+        fsm->AddNonDeterministicTransition(sink, loop);
+        fsm->AddNonDeterministicTransition(loop, body);
+        fsm->AddNonDeterministicTransition(AddFragment(child, fsm, body, reversed), loop);
+        fsm->AddNonDeterministicTransition(loop, exit);
+        return exit;
+      }
+      for (unsigned int i = node.min; i < node.max; ++i) {
+        auto body = fsm->AddState();
+        auto exit = fsm->AddState();
+        fsm->AddNonDeterministicTransition(sink, body);
+        fsm->AddNonDeterministicTransition(sink, exit);
+        fsm->AddNonDeterministicTransition(AddFragment(child, fsm, body, reversed), exit);
+        sink = exit;
+      }
+      return sink;
+    }
+  }
+  return source;
+}
+
+static std::vector<char> FullAlphabet() {
+  std::vector<char> alphabet;
+  for (unsigned int letter = 0; letter < 256; ++letter) {
+    alphabet.push_back(static_cast<char>(letter));
+  }
+  return alphabet;
+}
+
+Fsm ToNfsm(const Node& root, arena::Arena* arena) {
+  Fsm fsm(FullAlphabet(), arena);
+  auto sink = AddFragment(root, &fsm, fsm.GetStartState(), false);
+  fsm.AddEndOfInputTransition(sink, fsm.GetSuccessState());
+  fsm.Compact();
+  return fsm;
+}
+
+Fsm ToSearchNfsm(const Node& root, arena::Arena* arena) {
+  Fsm fsm(FullAlphabet(), arena);
+  auto source = fsm.AddState();
+  fsm.AddNonDeterministicTransition(fsm.GetStartState(), source);
+  fsm.AddRangeTransition(fsm.GetStartState(), fsm.GetStartState(), '\x00', '\xff');
+  auto sink = AddFragment(root, &fsm, source, false);
+  fsm.AddEndOfInputTransition(sink, fsm.GetSuccessState());
+  fsm.Compact();
+  return fsm;
+}
+
+Fsm ToReversedNfsm(const Node& root, arena::Arena* arena) {
+  Fsm fsm(FullAlphabet(), arena);
+  auto sink = AddFragment(root, &fsm, fsm.GetStartState(), true);
+  fsm.AddEndOfInputTransition(sink, fsm.GetSuccessState());
+  fsm.Compact();
+  return fsm;
+}
+
+// Determinizes and minimizes `nfsm`. Returns nullptr if that needs more than
+// `max_states` states.
+static std::unique_ptr<Fsm> ToMinimalDfsm(const Fsm& nfsm, size_t max_states) {
+  std::unique_ptr<Fsm> dfsm = fsm::Determinize(nfsm, max_states);
+  return dfsm == nullptr ? nullptr : fsm::Minimize(*dfsm, max_states);
+}
+
+std::unique_ptr<Regex> Compile(const std::string& pattern, std::string* error) {
+  return Compile(pattern, CompileOptions(), error);
+}
+
+std::unique_ptr<Regex> Regex::CompileInArena(const std::string& pattern,
+                                             const CompileOptions& options,
+                                             arena::Arena* arena,
+                                             std::string* error) {
+  using Clock = std::chrono::steady_clock;
+  CompileStats stats;
+
+  auto start = Clock::now();
+  std::unique_ptr<Node> root = Parse(pattern, error);
+  if (root == nullptr) {
+    return nullptr;
+  }
+  auto end = Clock::now();
+  stats.parse = end - start;
+
+  start = end;
+  Fsm nfsm = ToNfsm(*root, arena);
+  end = Clock::now();
+  stats.thompson = end - start;
+  stats.nfsm_states = nfsm.StateCount();
+  stats.required = fsm::FindRequiredFactor(nfsm);
+
+  // Builds the lazy engine's automata straight from the NFSMs, instead of
+  // anything below.
+  auto compile_lazy = [&]() {
+    stats.lazy = true;
+    auto start = Clock::now();
+    auto lazy = std::make_unique<fsm::LazyDfa>(nfsm, options.lazy_cache_bytes);
+    auto end = Clock::now();
+    stats.lower = end - start;
+    stats.byte_classes = lazy->ClassCount();
+    std::unique_ptr<fsm::LazyDfa> lazy_search;
+    std::unique_ptr<fsm::LazyDfa> lazy_reverse;
+    if (options.search) {
+      start = end;
+      lazy_search = std::make_unique<fsm::LazyDfa>(ToSearchNfsm(*root, arena),
+                                                   options.lazy_cache_bytes);
+      lazy_reverse = std::make_unique<fsm::LazyDfa>(ToReversedNfsm(*root, arena),
+                                                    options.lazy_cache_bytes);
+      end = Clock::now();
+      stats.search = end - start;
+    }
+    stats.scratch_bytes = arena->BytesAllocated();
+    std::unique_ptr<Regex> regex(new Regex(pattern, assembly::CodeArena::Code(),
+                                           assembly::CodeArena::Code(), nullptr, nullptr,
+                                           nullptr, stats));
+    regex->lazy_ = std::move(lazy);
+    regex->lazy_search_ = std::move(lazy_search);
+    regex->lazy_reverse_ = std::move(lazy_reverse);
+    return regex;
+  };
+  if (options.engine == Engine::kLazy) {
+    return compile_lazy();
+  }
+
+  if (options.engine == Engine::kBitParallel) {
+    start = end;
+    std::unique_ptr<fsm::BitParallelNfa> bit_parallel = fsm::ToBitParallelNfa(nfsm);
+    std::unique_ptr<fsm::BitParallelNfa> bit_parallel_search;
+    std::unique_ptr<fsm::BitParallelNfa> bit_parallel_reverse;
+    if (options.search && bit_parallel != nullptr) {
+      bit_parallel_search = fsm::ToBitParallelNfa(ToSearchNfsm(*root, arena));
+      bit_parallel_reverse = fsm::ToBitParallelNfa(ToReversedNfsm(*root, arena));
+    }
+    if (bit_parallel == nullptr ||
+        (options.search && (bit_parallel_search == nullptr || bit_parallel_reverse == nullptr))) {
+      if (options.lazy_fallback) {
+        return compile_lazy();
+      } else if (error != nullptr) {
+        *error = "pattern \"" + pattern + "\" has more than " +
+                 std::to_string(fsm::BitParallelNfa::kMaxPositions - 1) + " letters";
+      }
+      return nullptr;
+    }
+    end = Clock::now();
+    stats.lower = end - start;
+    stats.positions = bit_parallel->PositionCount();
+    stats.byte_classes = bit_parallel->ClassCount();
+    stats.table_size = bit_parallel->TableSize();
+    if (options.search) {
+      stats.table_size += bit_parallel_search->TableSize() + bit_parallel_reverse->TableSize();
+    }
+    stats.scratch_bytes = arena->BytesAllocated();
+    std::unique_ptr<Regex> regex(new Regex(pattern, assembly::CodeArena::Code(),
+                                           assembly::CodeArena::Code(), nullptr, nullptr,
+                                           nullptr, stats));
+    regex->bit_parallel_ = std::move(bit_parallel);
+    regex->bit_parallel_search_ = std::move(bit_parallel_search);
+    regex->bit_parallel_reverse_ = std::move(bit_parallel_reverse);
+    return regex;
+  }
+
+  start = end;
+  std::unique_ptr<Fsm> dfsm = fsm::Determinize(nfsm, options.max_states);
+  if (dfsm == nullptr) {
+    if (options.lazy_fallback) {
+      return compile_lazy();
+    } else if (error != nullptr) {
+      *error = "pattern \"" + pattern + "\" needs more than " +
+               std::to_string(options.max_states) + " states";
+    }
+    return nullptr;
+  }
+  end = Clock::now();
+  stats.determinize = end - start;
+  stats.dfsm_states = dfsm->StateCount();
+
+  start = end;
+  std::unique_ptr<Fsm> minimized = fsm::Minimize(*dfsm, options.max_states);
+  end = Clock::now();
+  stats.minimize = end - start;
+  stats.minimized_states = minimized->StateCount();
+  stats.byte_classes = fsm::ComputeByteClasses(*minimized).count();
+
+  // Scanning for a prefix first would only find what the automaton rejects
+  // at the first letter anyway.
+  fsm::LoweringOptions lowering;
+  const bool jit = options.engine == Engine::kJit;
+  stats.shuffled = jit && options.shuffle_codegen && fsm::CanShuffle(*minimized) &&
+                   __builtin_cpu_supports("ssse3");
+  if (jit && options.prefilter && !stats.required.empty() && !stats.required.prefix) {
+    lowering.prefilter = stats.required;
+    stats.prefiltered = true;
+  }
+
+  start = end;
+  assembly::AssemblySubroutine subroutine;
+  std::unique_ptr<fsm::TableDfa> table;
+  if (!jit) {
+    table = std::make_unique<fsm::TableDfa>(*minimized);
+    stats.table_size = table->TableSize();
+  } else if (options.scasb_codegen) {
+    Fsm binarized = fsm::ToBinarizedNfsm(*minimized);
+    end = Clock::now();
+    stats.binarize = end - start;
+    stats.binarized_states = binarized.StateCount();
+    start = end;
+    subroutine = fsm::ToSubroutine(binarized);
+  } else if (stats.shuffled) {
+    subroutine = fsm::ToShuffleSubroutine(*minimized);
+  } else {
+    subroutine = fsm::ToLoadCompareSubroutine(*minimized, lowering);
+  }
+  assembly::AssemblySubroutine record_subroutine;
+  if (jit && options.records) {
+    fsm::LoweringOptions record_lowering = lowering;
+    record_lowering.records = true;
+    record_subroutine = fsm::ToLoadCompareSubroutine(*minimized, record_lowering);
+  }
+  std::unique_ptr<fsm::TableDfa> parallel_table;
+  if (jit && options.parallel) {
+    parallel_table = std::make_unique<fsm::TableDfa>(*minimized);
+    stats.table_size += parallel_table->TableSize();
+  }
+  end = Clock::now();
+  stats.lower = end - start;
+
+  std::unique_ptr<fsm::TableDfa> reverse_table;
+  assembly::AssemblySubroutine search_subroutine;
+  std::unique_ptr<fsm::TableDfa> search_table;
+  if (options.search) {
+    start = end;
+    std::unique_ptr<Fsm> search_dfsm = ToMinimalDfsm(ToSearchNfsm(*root, arena), options.max_states);
+    std::unique_ptr<Fsm> reversed = ToMinimalDfsm(ToReversedNfsm(*root, arena),
+                                                  options.max_states);
+    if (search_dfsm == nullptr || reversed == nullptr) {
+      if (options.lazy_fallback) {
+        stats.determinize = std::chrono::nanoseconds(0);
+        stats.minimize = std::chrono::nanoseconds(0);
+        stats.dfsm_states = 0;
+        stats.minimized_states = 0;
+        stats.prefiltered = false;
+        return compile_lazy();
+      } else if (error != nullptr) {
+        *error = "searching for pattern \"" + pattern + "\" needs more than " +
+                 std::to_string(options.max_states) + " states";
+      }
+      return nullptr;
+    }
+    stats.search_states = search_dfsm->StateCount();
+    stats.reverse_states = reversed->StateCount();
+    reverse_table = std::make_unique<fsm::TableDfa>(*reversed);
+    stats.table_size += reverse_table->TableSize();
+    if (jit) {
+      lowering.return_end = true;
+      search_subroutine = fsm::ToLoadCompareSubroutine(fsm::StopAtEarliestMatch(*search_dfsm),
+                                                       lowering);
+    } else {
+      search_table = std::make_unique<fsm::TableDfa>(*search_dfsm);
+      stats.table_size += search_table->TableSize();
+    }
+    end = Clock::now();
+    stats.search = end - start;
+  }
+
+  if (!jit) {
+    stats.scratch_bytes = arena->BytesAllocated();
+    return std::unique_ptr<Regex>(new Regex(pattern, assembly::CodeArena::Code(),
+                                            assembly::CodeArena::Code(), std::move(table),
+                                            std::move(search_table), std::move(reverse_table),
+                                            stats));
+  }
+
+  start = end;
+  assembly::CodeArena* code_arena = options.code_arena != nullptr ?
+                                    options.code_arena : assembly::CodeArena::Default();
+  assembly::CodeArena::Batch batch(code_arena);
+  batch.Add(&subroutine);
+  if (options.search) {
+    batch.Add(&search_subroutine);
+  }
+  if (options.records) {
+    batch.Add(&record_subroutine);
+  }
+  std::string emit_error;
+  std::vector<assembly::CodeArena::Code> codes = batch.Commit(&emit_error);
+  if (codes.empty()) {
+    if (error != nullptr) {
+      *error = "failed to emit code for pattern \"" + pattern + "\": " + emit_error;
+    }
+    return nullptr;
+  }
+  end = Clock::now();
+  stats.emit = end - start;
+  stats.code_size = subroutine.size() + (options.search ? search_subroutine.size() : 0) +
+                    (options.records ? record_subroutine.size() : 0);
+  stats.peephole = subroutine.peephole_stats();
+  stats.scratch_bytes = arena->BytesAllocated();
+
+  assembly::CodeArena::Code search_code;
+  if (options.search) {
+    search_code = std::move(codes[1]);
+  }
+  std::unique_ptr<Regex> regex(new Regex(pattern, std::move(codes[0]), std::move(search_code),
+                                         nullptr, nullptr, std::move(reverse_table), stats));
+  regex->parallel_table_ = std::move(parallel_table);
+  if (options.records) {
+    regex->record_code_ = std::move(codes.back());
+    regex->record_function_ = regex->record_code_.function<RecordFunction>();
+  }
+  return regex;
+}
+
+std::unique_ptr<Regex> Compile(const std::string& pattern,
+                               const CompileOptions& options,
+                               std::string* error) {
+  arena::Arena local_arena;
+  arena::Arena* arena = options.arena != nullptr ? options.arena : &local_arena;
+  std::unique_ptr<Regex> regex = Regex::CompileInArena(pattern, options, arena, error);
+  arena->Reset();
+  return regex;
+}
+
+} // end namespace regex
+} // end namespace gnossen
@@ -0,0 +1,337 @@
+#ifndef GNOSSEN_TINYJIT_REGEX_COMPILER_H_
+#define GNOSSEN_TINYJIT_REGEX_COMPILER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "bit_parallel_nfa.h"
+#include "code_arena.h"
+#include "fsm.h"
+#include "lazy_dfa.h"
+#include "regex_ast.h"
+#include "table_dfa.h"
+#include "thread_pool.h"
+
+namespace gnossen {
+namespace regex {
+
+// The signature of the generated code. Takes the input as the range [begin,
+// end) and returns nonzero if all of it matches. The input may hold any
+// bytes, including '\0', and needs no terminator.
+using MatchFunction = uint8_t (*)(const uint8_t* begin, const uint8_t* end);
+
+// The signature of the generated code for a search. Takes the input as a
+// MatchFunction does and returns where the earliest match in it ends, or
+// nullptr if there's none.
+using SearchFunction = const uint8_t* (*)(const uint8_t* begin, const uint8_t* end);
+
+// The signature of the generated code for records, as described in
+// assembly_segment.h above assembly::RecordSetupSegment. Takes the input as
+// a MatchFunction does, as records ending in `delimiter`, and returns how
+// many of them match. If `indices` isn't null, it receives the number of
+// each matching record.
+using RecordFunction = size_t (*)(const uint8_t* begin, const uint8_t* end, uint8_t delimiter,
+                                  size_t* indices);
+
+// A match found by Regex::Search(), as offsets into its input.
+struct SearchResult {
+  bool found = false;
+  size_t start = 0;
+  size_t end = 0;
+};
+
+// How a compiled pattern is run.
+enum class Engine {
+  // Generated machine code.
+  kJit,
+
+  // A transition table, walked by fsm::TableDfa. Needs no executable memory
+  // and skips lowering altogether, so it suits sandboxes that forbid
+  // executable mappings and patterns used too little to repay compiling them.
+  kTable,
+
+  // The NFSM, determinized as the input is read by fsm::LazyDfa. Skips
+  // building the deterministic FSM, so it copes with patterns whose FSM
+  // would be far too big, but is slower until its cache warms up.
+  kLazy,
+
+  // The NFSM, simulated by fsm::BitParallelNfa with all its states in one
+  // register. Only for patterns of up to 63 letters, counting each repeat
+  // of a bounded repetition, but needs no determinization, so it's the
+  // quickest to compile and its speed doesn't depend on the input.
+  kBitParallel,
+};
+
+struct CompileOptions {
+  Engine engine = Engine::kJit;
+
+  // Also compile the code or table for Regex::Search(), and the reverse
+  // automaton it needs. The JIT always uses the load/compare code for it.
+  bool search = false;
+
+  // Patterns whose deterministic FSM would need more states than this are
+  // rejected rather than allowed to exhaust memory.
+  size_t max_states = fsm::kDefaultStateBudget;
+
+  // Rather than rejecting patterns that need more than max_states states,
+  // or that are too long for the bit-parallel engine, run them on the lazy
+  // engine.
+  bool lazy_fallback = false;
+
+  // The memory the lazy engine may spend caching states, per thread.
+  size_t lazy_cache_bytes = fsm::LazyDfa::kDefaultCacheBytes;
+
+  // Also compile the record loop for Regex::MatchRecords(). JIT only.
+  bool records = false;
+
+  // Also build the table engine's table for Regex::MatchParallel(), which
+  // can't run the generated code. JIT only: the table engine always has it.
+  bool parallel = false;
+
+  // Lower through a binarized FSM to the original scasb-based segments, one
+  // letter test per section, rather than to the load/compare code. Slower,
+  // but simpler to follow when debugging the generated code. JIT only.
+  bool scasb_codegen = false;
+
+  // Lower deterministic FSMs of up to fsm::CanShuffle()'s 32 states to a
+  // single branch-free pshufb loop instead, when the CPU has SSSE3. Takes
+  // the same time per letter whatever the input, where the load/compare
+  // code's time depends on how well its branches are predicted. Match()
+  // then skips the prefilter, though Search() still uses it. JIT only.
+  bool shuffle_codegen = false;
+
+  // Have the load/compare code scan the input for a literal that every match
+  // contains, if the pattern has one that isn't a prefix, and fail without
+  // running the automaton if it's not there. JIT only.
+  bool prefilter = true;
+
+  // Scratch memory for the graphs and segments built along the way. Compile()
+  // resets it before returning, so reusing one arena across many compilations
+  // lets them share its blocks. If null, each compilation uses its own.
+  arena::Arena* arena = nullptr;
+
+  // Where the machine code goes. It must outlive the compiled pattern. If
+  // null, the process-wide CodeArena::Default() is used.
+  assembly::CodeArena* code_arena = nullptr;
+};
+
+// Wall-clock time spent in each stage of the pipeline from devlog/002.txt.
+struct CompileStats {
+  std::chrono::nanoseconds parse{0};
+  std::chrono::nanoseconds thompson{0};
+  std::chrono::nanoseconds determinize{0};
+  std::chrono::nanoseconds minimize{0};
+  // Only done for scasb_codegen.
+  std::chrono::nanoseconds binarize{0};
+  std::chrono::nanoseconds lower{0};
+
+  // Only done for search: every stage of building the search code and the
+  // reverse automaton.
+  std::chrono::nanoseconds search{0};
+
+  // Writing the machine code into executable memory.
+  std::chrono::nanoseconds emit{0};
+
+  size_t nfsm_states = 0;
+  // Zero for the lazy engine.
+  size_t dfsm_states = 0;
+  size_t minimized_states = 0;
+  // The classes of letters that the minimized FSM tells apart.
+  size_t byte_classes = 0;
+  size_t binarized_states = 0;
+  size_t search_states = 0;
+  size_t reverse_states = 0;
+
+  // Whether the pattern runs on the lazy engine, whether asked for or as a
+  // fallback.
+  bool lazy = false;
+
+  // Whether Match() runs the pshufb loop from shuffle_codegen.
+  bool shuffled = false;
+
+  // The states of the bit-parallel engine's NFSM, counting the start. Zero
+  // for the other engines.
+  size_t positions = 0;
+
+  // The factor found in every match, whether or not it was used.
+  fsm::RequiredFactor required;
+  bool prefiltered = false;
+
+  // Including the search code or tables, if any, and the table for reading
+  // the pattern backwards.
+  size_t code_size = 0;
+  size_t table_size = 0;
+
+  // Arena memory used by the intermediate graphs and segments.
+  size_t scratch_bytes = 0;
+
+  assembly::PeepholeStats peephole;
+
+  std::chrono::nanoseconds total() const {
+    return parse + thompson + determinize + minimize + binarize + lower + search + emit;
+  }
+
+  std::string DebugString() const;
+};
+
+// A compiled pattern. Owns the executable memory backing its match function,
+// or the tables that stand in for it.
+class Regex {
+public:
+
+  Regex(const Regex&) = delete;
+  Regex& operator=(const Regex&) = delete;
+
+  bool Match(std::string_view input) const {
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+    if (table_ != nullptr) {
+      return table_->Match(begin, begin + input.size()) != 0;
+    } else if (bit_parallel_ != nullptr) {
+      return bit_parallel_->Match(begin, begin + input.size()) != 0;
+    } else if (lazy_ != nullptr) {
+      return lazy_->Match(begin, begin + input.size()) != 0;
+    }
+    return function_(begin, begin + input.size()) != 0;
+  }
+
+  // Matches a NUL-terminated string, not including the terminator.
+  bool Match(const char* str) const { return Match(std::string_view(str)); }
+
+  // Matches `count` inputs, the i-th being the range [begins[i], begins[i] +
+  // lengths[i]), and sets bit i % 64 of results[i / 64] if it matches, and
+  // clears it otherwise. Saves the overhead of a call per input, and the
+  // table engine steps several inputs at once so that the latencies of
+  // their table lookups overlap. The generated code's control flow follows
+  // a single input, so the JIT still matches them one at a time.
+  void MatchBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                  uint64_t* results) const;
+
+  // As Match(), but splits a long input into chunks matched across the
+  // threads of `pool`, or of ThreadPool::Default() if it's null, as
+  // fsm::TableDfa::MatchParallel() does. The JIT's code can't be started
+  // from an arbitrary state, so for the JIT this needs the table built with
+  // `parallel` set. Otherwise, and for the lazy and bit-parallel engines,
+  // it's the same as Match().
+  bool MatchParallel(std::string_view input, thread_pool::ThreadPool* pool = nullptr) const;
+
+  // Splits the input into records, each ending in `delimiter` or at the
+  // end of the input, and returns how many match. If `indices` isn't null,
+  // it receives the number of each matching record, counting from 0, and
+  // must have room for one per record. A delimiter at the very end of the
+  // input ends the last record rather than starting an empty one. With the
+  // record loop compiled, one call to the generated code goes through every
+  // record. Otherwise, each record is matched on its own.
+  size_t MatchRecords(std::string_view input, char delimiter, size_t* indices = nullptr) const;
+
+  // Null for all but the JIT.
+  MatchFunction function() const { return function_; }
+
+  // Finds the match in `input` that ends first, and of the matches ending
+  // there, the one that starts first. The generated code restarts the
+  // automaton at each letter as it goes, so the input is read at most once to
+  // find the end, and then backwards from there to find the start. Only for
+  // patterns compiled with `search` set.
+  SearchResult Search(std::string_view input) const;
+
+  // Null unless compiled with `search` set for the JIT.
+  SearchFunction search_function() const { return search_function_; }
+
+  // Null unless compiled with `records` set for the JIT.
+  RecordFunction record_function() const { return record_function_; }
+
+  const std::string& pattern() const { return pattern_; }
+
+  const CompileStats& stats() const { return stats_; }
+
+  // The memory the compiled pattern holds: its code's share of the code
+  // arena, its tables, and the budget of one cache for each of the lazy
+  // engine's automata. Each further thread on the lazy engine at once may
+  // hold another cache.
+  size_t MemoryFootprint() const;
+
+  // How the lazy engine's caches have fared so far, counting those of the
+  // search automata too. All zero for the other engines.
+  fsm::LazyDfa::Stats lazy_stats() const;
+
+private:
+  friend std::unique_ptr<Regex> Compile(const std::string& pattern,
+                                        const CompileOptions& options,
+                                        std::string* error);
+
+  // Runs the pipeline with all intermediate graphs and segments allocated
+  // from `arena`. None of them outlive the call.
+  static std::unique_ptr<Regex> CompileInArena(const std::string& pattern,
+                                               const CompileOptions& options,
+                                               arena::Arena* arena,
+                                               std::string* error);
+
+  Regex(const std::string& pattern, assembly::CodeArena::Code code,
+        assembly::CodeArena::Code search_code, std::unique_ptr<fsm::TableDfa> table,
+        std::unique_ptr<fsm::TableDfa> search_table, std::unique_ptr<fsm::TableDfa> reverse_table,
+        const CompileStats& stats);
+
+  const std::string pattern_;
+  assembly::CodeArena::Code code_;
+  MatchFunction function_;
+  assembly::CodeArena::Code search_code_;
+  SearchFunction search_function_;
+  assembly::CodeArena::Code record_code_;
+  RecordFunction record_function_ = nullptr;
+
+  // Set instead of the code for the table engine.
+  std::unique_ptr<fsm::TableDfa> table_;
+  std::unique_ptr<fsm::TableDfa> search_table_;
+
+  // The pattern read backwards, for finding where a match starts. Set for
+  // both the JIT and the table engine when compiled with `search`.
+  std::unique_ptr<fsm::TableDfa> reverse_table_;
+
+  // Set alongside the code for the JIT with `parallel` set.
+  std::unique_ptr<fsm::TableDfa> parallel_table_;
+
+  // Set instead of the code for the lazy engine, with the pattern read
+  // backwards standing in for the reverse table below.
+  std::unique_ptr<fsm::LazyDfa> lazy_;
+  std::unique_ptr<fsm::LazyDfa> lazy_search_;
+  std::unique_ptr<fsm::LazyDfa> lazy_reverse_;
+
+  // Likewise for the bit-parallel engine.
+  std::unique_ptr<fsm::BitParallelNfa> bit_parallel_;
+  std::unique_ptr<fsm::BitParallelNfa> bit_parallel_search_;
+  std::unique_ptr<fsm::BitParallelNfa> bit_parallel_reverse_;
+
+
+  const CompileStats stats_;
+};
+
+// Thompson's construction. Each AST node becomes a fragment of the FSM with
+// a single source and a single sink. The sink of the root transitions to the
+// success state at the end of the input.
+fsm::Fsm ToNfsm(const Node& root, arena::Arena* arena = nullptr);
+
+// As ToNfsm(), but the match may start after any number of letters, as it
+// may for a search.
+fsm::Fsm ToSearchNfsm(const Node& root, arena::Arena* arena = nullptr);
+
+// As ToNfsm(), for the pattern read backwards.
+fsm::Fsm ToReversedNfsm(const Node& root, arena::Arena* arena = nullptr);
+
+// Compiles a pattern all the way down to machine code.
+//
+// Returns nullptr and writes a description of the problem to `error`, if
+// supplied, when the pattern can't be compiled.
+std::unique_ptr<Regex> Compile(const std::string& pattern,
+                               const CompileOptions& options,
+                               std::string* error = nullptr);
+
+std::unique_ptr<Regex> Compile(const std::string& pattern, std::string* error = nullptr);
+
+} // end namespace regex
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_REGEX_COMPILER_H_
@@ -0,0 +1,697 @@
+#include "gtest/gtest.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "regex_compiler.h"
+
+namespace gnossen {
+namespace regex {
+namespace {
+
+// Every string over `alphabet` of at most `max_length` letters.
+static std::vector<std::string> AllStrings(const std::string& alphabet, size_t max_length) {
+  std::vector<std::string> strings {""};
+  size_t begin = 0;
+  for (size_t length = 1; length <= max_length; ++length) {
+    size_t end = strings.size();
+    for (size_t i = begin; i < end; ++i) {
+      for (char letter : alphabet) {
+        strings.push_back(strings[i] + letter);
+      }
+    }
+    begin = end;
+  }
+  return strings;
+}
+
+// Checks the JIT, with both code generators, and the other engines against
+// std::regex, which acts as the reference.
+static void ExpectAgreesWithReference(const std::string& pattern,
+                                      const std::string& alphabet,
+                                      size_t max_length) {
+  std::regex reference(pattern, std::regex::ECMAScript);
+  CompileOptions scasb;
+  scasb.scasb_codegen = true;
+  CompileOptions table;
+  table.engine = Engine::kTable;
+  CompileOptions lazy;
+  lazy.engine = Engine::kLazy;
+  CompileOptions bit_parallel;
+  bit_parallel.engine = Engine::kBitParallel;
+  CompileOptions shuffle;
+  shuffle.shuffle_codegen = true;
+  for (const CompileOptions& options : {CompileOptions(), scasb, table, lazy, bit_parallel,
+                                        shuffle}) {
+    std::string error;
+    std::unique_ptr<Regex> compiled = Compile(pattern, options, &error);
+    ASSERT_NE(compiled, nullptr) << error;
+    for (const std::string& str : AllStrings(alphabet, max_length)) {
+      EXPECT_EQ(compiled->Match(str), std::regex_match(str, reference))
+          << "pattern \"" << pattern << "\" on \"" << str << "\"" <<
+          (options.scasb_codegen ? " with scasb codegen" : "") <<
+          (options.shuffle_codegen ? " with shuffle codegen" : "") <<
+          (options.engine == Engine::kTable ? " with the table engine" : "") <<
+          (options.engine == Engine::kLazy ? " with the lazy engine" : "") <<
+          (options.engine == Engine::kBitParallel ? " with the bit-parallel engine" : "");
+    }
+  }
+}
+
+// Checks Search() against std::regex, by trying every substring: the
+// expected match is the one ending first, and of those, the one starting
+// first.
+static void ExpectSearchAgreesWithReference(const std::string& pattern,
+                                            const std::string& alphabet,
+                                            size_t max_length) {
+  std::regex reference(pattern, std::regex::ECMAScript);
+  for (Engine engine : {Engine::kJit, Engine::kTable, Engine::kLazy, Engine::kBitParallel}) {
+    CompileOptions options;
+    options.engine = engine;
+    options.search = true;
+    std::string error;
+    std::unique_ptr<Regex> compiled = Compile(pattern, options, &error);
+    ASSERT_NE(compiled, nullptr) << error;
+    const std::string description = "pattern \"" + pattern + "\"" +
+                                    (engine == Engine::kTable ? " with the table engine" : "") +
+                                    (engine == Engine::kLazy ? " with the lazy engine" : "") +
+                                    (engine == Engine::kBitParallel ?
+                                     " with the bit-parallel engine" : "");
+    for (const std::string& str : AllStrings(alphabet, max_length)) {
+      SearchResult expected;
+      for (size_t end = 0; end <= str.size() && !expected.found; ++end) {
+        for (size_t start = 0; start <= end; ++start) {
+          if (std::regex_match(str.substr(start, end - start), reference)) {
+            expected = SearchResult{true, start, end};
+            break;
+          }
+        }
+      }
+      const SearchResult found = compiled->Search(str);
+      EXPECT_EQ(found.found, expected.found) << description << " on \"" << str << "\"";
+      if (found.found && expected.found) {
+        EXPECT_EQ(found.start, expected.start) << description << " on \"" << str << "\"";
+        EXPECT_EQ(found.end, expected.end) << description << " on \"" << str << "\"";
+      }
+    }
+  }
+}
+
+TEST(RegexTest, DevlogExamples) {
+  ExpectAgreesWithReference("ba*b*a", "ab", 7);
+  ExpectAgreesWithReference("c(a|b)*c.", "abc", 6);
+}
+
+TEST(RegexTest, NeedsDeterminization) {
+  ExpectAgreesWithReference("(a|ab)(c|bcd)(d*)", "abcd", 6);
+  ExpectAgreesWithReference("(a|b)*a(a|b)(a|b)", "ab", 8);
+}
+
+TEST(RegexTest, Quantifiers) {
+  ExpectAgreesWithReference("a+b?", "ab", 6);
+  ExpectAgreesWithReference("(ab){2,3}", "ab", 8);
+  ExpectAgreesWithReference("a{2,}c", "ac", 6);
+  ExpectAgreesWithReference("(a?){3}b", "ab", 6);
+}
+
+TEST(RegexTest, Classes) {
+  ExpectAgreesWithReference("[a-c]x[^ab]*", "abcx", 5);
+  ExpectAgreesWithReference("\\d+\\.\\d", "12.a", 5);
+  ExpectAgreesWithReference("a.c", "ac\n", 4);
+}
+
+TEST(RegexTest, RangesAndSets) {
+  ExpectAgreesWithReference("[aeiou]+[a-f]?z", "abefiouz", 4);
+  ExpectAgreesWithReference("[^aeiou]x|[b-e]+", "abcefx", 4);
+  ExpectAgreesWithReference("[\\x00-\\x7f]*\\xff", "a\x7f\x80\xff", 4);
+
+  // One test per state rather than one per letter.
+  std::unique_ptr<Regex> identifier = Compile("[a-zA-Z_][a-zA-Z0-9_]*");
+  ASSERT_NE(identifier, nullptr);
+  EXPECT_LT(identifier->stats().code_size, 128);
+  EXPECT_TRUE(identifier->Match("snake_case_42"));
+  EXPECT_FALSE(identifier->Match("42nd"));
+}
+
+TEST(RegexTest, LiteralRuns) {
+  // Runs of each length that's compared differently, alone and between other
+  // states, each with a string matching it. Check that string, every prefix,
+  // every single substitution and one letter too many.
+  const std::vector<std::pair<std::string, std::string>> cases {
+    {"abcd", "abcd"},
+    {"x*abcdefg", "xxabcdefg"},
+    {"GET /api/v1/[a-z]+", "GET /api/v1/users"},
+    {"(a|b)0123456789abcdefghijklmnop(c|d)", "b0123456789abcdefghijklmnopc"},
+    {"0123456789abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ!",
+     "0123456789abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ!"},
+  };
+  for (const auto& test_case : cases) {
+    const std::string& pattern = test_case.first;
+    const std::string& literal = test_case.second;
+    std::regex reference(pattern, std::regex::ECMAScript);
+    std::vector<std::string> strings {literal + "z"};
+    for (size_t i = 0; i <= literal.size(); ++i) {
+      strings.push_back(literal.substr(0, i));
+    }
+    for (size_t i = 0; i < literal.size(); ++i) {
+      std::string mutated = literal;
+      mutated[i] ^= 0x01;
+      strings.push_back(mutated);
+    }
+    for (bool scasb_codegen : {false, true}) {
+      CompileOptions options;
+      options.scasb_codegen = scasb_codegen;
+      std::unique_ptr<Regex> compiled = Compile(pattern, options);
+      ASSERT_NE(compiled, nullptr);
+      for (const std::string& str : strings) {
+        EXPECT_EQ(compiled->Match(str), std::regex_match(str, reference))
+            << "pattern \"" << pattern << "\" on \"" << str << "\"" <<
+            (scasb_codegen ? " with scasb codegen" : "");
+      }
+    }
+  }
+}
+
+TEST(RegexTest, LiteralRunsStayOnTheirPage) {
+  // Put each string right at the end of a page followed by an inaccessible
+  // one, so that reading a literal run past the end of the input would
+  // fault.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  void* mapping = mmap(nullptr, 2 * page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  char* guard = static_cast<char*>(mapping) + page_size;
+  ASSERT_EQ(mprotect(guard, page_size, PROT_NONE), 0);
+
+  const std::string literal = "0123456789abcdefghijklmnopqrstuvwxyz";
+  std::unique_ptr<Regex> compiled = Compile(literal + "|" + literal.substr(0, 8));
+  ASSERT_NE(compiled, nullptr);
+  for (size_t i = 0; i <= literal.size(); ++i) {
+    const std::string str = literal.substr(0, i);
+    char* placed = guard - str.size();
+    memcpy(placed, str.data(), str.size());
+    EXPECT_EQ(compiled->Match(std::string_view(placed, str.size())),
+              i == 8 || i == literal.size()) << str;
+  }
+  munmap(mapping, 2 * page_size);
+}
+
+TEST(RegexTest, SkipLoops) {
+  // States looping on a letter, a range and all but a few letters, each
+  // given runs of every length up to a few vectors' worth, starting at every
+  // alignment, and followed by everything that can end them.
+  struct Case {
+    std::string pattern;
+    std::string prefix;
+    std::string run;
+    std::string alphabet;
+  };
+  const std::vector<Case> cases {
+    {"a*b", "", "a", "ab"},
+    {"x[a-z]*1", "x", "q", "ax1"},
+    {".*foo", "", "o", "afo\n"},
+    {"[^\n]*x\n", "", "y", "ax\n"},
+    {"a(b|c)*d", "a", "cb", "bcd"},
+    {"\\x00*a", "", std::string(1, '\0'), std::string("a\0", 2)},
+    {"[^a]*a", "", std::string("b\0", 2), std::string("ab\0", 3)},
+  };
+  for (const Case& test_case : cases) {
+    std::regex reference(test_case.pattern, std::regex::ECMAScript);
+    std::unique_ptr<Regex> compiled = Compile(test_case.pattern);
+    ASSERT_NE(compiled, nullptr);
+    for (size_t alignment = 0; alignment < 16; ++alignment) {
+      for (size_t length = 0; length < 40; ++length) {
+        for (const std::string& tail : AllStrings(test_case.alphabet, 2)) {
+          std::string str = test_case.prefix;
+          for (size_t i = 0; i < length; ++i) {
+            str += test_case.run[i % test_case.run.size()];
+          }
+          str += tail;
+          // Surrounded by letters that the loops would skip, were they not
+          // past the end of the input.
+          alignas(16) char buffer[128];
+          memset(buffer, test_case.run[0], sizeof(buffer));
+          memcpy(buffer + alignment, str.data(), str.size());
+          EXPECT_EQ(compiled->Match(std::string_view(buffer + alignment, str.size())),
+                    std::regex_match(str, reference))
+              << "pattern \"" << test_case.pattern << "\" on \"" << str << "\" at " << alignment;
+        }
+      }
+    }
+  }
+}
+
+TEST(RegexTest, SkipLoopsStayOnTheirPage) {
+  // As above, with the input ending right at the end of a page.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  void* mapping = mmap(nullptr, 2 * page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  char* guard = static_cast<char*>(mapping) + page_size;
+  ASSERT_EQ(mprotect(guard, page_size, PROT_NONE), 0);
+
+  std::unique_ptr<Regex> compiled = Compile(".*a");
+  ASSERT_NE(compiled, nullptr);
+  for (size_t length = 0; length < 40; ++length) {
+    const std::string str = std::string(length, 'b') + "a";
+    char* placed = guard - str.size();
+    memcpy(placed, str.data(), str.size());
+    EXPECT_TRUE(compiled->Match(std::string_view(placed, str.size()))) << str;
+    placed[str.size() - 1] = 'b';
+    EXPECT_FALSE(compiled->Match(std::string_view(placed, str.size()))) << str;
+  }
+  munmap(mapping, 2 * page_size);
+}
+
+TEST(RegexTest, BinaryInput) {
+  // '\0' is a letter like any other.
+  const std::string alphabet("a\0", 2);
+  ExpectAgreesWithReference("a\\x00*a", alphabet, 5);
+  ExpectAgreesWithReference(".\\x00", alphabet, 4);
+  ExpectAgreesWithReference("[^a]+", alphabet, 4);
+  ExpectAgreesWithReference("(a\\x00)*", alphabet, 6);
+}
+
+TEST(RegexTest, MatchesWithinLargerBuffers) {
+  // Only the given range is matched, whatever surrounds it.
+  std::unique_ptr<Regex> compiled = Compile("ab*c");
+  ASSERT_NE(compiled, nullptr);
+  const std::string buffer = "xabbbcx";
+  EXPECT_TRUE(compiled->Match(std::string_view(buffer).substr(1, 5)));
+  EXPECT_FALSE(compiled->Match(std::string_view(buffer).substr(1, 4)));
+  EXPECT_FALSE(compiled->Match(std::string_view(buffer).substr(1, 6)));
+  EXPECT_FALSE(compiled->Match(std::string_view(buffer).substr(1, 0)));
+}
+
+TEST(RegexTest, Search) {
+  ExpectSearchAgreesWithReference("ab", "abc", 6);
+  ExpectSearchAgreesWithReference("a+b*", "ab", 6);
+  ExpectSearchAgreesWithReference("(a|bc)d*", "abcd", 5);
+  ExpectSearchAgreesWithReference("[^a]b|c.c", "abc", 5);
+  ExpectSearchAgreesWithReference("x*", "xy", 4);
+  ExpectSearchAgreesWithReference("a\\x00+", std::string("a\0", 2), 5);
+
+  // Search code is only compiled on request.
+  std::unique_ptr<Regex> compiled = Compile("ab");
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_EQ(compiled->search_function(), nullptr);
+}
+
+TEST(RegexTest, TableEngine) {
+  // The table engine needs no executable memory at all.
+  assembly::CodeArena code_arena;
+  CompileOptions options;
+  options.engine = Engine::kTable;
+  options.search = true;
+  options.code_arena = &code_arena;
+  std::unique_ptr<Regex> compiled = Compile("[a-z]+@[a-z]+\\.com", options);
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_EQ(code_arena.ChunkCount(), 0);
+  EXPECT_EQ(compiled->function(), nullptr);
+  EXPECT_EQ(compiled->search_function(), nullptr);
+  EXPECT_EQ(compiled->stats().code_size, 0);
+  EXPECT_GT(compiled->stats().table_size, 0);
+
+  EXPECT_TRUE(compiled->Match("alice@example.com"));
+  EXPECT_FALSE(compiled->Match("alice@example.org"));
+  EXPECT_FALSE(compiled->Match(std::string(1000, 'a') + "@example.co"));
+  const SearchResult found = compiled->Search("mail alice@example.com now");
+  ASSERT_TRUE(found.found);
+  EXPECT_EQ(found.start, 5);
+  EXPECT_EQ(found.end, 22);
+}
+
+TEST(RegexTest, LazyEngine) {
+  // Far more states than allowed, but only a handful for any one input.
+  const std::string pattern = "(a|b)*a(a|b){12}";
+  CompileOptions options;
+  options.max_states = 1000;
+  options.lazy_fallback = true;
+  options.search = true;
+  std::unique_ptr<Regex> compiled = Compile(pattern, options);
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_TRUE(compiled->stats().lazy);
+  EXPECT_EQ(compiled->function(), nullptr);
+  EXPECT_EQ(compiled->stats().code_size, 0);
+
+  std::regex reference(pattern, std::regex::ECMAScript);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 200; ++i) {
+    std::string str;
+    for (size_t length = i % 40; str.size() < length; ) {
+      seed = seed * 1103515245 + 12345;
+      str.push_back((seed >> 16) % 3 == 0 ? 'b' : 'a');
+    }
+    EXPECT_EQ(compiled->Match(str), std::regex_match(str, reference)) << "on \"" << str << "\"";
+  }
+  EXPECT_GT(compiled->lazy_stats().hits, 0);
+  EXPECT_GT(compiled->lazy_stats().misses, 0);
+  EXPECT_EQ(compiled->lazy_stats().flushes, 0);
+
+  const SearchResult found = compiled->Search("xxbab" + std::string(12, 'b') + "xx");
+  ASSERT_TRUE(found.found);
+  EXPECT_EQ(found.start, 2);
+  EXPECT_EQ(found.end, 16);
+
+  // A cache too small for the states visited is flushed rather than grown.
+  options.lazy_cache_bytes = 4096;
+  compiled = Compile(pattern, options);
+  ASSERT_NE(compiled, nullptr);
+  std::string str;
+  for (size_t length = 0; length < 5000; ++length) {
+    seed = seed * 1103515245 + 12345;
+    str.push_back((seed >> 16) % 2 == 0 ? 'b' : 'a');
+  }
+  EXPECT_EQ(compiled->Match(str), std::regex_match(str, reference));
+  EXPECT_GT(compiled->lazy_stats().flushes, 0);
+  EXPECT_LE(compiled->lazy_stats().cache_bytes, 4096);
+}
+
+TEST(RegexTest, BitParallelEngine) {
+  CompileOptions options;
+  options.engine = Engine::kBitParallel;
+  options.search = true;
+  std::unique_ptr<Regex> compiled = Compile("(a|b)*a(a|b){12}", options);
+  ASSERT_NE(compiled, nullptr);
+  // The start, the "a" in the middle, and an "a" and a "b" for the loop and
+  // each of the twelve repeats.
+  EXPECT_EQ(compiled->stats().positions, 28);
+  EXPECT_EQ(compiled->stats().dfsm_states, 0);
+  EXPECT_EQ(compiled->function(), nullptr);
+  EXPECT_GT(compiled->stats().table_size, 0);
+  EXPECT_TRUE(compiled->Match("bba" + std::string(12, 'b')));
+  EXPECT_FALSE(compiled->Match("bba" + std::string(13, 'b')));
+  const SearchResult found = compiled->Search("xxbab" + std::string(12, 'b') + "xx");
+  ASSERT_TRUE(found.found);
+  EXPECT_EQ(found.start, 2);
+  EXPECT_EQ(found.end, 16);
+
+  // Too long for one register, unless it may fall back.
+  std::string error;
+  EXPECT_EQ(Compile("[a-z]{64}", options, &error), nullptr);
+  EXPECT_NE(error, "");
+  options.lazy_fallback = true;
+  compiled = Compile("[a-z]{64}", options);
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_TRUE(compiled->stats().lazy);
+  EXPECT_TRUE(compiled->Match(std::string(64, 'q')));
+}
+
+TEST(RegexTest, ShuffleCodegen) {
+  if (!__builtin_cpu_supports("ssse3")) {
+    GTEST_SKIP() << "needs SSSE3";
+  }
+  CompileOptions options;
+  options.shuffle_codegen = true;
+  // Eight live states, then sixteen, which need both halves of each row, and
+  // then too many.
+  for (size_t n : {2, 3, 4}) {
+    const std::string pattern = "(a|b)*a(a|b){" + std::to_string(n) + "}";
+    std::unique_ptr<Regex> compiled = Compile(pattern, options);
+    ASSERT_NE(compiled, nullptr);
+    EXPECT_EQ(compiled->stats().shuffled, n < 4) << pattern;
+    const std::regex reference(pattern, std::regex::ECMAScript);
+    uint32_t seed = n;
+    for (size_t length = 0; length < 100; ++length) {
+      std::string str;
+      while (str.size() < length) {
+        seed = seed * 1103515245 + 12345;
+        str.push_back("aab"[(seed >> 16) % 3]);
+      }
+      EXPECT_EQ(compiled->Match(str), std::regex_match(str, reference))
+          << pattern << " on \"" << str << "\"";
+      // Failing early, both within a block of eight letters and in the
+      // letters left over after the last block.
+      EXPECT_FALSE(compiled->Match("c" + str)) << pattern;
+      EXPECT_FALSE(compiled->Match(str + "c")) << pattern;
+    }
+  }
+}
+
+TEST(RegexTest, MatchesBatches) {
+  std::vector<std::string> inputs;
+  for (const char* user : {"alice", "bob", "carol", "x"}) {
+    for (const char* domain : {"example", "ex4mple", "a"}) {
+      inputs.push_back(std::string(user) + "@" + domain + ".com");
+      inputs.push_back(std::string(user) + "@" + domain + ".org");
+    }
+  }
+  std::vector<const uint8_t*> begins;
+  std::vector<size_t> lengths;
+  for (const std::string& input : inputs) {
+    begins.push_back(reinterpret_cast<const uint8_t*>(input.data()));
+    lengths.push_back(input.size());
+  }
+  for (Engine engine : {Engine::kJit, Engine::kTable, Engine::kLazy, Engine::kBitParallel}) {
+    CompileOptions options;
+    options.engine = engine;
+    std::unique_ptr<Regex> compiled = Compile("[a-z]+@[a-z]+\\.com", options);
+    ASSERT_NE(compiled, nullptr);
+    uint64_t results = ~uint64_t{0};
+    compiled->MatchBatch(begins.data(), lengths.data(), inputs.size(), &results);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ((results >> i) & 1, compiled->Match(inputs[i])) << inputs[i];
+    }
+  }
+}
+
+TEST(RegexTest, MatchesInParallel) {
+  thread_pool::ThreadPool pool(3);
+  std::string line;
+  for (size_t i = 0; i < 20000; ++i) {
+    line += "GET /index.html 200\n";
+  }
+  const std::string bad = line.substr(0, line.size() / 2) + "?" + line.substr(line.size() / 2);
+  CompileOptions jit;
+  jit.parallel = true;
+  CompileOptions table;
+  table.engine = Engine::kTable;
+  CompileOptions lazy;
+  lazy.engine = Engine::kLazy;
+  for (const CompileOptions& options : {jit, table, lazy, CompileOptions()}) {
+    std::unique_ptr<Regex> compiled = Compile("([A-Z]+ /[a-z.]* [0-9]+\n)*", options);
+    ASSERT_NE(compiled, nullptr);
+    EXPECT_TRUE(compiled->MatchParallel(line, &pool));
+    EXPECT_FALSE(compiled->MatchParallel(bad, &pool));
+    EXPECT_FALSE(compiled->MatchParallel(line + "GET", &pool));
+    EXPECT_TRUE(compiled->MatchParallel(""));
+  }
+}
+
+TEST(RegexTest, MatchesRecords) {
+  // Records shorter and longer than a block, empty ones, and a last one
+  // with no delimiter after it.
+  const std::string log =
+      "GET /index.html 200\n"
+      "\n"
+      "POST /a 404\n"
+      "GET /a/much/longer/path/than/sixteen/letters.html 200\n"
+      "\n"
+      "get /lower 200\n"
+      "PUT / 201";
+  CompileOptions jit;
+  jit.records = true;
+  CompileOptions table;
+  table.engine = Engine::kTable;
+  for (const CompileOptions& options : {jit, table, CompileOptions()}) {
+    for (const char* pattern : {"[A-Z]+ /[a-z./]* 2[0-9]+", ".*404.*", "", ".*letters.*",
+                                "[^ ]* [^ ]* [0-9]*"}) {
+      std::unique_ptr<Regex> compiled = Compile(pattern, options);
+      ASSERT_NE(compiled, nullptr) << pattern;
+      EXPECT_EQ(compiled->record_function() != nullptr, options.records) << pattern;
+      for (const std::string& input : {log, log + "\n", std::string(), std::string("\n"),
+                                       log + "\n\n"}) {
+        std::vector<size_t> expected;
+        std::string_view rest = input;
+        for (size_t record = 0; !rest.empty(); ++record) {
+          const size_t end = std::min(rest.find('\n'), rest.size());
+          if (compiled->Match(rest.substr(0, end))) {
+            expected.push_back(record);
+          }
+          rest.remove_prefix(std::min(end + 1, rest.size()));
+        }
+        std::vector<size_t> indices(input.size() + 1);
+        const size_t count = compiled->MatchRecords(input, '\n', indices.data());
+        ASSERT_EQ(count, expected.size()) << pattern;
+        indices.resize(count);
+        EXPECT_EQ(indices, expected) << pattern;
+        EXPECT_EQ(compiled->MatchRecords(input, '\n'), count) << pattern;
+      }
+    }
+  }
+
+  std::unique_ptr<Regex> compiled = Compile("[a-z]+", jit);
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_EQ(compiled->MatchRecords("ab,,c,D,e", ','), 3u);
+  EXPECT_EQ(compiled->MatchRecords(std::string(1000, 'x') + std::string("\0y\0", 3), '\0'), 2u);
+}
+
+TEST(RegexTest, SearchesLongInputs) {
+  // The start state skips up to the first letter of a candidate, from any
+  // alignment, and past false starts.
+  CompileOptions options;
+  options.search = true;
+  std::unique_ptr<Regex> compiled = Compile("needle|nee+dles", options);
+  ASSERT_NE(compiled, nullptr);
+  for (size_t offset = 0; offset < 200; offset += 7) {
+    for (size_t alignment = 0; alignment < 16; ++alignment) {
+      std::string str = std::string(alignment, 'n') + std::string(500, 'x');
+      str.replace(alignment + offset, 6, "needle");
+      str.replace(alignment + offset / 2, 3, "nee");
+      const SearchResult found = compiled->Search(str);
+      ASSERT_TRUE(found.found) << offset << " at " << alignment;
+      EXPECT_EQ(found.start, alignment + offset) << offset << " at " << alignment;
+      EXPECT_EQ(found.end, alignment + offset + 6) << offset << " at " << alignment;
+    }
+  }
+  EXPECT_FALSE(compiled->Search(std::string(1000, 'n')).found);
+  EXPECT_FALSE(compiled->Search("").found);
+}
+
+TEST(RegexTest, Prefilters) {
+  std::unique_ptr<Regex> compiled = Compile(".*error [0-9]+");
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_EQ(compiled->stats().required.literal, "error ");
+  EXPECT_TRUE(compiled->stats().prefiltered);
+
+  // The automaton rejects inputs without a prefix just as soon itself.
+  compiled = Compile("abc.*");
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_EQ(compiled->stats().required.literal, "abc");
+  EXPECT_FALSE(compiled->stats().prefiltered);
+
+  compiled = Compile(".*(a|b)c|.*(a|b)d");
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_TRUE(compiled->stats().required.empty());
+  EXPECT_FALSE(compiled->stats().prefiltered);
+
+  ExpectAgreesWithReference(".*ab.*", "abc", 7);
+  ExpectAgreesWithReference("(a|b)*cab", "abc", 7);
+  ExpectAgreesWithReference(".*[ab]c*", "abc", 6);
+  ExpectAgreesWithReference("c*a\\x00b", std::string("abc\0", 4), 6);
+  ExpectSearchAgreesWithReference("a.b", "abc", 6);
+  ExpectSearchAgreesWithReference("c*(a|b)", "abc", 6);
+}
+
+TEST(RegexTest, PrefiltersLongInputs) {
+  // The fingerprint is found from any alignment, in the vector loop or the
+  // scalar tail, right up to the end of a page followed by an inaccessible
+  // one.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  void* mapping = mmap(nullptr, 2 * page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  char* guard = static_cast<char*>(mapping) + page_size;
+  ASSERT_EQ(mprotect(guard, page_size, PROT_NONE), 0);
+
+  std::unique_ptr<Regex> compiled = Compile(".*needle[0-9]");
+  ASSERT_NE(compiled, nullptr);
+  ASSERT_TRUE(compiled->stats().prefiltered);
+  for (size_t length = 0; length < 80; ++length) {
+    for (size_t offset = 0; offset + 7 <= length; ++offset) {
+      std::string str(length, 'n');
+      str.replace(offset, 7, "needle7");
+      char* placed = guard - str.size();
+      memcpy(placed, str.data(), str.size());
+      EXPECT_EQ(compiled->Match(std::string_view(placed, str.size())), offset + 7 == length)
+          << offset << " in " << length;
+      // Without the last letter of the fingerprint.
+      placed[offset + 5] = 'x';
+      EXPECT_FALSE(compiled->Match(std::string_view(placed, str.size())))
+          << offset << " in " << length;
+    }
+    std::string str(length, 'e');
+    char* placed = guard - str.size();
+    memcpy(placed, str.data(), str.size());
+    EXPECT_FALSE(compiled->Match(std::string_view(placed, str.size()))) << length;
+  }
+  munmap(mapping, 2 * page_size);
+}
+
+TEST(RegexTest, JumpTables) {
+  // Enough words that the start state leads to a different state for each of
+  // their first letters, so that it dispatches through a jump table.
+  std::string pattern = "(";
+  std::string alphabet = " ";
+  for (char letter = 'a'; letter <= 't'; ++letter) {
+    pattern += std::string(letter == 'a' ? "" : "|") + letter + letter;
+    alphabet += letter;
+  }
+  pattern += ") ";
+  ExpectAgreesWithReference(pattern, alphabet, 3);
+  ExpectAgreesWithReference("(" + pattern + ")*", "abt ", 6);
+}
+
+TEST(RegexTest, Empty) {
+  ExpectAgreesWithReference("", "a", 2);
+  ExpectAgreesWithReference("(|a)b", "ab", 3);
+}
+
+TEST(RegexTest, LongJumps) {
+  // Enough code between sections that some jumps need 32-bit displacements.
+  ExpectAgreesWithReference("(.x)*y", "xyz", 6);
+}
+
+TEST(RegexTest, ReportsErrors) {
+  std::string error;
+  EXPECT_EQ(Compile("(a", &error), nullptr);
+  EXPECT_NE(error, "");
+}
+
+TEST(RegexTest, RejectsStateExplosion) {
+  CompileOptions options;
+  options.max_states = 1000;
+  std::string error;
+  EXPECT_EQ(Compile("(a|b)*a(a|b){12}", options, &error), nullptr);
+  EXPECT_NE(error, "");
+  EXPECT_NE(Compile("(a|b)*a(a|b){8}", options), nullptr);
+}
+
+TEST(RegexTest, Minimizes) {
+  std::unique_ptr<Regex> compiled = Compile("(ab|cb)*");
+  ASSERT_NE(compiled, nullptr);
+  EXPECT_LT(compiled->stats().minimized_states, compiled->stats().dfsm_states);
+  ExpectAgreesWithReference("(ab|cb)*", "abc", 6);
+  ExpectAgreesWithReference("(a|b)*a(a|b){3}", "ab", 8);
+}
+
+TEST(RegexTest, ReportsStats) {
+  std::unique_ptr<Regex> compiled = Compile("c(a|b)*c.");
+  ASSERT_NE(compiled, nullptr);
+  const CompileStats& stats = compiled->stats();
+  EXPECT_GT(stats.nfsm_states, stats.dfsm_states);
+  // "a" and "b", "c", newlines, and everything else.
+  EXPECT_EQ(stats.byte_classes, 4);
+  EXPECT_GT(stats.code_size, 0);
+  EXPECT_GT(stats.peephole.bytes_saved, 0);
+  EXPECT_GT(stats.total().count(), 0);
+}
+
+TEST(RegexTest, ReusesArena) {
+  arena::Arena arena;
+  CompileOptions options;
+  options.arena = &arena;
+  std::unique_ptr<Regex> first = Compile("c(a|b)*c.", options);
+  ASSERT_NE(first, nullptr);
+  EXPECT_GT(first->stats().scratch_bytes, 0);
+  EXPECT_EQ(arena.BytesAllocated(), 0);
+  const size_t blocks = arena.BlockCount();
+
+  std::unique_ptr<Regex> second = Compile("c(b|a)*c.", options);
+  ASSERT_NE(second, nullptr);
+  EXPECT_EQ(arena.BlockCount(), blocks);
+  EXPECT_TRUE(first->Match("cabc!"));
+  EXPECT_TRUE(second->Match("cbac!"));
+}
+
+} // end namespace
+} // end namespace regex
+} // end namespace gnossen
@@ -0,0 +1,94 @@
+#include "table_dfa.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace gnossen {
+namespace fsm {
+
+constexpr size_t TableDfa::kDefaultMinChunkSize;
+constexpr size_t TableDfa::kMaxTrackedStates;
+constexpr size_t TableDfa::kMaxSpeculation;
+
+TableDfa::TableDfa(const Fsm& dfsm) :
+  state_count_(dfsm.StateCount()),
+  class_count_(0),
+  wide_(false),
+  classes_(),
+  start_(0),
+  failure_(0),
+  first_accepting_(0)
+{
+  // The target of each state on each class of letters.
+  const ByteClasses classes = ComputeByteClasses(dfsm);
+  std::copy(classes.class_of, classes.class_of + 256, classes_);
+  class_count_ = classes.count();
+  const size_t count = state_count_;
+  std::vector<Fsm::StateId> next(count * class_count_, Fsm::GetFailureState());
+  std::vector<bool> accepts(count, false);
+  for (Fsm::StateId id = 0; id < count; ++id) {
+    Fsm::StateId* row = &next[id * class_count_];
+    // The remainder transition comes last, but covers only the letters the
+    // others don't, so fill it in first.
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.remainder) {
+        std::fill(row, row + class_count_, transition.first);
+      }
+    }
+    for (const auto& transition : dfsm.GetTransitions(id)) {
+      if (transition.second.end_of_input) {
+        accepts[id] = transition.first == Fsm::GetSuccessState();
+      } else if (transition.second.IsLetters()) {
+        for (size_t c = 0; c < class_count_; ++c) {
+          if (dfsm.LabelMatches(transition.second, classes.representatives[c])) {
+            row[c] = transition.first;
+          }
+        }
+      }
+    }
+  }
+
+  // Ordinary states first, then the failure state, then the accepting ones.
+  std::vector<Fsm::StateId> order;
+  for (Fsm::StateId id = 0; id < count; ++id) {
+    if (id != Fsm::GetFailureState() && !accepts[id]) {
+      order.push_back(id);
+    }
+  }
+  order.push_back(Fsm::GetFailureState());
+  for (Fsm::StateId id = 0; id < count; ++id) {
+    if (accepts[id]) {
+      order.push_back(id);
+    }
+  }
+  std::vector<uint32_t> offsets(count);
+  for (size_t position = 0; position < order.size(); ++position) {
+    offsets[order[position]] = position * class_count_;
+  }
+  start_ = offsets[Fsm::GetStartState()];
+  failure_ = offsets[Fsm::GetFailureState()];
+  first_accepting_ = (count - std::count(accepts.begin(), accepts.end(), true)) * class_count_;
+
+  wide_ = (count - 1) * class_count_ > std::numeric_limits<uint16_t>::max();
+  auto fill = [&](auto* table) {
+    table->resize(count * class_count_);
+    for (Fsm::StateId id : order) {
+      for (size_t letter_class = 0; letter_class < class_count_; ++letter_class) {
+        (*table)[offsets[id] + letter_class] = offsets[next[id * class_count_ + letter_class]];
+      }
+    }
+  };
+  if (wide_) {
+    fill(&wide_table_);
+  } else {
+    fill(&narrow_table_);
+  }
+}
+
+size_t TableDfa::TableSize() const {
+  return sizeof(classes_) + narrow_table_.size() * sizeof(uint16_t) +
+         wide_table_.size() * sizeof(uint32_t);
+}
+
+} // end namespace fsm
+} // end namespace gnossen
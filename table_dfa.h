@@ -0,0 +1,353 @@
+#ifndef GNOSSEN_TINYJIT_TABLE_DFA_H_
+#define GNOSSEN_TINYJIT_TABLE_DFA_H_
+
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "fsm.h"
+#include "thread_pool.h"
+
+namespace gnossen {
+namespace fsm {
+
+// A deterministic FSM as a dense transition table, run by ordinary compiled
+// code rather than generated code. Needs no executable memory, and is quick
+// to build, so it suits places where JIT compilation isn't allowed or
+// wouldn't pay for itself.
+//
+// Letters that no state tells apart share a column of the table, as given by
+// ComputeByteClasses(), so each row holds one entry per class rather than 256. Entries are the
+// offsets of rows, rather than state identifiers, to save a multiplication
+// per letter, and are 16 bits wide when every offset fits in that many.
+//
+// Rows are ordered so that the failure state and the accepting states come
+// last, which lets a single comparison tell whether the match is settled.
+class TableDfa {
+public:
+  static constexpr size_t kDefaultMinChunkSize = 256 * 1024;
+  static constexpr size_t kMaxTrackedStates = 4;
+  static constexpr size_t kMaxSpeculation = 4096;
+
+  explicit TableDfa(const Fsm& dfsm);
+
+  TableDfa(const TableDfa&) = delete;
+  TableDfa& operator=(const TableDfa&) = delete;
+
+  // Takes the input as the range [begin, end) and returns nonzero if all of
+  // it matches, just as the generated code does.
+  uint8_t Match(const uint8_t* begin, const uint8_t* end) const {
+    return wide_ ? Run<uint32_t>(begin, end) : Run<uint16_t>(begin, end);
+  }
+
+  // Matches `count` inputs, the i-th being the range [begins[i], begins[i] +
+  // lengths[i]), and sets bit i % 64 of results[i / 64] if it matches, and
+  // clears it otherwise. Steps four inputs at once, each with its own
+  // state, so that their chains of dependent loads overlap rather than
+  // running one after the other.
+  void MatchBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                  uint64_t* results) const {
+    if (wide_) {
+      RunBatch<uint32_t>(begins, lengths, count, results);
+    } else {
+      RunBatch<uint16_t>(begins, lengths, count, results);
+    }
+  }
+
+  // As Match(), but splits the input into chunks matched on `pool` at the
+  // same time. Since the state each chunk starts in isn't known until the
+  // chunks before it are done, every chunk but the first is run from every
+  // state at once. Most automata soon forget where they started, and the
+  // different starting states end up in the same few states after a few
+  // letters, so each chunk only tracks the distinct states reached so far.
+  // Each chunk's map from starting to ending states is then applied in
+  // turn. A chunk that still has more than kMaxTrackedStates states after
+  // kMaxSpeculation letters is left to be run again once its starting state
+  // is known.
+  //
+  // Inputs too short to have at least two chunks of `min_chunk_size`
+  // letters are matched by Match() instead.
+  uint8_t MatchParallel(const uint8_t* begin, const uint8_t* end, thread_pool::ThreadPool* pool,
+                        size_t min_chunk_size = kDefaultMinChunkSize) const {
+    return wide_ ? RunParallel<uint32_t>(begin, end, pool, min_chunk_size) :
+                   RunParallel<uint16_t>(begin, end, pool, min_chunk_size);
+  }
+
+  // Returns where the shortest prefix of the input that matches ends, or
+  // nullptr if there's none. Run on the DFSM for a search, that's the end
+  // of the earliest match, just as for the generated search code.
+  const uint8_t* Find(const uint8_t* begin, const uint8_t* end) const {
+    return wide_ ? RunToMatch<uint32_t>(begin, end) : RunToMatch<uint16_t>(begin, end);
+  }
+
+  // Reads the input backwards from `end`, and returns the position furthest
+  // back such that the letters read so far, in the order they were read,
+  // match, as LazyDfa::FindBackwards() does. Returns nullptr if there's
+  // none.
+  const uint8_t* FindBackwards(const uint8_t* begin, const uint8_t* end) const {
+    return wide_ ? RunBackwards<uint32_t>(begin, end) : RunBackwards<uint16_t>(begin, end);
+  }
+
+  size_t StateCount() const { return state_count_; }
+  size_t ClassCount() const { return class_count_; }
+
+  // The size of the transition table and the class map.
+  size_t TableSize() const;
+
+private:
+  template <typename Entry>
+  const Entry* table() const;
+
+  // Returns the row of the state reached from the row `state`, or the
+  // failure state's as soon as it's reached.
+  template <typename Entry>
+  uint32_t Advance(const uint8_t* begin, const uint8_t* end, uint32_t state) const;
+
+  template <typename Entry>
+  uint8_t Run(const uint8_t* begin, const uint8_t* end, uint32_t state) const {
+    return Advance<Entry>(begin, end, state) >= first_accepting_;
+  }
+
+  template <typename Entry>
+  uint8_t Run(const uint8_t* begin, const uint8_t* end) const {
+    return Run<Entry>(begin, end, start_);
+  }
+
+  // What reading a chunk of the input does from each state.
+  struct ChunkMap {
+    // Whether the chunk was run from every state. If not, the rest is unset.
+    bool resolved = false;
+
+    // The distinct rows reached, and for each state, in the order of their
+    // rows, which of them it reaches.
+    std::vector<uint32_t> ends;
+    std::vector<uint32_t> end_of;
+  };
+
+  template <typename Entry>
+  void RunFromEveryState(const uint8_t* begin, const uint8_t* end, ChunkMap* map) const;
+
+  template <typename Entry>
+  uint8_t RunParallel(const uint8_t* begin, const uint8_t* end, thread_pool::ThreadPool* pool,
+                      size_t min_chunk_size) const;
+
+  template <typename Entry>
+  void RunBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                uint64_t* results) const;
+
+  template <typename Entry>
+  const uint8_t* RunToMatch(const uint8_t* begin, const uint8_t* end) const;
+
+  template <typename Entry>
+  const uint8_t* RunBackwards(const uint8_t* begin, const uint8_t* end) const;
+
+  size_t state_count_;
+  size_t class_count_;
+  bool wide_;
+
+  // The class of each letter, and so its column in each row.
+  uint8_t classes_[256];
+
+  // The offsets of the start state's row, the failure state's row, and
+  // the first accepting state's row. Every row from the failure state's on
+  // is either the failure state's or an accepting state's.
+  uint32_t start_;
+  uint32_t failure_;
+  uint32_t first_accepting_;
+
+  // One of these holds the table, depending on wide_.
+  std::vector<uint16_t> narrow_table_;
+  std::vector<uint32_t> wide_table_;
+};
+
+template <>
+inline const uint16_t* TableDfa::table<uint16_t>() const { return narrow_table_.data(); }
+
+template <>
+inline const uint32_t* TableDfa::table<uint32_t>() const { return wide_table_.data(); }
+
+template <typename Entry>
+uint32_t TableDfa::Advance(const uint8_t* begin, const uint8_t* end, uint32_t state) const {
+  const Entry* table = this->table<Entry>();
+  // Four letters at a time, only checking for failure in between, since
+  // the failure state loops back to itself anyway.
+  while (end - begin >= 4) {
+    state = table[state + classes_[begin[0]]];
+    state = table[state + classes_[begin[1]]];
+    state = table[state + classes_[begin[2]]];
+    state = table[state + classes_[begin[3]]];
+    if (state == failure_) {
+      return state;
+    }
+    begin += 4;
+  }
+  while (begin != end) {
+    state = table[state + classes_[*begin++]];
+  }
+  return state;
+}
+
+template <typename Entry>
+void TableDfa::RunBatch(const uint8_t* const* begins, const size_t* lengths, size_t count,
+                        uint64_t* results) const {
+  const Entry* table = this->table<Entry>();
+  std::fill(results, results + (count + 63) / 64, 0);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // Step all four inputs through the letters they all have, until they've
+    // all failed, then finish each on its own.
+    const uint8_t* const* group = begins + i;
+    const size_t common = std::min(std::min(lengths[i], lengths[i + 1]),
+                                   std::min(lengths[i + 2], lengths[i + 3]));
+    uint32_t state0 = start_;
+    uint32_t state1 = start_;
+    uint32_t state2 = start_;
+    uint32_t state3 = start_;
+    size_t position = 0;
+    while (position < common) {
+      for (const size_t stop = std::min(common, position + 8); position < stop; ++position) {
+        state0 = table[state0 + classes_[group[0][position]]];
+        state1 = table[state1 + classes_[group[1][position]]];
+        state2 = table[state2 + classes_[group[2][position]]];
+        state3 = table[state3 + classes_[group[3][position]]];
+      }
+      if (state0 == failure_ && state1 == failure_ && state2 == failure_ && state3 == failure_) {
+        break;
+      }
+    }
+    const uint32_t states[4] = {state0, state1, state2, state3};
+    for (size_t lane = 0; lane < 4; ++lane) {
+      const uint64_t matched = states[lane] == failure_ ? 0 :
+                               Run<Entry>(group[lane] + position, group[lane] + lengths[i + lane],
+                                          states[lane]);
+      results[(i + lane) / 64] |= matched << ((i + lane) % 64);
+    }
+  }
+  for (; i < count; ++i) {
+    const uint64_t matched = Run<Entry>(begins[i], begins[i] + lengths[i], start_);
+    results[i / 64] |= matched << (i % 64);
+  }
+}
+
+template <typename Entry>
+void TableDfa::RunFromEveryState(const uint8_t* begin, const uint8_t* end, ChunkMap* map) const {
+  const Entry* table = this->table<Entry>();
+  map->ends.resize(state_count_);
+  map->end_of.resize(state_count_);
+  for (size_t i = 0; i < state_count_; ++i) {
+    map->ends[i] = i * class_count_;
+    map->end_of[i] = i;
+  }
+  std::vector<uint32_t> slot_of(state_count_, std::numeric_limits<uint32_t>::max());
+  std::vector<uint32_t> merged;
+  std::vector<uint32_t> remap;
+  const uint8_t* position = begin;
+  // Check for states that have come together after 16 letters, then twice
+  // as many each time, up to every 256.
+  size_t stride = 16;
+  while (position != end) {
+    const uint8_t* stop = static_cast<size_t>(end - position) > stride ? position + stride : end;
+    stride = std::min<size_t>(stride * 2, 256);
+    std::vector<uint32_t>& ends = map->ends;
+    for (; position != stop; ++position) {
+      const uint8_t letter_class = classes_[*position];
+      for (uint32_t& state : ends) {
+        state = table[state + letter_class];
+      }
+    }
+
+    merged.clear();
+    remap.resize(ends.size());
+    for (size_t i = 0; i < ends.size(); ++i) {
+      uint32_t& slot = slot_of[ends[i] / class_count_];
+      if (slot == std::numeric_limits<uint32_t>::max()) {
+        slot = merged.size();
+        merged.push_back(ends[i]);
+      }
+      remap[i] = slot;
+    }
+    for (uint32_t state : merged) {
+      slot_of[state / class_count_] = std::numeric_limits<uint32_t>::max();
+    }
+    if (merged.size() < ends.size()) {
+      for (uint32_t& end_index : map->end_of) {
+        end_index = remap[end_index];
+      }
+      ends.swap(merged);
+    }
+
+    if (ends.size() == 1) {
+      ends[0] = Advance<Entry>(position, end, ends[0]);
+      break;
+    } else if (static_cast<size_t>(position - begin) >= kMaxSpeculation &&
+               ends.size() > kMaxTrackedStates) {
+      return;
+    }
+  }
+  map->resolved = true;
+}
+
+template <typename Entry>
+uint8_t TableDfa::RunParallel(const uint8_t* begin, const uint8_t* end,
+                              thread_pool::ThreadPool* pool, size_t min_chunk_size) const {
+  // A few chunks per thread, so that threads that finish early can steal
+  // from those that don't.
+  const size_t length = end - begin;
+  const size_t chunks = std::min(length / std::max<size_t>(min_chunk_size, 1),
+                                 (pool->ThreadCount() + 1) * 8);
+  if (chunks < 2 || pool->ThreadCount() == 0) {
+    return Run<Entry>(begin, end);
+  }
+  auto chunk_begin = [&](size_t chunk) { return begin + length * chunk / chunks; };
+
+  // The first chunk's starting state is known, so it's run from that alone.
+  uint32_t state = start_;
+  std::vector<ChunkMap> maps(chunks);
+  pool->ParallelFor(chunks, [&](size_t chunk) {
+    if (chunk == 0) {
+      state = Advance<Entry>(begin, chunk_begin(1), start_);
+    } else {
+      RunFromEveryState<Entry>(chunk_begin(chunk), chunk_begin(chunk + 1), &maps[chunk]);
+    }
+  });
+
+  for (size_t chunk = 1; chunk < chunks && state != failure_; ++chunk) {
+    const ChunkMap& map = maps[chunk];
+    state = map.resolved ? map.ends[map.end_of[state / class_count_]] :
+                           Advance<Entry>(chunk_begin(chunk), chunk_begin(chunk + 1), state);
+  }
+  return state >= first_accepting_;
+}
+
+template <typename Entry>
+const uint8_t* TableDfa::RunToMatch(const uint8_t* begin, const uint8_t* end) const {
+  const Entry* table = this->table<Entry>();
+  uint32_t state = start_;
+  while (state < failure_ && begin != end) {
+    state = table[state + classes_[*begin++]];
+  }
+  return state >= first_accepting_ ? begin : nullptr;
+}
+
+template <typename Entry>
+const uint8_t* TableDfa::RunBackwards(const uint8_t* begin, const uint8_t* end) const {
+  const Entry* table = this->table<Entry>();
+  uint32_t state = start_;
+  const uint8_t* found = state >= first_accepting_ ? end : nullptr;
+  while (end != begin) {
+    state = table[state + classes_[*--end]];
+    if (state == failure_) {
+      break;
+    } else if (state >= first_accepting_) {
+      found = end;
+    }
+  }
+  return found;
+}
+
+} // end namespace fsm
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_TABLE_DFA_H_
@@ -0,0 +1,197 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+
+#include "table_dfa.h"
+
+namespace gnossen {
+namespace fsm {
+namespace {
+
+static bool Matches(const TableDfa& dfa, const std::string& input) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  return dfa.Match(begin, begin + input.size()) != 0;
+}
+
+// Where the shortest matching prefix of `input` ends, or -1.
+static int FindEnd(const TableDfa& dfa, const std::string& input) {
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+  const uint8_t* end = dfa.Find(begin, begin + input.size());
+  return end == nullptr ? -1 : end - begin;
+}
+
+// A DFSM for "a*b".
+static Fsm MakeDfsm() {
+  Fsm fsm({'a', 'b'});
+  auto end = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), fsm.GetStartState(), 'a');
+  fsm.AddTransition(fsm.GetStartState(), end, 'b');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(end, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(end, fsm.GetFailureState());
+  return fsm;
+}
+
+TEST(TableDfaTest, Matches) {
+  TableDfa dfa(MakeDfsm());
+  // "a", "b" and everything else.
+  EXPECT_EQ(dfa.ClassCount(), 3);
+  EXPECT_EQ(dfa.StateCount(), 4);
+  EXPECT_EQ(dfa.TableSize(), 256 + 4 * 3 * sizeof(uint16_t));
+
+  EXPECT_TRUE(Matches(dfa, "b"));
+  EXPECT_TRUE(Matches(dfa, "ab"));
+  EXPECT_TRUE(Matches(dfa, "aaaaaaab"));
+  EXPECT_TRUE(Matches(dfa, std::string(1000, 'a') + "b"));
+  EXPECT_FALSE(Matches(dfa, ""));
+  EXPECT_FALSE(Matches(dfa, "a"));
+  EXPECT_FALSE(Matches(dfa, "aaaaaaaba"));
+  EXPECT_FALSE(Matches(dfa, "bb"));
+  EXPECT_FALSE(Matches(dfa, std::string("a\0b", 3)));
+}
+
+TEST(TableDfaTest, FindsShortestMatch) {
+  // A DFSM for "ab+".
+  Fsm fsm({'a', 'b'});
+  auto after_a = fsm.AddState();
+  auto after_b = fsm.AddState();
+  fsm.AddTransition(fsm.GetStartState(), after_a, 'a');
+  fsm.AddTransitionForRemaining(fsm.GetStartState(), fsm.GetFailureState());
+  fsm.AddTransition(after_a, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_a, fsm.GetFailureState());
+  fsm.AddEndOfInputTransition(after_b, fsm.GetSuccessState());
+  fsm.AddTransition(after_b, after_b, 'b');
+  fsm.AddTransitionForRemaining(after_b, fsm.GetFailureState());
+
+  TableDfa dfa(fsm);
+  EXPECT_EQ(FindEnd(dfa, "abbb"), 2);
+  EXPECT_EQ(FindEnd(dfa, "abx"), 2);
+  EXPECT_EQ(FindEnd(dfa, "a"), -1);
+  EXPECT_EQ(FindEnd(dfa, "ba"), -1);
+  EXPECT_EQ(FindEnd(dfa, ""), -1);
+  EXPECT_TRUE(Matches(dfa, "abbb"));
+  EXPECT_FALSE(Matches(dfa, "abx"));
+}
+
+TEST(TableDfaTest, FindsBackwards) {
+  // Read backwards, "a*b" matches suffixes "ba*", and the furthest back
+  // start wins.
+  TableDfa dfa(MakeDfsm());
+  auto find_start = [&](const std::string& input) {
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+    const uint8_t* start = dfa.FindBackwards(begin, begin + input.size());
+    return start == nullptr ? -1 : start - begin;
+  };
+  EXPECT_EQ(find_start("xbaa"), 1);
+  EXPECT_EQ(find_start("baaa"), 0);
+  EXPECT_EQ(find_start("xbaab"), 4);
+  EXPECT_EQ(find_start("aa"), -1);
+  EXPECT_EQ(find_start(""), -1);
+}
+
+TEST(TableDfaTest, MatchesBatches) {
+  // Inputs of every length up to a few groups' worth, in batches of every
+  // size, so that groups mix inputs that fail early, fail late, and match.
+  TableDfa dfa(MakeDfsm());
+  std::vector<std::string> inputs;
+  for (size_t length = 0; length < 70; ++length) {
+    inputs.push_back(std::string(length, 'a') + (length % 3 == 0 ? "b" : ""));
+    inputs.push_back("b" + std::string(length, 'a'));
+  }
+  std::vector<const uint8_t*> begins;
+  std::vector<size_t> lengths;
+  for (const std::string& input : inputs) {
+    begins.push_back(reinterpret_cast<const uint8_t*>(input.data()));
+    lengths.push_back(input.size());
+  }
+  for (size_t count = 0; count <= inputs.size(); count += 1 + count / 8) {
+    std::vector<uint64_t> results((count + 63) / 64, ~uint64_t{0});
+    dfa.MatchBatch(begins.data(), lengths.data(), count, results.data());
+    for (size_t i = 0; i < count; ++i) {
+      EXPECT_EQ((results[i / 64] >> (i % 64)) & 1, Matches(dfa, inputs[i]))
+          << "input " << i << " of " << count;
+    }
+  }
+}
+
+TEST(TableDfaTest, MatchesInParallel) {
+  thread_pool::ThreadPool pool(3);
+  auto matches_in_parallel = [&](const TableDfa& dfa, const std::string& input) {
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(input.data());
+    return dfa.MatchParallel(begin, begin + input.size(), &pool, 16) != 0;
+  };
+
+  // Every state but failure goes to the start state on "a", so each chunk
+  // is down to a single state straight away.
+  TableDfa converging(MakeDfsm());
+  for (size_t length : {0, 31, 32, 100, 5000, 100000}) {
+    const std::string matching = std::string(length, 'a') + "b";
+    EXPECT_TRUE(matches_in_parallel(converging, matching)) << length;
+    std::string failing = matching;
+    failing[length / 2] = 'b';
+    EXPECT_EQ(matches_in_parallel(converging, failing), length == 0) << length;
+  }
+
+  // A DFSM for "(a{n})*", which keeps n states apart forever: few enough to
+  // track for n = 3, but not for n = 7, whose chunks are run again once
+  // their starting states are known.
+  for (size_t n : {3, 7}) {
+    Fsm fsm({'a'});
+    std::vector<Fsm::StateId> cycle {fsm.GetStartState()};
+    while (cycle.size() < n) {
+      cycle.push_back(fsm.AddState());
+    }
+    for (size_t i = 0; i < n; ++i) {
+      fsm.AddTransition(cycle[i], cycle[(i + 1) % n], 'a');
+      fsm.AddTransitionForRemaining(cycle[i], fsm.GetFailureState());
+    }
+    fsm.AddEndOfInputTransition(fsm.GetStartState(), fsm.GetSuccessState());
+    TableDfa cycling(fsm);
+    for (size_t length : {n * 1000, n * 100000 + 1, n * 100000}) {
+      const std::string input(length, 'a');
+      EXPECT_EQ(matches_in_parallel(cycling, input), length % n == 0) << n << " " << length;
+      EXPECT_FALSE(matches_in_parallel(cycling, input + "b")) << n << " " << length;
+    }
+  }
+}
+
+TEST(TableDfaTest, WidensBigTables) {
+  // A DFSM for a 300 letter literal cycling through every letter, whose
+  // table has 256 classes and too many rows for 16 bit offsets.
+  std::vector<char> alphabet;
+  for (int letter = 0; letter < 256; ++letter) {
+    alphabet.push_back(static_cast<char>(letter));
+  }
+  Fsm fsm(alphabet);
+  std::string literal;
+  Fsm::StateId state = fsm.GetStartState();
+  for (size_t i = 0; i < 300; ++i) {
+    const Fsm::StateId next = fsm.AddState();
+    literal.push_back(static_cast<char>(i % 256));
+    fsm.AddTransition(state, next, literal.back());
+    fsm.AddTransitionForRemaining(state, fsm.GetFailureState());
+    state = next;
+  }
+  fsm.AddEndOfInputTransition(state, fsm.GetSuccessState());
+  fsm.AddTransitionForRemaining(state, fsm.GetFailureState());
+
+  TableDfa dfa(fsm);
+  EXPECT_EQ(dfa.ClassCount(), 256);
+  EXPECT_EQ(dfa.TableSize(), 256 + dfa.StateCount() * 256 * sizeof(uint32_t));
+  EXPECT_TRUE(Matches(dfa, literal));
+  EXPECT_FALSE(Matches(dfa, literal.substr(0, 299)));
+  EXPECT_FALSE(Matches(dfa, literal + literal[0]));
+  literal[257] = 'x';
+  EXPECT_FALSE(Matches(dfa, literal));
+
+  thread_pool::ThreadPool pool(2);
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(literal.data());
+  EXPECT_FALSE(dfa.MatchParallel(begin, begin + literal.size(), &pool, 50));
+  literal[257] = static_cast<char>(1);
+  EXPECT_TRUE(dfa.MatchParallel(begin, begin + literal.size(), &pool, 50));
+}
+
+} // end namespace
+} // end namespace fsm
+} // end namespace gnossen
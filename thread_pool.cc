@@ -0,0 +1,109 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace gnossen {
+namespace thread_pool {
+
+ThreadPool::ThreadPool(size_t threads) {
+  for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+ThreadPool* ThreadPool::Default() {
+  static ThreadPool* pool = new ThreadPool(
+      std::max<unsigned int>(std::thread::hardware_concurrency(), 1) - 1);
+  return pool;
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+  if (count == 0) {
+    return;
+  }
+  Job job;
+  job.task = &task;
+  job.remaining = count;
+  // Counted before they're queued, so that a worker taking one straight
+  // away never takes the count below zero.
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_ += count;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Queue& queue = *queues_[i % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.work.push_back(Work{&job, i});
+  }
+  wake_.notify_all();
+
+  // Help out, with this job's tasks or anyone else's, until there's nothing
+  // left to take, then wait for the workers to finish.
+  Work work;
+  while (job.remaining > 0 && Take(queues_.size() - 1, &work)) {
+    Run(work);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [&]() { return job.remaining == 0; });
+}
+
+bool ThreadPool::Take(size_t own, Work* work) {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    Queue& queue = *queues_[(own + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.work.empty()) {
+      if (i == 0) {
+        *work = queue.work.back();
+        queue.work.pop_back();
+      } else {
+        *work = queue.work.front();
+        queue.work.pop_front();
+      }
+      --queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::Run(const Work& work) {
+  (*work.job->task)(work.index);
+  if (--work.job->remaining == 0) {
+    // Taking the lock keeps the notification from slipping in between the
+    // waiter checking `remaining` and going to sleep.
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_.notify_all();
+  }
+}
+
+void ThreadPool::WorkerLoop(size_t id) {
+  Work work;
+  while (true) {
+    if (Take(id, &work)) {
+      Run(work);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [&]() { return stopping_ || queued_ > 0; });
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+} // end namespace thread_pool
+} // end namespace gnossen
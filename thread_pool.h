@@ -0,0 +1,89 @@
+#ifndef GNOSSEN_TINYJIT_THREAD_POOL_H_
+#define GNOSSEN_TINYJIT_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gnossen {
+namespace thread_pool {
+
+// A fixed set of worker threads for splitting a loop across cores.
+//
+// Each worker has its own queue of tasks. ParallelFor() deals its tasks out
+// over the queues in turn. A worker takes tasks from the back of its own
+// queue, and once that's empty, steals from the front of the others'. A
+// worker stuck with slow tasks then holds up nobody, because the others
+// take its remaining tasks.
+class ThreadPool {
+public:
+  // Starts `threads` workers. The thread calling ParallelFor() works too,
+  // so a pool with no workers runs every task on the calling thread.
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // A pool shared by the whole process, with a worker for each core but
+  // one.
+  static ThreadPool* Default();
+
+  size_t ThreadCount() const { return threads_.size(); }
+
+  // Calls task(i) for each i in [0, count), on the workers and the calling
+  // thread, and returns once every call has returned. Several threads may
+  // call this at once, and tasks may call it themselves.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+  struct Job {
+    const std::function<void(size_t)>* task;
+    std::atomic<size_t> remaining;
+  };
+
+  struct Work {
+    Job* job;
+    size_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Work> work;
+  };
+
+  // Takes a task from the back of queue `own`, or failing that, from the
+  // front of any other.
+  bool Take(size_t own, Work* work);
+
+  // Runs the task, and wakes whoever is waiting for its job if it was the
+  // last one.
+  void Run(const Work& work);
+
+  void WorkerLoop(size_t id);
+
+  // One per worker, or just one if there are none.
+  std::vector<std::unique_ptr<Queue>> queues_;
+
+  // Guards `stopping_`, and is held to wait for work or for a job to end.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  bool stopping_ = false;
+
+  // The tasks in the queues, or about to be, that nobody has taken yet.
+  std::atomic<size_t> queued_{0};
+
+  std::vector<std::thread> threads_;
+};
+
+} // end namespace thread_pool
+} // end namespace gnossen
+
+#endif // GNOSSEN_TINYJIT_THREAD_POOL_H_
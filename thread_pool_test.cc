@@ -0,0 +1,71 @@
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace gnossen {
+namespace thread_pool {
+namespace {
+
+TEST(ThreadPoolTest, RunsEveryTask) {
+  ThreadPool pool(3);
+  EXPECT_EQ(pool.ThreadCount(), 3);
+  for (size_t count : {0, 1, 2, 3, 4, 100}) {
+    std::vector<int> runs(count, 0);
+    pool.ParallelFor(count, [&](size_t i) { ++runs[i]; });
+    EXPECT_EQ(runs, std::vector<int>(count, 1));
+  }
+}
+
+TEST(ThreadPoolTest, RunsOnTheCallerWithoutWorkers) {
+  ThreadPool pool(0);
+  const std::thread::id caller = std::this_thread::get_id();
+  size_t runs = 0;
+  pool.ParallelFor(10, [&](size_t i) {
+    EXPECT_EQ(std::this_thread::get_id(), caller);
+    ++runs;
+  });
+  EXPECT_EQ(runs, 10);
+}
+
+TEST(ThreadPoolTest, StealsFromBusyWorkers) {
+  // The first task holds up whichever thread runs it until every other
+  // task is done, which only happens if the tasks dealt out behind it are
+  // taken by the others.
+  ThreadPool pool(2);
+  std::atomic<size_t> done{0};
+  const size_t count = 30;
+  pool.ParallelFor(count, [&](size_t i) {
+    if (i == 0) {
+      while (done < count - 1) {
+        std::this_thread::yield();
+      }
+    }
+    ++done;
+  });
+  EXPECT_EQ(done, count);
+}
+
+TEST(ThreadPoolTest, NestsAndRunsFromManyThreads) {
+  ThreadPool pool(2);
+  std::atomic<size_t> runs{0};
+  std::vector<std::thread> callers;
+  for (size_t t = 0; t < 3; ++t) {
+    callers.emplace_back([&]() {
+      pool.ParallelFor(4, [&](size_t i) {
+        pool.ParallelFor(5, [&](size_t j) { ++runs; });
+      });
+    });
+  }
+  for (std::thread& caller : callers) {
+    caller.join();
+  }
+  EXPECT_EQ(runs, 3 * 4 * 5);
+}
+
+} // end namespace
+} // end namespace thread_pool
+} // end namespace gnossen
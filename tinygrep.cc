@@ -0,0 +1,263 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "regex_ast.h"
+#include "regex_compiler.h"
+#include "thread_pool.h"
+
+using gnossen::regex::CompileOptions;
+using gnossen::regex::Regex;
+using gnossen::thread_pool::ThreadPool;
+
+namespace {
+
+// Files are split into chunks of about this many bytes, each ending at the
+// end of a line, and this many chunks per thread are scanned at a time
+// before their output is written, so that memory use doesn't grow with the
+// size of the file.
+constexpr size_t kChunkSize = 4 << 20;
+constexpr size_t kChunksPerThread = 4;
+
+// Except for -c, chunks are scanned this many bytes at a time, each slice
+// ending at the end of a line, so that -l stops soon after the first match,
+// and the indices of matching lines fit in a buffer of a fixed size.
+constexpr size_t kSliceSize = 64 << 10;
+
+enum class Mode {
+    // Every matching line.
+    kLines,
+
+    // The number of matching lines in each file.
+    kCount,
+
+    // The name of each file with a matching line.
+    kFiles,
+};
+
+struct Flags {
+    Mode mode = Mode::kLines;
+    bool whole_line = false;
+    size_t threads = std::max<unsigned int>(std::thread::hardware_concurrency(), 1);
+    std::string pattern;
+    std::vector<std::string> files;
+};
+
+void Usage(const char* argv0) {
+    std::cerr << "USAGE: " << argv0 << " [-c | -l] [-x] [-j threads] pattern file..." << std::endl <<
+                 "  -c  print only the number of matching lines in each file" << std::endl <<
+                 "  -l  print only the names of files with a matching line" << std::endl <<
+                 "  -x  match whole lines only" << std::endl <<
+                 "  -j  scan with this many threads" << std::endl;
+    exit(2);
+}
+
+Flags ParseFlags(int argc, char** argv) {
+    Flags flags;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        const std::string flag = argv[i];
+        if (flag == "-c") {
+            flags.mode = Mode::kCount;
+        } else if (flag == "-l") {
+            flags.mode = Mode::kFiles;
+        } else if (flag == "-x") {
+            flags.whole_line = true;
+        } else if (flag == "-j" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            flags.threads = atoi(argv[++i]);
+        } else if (flag == "--") {
+            ++i;
+            break;
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    if (argc - i < 2) {
+        Usage(argv[0]);
+    }
+    flags.pattern = argv[i++];
+    flags.files.assign(argv + i, argv + argc);
+    return flags;
+}
+
+// A file mapped into memory for reading, read front to back.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error_ = strerror(errno);
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            error_ = strerror(errno);
+        } else if (S_ISDIR(info.st_mode)) {
+            error_ = "Is a directory";
+        } else if (info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                error_ = strerror(errno);
+            } else {
+                madvise(data, info.st_size, MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(data);
+                size_ = info.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Empty if the file was mapped, or is empty.
+    const std::string& error() const { return error_; }
+
+    std::string_view contents() const { return std::string_view(data_, size_); }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string error_;
+};
+
+// Splits `contents` into pieces of about `size` bytes, each ending just
+// after a newline, or at the end.
+std::vector<std::string_view> SplitIntoChunks(std::string_view contents, size_t size) {
+    std::vector<std::string_view> chunks;
+    while (!contents.empty()) {
+        size_t end = contents.size();
+        if (end > size) {
+            const size_t newline = contents.find('\n', size - 1);
+            end = newline == std::string_view::npos ? contents.size() : newline + 1;
+        }
+        chunks.push_back(contents.substr(0, end));
+        contents.remove_prefix(end);
+    }
+    return chunks;
+}
+
+// What scanning a chunk found.
+struct ChunkResult {
+    size_t count = 0;
+
+    // The matching lines, each ending in a newline, and prefixed with the
+    // file name if there's more than one file. Only kept for Mode::kLines.
+    std::string output;
+};
+
+// Scans the lines of `chunk`, many at a time, with the regex's record loop.
+// For Mode::kFiles, stops at the first slice with a matching line, and skips
+// the chunk altogether once another chunk of the file has found one.
+void ScanChunk(const Regex& regex, const Flags& flags, const std::string& prefix,
+               std::string_view chunk, std::atomic<bool>* found, ChunkResult* result) {
+    if (flags.mode == Mode::kCount) {
+        result->count = regex.MatchRecords(chunk, '\n');
+        return;
+    }
+    // A slice has a line for each of its first kSliceSize letters at most,
+    // plus one ending past them.
+    std::vector<size_t> indices(flags.mode == Mode::kLines ? kSliceSize + 1 : 0);
+    for (std::string_view slice : SplitIntoChunks(chunk, kSliceSize)) {
+        if (flags.mode == Mode::kFiles) {
+            if (*found) {
+                return;
+            }
+            if (regex.MatchRecords(slice, '\n') > 0) {
+                result->count = 1;
+                *found = true;
+                return;
+            }
+            continue;
+        }
+        const size_t matches = regex.MatchRecords(slice, '\n', indices.data());
+        result->count += matches;
+        size_t line_number = 0;
+        for (size_t i = 0; i < matches; ++i) {
+            for (; line_number < indices[i]; ++line_number) {
+                slice.remove_prefix(slice.find('\n') + 1);
+            }
+            const std::string_view line = slice.substr(0, slice.find('\n'));
+            result->output += prefix;
+            result->output.append(line.data(), line.size());
+            result->output += '\n';
+        }
+    }
+}
+
+} // end namespace
+
+int main(int argc, char ** argv) {
+    const Flags flags = ParseFlags(argc, argv);
+
+    // Lines match if the pattern matches any part of them, as for grep,
+    // unless -x asks for the whole line, or anchors tie it to either end.
+    std::string error;
+    const std::string pattern = gnossen::regex::ToLinePattern(flags.pattern, flags.whole_line);
+    CompileOptions options;
+    options.records = true;
+    std::unique_ptr<Regex> regex = gnossen::regex::Compile(pattern, options, &error);
+    if (regex == nullptr) {
+        std::cerr << error << std::endl;
+        exit(2);
+    }
+
+    ThreadPool pool(flags.threads - 1);
+    const size_t window = flags.threads * kChunksPerThread;
+    bool any_matched = false;
+    bool any_failed = false;
+    for (const std::string& path : flags.files) {
+        MappedFile file(path);
+        if (!file.error().empty()) {
+            std::cerr << argv[0] << ": " << path << ": " << file.error() << std::endl;
+            any_failed = true;
+            continue;
+        }
+        const std::string prefix = flags.files.size() > 1 ? path + ":" : "";
+        const std::vector<std::string_view> chunks = SplitIntoChunks(file.contents(), kChunkSize);
+        std::atomic<bool> found{false};
+        size_t count = 0;
+        for (size_t first = 0; first < chunks.size(); first += window) {
+            const size_t size = std::min(window, chunks.size() - first);
+            std::vector<ChunkResult> results(size);
+            pool.ParallelFor(size, [&](size_t i) {
+                ScanChunk(*regex, flags, prefix, chunks[first + i], &found, &results[i]);
+            });
+            for (const ChunkResult& result : results) {
+                count += result.count;
+                fwrite(result.output.data(), 1, result.output.size(), stdout);
+            }
+            if (flags.mode == Mode::kFiles && found) {
+                break;
+            }
+        }
+        any_matched |= count > 0;
+        if (flags.mode == Mode::kCount) {
+            printf("%s%zu\n", prefix.c_str(), count);
+        } else if (flags.mode == Mode::kFiles && count > 0) {
+            printf("%s\n", path.c_str());
+        }
+    }
+    return any_failed ? 2 : (any_matched ? 0 : 1);
+}